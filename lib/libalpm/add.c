@@ -27,6 +27,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h> /* int64_t */
+#include <pthread.h>
+#include <dirent.h>
 
 /* libarchive */
 #include <archive.h>
@@ -46,6 +48,8 @@
 #include "db.h"
 #include "remove.h"
 #include "handle.h"
+#include "deps.h"
+#include "filelist.h"
 
 /** Add a package to the transaction. */
 int SYMEXPORT alpm_add_pkg(alpm_handle_t *handle, alpm_pkg_t *pkg)
@@ -106,20 +110,458 @@ int SYMEXPORT alpm_add_pkg(alpm_handle_t *handle, alpm_pkg_t *pkg)
 	return 0;
 }
 
+#define EXTRACT_FLAGS (ARCHIVE_EXTRACT_OWNER | \
+                       ARCHIVE_EXTRACT_PERM | \
+                       ARCHIVE_EXTRACT_TIME | \
+                       ARCHIVE_EXTRACT_UNLINK | \
+                       ARCHIVE_EXTRACT_SECURE_SYMLINKS)
+
+/* Plain files up to this size are read into memory while the package is
+ * decompressed and written to disk by a pool of extraction threads. */
+#define EXTRACT_JOB_MAX_SIZE (256 * 1024)
+/* limits on what may be waiting for the extraction threads */
+#define EXTRACT_QUEUE_LEN 256
+#define EXTRACT_QUEUE_BYTES (16 * 1024 * 1024)
+
+struct extract_job {
+	/* copy of the archive entry, named after the file to write */
+	struct archive_entry *entry;
+	char *data;
+	size_t size;
+	/* outcome of writing the file, reported in archive order */
+	int ret;
+	int err;
+	char *error;
+	int done;
+};
+
+struct extract_pool {
+	pthread_mutex_t lock;
+	/* signalled when a job is queued or the pool is closed */
+	pthread_cond_t work;
+	/* signalled when a job has been written */
+	pthread_cond_t done;
+	struct extract_job jobs[EXTRACT_QUEUE_LEN];
+	/* running counts of jobs; reported <= taken <= queued */
+	size_t reported;
+	size_t taken;
+	size_t queued;
+	/* file data held by unreported jobs */
+	size_t bytes;
+	pthread_t *threads;
+	size_t nthreads;
+	int closed;
+};
+
+static void extract_job_write(struct extract_job *job)
+{
+	struct archive *writer;
+	int ret, ret2;
+
+	_alpm_umask_lock();
+	writer = archive_write_disk_new();
+	_alpm_umask_unlock();
+	if(writer == NULL) {
+		job->ret = ARCHIVE_FATAL;
+		job->err = ENOMEM;
+		return;
+	}
+	archive_write_disk_set_options(writer, EXTRACT_FLAGS);
+
+	/* mirror archive_read_extract2(): the first error message is kept and
+	 * failures to write the file are downgraded to warnings */
+	ret = archive_write_header(writer, job->entry);
+	if(ret < ARCHIVE_WARN) {
+		ret = ARCHIVE_WARN;
+	}
+	if(ret == ARCHIVE_OK && job->size > 0) {
+		if(archive_write_data_block(writer, job->data, job->size, 0) < ARCHIVE_OK) {
+			ret = ARCHIVE_WARN;
+		}
+	}
+	if(ret != ARCHIVE_OK) {
+		job->err = archive_errno(writer);
+		if(archive_error_string(writer)) {
+			job->error = strdup(archive_error_string(writer));
+		}
+	}
+	ret2 = archive_write_finish_entry(writer);
+	if(ret2 < ARCHIVE_WARN) {
+		ret2 = ARCHIVE_WARN;
+	}
+	if(ret2 != ARCHIVE_OK && ret == ARCHIVE_OK) {
+		job->err = archive_errno(writer);
+		if(archive_error_string(writer)) {
+			job->error = strdup(archive_error_string(writer));
+		}
+	}
+	job->ret = ret2 < ret ? ret2 : ret;
+
+	archive_write_free(writer);
+}
+
+static void *extract_worker(void *arg)
+{
+	struct extract_pool *pool = arg;
+
+	while(1) {
+		struct extract_job *job;
+
+		pthread_mutex_lock(&pool->lock);
+		while(pool->taken == pool->queued && !pool->closed) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if(pool->taken == pool->queued) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		job = pool->jobs + pool->taken++ % EXTRACT_QUEUE_LEN;
+		pthread_mutex_unlock(&pool->lock);
+
+		extract_job_write(job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* log the outcome of a job like perform_extraction() does and release it */
+static int extract_job_report(alpm_handle_t *handle, struct extract_job *job)
+{
+	const char *filename = archive_entry_pathname(job->entry);
+	const char *error = job->error ? job->error : strerror(job->err);
+	int errors = 0;
+
+	if(job->ret == ARCHIVE_WARN && job->err != ENOSPC) {
+		_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
+				filename, error);
+	} else if(job->ret != ARCHIVE_OK) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
+				filename, error);
+		alpm_logaction(handle, ALPM_CALLER_PREFIX,
+				"error: could not extract %s (%s)\n", filename, error);
+		errors = 1;
+	}
+
+	archive_entry_free(job->entry);
+	FREE(job->data);
+	FREE(job->error);
+	return errors;
+}
+
+/* Wait until no more than len jobs holding no more than bytes of data are
+ * outstanding. Finished jobs are reported strictly in the order they were
+ * queued, so messages come out the same as when extracting serially.
+ * Returns the number of files that could not be extracted. */
+static int extract_pool_wait(alpm_handle_t *handle, struct extract_pool *pool,
+		size_t len, size_t bytes)
+{
+	int errors = 0;
+
+	if(pool == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->queued - pool->reported > len || pool->bytes > bytes) {
+		struct extract_job *job = pool->jobs + pool->reported % EXTRACT_QUEUE_LEN;
+		if(!job->done) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		errors += extract_job_report(handle, job);
+		pthread_mutex_lock(&pool->lock);
+		pool->bytes -= job->size;
+		pool->reported++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return errors;
+}
+
+/* wait for every queued file to be written */
+static int extract_pool_drain(alpm_handle_t *handle, struct extract_pool *pool)
+{
+	return extract_pool_wait(handle, pool, 0, 0);
+}
+
+/* whether filename is still waiting to be written by the pool */
+static int extract_pool_pending(struct extract_pool *pool, const char *filename)
+{
+	size_t i;
+
+	if(pool == NULL) {
+		return 0;
+	}
+	/* only the main thread queues and reports, so these can be read safely */
+	for(i = pool->reported; i < pool->queued; i++) {
+		struct extract_job *job = pool->jobs + i % EXTRACT_QUEUE_LEN;
+		if(strcmp(archive_entry_pathname(job->entry), filename) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Plain files can be handed to the pool; anything else may refer to files
+ * still being written (hard links) or change what later files are written
+ * into (directories, symlinks), so it is extracted once the pool is idle. */
+static int extract_pool_accepts(struct extract_pool *pool,
+		struct archive_entry *entry)
+{
+	return pool != NULL && S_ISREG(archive_entry_mode(entry))
+		&& archive_entry_hardlink(entry) == NULL
+		&& archive_entry_size_is_set(entry)
+		&& archive_entry_size(entry) >= 0
+		&& archive_entry_size(entry) <= EXTRACT_JOB_MAX_SIZE;
+}
+
+/* read the data of entry and queue it to be written to filename */
+static int extract_pool_queue(alpm_handle_t *handle, struct extract_pool *pool,
+		struct archive *archive, struct archive_entry *entry, const char *filename)
+{
+	struct extract_job *job;
+	size_t size = (size_t)archive_entry_size(entry), pos = 0;
+	int errors;
+
+	errors = extract_pool_wait(handle, pool, EXTRACT_QUEUE_LEN - 1,
+			EXTRACT_QUEUE_BYTES - size);
+
+	job = pool->jobs + pool->queued % EXTRACT_QUEUE_LEN;
+	memset(job, 0, sizeof(*job));
+	job->size = size;
+	if(size > 0) {
+		MALLOC(job->data, size, goto error);
+	}
+	while(pos < size) {
+		ssize_t n = archive_read_data(archive, job->data + pos, size - pos);
+		if(n <= 0) {
+			/* the data in the archive is shorter than announced */
+			goto error;
+		}
+		pos += (size_t)n;
+	}
+	job->entry = archive_entry_clone(entry);
+	if(job->entry == NULL) {
+		goto error;
+	}
+	archive_entry_set_pathname(job->entry, filename);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->bytes += size;
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return errors;
+
+error:
+	FREE(job->data);
+	errors += extract_pool_drain(handle, pool);
+	_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
+			filename, archive_error_string(archive));
+	alpm_logaction(handle, ALPM_CALLER_PREFIX,
+			"error: could not extract %s (%s)\n",
+			filename, archive_error_string(archive));
+	return errors + 1;
+}
+
+static size_t extract_thread_count(alpm_handle_t *handle)
+{
+	long count = handle->worker_threads;
+
+	if(count == 0) {
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	return count > 0 ? (size_t)count : 1;
+}
+
+static void extract_pool_free(alpm_handle_t *handle, struct extract_pool *pool)
+{
+	size_t n;
+
+	if(pool == NULL) {
+		return;
+	}
+	extract_pool_drain(handle, pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for(n = 0; n < pool->nthreads; n++) {
+		pthread_join(pool->threads[n], NULL);
+	}
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Start the threads that write out package files. Returns NULL if files
+ * should be extracted by the calling thread alone. */
+static struct extract_pool *extract_pool_new(alpm_handle_t *handle)
+{
+	struct extract_pool *pool;
+	size_t n, nthreads = extract_thread_count(handle);
+
+	if(nthreads < 2) {
+		return NULL;
+	}
+
+	CALLOC(pool, 1, sizeof(struct extract_pool), return NULL);
+	CALLOC(pool->threads, nthreads, sizeof(pthread_t), free(pool); return NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for(n = 0; n < nthreads; n++) {
+		if(pthread_create(pool->threads + n, NULL, extract_worker, pool) != 0) {
+			break;
+		}
+		pool->nthreads++;
+	}
+	if(pool->nthreads == 0) {
+		extract_pool_free(handle, pool);
+		return NULL;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "using %zu threads to extract files\n",
+			pool->nthreads);
+	return pool;
+}
+
+/* skip the data of an entry read from archive; entries of a staged package
+ * (archive is NULL) have theirs in the stage */
+static void skip_entry_data(struct archive *archive)
+{
+	if(archive != NULL) {
+		archive_read_data_skip(archive);
+	}
+}
+
+/* Write out a staged entry the way archive_read_extract2() does, taking the
+ * data of a regular file from its staged copy. */
+static int extract_staged(struct archive *writer, struct archive_entry *entry)
+{
+	const char *staged = archive_entry_sourcepath(entry);
+	char buf[ALPM_BUFFER_SIZE];
+	ssize_t n = 0;
+	int fd, ret, ret2;
+
+	ret = archive_write_header(writer, entry);
+	if(ret < ARCHIVE_WARN) {
+		ret = ARCHIVE_WARN;
+	}
+	if(ret == ARCHIVE_OK && staged != NULL) {
+		OPEN(fd, staged, O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			archive_set_error(writer, errno, "%s", strerror(errno));
+			ret = ARCHIVE_WARN;
+		} else {
+			while((n = read(fd, buf, sizeof(buf))) > 0) {
+				if(archive_write_data(writer, buf, (size_t)n) != n) {
+					ret = ARCHIVE_WARN;
+					break;
+				}
+			}
+			if(n < 0) {
+				archive_set_error(writer, errno, "%s", strerror(errno));
+				ret = ARCHIVE_WARN;
+			}
+			close(fd);
+		}
+	}
+	ret2 = archive_write_finish_entry(writer);
+	if(ret2 < ARCHIVE_WARN) {
+		ret2 = ARCHIVE_WARN;
+	}
+	return ret2 < ret ? ret2 : ret;
+}
+
+/* Open the directory holding filename, which must lie below the root,
+ * without following a symbolic link in any component below the root; the
+ * same paths archive_write_disk() refuses with ARCHIVE_EXTRACT_SECURE_SYMLINKS.
+ * On success *base points to the last component of filename. */
+static int open_parent_nofollow(alpm_handle_t *handle, const char *filename,
+		const char **base)
+{
+	size_t rootlen = strlen(handle->root);
+	const char *name, *slash;
+	int fd;
+
+	if(strncmp(filename, handle->root, rootlen) != 0) {
+		return -1;
+	}
+	OPEN(fd, handle->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(fd < 0) {
+		return -1;
+	}
+	for(name = filename + rootlen; (slash = strchr(name, '/')) != NULL;
+			name = slash + 1) {
+		char component[NAME_MAX + 1];
+		size_t len = slash - name;
+		int next;
+
+		if(len == 0) {
+			continue;
+		}
+		if(len > NAME_MAX || (len == 2 && strncmp(name, "..", 2) == 0)) {
+			close(fd);
+			return -1;
+		}
+		memcpy(component, name, len);
+		component[len] = '\0';
+		do {
+			next = openat(fd, component,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		} while(next == -1 && errno == EINTR);
+		close(fd);
+		if(next < 0) {
+			return -1;
+		}
+		fd = next;
+	}
+	*base = name;
+	return fd;
+}
+
+/* Move a staged file into place, unless that would write through a
+ * symbolic link in a parent directory of filename. */
+static int rename_staged(alpm_handle_t *handle, const char *staged,
+		const char *filename)
+{
+	const char *base;
+	int ret, dirfd = open_parent_nofollow(handle, filename, &base);
+
+	if(dirfd < 0) {
+		return -1;
+	}
+	ret = renameat(AT_FDCWD, staged, dirfd, base);
+	close(dirfd);
+	return ret;
+}
+
+/* Extract entry to filename, reading its data from archive, or for a staged
+ * package (archive is NULL) from the stage. A staged file is moved into
+ * place, and only copied by archive_write_disk() where that is not possible,
+ * e.g. when it would cross file systems or a parent directory is a
+ * symbolic link. */
 static int perform_extraction(alpm_handle_t *handle, struct archive *archive,
 		struct archive_entry *entry, const char *filename)
 {
 	int ret;
-	struct archive *archive_writer;
-	const int archive_flags = ARCHIVE_EXTRACT_OWNER |
-	                          ARCHIVE_EXTRACT_PERM |
-	                          ARCHIVE_EXTRACT_TIME |
-	                          ARCHIVE_EXTRACT_UNLINK |
-	                          ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+	struct archive *archive_writer, *errors_from;
 
 	archive_entry_set_pathname(entry, filename);
 
+	if(archive == NULL && archive_entry_sourcepath(entry) != NULL
+			&& rename_staged(handle, archive_entry_sourcepath(entry), filename) == 0) {
+		return 0;
+	}
+
+	_alpm_umask_lock();
 	archive_writer = archive_write_disk_new();
+	_alpm_umask_unlock();
 	if (archive_writer == NULL) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("cannot allocate disk archive object"));
 		alpm_logaction(handle, ALPM_CALLER_PREFIX,
@@ -127,24 +569,30 @@ static int perform_extraction(alpm_handle_t *handle, struct archive *archive,
 		return 1;
 	}
 
-	archive_write_disk_set_options(archive_writer, archive_flags);
+	archive_write_disk_set_options(archive_writer, EXTRACT_FLAGS);
 
-	ret = archive_read_extract2(archive, entry, archive_writer);
-
-	archive_write_free(archive_writer);
+	if(archive != NULL) {
+		ret = archive_read_extract2(archive, entry, archive_writer);
+		errors_from = archive;
+	} else {
+		ret = extract_staged(archive_writer, entry);
+		errors_from = archive_writer;
+	}
 
-	if(ret == ARCHIVE_WARN && archive_errno(archive) != ENOSPC) {
+	if(ret == ARCHIVE_WARN && archive_errno(errors_from) != ENOSPC) {
 		/* operation succeeded but a "non-critical" error was encountered */
 		_alpm_log(handle, ALPM_LOG_WARNING, _("warning given when extracting %s (%s)\n"),
-				filename, archive_error_string(archive));
+				filename, archive_error_string(errors_from));
 	} else if(ret != ARCHIVE_OK) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not extract %s (%s)\n"),
-				filename, archive_error_string(archive));
+				filename, archive_error_string(errors_from));
 		alpm_logaction(handle, ALPM_CALLER_PREFIX,
 				"error: could not extract %s (%s)\n",
-				filename, archive_error_string(archive));
+				filename, archive_error_string(errors_from));
+		archive_write_free(archive_writer);
 		return 1;
 	}
+	archive_write_free(archive_writer);
 	return 0;
 }
 
@@ -174,7 +622,7 @@ static int extract_db_file(alpm_handle_t *handle, struct archive *archive,
 	} else if(*entryname == '.') {
 		/* reserve all files starting with '.' for future possibilities */
 		_alpm_log(handle, ALPM_LOG_DEBUG, "skipping extraction of '%s'\n", entryname);
-		archive_read_data_skip(archive);
+		skip_entry_data(archive);
 		return 0;
 	}
 	archive_entry_set_perm(entry, 0644);
@@ -184,7 +632,8 @@ static int extract_db_file(alpm_handle_t *handle, struct archive *archive,
 }
 
 static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
-		struct archive_entry *entry, alpm_pkg_t *newpkg, alpm_pkg_t *oldpkg)
+		struct archive_entry *entry, alpm_pkg_t *newpkg, alpm_pkg_t *oldpkg,
+		struct extract_pool *pool)
 {
 	const char *entryname = archive_entry_pathname(entry);
 	mode_t entrymode = archive_entry_mode(entry);
@@ -196,23 +645,35 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 	struct stat lsbuf;
 	size_t filename_len;
 
+	if(*entryname == '.' || !extract_pool_accepts(pool, entry)) {
+		errors += extract_pool_drain(handle, pool);
+		pool = NULL;
+	}
+
 	if(*entryname == '.') {
-		return extract_db_file(handle, archive, entry, newpkg, entryname);
+		return errors + extract_db_file(handle, archive, entry, newpkg, entryname);
 	}
 
 	if (!alpm_filelist_contains(&newpkg->files, entryname)) {
+		errors += extract_pool_drain(handle, pool);
 		_alpm_log(handle, ALPM_LOG_WARNING,
 				_("file not found in file list for package %s. skipping extraction of %s\n"),
 				newpkg->name, entryname);
-		return 0;
+		return errors;
 	}
 
 	/* build the new entryname relative to handle->root */
 	filename_len = snprintf(filename, PATH_MAX, "%s%s", handle->root, entryname);
 	if(filename_len >= PATH_MAX) {
+		errors += extract_pool_drain(handle, pool);
 		_alpm_log(handle, ALPM_LOG_ERROR,
 				_("unable to extract %s%s: path too long"), handle->root, entryname);
-		return 1;
+		return errors + 1;
+	}
+
+	/* a file listed twice must not be looked at while it is being written */
+	if(extract_pool_pending(pool, filename)) {
+		errors += extract_pool_drain(handle, pool);
 	}
 
 	/* if a file is in NoExtract then we never extract it */
@@ -220,8 +681,8 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		_alpm_log(handle, ALPM_LOG_DEBUG, "%s is in NoExtract,"
 				" skipping extraction of %s\n",
 				entryname, filename);
-		archive_read_data_skip(archive);
-		return 0;
+		skip_entry_data(archive);
+		return errors;
 	}
 
 	/* Check for file existence. This is one of the more crucial parts
@@ -280,14 +741,15 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 
 		_alpm_log(handle, ALPM_LOG_DEBUG, "extract: skipping dir extraction of %s\n",
 				filename);
-		archive_read_data_skip(archive);
-		return 0;
+		skip_entry_data(archive);
+		return errors;
 	} else if(S_ISDIR(lsbuf.st_mode)) {
 		/* case 5: trying to overwrite dir with file, don't allow it */
+		errors += extract_pool_drain(handle, pool);
 		_alpm_log(handle, ALPM_LOG_ERROR, _("extract: not overwriting dir with file %s\n"),
 				filename);
-		archive_read_data_skip(archive);
-		return 1;
+		skip_entry_data(archive);
+		return errors + 1;
 	} else if(S_ISDIR(entrymode)) {
 		/* case 4: trying to overwrite file with dir */
 		_alpm_log(handle, ALPM_LOG_DEBUG, "extract: overwriting file with dir %s\n",
@@ -309,17 +771,26 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		}
 	}
 
+	if(notouch || needbackup || backup) {
+		/* the outcome has to be looked at once the file is on disk */
+		errors += extract_pool_drain(handle, pool);
+		pool = NULL;
+	}
+
 	if(notouch || needbackup) {
 		if(filename_len + strlen(".pacnew") >= PATH_MAX) {
 			_alpm_log(handle, ALPM_LOG_ERROR,
 					_("unable to extract %s.pacnew: path too long"), filename);
-			return 1;
+			return errors + 1;
 		}
 		strcpy(filename + filename_len, ".pacnew");
 		isnewfile = (llstat(filename, &lsbuf) != 0 && errno == ENOENT);
 	}
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "extracting %s\n", filename);
+	if(pool) {
+		return errors + extract_pool_queue(handle, pool, archive, entry, filename);
+	}
 	if(perform_extraction(handle, archive, entry, filename)) {
 		errors++;
 		return errors;
@@ -340,7 +811,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 		};
 		/* "remove" the .pacnew suffix */
 		filename[filename_len] = '\0';
-		EVENT(handle, &event);
+		_alpm_pacnew_created(handle, &event);
 		alpm_logaction(handle, ALPM_CALLER_PREFIX,
 				"warning: %s installed as %s.pacnew\n", filename, filename);
 	} else if(needbackup) {
@@ -394,7 +865,7 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 			_alpm_log(handle, ALPM_LOG_DEBUG,
 					"action: keeping current file and installing"
 					" new one with .pacnew ending\n");
-			EVENT(handle, &event);
+			_alpm_pacnew_created(handle, &event);
 			alpm_logaction(handle, ALPM_CALLER_PREFIX,
 					"warning: %s installed as %s\n", origfile, filename);
 		}
@@ -407,64 +878,372 @@ static int extract_single_file(alpm_handle_t *handle, struct archive *archive,
 	return errors;
 }
 
-static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
-		size_t pkg_current, size_t pkg_count)
+/* The files of a package extracted ahead of its installation. The data of
+ * each regular file is written to the stage directory under the index of
+ * its entry, which is recorded as the entry's source path; installing the
+ * package then only has to move it into place. */
+struct pkg_stage {
+	char *dir;
+	struct archive_entry **entries;
+	size_t count;
+};
+
+/* the directory holding the stages of all packages, below the database */
+static char *stage_root(alpm_handle_t *handle)
 {
-	int i, ret = 0, errors = 0;
-	int is_upgrade = 0;
-	alpm_pkg_t *oldpkg = NULL;
-	alpm_db_t *db = handle->db_local;
-	alpm_trans_t *trans = handle->trans;
-	alpm_progress_t progress = ALPM_PROGRESS_ADD_START;
+	char *path;
+	size_t len = strlen(handle->dbpath) + 7;
+
+	MALLOC(path, len, RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	snprintf(path, len, "%sstage/", handle->dbpath);
+	return path;
+}
+
+/* remove the staged files left in dir, and dir itself */
+static void stage_remove_dir(const char *dir)
+{
+	DIR *dirp = opendir(dir);
+	struct dirent *ent;
+	char path[PATH_MAX];
+
+	if(dirp == NULL) {
+		return;
+	}
+	while((ent = readdir(dirp)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		if(snprintf(path, PATH_MAX, "%s/%s", dir, ent->d_name) < PATH_MAX) {
+			unlink(path);
+		}
+	}
+	closedir(dirp);
+	rmdir(dir);
+}
+
+/**
+ * Set up the directory packages are staged in. Anything in it was left
+ * behind by a transaction that did not get to clean up after itself, as
+ * the database is locked while packages are staged.
+ * @param handle the context handle
+ * @return 0 on success, -1 on error
+ */
+int _alpm_stage_setup(alpm_handle_t *handle)
+{
+	char *root = stage_root(handle);
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *dirp;
+	int ret = 0;
+
+	if(root == NULL) {
+		return -1;
+	}
+	dirp = opendir(root);
+	if(dirp != NULL) {
+		while((ent = readdir(dirp)) != NULL) {
+			if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+				continue;
+			}
+			if(snprintf(path, PATH_MAX, "%s%s", root, ent->d_name) < PATH_MAX) {
+				_alpm_log(handle, ALPM_LOG_DEBUG, "removing stale stage %s\n", path);
+				stage_remove_dir(path);
+			}
+		}
+		closedir(dirp);
+	} else if(_alpm_makepath_mode(root, 0700) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not create stage directory %s\n", root);
+		ret = -1;
+	}
+	free(root);
+	return ret;
+}
+
+/**
+ * Release the stage of a package, removing any files not installed from it.
+ * @param stage the stage to free, may be NULL
+ */
+void _alpm_stage_free(struct pkg_stage *stage)
+{
+	size_t i;
+
+	if(stage == NULL) {
+		return;
+	}
+	for(i = 0; i < stage->count; i++) {
+		const char *staged = archive_entry_sourcepath(stage->entries[i]);
+		if(staged != NULL) {
+			unlink(staged);
+		}
+		archive_entry_free(stage->entries[i]);
+	}
+	rmdir(stage->dir);
+	free(stage->entries);
+	free(stage->dir);
+	free(stage);
+}
+
+/* whether the data of an entry is written to the stage; hard links and
+ * empty files are made from their header alone */
+static int stage_holds_data(struct archive_entry *entry)
+{
+	return S_ISREG(archive_entry_mode(entry))
+		&& archive_entry_hardlink(entry) == NULL
+		&& archive_entry_size(entry) > 0;
+}
+
+/**
+ * Extract the files of a loaded package into a directory of its own below
+ * the stage directory set up by _alpm_stage_setup(). Called once the package
+ * file has passed its integrity checks, while other downloads may still be
+ * running; commit_single_pkg() then moves the files into place.
+ * @param handle the context handle
+ * @param pkg package loaded from a file
+ * @return 0 on success, -1 on error (the package is then installed from
+ * its file)
+ */
+int _alpm_stage_pkg(alpm_handle_t *handle, alpm_pkg_t *pkg)
+{
+	const char *pkgfile = pkg->origin_data.file;
+	struct pkg_stage *stage = NULL;
+	struct archive *archive, *writer = NULL;
+	struct archive_entry *entry;
+	struct stat st;
+	char path[PATH_MAX];
+	size_t entries_size = 0;
+	char *root;
+	int fd, ret;
+
+	fd = _alpm_open_archive(handle, pkgfile, &st, &archive, ALPM_ERR_PKG_OPEN);
+	if(fd < 0) {
+		return -1;
+	}
+	root = stage_root(handle);
+	if(root == NULL) {
+		goto error;
+	}
+	CALLOC(stage, 1, sizeof(struct pkg_stage),
+			handle->pm_errno = ALPM_ERR_MEMORY; goto error);
+	snprintf(path, PATH_MAX, "%s%s-XXXXXX", root, pkg->name);
+	FREE(root);
+	if(mkdtemp(path) == NULL) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not create %s: %s\n",
+				path, strerror(errno));
+		handle->pm_errno = ALPM_ERR_SYSTEM;
+		goto error;
+	}
+	STRDUP(stage->dir, path, rmdir(path);
+			handle->pm_errno = ALPM_ERR_MEMORY; goto error);
+
+	_alpm_umask_lock();
+	writer = archive_write_disk_new();
+	_alpm_umask_unlock();
+	if(writer == NULL) {
+		handle->pm_errno = ALPM_ERR_LIBARCHIVE;
+		goto error;
+	}
+	archive_write_disk_set_options(writer, EXTRACT_FLAGS);
+
+	while((ret = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
+		struct archive_entry *copy;
+
+		if(archive_entry_hardlink(entry) != NULL && archive_entry_size(entry) > 0) {
+			/* the data would have to go to the link target */
+			_alpm_log(handle, ALPM_LOG_DEBUG, "not staging %s: hard link with data\n",
+					pkgfile);
+			goto error;
+		}
+		if(!_alpm_greedy_grow((void **)&stage->entries, &entries_size,
+					(stage->count + 1) * sizeof(struct archive_entry *))) {
+			handle->pm_errno = ALPM_ERR_MEMORY;
+			goto error;
+		}
+		if(archive_entry_pathname(entry)[0] == '.') {
+			/* as extract_db_file() will install it */
+			archive_entry_set_perm(entry, 0644);
+		}
+		copy = archive_entry_clone(entry);
+		if(copy == NULL) {
+			handle->pm_errno = ALPM_ERR_MEMORY;
+			goto error;
+		}
+		stage->entries[stage->count++] = copy;
+
+		if(!stage_holds_data(entry)) {
+			if(archive_read_data_skip(archive) != ARCHIVE_OK) {
+				goto error_archive;
+			}
+			continue;
+		}
+		snprintf(path, PATH_MAX, "%s/%zu", stage->dir, stage->count - 1);
+		archive_entry_set_pathname(entry, path);
+		if(archive_read_extract2(archive, entry, writer) != ARCHIVE_OK) {
+			/* the file may have been created before it failed */
+			unlink(path);
+			goto error_archive;
+		}
+		archive_entry_copy_sourcepath(copy, path);
+	}
+	if(ret != ARCHIVE_EOF) {
+		goto error_archive;
+	}
+
+	archive_write_free(writer);
+	_alpm_archive_read_free(archive);
+	close(fd);
+	_alpm_log(handle, ALPM_LOG_DEBUG, "staged %s in %s\n", pkgfile, stage->dir);
+	_alpm_stage_free(pkg->stage);
+	pkg->stage = stage;
+	return 0;
+
+error_archive:
+	_alpm_log(handle, ALPM_LOG_DEBUG, "could not stage %s: %s\n",
+			pkgfile, archive_error_string(archive));
+	handle->pm_errno = ALPM_ERR_LIBARCHIVE;
+error:
+	free(root);
+	if(writer) {
+		archive_write_free(writer);
+	}
+	if(stage && stage->dir) {
+		_alpm_stage_free(stage);
+	} else {
+		free(stage);
+	}
+	_alpm_archive_read_free(archive);
+	close(fd);
+	return -1;
+}
+
+/* A package being installed by _alpm_upgrade_packages() */
+struct install_job {
+	alpm_pkg_t *newpkg;
+	alpm_pkg_t *oldpkg;
+	size_t pkg_current;
+	size_t pkg_count;
+	alpm_progress_t progress;
 	alpm_event_package_operation_t event;
-	const char *log_msg = "adding";
-	const char *pkgfile;
+	int is_upgrade;
 	struct archive *archive;
-	struct archive_entry *entry;
-	int fd, cwdfd;
+	int fd;
 	struct stat buf;
+	int errors;
+	/* only used when the files are written by an install_schedule thread:
+	 * a copy of the handle holding back its output, how far extraction got
+	 * and whether it is over */
+	alpm_handle_t handle;
+	alpm_list_t *deferred;
+	int percent;
+	int done;
+};
+
+/* Threads writing out the files of packages which do not depend on each
+ * other, while the main thread runs scriptlets and updates the database. */
+struct install_schedule {
+	pthread_mutex_t lock;
+	/* signalled when a job is queued or the schedule is closed */
+	pthread_cond_t work;
+	/* signalled when a job made progress */
+	pthread_cond_t progress;
+	/* one job per target, and how many targets have to be installed
+	 * before each one can be started */
+	struct install_job *jobs;
+	size_t *required;
+	size_t count;
+	size_t queued;
+	size_t taken;
+	pthread_t *threads;
+	size_t nthreads;
+	int closed;
+};
+
+/* point a hard link at its target below the root; libarchive otherwise
+ * looks for it relative to the working directory */
+static int rebase_hardlink(alpm_handle_t *handle, struct archive_entry *entry)
+{
+	const char *hardlink = archive_entry_hardlink(entry);
+	char path[PATH_MAX];
+
+	if(hardlink == NULL) {
+		return 0;
+	}
+	if(snprintf(path, PATH_MAX, "%s%s", handle->root, hardlink) >= PATH_MAX) {
+		_alpm_log(handle, ALPM_LOG_ERROR,
+				_("unable to extract %s%s: path too long"), handle->root,
+				archive_entry_pathname(entry));
+		return 1;
+	}
+	archive_entry_set_hardlink(entry, path);
+	return 0;
+}
+
+static void install_progress(alpm_handle_t *handle, struct install_job *job,
+		struct install_schedule *sched, int percent)
+{
+	if(sched == NULL) {
+		PROGRESS(handle, job->progress, job->newpkg->name, percent,
+				job->pkg_count, job->pkg_current);
+	} else if(percent != job->percent) {
+		pthread_mutex_lock(&sched->lock);
+		job->percent = percent;
+		pthread_cond_broadcast(&sched->progress);
+		pthread_mutex_unlock(&sched->lock);
+	}
+}
+
+/* Announce the package, run its pre_install scriptlet, remove the version
+ * it replaces and open its archive. */
+static int install_begin(alpm_handle_t *handle, struct install_job *job)
+{
+	alpm_pkg_t *newpkg = job->newpkg, *oldpkg = NULL;
+	alpm_db_t *db = handle->db_local;
+	alpm_trans_t *trans = handle->trans;
+	const char *log_msg = "adding";
+	int ret;
 
 	ASSERT(trans != NULL, return -1);
 
+	job->progress = ALPM_PROGRESS_ADD_START;
+	job->fd = -1;
+
 	/* see if this is an upgrade. if so, remove the old package first */
 	if(_alpm_db_get_pkgfromcache(db, newpkg->name) && (oldpkg = newpkg->oldpkg)) {
 		int cmp = _alpm_pkg_compare_versions(newpkg, oldpkg);
 		if(cmp < 0) {
 			log_msg = "downgrading";
-			progress = ALPM_PROGRESS_DOWNGRADE_START;
-			event.operation = ALPM_PACKAGE_DOWNGRADE;
+			job->progress = ALPM_PROGRESS_DOWNGRADE_START;
+			job->event.operation = ALPM_PACKAGE_DOWNGRADE;
 		} else if(cmp == 0) {
 			log_msg = "reinstalling";
-			progress = ALPM_PROGRESS_REINSTALL_START;
-			event.operation = ALPM_PACKAGE_REINSTALL;
+			job->progress = ALPM_PROGRESS_REINSTALL_START;
+			job->event.operation = ALPM_PACKAGE_REINSTALL;
 		} else {
 			log_msg = "upgrading";
-			progress = ALPM_PROGRESS_UPGRADE_START;
-			event.operation = ALPM_PACKAGE_UPGRADE;
+			job->progress = ALPM_PROGRESS_UPGRADE_START;
+			job->event.operation = ALPM_PACKAGE_UPGRADE;
 		}
-		is_upgrade = 1;
+		job->is_upgrade = 1;
 
 		/* copy over the install reason */
 		newpkg->reason = alpm_pkg_get_reason(oldpkg);
 	} else {
-		event.operation = ALPM_PACKAGE_INSTALL;
+		job->event.operation = ALPM_PACKAGE_INSTALL;
 	}
+	job->oldpkg = oldpkg;
 
-	event.type = ALPM_EVENT_PACKAGE_OPERATION_START;
-	event.oldpkg = oldpkg;
-	event.newpkg = newpkg;
-	EVENT(handle, &event);
-
-	pkgfile = newpkg->origin_data.file;
+	job->event.type = ALPM_EVENT_PACKAGE_OPERATION_START;
+	job->event.oldpkg = oldpkg;
+	job->event.newpkg = newpkg;
+	EVENT(handle, &job->event);
 
 	_alpm_log(handle, ALPM_LOG_DEBUG, "%s package %s-%s\n",
 			log_msg, newpkg->name, newpkg->version);
 		/* pre_install/pre_upgrade scriptlet */
 	if(alpm_pkg_has_scriptlet(newpkg) &&
 			!(trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET)) {
-		const char *scriptlet_name = is_upgrade ? "pre_upgrade" : "pre_install";
+		const char *scriptlet_name = job->is_upgrade ? "pre_upgrade" : "pre_install";
 
-		_alpm_runscriptlet(handle, pkgfile, scriptlet_name,
+		_alpm_runscriptlet(handle, newpkg->origin_data.file, scriptlet_name,
 				newpkg->version, oldpkg ? oldpkg->version : NULL, 1);
 	}
 
@@ -476,105 +1255,145 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 	}
 
 	if(oldpkg) {
+		/* the backup files of the old version are still needed during
+		 * extraction, after its database entry is gone */
+		alpm_pkg_get_backup(oldpkg);
+
 		/* set up fake remove transaction */
 		if(_alpm_remove_single_package(handle, oldpkg, newpkg, 0, 0) == -1) {
 			handle->pm_errno = ALPM_ERR_TRANS_ABORT;
-			ret = -1;
-			goto cleanup;
+			return -1;
 		}
 	}
 
 	/* prepare directory for database entries so permissions are correct after
 	   changelog/install script installation */
-	if(_alpm_local_db_prepare(db, newpkg)) {
+	_alpm_umask_lock();
+	ret = _alpm_local_db_prepare(db, newpkg);
+	_alpm_umask_unlock();
+	if(ret) {
 		alpm_logaction(handle, ALPM_CALLER_PREFIX,
 				"error: could not create database entry %s-%s\n",
 				newpkg->name, newpkg->version);
 		handle->pm_errno = ALPM_ERR_DB_WRITE;
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
-	fd = _alpm_open_archive(db->handle, pkgfile, &buf,
-			&archive, ALPM_ERR_PKG_OPEN);
-	if(fd < 0) {
-		ret = -1;
-		goto cleanup;
+	if(newpkg->stage) {
+		/* the files are taken from the stage instead */
+		return 0;
+	}
+	job->fd = _alpm_open_archive(db->handle, newpkg->origin_data.file, &job->buf,
+			&job->archive, ALPM_ERR_PKG_OPEN);
+	if(job->fd < 0) {
+		return -1;
 	}
+	return 0;
+}
 
-	/* save the cwd so we can restore it later */
-	OPEN(cwdfd, ".", O_RDONLY | O_CLOEXEC);
-	if(cwdfd < 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not get current working directory\n"));
+/* the entry of the package being installed after the i entries before it,
+ * or NULL after the last one */
+static struct archive_entry *install_next_entry(struct install_job *job, size_t i)
+{
+	struct pkg_stage *stage = job->newpkg->stage;
+	struct archive_entry *entry;
+
+	if(stage) {
+		return i < stage->count ? stage->entries[i] : NULL;
+	}
+	if(archive_read_next_header(job->archive, &entry) != ARCHIVE_OK) {
+		return NULL;
 	}
+	return entry;
+}
 
-	/* libarchive requires this for extracting hard links */
-	if(chdir(handle->root) != 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not change directory to %s (%s)\n"),
-				handle->root, strerror(errno));
-		_alpm_archive_read_free(archive);
-		if(cwdfd >= 0) {
-			close(cwdfd);
-		}
-		close(fd);
-		ret = -1;
-		goto cleanup;
+static int install_percent(struct install_job *job, size_t i)
+{
+	struct pkg_stage *stage = job->newpkg->stage;
+	int percent;
+
+	if(stage) {
+		return stage->count ? (int)(i * 100 / stage->count) : 0;
+	}
+	if(job->buf.st_size == 0) {
+		return 0;
 	}
+	/* Using compressed size for calculations here, as newpkg->isize is not
+	 * exact when it comes to comparing to the ACTUAL uncompressed size
+	 * (missing metadata sizes) */
+	percent = (_alpm_archive_compressed_ftell(job->archive) * 100) / job->buf.st_size;
+	return percent >= 100 ? 100 : percent;
+}
 
-	if(trans->flags & ALPM_TRANS_FLAG_DBONLY) {
+/* Write out the files of the package and close its archive or release its
+ * stage. Without a schedule, this happens on the main thread, reporting
+ * progress as it goes; on a schedule thread, progress is left to the main
+ * thread. Hard links are pointed at the root rather than changing into it,
+ * as the working directory is shared by all threads. */
+static int install_extract(alpm_handle_t *handle, struct install_job *job,
+		struct extract_pool *pool, struct install_schedule *sched)
+{
+	alpm_pkg_t *newpkg = job->newpkg;
+	struct archive_entry *entry;
+	size_t i;
+
+	if(newpkg->stage) {
+		/* staged files are only moved into place */
+		pool = NULL;
+	}
+
+	if(handle->trans->flags & ALPM_TRANS_FLAG_DBONLY) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "extracting db files\n");
-		while(archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+		for(i = 0; (entry = install_next_entry(job, i)) != NULL; i++) {
 			const char *entryname = archive_entry_pathname(entry);
 			if(entryname[0] == '.') {
-				errors += extract_db_file(handle, archive, entry, newpkg, entryname);
+				job->errors += extract_db_file(handle, job->archive, entry,
+						newpkg, entryname);
 			} else {
-				archive_read_data_skip(archive);
+				skip_entry_data(job->archive);
 			}
 		}
 	} else {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "extracting files\n");
 
 		/* call PROGRESS once with 0 percent, as we sort-of skip that here */
-		PROGRESS(handle, progress, newpkg->name, 0, pkg_count, pkg_current);
-
-		for(i = 0; archive_read_next_header(archive, &entry) == ARCHIVE_OK; i++) {
-			int percent;
-
-			if(newpkg->size != 0) {
-				/* Using compressed size for calculations here, as newpkg->isize is not
-				 * exact when it comes to comparing to the ACTUAL uncompressed size
-				 * (missing metadata sizes) */
-				int64_t pos = _alpm_archive_compressed_ftell(archive);
-				percent = (pos * 100) / newpkg->size;
-				if(percent >= 100) {
-					percent = 100;
-				}
-			} else {
-				percent = 0;
-			}
+		install_progress(handle, job, sched, 0);
+
+		for(i = 0; (entry = install_next_entry(job, i)) != NULL; i++) {
+			install_progress(handle, job, sched, install_percent(job, i));
 
-			PROGRESS(handle, progress, newpkg->name, percent, pkg_count, pkg_current);
+			if(rebase_hardlink(handle, entry) != 0) {
+				skip_entry_data(job->archive);
+				job->errors++;
+				continue;
+			}
 
 			/* extract the next file from the archive */
-			errors += extract_single_file(handle, archive, entry, newpkg, oldpkg);
+			job->errors += extract_single_file(handle, job->archive, entry,
+					newpkg, job->oldpkg, pool);
 		}
+		job->errors += extract_pool_drain(handle, pool);
 	}
 
-	_alpm_archive_read_free(archive);
-	close(fd);
-
-	/* restore the old cwd if we have it */
-	if(cwdfd >= 0) {
-		if(fchdir(cwdfd) != 0) {
-			_alpm_log(handle, ALPM_LOG_ERROR,
-					_("could not restore working directory (%s)\n"), strerror(errno));
-		}
-		close(cwdfd);
+	if(job->archive) {
+		_alpm_archive_read_free(job->archive);
+		close(job->fd);
 	}
+	_alpm_stage_free(newpkg->stage);
+	newpkg->stage = NULL;
+	return 0;
+}
+
+/* Record the package in the database and run its post_install scriptlet. */
+static int install_finish(alpm_handle_t *handle, struct install_job *job)
+{
+	alpm_pkg_t *newpkg = job->newpkg, *oldpkg = job->oldpkg;
+	alpm_db_t *db = handle->db_local;
+	int ret = 0, write_ret;
 
-	if(errors) {
+	if(job->errors) {
 		ret = -1;
-		if(is_upgrade) {
+		if(job->is_upgrade) {
 			_alpm_log(handle, ALPM_LOG_ERROR, _("problem occurred while upgrading %s\n"),
 					newpkg->name);
 			alpm_logaction(handle, ALPM_CALLER_PREFIX,
@@ -595,15 +1414,17 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 	_alpm_log(handle, ALPM_LOG_DEBUG, "updating database\n");
 	_alpm_log(handle, ALPM_LOG_DEBUG, "adding database entry '%s'\n", newpkg->name);
 
-	if(_alpm_local_db_write(db, newpkg, INFRQ_ALL)) {
+	_alpm_umask_lock();
+	write_ret = _alpm_local_db_write(db, newpkg, INFRQ_ALL);
+	_alpm_umask_unlock();
+	if(write_ret) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not update database entry %s-%s\n"),
 				newpkg->name, newpkg->version);
 		alpm_logaction(handle, ALPM_CALLER_PREFIX,
 				"error: could not update database entry %s-%s\n",
 				newpkg->name, newpkg->version);
 		handle->pm_errno = ALPM_ERR_DB_WRITE;
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
 	if(_alpm_db_add_pkgincache(db, newpkg) == -1) {
@@ -611,9 +1432,10 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 				newpkg->name);
 	}
 
-	PROGRESS(handle, progress, newpkg->name, 100, pkg_count, pkg_current);
+	PROGRESS(handle, job->progress, newpkg->name, 100,
+			job->pkg_count, job->pkg_current);
 
-	switch(event.operation) {
+	switch(job->event.operation) {
 		case ALPM_PACKAGE_INSTALL:
 			alpm_logaction(handle, ALPM_CALLER_PREFIX, "installed %s (%s)\n",
 					newpkg->name, newpkg->version);
@@ -637,19 +1459,294 @@ static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
 
 	/* run the post-install script if it exists */
 	if(alpm_pkg_has_scriptlet(newpkg)
-			&& !(trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET)) {
+			&& !(handle->trans->flags & ALPM_TRANS_FLAG_NOSCRIPTLET)) {
 		char *scriptlet = _alpm_local_db_pkgpath(db, newpkg, "install");
-		const char *scriptlet_name = is_upgrade ? "post_upgrade" : "post_install";
+		const char *scriptlet_name = job->is_upgrade ? "post_upgrade" : "post_install";
 
 		_alpm_runscriptlet(handle, scriptlet, scriptlet_name,
 				newpkg->version, oldpkg ? oldpkg->version : NULL, 0);
 		free(scriptlet);
 	}
 
-	event.type = ALPM_EVENT_PACKAGE_OPERATION_DONE;
-	EVENT(handle, &event);
+	job->event.type = ALPM_EVENT_PACKAGE_OPERATION_DONE;
+	EVENT(handle, &job->event);
 
-cleanup:
+	return ret;
+}
+
+static int commit_single_pkg(alpm_handle_t *handle, alpm_pkg_t *newpkg,
+		size_t pkg_current, size_t pkg_count, struct extract_pool *pool)
+{
+	struct install_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.newpkg = newpkg;
+	job.pkg_current = pkg_current;
+	job.pkg_count = pkg_count;
+
+	if(install_begin(handle, &job) != 0
+			|| install_extract(handle, &job, pool, NULL) != 0) {
+		return -1;
+	}
+	return install_finish(handle, &job);
+}
+
+static void *install_worker(void *arg)
+{
+	struct install_schedule *sched = arg;
+
+	while(1) {
+		struct install_job *job;
+
+		pthread_mutex_lock(&sched->lock);
+		while(sched->taken == sched->queued && !sched->closed) {
+			pthread_cond_wait(&sched->work, &sched->lock);
+		}
+		if(sched->taken == sched->queued) {
+			pthread_mutex_unlock(&sched->lock);
+			return NULL;
+		}
+		job = sched->jobs + sched->taken++;
+		pthread_mutex_unlock(&sched->lock);
+
+		install_extract(&job->handle, job, NULL, sched);
+
+		pthread_mutex_lock(&sched->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&sched->progress);
+		pthread_mutex_unlock(&sched->lock);
+	}
+}
+
+/* hand the next begun job to the threads */
+static void install_schedule_queue(alpm_handle_t *handle,
+		struct install_schedule *sched, struct install_job *job)
+{
+	job->handle = *handle;
+	job->handle.deferred = &job->deferred;
+
+	pthread_mutex_lock(&sched->lock);
+	sched->queued++;
+	pthread_cond_signal(&sched->work);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/* report the progress of a queued job until its files are written */
+static void install_schedule_wait(alpm_handle_t *handle,
+		struct install_schedule *sched, struct install_job *job)
+{
+	int reported = -1;
+
+	pthread_mutex_lock(&sched->lock);
+	while(1) {
+		int percent = job->percent;
+		if(percent != reported) {
+			reported = percent;
+			pthread_mutex_unlock(&sched->lock);
+			PROGRESS(handle, job->progress, job->newpkg->name, percent,
+					job->pkg_count, job->pkg_current);
+			pthread_mutex_lock(&sched->lock);
+			continue;
+		}
+		if(job->done) {
+			break;
+		}
+		pthread_cond_wait(&sched->progress, &sched->lock);
+	}
+	pthread_mutex_unlock(&sched->lock);
+}
+
+static void install_schedule_free(struct install_schedule *sched)
+{
+	size_t n;
+
+	if(sched == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&sched->lock);
+	sched->closed = 1;
+	pthread_cond_broadcast(&sched->work);
+	pthread_mutex_unlock(&sched->lock);
+	for(n = 0; n < sched->nthreads; n++) {
+		pthread_join(sched->threads[n], NULL);
+	}
+	pthread_cond_destroy(&sched->progress);
+	pthread_cond_destroy(&sched->work);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched->threads);
+	free(sched->required);
+	free(sched->jobs);
+	free(sched);
+}
+
+/* Removing the old version of a target deletes the directories it owns once
+ * they are empty and no installed package lists them. Targets ahead of it
+ * are only in the database once finished, so make it wait for every one of
+ * them that puts anything into a directory the old version may delete,
+ * which is one the new version does not list itself. */
+static int install_schedule_shared_dirs(alpm_handle_t *handle,
+		struct install_schedule *sched, alpm_list_t *targets)
+{
+	alpm_pkg_t **pkgs;
+	alpm_list_t *i;
+	size_t k, n;
+
+	CALLOC(pkgs, sched->count, sizeof(alpm_pkg_t *), return -1);
+	for(n = 0, i = targets; i; i = i->next, n++) {
+		pkgs[n] = i->data;
+	}
+
+	for(k = 0; k < sched->count; k++) {
+		alpm_pkg_t *oldpkg = pkgs[k]->oldpkg;
+		alpm_filelist_t *oldfiles;
+
+		if(oldpkg == NULL) {
+			continue;
+		}
+		oldfiles = alpm_pkg_get_files(oldpkg);
+		for(n = 0; n < oldfiles->count && sched->required[k] < k; n++) {
+			const char *dir = oldfiles->files[n].name;
+			size_t j;
+
+			if(dir[strlen(dir) - 1] != '/'
+					|| alpm_filelist_contains(alpm_pkg_get_files(pkgs[k]), dir)) {
+				continue;
+			}
+			for(j = k; j > sched->required[k]; j--) {
+				if(_alpm_filelist_contains_below(alpm_pkg_get_files(pkgs[j - 1]), dir)) {
+					_alpm_log(handle, ALPM_LOG_DEBUG,
+							"%s waits for %s, which uses directory %s\n",
+							pkgs[k]->name, pkgs[j - 1]->name, dir);
+					sched->required[k] = j;
+					break;
+				}
+			}
+		}
+	}
+	free(pkgs);
+	return 0;
+}
+
+/* Start the threads installing the targets concurrently. Returns NULL if
+ * they should be installed one at a time. */
+static struct install_schedule *install_schedule_new(alpm_handle_t *handle)
+{
+	struct install_schedule *sched;
+	alpm_trans_t *trans = handle->trans;
+	size_t n, nthreads = extract_thread_count(handle);
+	size_t count = alpm_list_count(trans->add);
+
+	if(!(trans->flags & ALPM_TRANS_FLAG_CONCURRENT)
+			|| (trans->flags & ALPM_TRANS_FLAG_DBONLY)) {
+		return NULL;
+	}
+	if(handle->overwrite_files) {
+		/* targets may then own the same files, and the last one installed
+		 * has to win */
+		_alpm_log(handle, ALPM_LOG_DEBUG,
+				"overwriting files, installing one package at a time\n");
+		return NULL;
+	}
+	if(nthreads > count) {
+		nthreads = count;
+	}
+	if(nthreads < 2) {
+		return NULL;
+	}
+
+	CALLOC(sched, 1, sizeof(struct install_schedule), return NULL);
+	sched->count = count;
+	sched->required = _alpm_sortbydeps_prefix(handle, trans->add);
+	CALLOC(sched->jobs, count, sizeof(struct install_job), goto error);
+	CALLOC(sched->threads, nthreads, sizeof(pthread_t), goto error);
+	if(sched->required == NULL
+			|| install_schedule_shared_dirs(handle, sched, trans->add) != 0) {
+		goto error;
+	}
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->work, NULL);
+	pthread_cond_init(&sched->progress, NULL);
+	for(n = 0; n < nthreads; n++) {
+		if(pthread_create(sched->threads + n, NULL, install_worker, sched) != 0) {
+			break;
+		}
+		sched->nthreads++;
+	}
+	if(sched->nthreads < 2) {
+		install_schedule_free(sched);
+		return NULL;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "installing up to %zu packages at once\n",
+			sched->nthreads);
+	return sched;
+
+error:
+	free(sched->threads);
+	free(sched->required);
+	free(sched->jobs);
+	free(sched);
+	return NULL;
+}
+
+/* Install the targets in the order of the transaction, writing out the
+ * files of a package as soon as every target it depends on is installed.
+ * Everything but writing files is done here on the main thread, in order:
+ * packages are begun as far as dependencies and threads allow and finished
+ * one after the other once their files are on disk. */
+static int commit_concurrently(alpm_handle_t *handle,
+		struct install_schedule *sched, int *skip_ldconfig)
+{
+	alpm_trans_t *trans = handle->trans;
+	alpm_list_t *targ = trans->add;
+	size_t begun = 0, finished = 0;
+	int ret = 0, stop = 0;
+
+	while(finished < begun || (!stop && begun < sched->count)) {
+		struct install_job *job;
+
+		while(!stop && begun < sched->count
+				&& begun - finished < sched->nthreads
+				&& sched->required[begun] <= finished) {
+			job = sched->jobs + begun;
+			if(trans->state == STATE_INTERRUPTED) {
+				*skip_ldconfig = 1;
+				stop = 1;
+				break;
+			}
+			job->newpkg = targ->data;
+			job->pkg_current = begun + 1;
+			job->pkg_count = sched->count;
+			targ = targ->next;
+			if(install_begin(handle, job) != 0) {
+				/* something screwed up on the commit, abort the trans */
+				trans->state = STATE_INTERRUPTED;
+				handle->pm_errno = ALPM_ERR_TRANS_ABORT;
+				/* running ldconfig at this point could possibly screw system */
+				*skip_ldconfig = 1;
+				ret = -1;
+				stop = 1;
+				break;
+			}
+			install_schedule_queue(handle, sched, job);
+			begun++;
+		}
+		if(finished == begun) {
+			continue;
+		}
+
+		job = sched->jobs + finished;
+		install_schedule_wait(handle, sched, job);
+		_alpm_deferred_flush(handle, job->deferred);
+		job->deferred = NULL;
+		if(install_finish(handle, job) != 0) {
+			trans->state = STATE_INTERRUPTED;
+			handle->pm_errno = ALPM_ERR_TRANS_ABORT;
+			*skip_ldconfig = 1;
+			ret = -1;
+			stop = 1;
+		}
+		finished++;
+	}
 	return ret;
 }
 
@@ -659,23 +1756,40 @@ int _alpm_upgrade_packages(alpm_handle_t *handle)
 	int skip_ldconfig = 0, ret = 0;
 	alpm_list_t *targ;
 	alpm_trans_t *trans = handle->trans;
+	struct extract_pool *pool = NULL;
+	struct install_schedule *sched;
 
 	if(trans->add == NULL) {
 		return 0;
 	}
 
+	sched = install_schedule_new(handle);
+	if(sched) {
+		ret = commit_concurrently(handle, sched, &skip_ldconfig);
+		install_schedule_free(sched);
+		if(!skip_ldconfig) {
+			_alpm_ldconfig(handle);
+		}
+		return ret;
+	}
+
 	pkg_count = alpm_list_count(trans->add);
 	pkg_current = 1;
 
+	if(!(trans->flags & ALPM_TRANS_FLAG_DBONLY)) {
+		pool = extract_pool_new(handle);
+	}
+
 	/* loop through our package list adding/upgrading one at a time */
 	for(targ = trans->add; targ; targ = targ->next) {
 		alpm_pkg_t *newpkg = targ->data;
 
 		if(handle->trans->state == STATE_INTERRUPTED) {
+			extract_pool_free(handle, pool);
 			return ret;
 		}
 
-		if(commit_single_pkg(handle, newpkg, pkg_current, pkg_count)) {
+		if(commit_single_pkg(handle, newpkg, pkg_current, pkg_count, pool)) {
 			/* something screwed up on the commit, abort the trans */
 			trans->state = STATE_INTERRUPTED;
 			handle->pm_errno = ALPM_ERR_TRANS_ABORT;
@@ -687,6 +1801,8 @@ int _alpm_upgrade_packages(alpm_handle_t *handle)
 		pkg_current++;
 	}
 
+	extract_pool_free(handle, pool);
+
 	if(!skip_ldconfig) {
 		/* run ldconfig if it exists */
 		_alpm_ldconfig(handle);
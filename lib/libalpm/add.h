@@ -23,7 +23,11 @@
 #include "db.h"
 #include "alpm_list.h"
 #include "trans.h"
+#include "package.h"
 
 int _alpm_upgrade_packages(alpm_handle_t *handle);
+int _alpm_stage_setup(alpm_handle_t *handle);
+int _alpm_stage_pkg(alpm_handle_t *handle, alpm_pkg_t *pkg);
+void _alpm_stage_free(struct pkg_stage *stage);
 
 #endif /* ALPM_ADD_H */
@@ -921,6 +921,40 @@ int alpm_option_set_deltaratio(alpm_handle_t *handle, double ratio);
 int alpm_option_get_checkspace(alpm_handle_t *handle);
 int alpm_option_set_checkspace(alpm_handle_t *handle, int checkspace);
 
+/** Returns the number of package files downloaded at the same time. */
+unsigned int alpm_option_get_parallel_downloads(alpm_handle_t *handle);
+/** Sets the number of package files downloaded at the same time.
+ * With more than one, files are fetched concurrently by the internal
+ * downloader; an external fetch callback always gets one file at a time.
+ * @param handle the context handle
+ * @param num_streams number of concurrent downloads, at least 1
+ * @return 0 on success, -1 on error (pm_errno is set accordingly)
+ */
+int alpm_option_set_parallel_downloads(alpm_handle_t *handle,
+		unsigned int num_streams);
+
+/** Returns the size from which files are downloaded in segments. */
+off_t alpm_option_get_segmented_download_size(alpm_handle_t *handle);
+/** Sets the size from which files are downloaded in segments.
+ * Package files of at least this size are split into byte ranges that are
+ * fetched over parallel_downloads connections at the same time. Only HTTP
+ * servers are used this way, and only by the internal downloader.
+ * @param handle the context handle
+ * @param size size in bytes, 0 to never split files
+ * @return 0 on success, -1 on error (pm_errno is set accordingly)
+ */
+int alpm_option_set_segmented_download_size(alpm_handle_t *handle, off_t size);
+
+/** Returns the number of threads used to validate, load and extract package files. */
+unsigned int alpm_option_get_worker_threads(alpm_handle_t *handle);
+/** Sets the number of threads used to validate, load and extract package files.
+ * @param handle the context handle
+ * @param num_threads number of threads, 0 for one per online CPU
+ * @return 0 on success, -1 on error (pm_errno is set accordingly)
+ */
+int alpm_option_set_worker_threads(alpm_handle_t *handle,
+		unsigned int num_threads);
+
 const char *alpm_option_get_dbext(alpm_handle_t *handle);
 int alpm_option_set_dbext(alpm_handle_t *handle, const char *dbext);
 
@@ -1026,6 +1060,40 @@ alpm_pkg_t *alpm_db_get_pkg(alpm_db_t *db, const char *name);
  */
 alpm_list_t *alpm_db_get_pkgcache(alpm_db_t *db);
 
+/** Find the packages of a database owning a file.
+ * Directories are only matched with a trailing slash.
+ * @param db pointer to the package database to search
+ * @param path path of the file, relative to the root
+ * @return a list of owning packages in database order, which must be freed
+ * with alpm_list_free(); NULL if no package owns the file or on error
+ */
+alpm_list_t *alpm_db_find_file_owners(alpm_db_t *db, const char *path);
+
+/** Find the packages of a database with a file of a given name.
+ * Only the part of a path after its last slash is compared, so directories
+ * never match.
+ * @param db pointer to the package database to search
+ * @param filename name of the file, without any directory
+ * @return a list of matching packages in database order, which must be
+ * freed with alpm_list_free(); NULL if no package matches or on error
+ */
+alpm_list_t *alpm_db_filename_search(alpm_db_t *db, const char *filename);
+
+/** Load the package caches of all sync databases concurrently.
+ * Each database is decompressed and parsed on a pool of worker threads,
+ * so loading them all takes about as long as loading the largest one.
+ * Databases whose cache is already loaded are skipped. A database that
+ * fails to load is left without a cache, and a later call to
+ * alpm_db_get_pkgcache() on it reports its error. The callbacks of the
+ * handle are only called from the calling thread, once every database
+ * is loaded.
+ * @param handle the context handle
+ * @param nthreads maximum number of threads to use, 0 for one per database
+ * @return 0 on success, -1 if any database failed to load (pm_errno is set
+ * to the error of the first one)
+ */
+int alpm_dbs_populate_parallel(alpm_handle_t *handle, unsigned int nthreads);
+
 /** Get a group entry from a package database.
  * @param db pointer to the package database to get the group from
  * @param name of the group
@@ -1077,13 +1145,12 @@ int alpm_db_get_usage(alpm_db_t *db, int *usage);
 
 /** Create a package from a file.
  * If full is false, the archive is read only until all necessary
- * metadata is found. If it is true, the entire archive is read, which
- * serves as a verification of integrity and the filelist can be created.
+ * metadata is found. If it is true, the filelist is created as well, from
+ * the package's .MTREE if it has one or else by reading the entire archive.
  * The allocated structure should be freed using alpm_pkg_free().
  * @param handle the context handle
  * @param filename location of the package tarball
- * @param full whether to stop the load after metadata is read or continue
- * through the full archive
+ * @param full whether to also create the filelist
  * @param level what level of package signature checking to perform on the
  * package; note that this must be a '.sig' file type verification
  * @param pkg address of the package pointer
@@ -1474,7 +1541,11 @@ typedef enum _alpm_transflag_t {
 	ALPM_TRANS_FLAG_RECURSE = (1 << 5),
 	/** Modify database but do not commit changes to the filesystem. */
 	ALPM_TRANS_FLAG_DBONLY = (1 << 6),
-	/* (1 << 7) flag can go here */
+	/** Extract the files of packages into a staging directory below the
+	 * database path as soon as they are downloaded and validated, while
+	 * other downloads are still running; installing a package then moves
+	 * its files into place. */
+	ALPM_TRANS_FLAG_STREAM = (1 << 7),
 	/** Use ALPM_PKG_REASON_DEPEND when installing packages. */
 	ALPM_TRANS_FLAG_ALLDEPS = (1 << 8),
 	/** Only download packages and do not actually install. */
@@ -1483,7 +1554,12 @@ typedef enum _alpm_transflag_t {
 	ALPM_TRANS_FLAG_NOSCRIPTLET = (1 << 10),
 	/** Ignore dependency conflicts. */
 	ALPM_TRANS_FLAG_NOCONFLICTS = (1 << 11),
-	/* (1 << 12) flag can go here */
+	/** Write out the files of packages which do not depend on each other
+	 * at the same time. Scriptlets and database updates still happen one
+	 * package at a time, in dependency order, and progress is reported for
+	 * one package after the other, though a package may be started before
+	 * the ones ahead of it are done. */
+	ALPM_TRANS_FLAG_CONCURRENT = (1 << 12),
 	/** Do not install a package if it is already installed and up to date. */
 	ALPM_TRANS_FLAG_NEEDED = (1 << 13),
 	/** Use ALPM_PKG_REASON_EXPLICIT when installing packages. */
@@ -1493,7 +1569,11 @@ typedef enum _alpm_transflag_t {
 	/** Remove also explicitly installed unneeded deps (use with ALPM_TRANS_FLAG_RECURSE). */
 	ALPM_TRANS_FLAG_RECURSEALL = (1 << 16),
 	/** Do not lock the database during the operation. */
-	ALPM_TRANS_FLAG_NOLOCK = (1 << 17)
+	ALPM_TRANS_FLAG_NOLOCK = (1 << 17),
+	/** Validate and load each package as soon as it has been downloaded,
+	 * while the remaining downloads are still running. Implied by
+	 * ALPM_TRANS_FLAG_STREAM. */
+	ALPM_TRANS_FLAG_PIPELINE = (1 << 18)
 } alpm_transflag_t;
 
 /** Returns the bitfield of flags for the current transaction.
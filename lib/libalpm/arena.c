@@ -0,0 +1,158 @@
+/*
+ *  arena.c
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libalpm */
+#include "arena.h"
+#include "util.h"
+
+/* large enough for a few hundred packages worth of metadata */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* strictest alignment required by anything stored in an arena */
+union arena_align {
+	void *p;
+	long l;
+	long long ll;
+	double d;
+};
+#define ARENA_ALIGN (sizeof(union arena_align))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	union arena_align data[];
+};
+
+struct _alpm_arena_t {
+	struct arena_chunk *chunks;
+};
+
+alpm_arena_t *_alpm_arena_new(void)
+{
+	alpm_arena_t *arena;
+	CALLOC(arena, 1, sizeof(alpm_arena_t), return NULL);
+	return arena;
+}
+
+void _alpm_arena_free(alpm_arena_t *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	if(arena == NULL) {
+		return;
+	}
+	for(chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+static void *arena_alloc(alpm_arena_t *arena, size_t size, size_t align)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t offset;
+
+	if(chunk) {
+		offset = (chunk->used + align - 1) & ~(align - 1);
+		if(offset <= chunk->size && size <= chunk->size - offset) {
+			chunk->used = offset + size;
+			return (char *)chunk->data + offset;
+		}
+	}
+
+	if(size > ARENA_CHUNK_SIZE / 4) {
+		/* oversized requests get a chunk of their own behind the current one,
+		 * so the space left in the current chunk is not wasted */
+		MALLOC(chunk, sizeof(struct arena_chunk) + size, return NULL);
+		chunk->size = chunk->used = size;
+		if(arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+		return chunk->data;
+	}
+
+	MALLOC(chunk, sizeof(struct arena_chunk) + ARENA_CHUNK_SIZE, return NULL);
+	chunk->size = ARENA_CHUNK_SIZE;
+	chunk->used = size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk->data;
+}
+
+/** Allocate zeroed memory suitably aligned for any struct. */
+void *_alpm_arena_calloc(alpm_arena_t *arena, size_t size)
+{
+	void *ptr = arena_alloc(arena, size, ARENA_ALIGN);
+	if(ptr) {
+		memset(ptr, 0, size);
+	}
+	return ptr;
+}
+
+char *_alpm_arena_strndup(alpm_arena_t *arena, const char *s, size_t n)
+{
+	char *dup;
+
+	n = strnlen(s, n);
+	dup = arena_alloc(arena, n + 1, 1);
+	if(dup) {
+		memcpy(dup, s, n);
+		dup[n] = '\0';
+	}
+	return dup;
+}
+
+char *_alpm_arena_strdup(alpm_arena_t *arena, const char *s)
+{
+	return _alpm_arena_strndup(arena, s, strlen(s));
+}
+
+/** Append to a list whose nodes live in the arena.
+ * Such a list must not be freed with alpm_list_free().
+ * @return the new list head, or NULL if memory ran out
+ */
+alpm_list_t *_alpm_arena_list_add(alpm_arena_t *arena, alpm_list_t *list,
+		void *data)
+{
+	alpm_list_t *ptr = arena_alloc(arena, sizeof(alpm_list_t), ARENA_ALIGN);
+
+	if(ptr == NULL) {
+		return NULL;
+	}
+	ptr->data = data;
+	ptr->next = NULL;
+
+	if(list == NULL) {
+		ptr->prev = ptr;
+		return ptr;
+	}
+	list->prev->next = ptr;
+	ptr->prev = list->prev;
+	list->prev = ptr;
+	return list;
+}
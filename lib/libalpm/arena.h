@@ -0,0 +1,44 @@
+/*
+ *  arena.h
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALPM_ARENA_H
+#define ALPM_ARENA_H
+
+#include <stddef.h>
+
+#include "alpm_list.h"
+
+/**
+ * @brief A bump allocator for data that shares a single lifetime.
+ *
+ * Memory is handed out from large chunks and is only ever released all at
+ * once by _alpm_arena_free(). Individual allocations must never be passed
+ * to free().
+ */
+typedef struct _alpm_arena_t alpm_arena_t;
+
+alpm_arena_t *_alpm_arena_new(void);
+void _alpm_arena_free(alpm_arena_t *arena);
+
+void *_alpm_arena_calloc(alpm_arena_t *arena, size_t size);
+char *_alpm_arena_strdup(alpm_arena_t *arena, const char *s);
+char *_alpm_arena_strndup(alpm_arena_t *arena, const char *s, size_t n);
+alpm_list_t *_alpm_arena_list_add(alpm_arena_t *arena, alpm_list_t *list,
+		void *data);
+
+#endif /* ALPM_ARENA_H */
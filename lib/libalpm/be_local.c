@@ -43,6 +43,7 @@
 #include "package.h"
 #include "deps.h"
 #include "filelist.h"
+#include "snapshot.h"
 
 /* local database format version */
 size_t ALPM_LOCAL_DB_VERSION = 9;
@@ -498,6 +499,177 @@ version_error:
 	return -1;
 }
 
+/* Note: the return value must be freed by the caller */
+static char *local_db_snapshot_path(alpm_db_t *db)
+{
+	const char *dbpath = db->handle->dbpath;
+	size_t len = strlen(dbpath) + strlen(db->treename) + 10;
+	char *path;
+
+	MALLOC(path, len, RET_ERR(db->handle, ALPM_ERR_MEMORY, NULL));
+	snprintf(path, len, "%s%s.snapshot", dbpath, db->treename);
+	return path;
+}
+
+/* Remove the snapshot once the database is modified. The mapping is kept:
+ * records are checked against their entries before use, so those of
+ * untouched entries are still read from it, and the snapshot is rebuilt
+ * from them by _alpm_local_db_snapshot_update() when the lock is released. */
+static void local_db_snapshot_invalidate(alpm_db_t *db)
+{
+	char *path;
+
+	db->status |= DB_STATUS_SNAPSHOT_DIRTY;
+	db->status &= ~DB_STATUS_SNAPSHOT_CHECKED;
+
+	path = local_db_snapshot_path(db);
+	if(path && unlink(path) != 0 && errno != ENOENT) {
+		_alpm_log(db->handle, ALPM_LOG_DEBUG, "could not remove snapshot %s: %s\n",
+				path, strerror(errno));
+	}
+	free(path);
+}
+
+/* Stamp the entry directory of a package and the files its snapshot record
+ * is read from, in the order the records keep them. */
+static void local_db_entry_stamps(alpm_db_t *db, alpm_pkg_t *info,
+		alpm_snapshot_stamp_t *stamps)
+{
+	static const char *const names[SNAPSHOT_STAMPS] = { NULL, "desc", "files" };
+	size_t i;
+
+	for(i = 0; i < SNAPSHOT_STAMPS; i++) {
+		char *path = _alpm_local_db_pkgpath(db, info, names[i]);
+		struct stat st;
+
+		memset(stamps + i, 0, sizeof(alpm_snapshot_stamp_t));
+		if(path && stat(path, &st) == 0) {
+			_alpm_snapshot_stamp(stamps + i, &st);
+		}
+		free(path);
+	}
+}
+
+/* Find the snapshot record matching a cached package, if there is one and
+ * the entry has not been changed since the record was written. Entries
+ * edited in place leave the directory of the database untouched, so each
+ * record is checked on its own until the whole snapshot has been. */
+static ssize_t local_db_snapshot_record(alpm_db_t *db, alpm_pkg_t *info)
+{
+	alpm_snapshot_stamp_t stamps[SNAPSHOT_STAMPS];
+	ssize_t idx;
+
+	if(db->snapshot == NULL) {
+		return -1;
+	}
+	idx = _alpm_snapshot_find(db->snapshot, info->name);
+	if(idx < 0 || strcmp(_alpm_snapshot_version(db->snapshot, idx),
+				info->version) != 0) {
+		return -1;
+	}
+	if(db->status & DB_STATUS_SNAPSHOT_CHECKED) {
+		return idx;
+	}
+	local_db_entry_stamps(db, info, stamps);
+	if(!_alpm_snapshot_stamps_match(db->snapshot, idx, stamps)) {
+		_alpm_log(db->handle, ALPM_LOG_DEBUG,
+				"snapshot entry for %s-%s is out of date\n",
+				info->name, info->version);
+		db->status |= DB_STATUS_SNAPSHOT_DIRTY;
+		return -1;
+	}
+	return idx;
+}
+
+/** Check every record of the mapped snapshot of the local database against
+ * its entry, so that lookups in its path tables can be trusted.
+ * @param db the local database
+ * @return 0 if the snapshot matches the database, -1 otherwise
+ */
+int _alpm_local_db_snapshot_check(alpm_db_t *db)
+{
+	alpm_list_t *i;
+
+	if(db->snapshot == NULL || (db->status & DB_STATUS_SNAPSHOT_DIRTY)) {
+		return -1;
+	}
+	if(db->status & DB_STATUS_SNAPSHOT_CHECKED) {
+		return 0;
+	}
+	for(i = _alpm_db_get_pkgcache(db); i; i = i->next) {
+		if(local_db_snapshot_record(db, i->data) < 0) {
+			return -1;
+		}
+	}
+	db->status |= DB_STATUS_SNAPSHOT_CHECKED;
+	return 0;
+}
+
+/* Populate the package cache from the snapshot, avoiding a walk over every
+ * entry directory. Only the package names and versions are loaded up front;
+ * everything else is read lazily from the mapping by local_db_read(). */
+static int local_db_populate_snapshot(alpm_db_t *db, const struct stat *buf)
+{
+	alpm_snapshot_t *snapshot;
+	char *path;
+	size_t i, count;
+
+	path = local_db_snapshot_path(db);
+	if(path == NULL) {
+		return -1;
+	}
+	snapshot = _alpm_snapshot_open(db->handle, path, buf);
+	free(path);
+	if(snapshot == NULL) {
+		return -1;
+	}
+
+	count = _alpm_snapshot_count(snapshot);
+	db->pkgcache = _alpm_pkghash_create(count);
+	if(db->pkgcache == NULL) {
+		_alpm_snapshot_close(snapshot);
+		return -1;
+	}
+
+	for(i = 0; i < count; i++) {
+		alpm_pkg_t *pkg = _alpm_pkg_new();
+		if(pkg == NULL) {
+			goto error;
+		}
+		STRDUP(pkg->name, _alpm_snapshot_name(snapshot, i),
+				_alpm_pkg_free(pkg); goto error);
+		STRDUP(pkg->version, _alpm_snapshot_version(snapshot, i),
+				_alpm_pkg_free(pkg); goto error);
+		pkg->name_hash = _alpm_hash_sdbm(pkg->name);
+
+		pkg->origin = ALPM_PKG_FROM_LOCALDB;
+		pkg->origin_data.db = db;
+		pkg->ops = &local_pkg_ops;
+		pkg->handle = db->handle;
+		pkg->infolevel = INFRQ_BASE;
+
+		if(_alpm_pkghash_add(&db->pkgcache, pkg) == NULL) {
+			_alpm_pkg_free(pkg);
+			goto error;
+		}
+	}
+
+	/* records are sorted by name, so the list already is as well */
+	db->snapshot = snapshot;
+	db->status &= ~(DB_STATUS_SNAPSHOT_DIRTY | DB_STATUS_SNAPSHOT_CHECKED);
+	_alpm_log(db->handle, ALPM_LOG_DEBUG,
+			"added %zu packages to package cache for db '%s' from snapshot\n",
+			count, db->treename);
+	return 0;
+
+error:
+	alpm_list_free_inner(db->pkgcache->list, (alpm_list_fn_free)_alpm_pkg_free);
+	_alpm_pkghash_free(db->pkgcache);
+	db->pkgcache = NULL;
+	_alpm_snapshot_close(snapshot);
+	return -1;
+}
+
 static int local_db_populate(alpm_db_t *db)
 {
 	size_t est_count;
@@ -520,6 +692,14 @@ static int local_db_populate(alpm_db_t *db)
 		return -1;
 	}
 
+	if(stat(dbpath, &buf) == 0 && local_db_populate_snapshot(db, &buf) == 0) {
+		db->status |= DB_STATUS_EXISTS;
+		db->status &= ~DB_STATUS_MISSING;
+		return 0;
+	}
+	/* no usable snapshot, have one written the next time we hold the lock */
+	db->status |= DB_STATUS_SNAPSHOT_DIRTY;
+
 	dbdir = opendir(dbpath);
 	if(dbdir == NULL) {
 		RET_ERR(db->handle, ALPM_ERR_DB_OPEN, -1);
@@ -668,6 +848,7 @@ static int local_db_read(alpm_pkg_t *info, int inforeq)
 	FILE *fp = NULL;
 	char line[1024];
 	alpm_db_t *db = info->origin_data.db;
+	ssize_t snapidx;
 
 	/* bitmask logic here:
 	 * infolevel: 00001111
@@ -692,6 +873,29 @@ static int local_db_read(alpm_pkg_t *info, int inforeq)
 	/* clear out 'line', to be certain - and to make valgrind happy */
 	memset(line, 0, sizeof(line));
 
+	/* the snapshot, if mapped, saves opening the entry files */
+	snapidx = local_db_snapshot_record(db, info);
+	if(snapidx >= 0) {
+		if(inforeq & INFRQ_DESC && !(info->infolevel & INFRQ_DESC)) {
+			if(_alpm_snapshot_read(db->snapshot, snapidx,
+						SNAPSHOT_SECTION_DESC, info, NULL) != 0) {
+				goto error;
+			}
+			info->infolevel |= INFRQ_DESC;
+		}
+		if(inforeq & INFRQ_FILES && !(info->infolevel & INFRQ_FILES)) {
+			if(_alpm_snapshot_read(db->snapshot, snapidx,
+						SNAPSHOT_SECTION_FILES, info, NULL) != 0) {
+				goto error;
+			}
+			info->infolevel |= INFRQ_FILES;
+		}
+		if(inforeq & INFRQ_SCRIPTLET && !(info->infolevel & INFRQ_SCRIPTLET)) {
+			info->scriptlet = _alpm_snapshot_has_scriptlet(db->snapshot, snapidx);
+			info->infolevel |= INFRQ_SCRIPTLET;
+		}
+	}
+
 	/* DESC */
 	if(inforeq & INFRQ_DESC && !(info->infolevel & INFRQ_DESC)) {
 		char *path = _alpm_local_db_pkgpath(db, info, "desc");
@@ -880,6 +1084,9 @@ int _alpm_local_db_prepare(alpm_db_t *db, alpm_pkg_t *info)
 		return -1;
 	}
 
+	local_db_snapshot_invalidate(db);
+
+	_alpm_umask_lock();
 	oldmask = umask(0000);
 	pkgpath = _alpm_local_db_pkgpath(db, info, NULL);
 
@@ -890,6 +1097,7 @@ int _alpm_local_db_prepare(alpm_db_t *db, alpm_pkg_t *info)
 
 	free(pkgpath);
 	umask(oldmask);
+	_alpm_umask_unlock();
 
 	return retval;
 }
@@ -922,7 +1130,10 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, int inforeq)
 		return -1;
 	}
 
+	local_db_snapshot_invalidate(db);
+
 	/* make sure we have a sane umask */
+	_alpm_umask_lock();
 	oldmask = umask(0022);
 
 	/* DESC */
@@ -1064,6 +1275,7 @@ int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, int inforeq)
 
 cleanup:
 	umask(oldmask);
+	_alpm_umask_unlock();
 	return retval;
 }
 
@@ -1075,6 +1287,8 @@ int _alpm_local_db_remove(alpm_db_t *db, alpm_pkg_t *info)
 	char *pkgpath;
 	size_t pkgpath_len;
 
+	local_db_snapshot_invalidate(db);
+
 	pkgpath = _alpm_local_db_pkgpath(db, info, NULL);
 	if(!pkgpath) {
 		return -1;
@@ -1112,6 +1326,108 @@ int _alpm_local_db_remove(alpm_db_t *db, alpm_pkg_t *info)
 	return ret;
 }
 
+/** Rebuild the snapshot of the local database if it is out of date.
+ * Entries that have not changed since the mapped snapshot was written are
+ * copied from it; the others are read from their directories, which remain
+ * the reference copy of the database. This must only be called while
+ * holding the database lock.
+ * @param db the local database
+ * @return 0 on success or if nothing needed to be done, -1 on error
+ */
+int _alpm_local_db_snapshot_update(alpm_db_t *db)
+{
+	alpm_snapshot_writer_t *writer = NULL;
+	alpm_list_t *pkgs = NULL, *i;
+	struct dirent *ent;
+	struct stat buf;
+	const char *dbpath;
+	char *path;
+	DIR *dbdir;
+	size_t count = 0;
+	int ret = -1;
+
+	if(db == NULL || !(db->status & DB_STATUS_SNAPSHOT_DIRTY)
+			|| !(db->status & DB_STATUS_VALID)) {
+		return 0;
+	}
+
+	dbpath = _alpm_db_path(db);
+	if(dbpath == NULL || (dbdir = opendir(dbpath)) == NULL) {
+		return -1;
+	}
+	/* stamp before reading so that concurrent changes leave it stale */
+	if(fstat(dirfd(dbdir), &buf) != 0) {
+		closedir(dbdir);
+		return -1;
+	}
+
+	while((ent = readdir(dbdir)) != NULL) {
+		const char *name = ent->d_name;
+		alpm_pkg_t *pkg;
+
+		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+				|| !is_dir(dbpath, ent)) {
+			continue;
+		}
+		if((pkg = _alpm_pkg_new()) == NULL) {
+			closedir(dbdir);
+			goto cleanup;
+		}
+		if(_alpm_splitname(name, &(pkg->name), &(pkg->version),
+					&(pkg->name_hash)) != 0) {
+			_alpm_pkg_free(pkg);
+			continue;
+		}
+		pkg->origin = ALPM_PKG_FROM_LOCALDB;
+		pkg->origin_data.db = db;
+		pkg->ops = &local_pkg_ops;
+		pkg->handle = db->handle;
+		pkgs = alpm_list_add(pkgs, pkg);
+		count++;
+	}
+	closedir(dbdir);
+	pkgs = alpm_list_msort(pkgs, count, _alpm_pkg_cmp);
+
+	if((writer = _alpm_snapshot_writer_new()) == NULL) {
+		goto cleanup;
+	}
+	for(i = pkgs; i; i = i->next) {
+		alpm_pkg_t *pkg = i->data;
+		alpm_snapshot_stamp_t stamps[SNAPSHOT_STAMPS];
+
+		/* stamp before reading, for the same reason as above */
+		local_db_entry_stamps(db, pkg, stamps);
+		if(local_db_read(pkg, INFRQ_ALL) != 0
+				|| _alpm_snapshot_writer_add(writer, pkg, stamps) != 0) {
+			/* leave it to the directory walk to report broken entries */
+			_alpm_log(db->handle, ALPM_LOG_DEBUG,
+					"not writing snapshot for db '%s': could not add entry %s-%s\n",
+					db->treename, pkg->name, pkg->version);
+			goto cleanup;
+		}
+		/* only one fully loaded entry needs to be held in memory */
+		_alpm_pkg_free(pkg);
+		i->data = NULL;
+	}
+
+	if((path = local_db_snapshot_path(db)) != NULL) {
+		ret = _alpm_snapshot_writer_commit(db->handle, writer, path, &buf);
+		if(ret == 0) {
+			/* the old mapping no longer matches the entry directories */
+			_alpm_snapshot_close(db->snapshot);
+			db->snapshot = _alpm_snapshot_open(db->handle, path, &buf);
+			db->status &= ~(DB_STATUS_SNAPSHOT_DIRTY | DB_STATUS_SNAPSHOT_CHECKED);
+		}
+		free(path);
+	}
+
+cleanup:
+	_alpm_snapshot_writer_free(writer);
+	alpm_list_free_inner(pkgs, (alpm_list_fn_free)_alpm_pkg_free);
+	alpm_list_free(pkgs);
+	return ret;
+}
+
 int SYMEXPORT alpm_pkg_set_reason(alpm_pkg_t *pkg, alpm_pkgreason_t reason)
 {
 	ASSERT(pkg != NULL, return -1);
@@ -260,6 +260,18 @@ static int parse_descfile(alpm_handle_t *handle, struct archive *a, alpm_pkg_t *
 	return 0;
 }
 
+/* use the digest computed while the file was downloaded, if there is one,
+ * rather than reading the file again */
+static int test_checksum(alpm_handle_t *handle, const char *pkgfile,
+		const char *expected, const char *computed, alpm_pkgvalidation_t type)
+{
+	if(computed == NULL) {
+		return _alpm_test_checksum(pkgfile, expected, type);
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "using checksum computed during download\n");
+	return strcmp(expected, computed) != 0;
+}
+
 /**
  * Validate a package.
  * @param handle the context handle
@@ -312,7 +324,8 @@ int _alpm_pkg_validate_internal(alpm_handle_t *handle,
 		if(syncpkg->md5sum && !syncpkg->sha256sum) {
 			_alpm_log(handle, ALPM_LOG_DEBUG, "md5sum: %s\n", syncpkg->md5sum);
 			_alpm_log(handle, ALPM_LOG_DEBUG, "checking md5sum for %s\n", pkgfile);
-			if(_alpm_test_checksum(pkgfile, syncpkg->md5sum, ALPM_PKG_VALIDATION_MD5SUM) != 0) {
+			if(test_checksum(handle, pkgfile, syncpkg->md5sum, syncpkg->dl_md5sum,
+						ALPM_PKG_VALIDATION_MD5SUM) != 0) {
 				RET_ERR(handle, ALPM_ERR_PKG_INVALID_CHECKSUM, -1);
 			}
 			if(validation) {
@@ -323,7 +336,8 @@ int _alpm_pkg_validate_internal(alpm_handle_t *handle,
 		if(syncpkg->sha256sum) {
 			_alpm_log(handle, ALPM_LOG_DEBUG, "sha256sum: %s\n", syncpkg->sha256sum);
 			_alpm_log(handle, ALPM_LOG_DEBUG, "checking sha256sum for %s\n", pkgfile);
-			if(_alpm_test_checksum(pkgfile, syncpkg->sha256sum, ALPM_PKG_VALIDATION_SHA256SUM) != 0) {
+			if(test_checksum(handle, pkgfile, syncpkg->sha256sum, syncpkg->dl_sha256sum,
+						ALPM_PKG_VALIDATION_SHA256SUM) != 0) {
 				RET_ERR(handle, ALPM_ERR_PKG_INVALID_CHECKSUM, -1);
 			}
 			if(validation) {
@@ -508,6 +522,15 @@ static int build_filelist_from_mtree(alpm_handle_t *handle, alpm_pkg_t *pkg, str
 			continue;
 		}
 
+		/* the payload is not read when the mtree is used, so it has to
+		 * provide everything the archive headers would have */
+		if(archive_entry_filetype(mtree_entry) == AE_IFREG
+				&& !archive_entry_size_is_set(mtree_entry)) {
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"mtree of package %s lacks the size of %s\n", pkg->filename, path);
+			goto error;
+		}
+
 		if(add_entry_to_files_list(&filelist, &files_size, mtree_entry, path) < 0) {
 			goto error;
 		}
@@ -549,8 +572,8 @@ error:
  * Load a package and create the corresponding alpm_pkg_t struct.
  * @param handle the context handle
  * @param pkgfile path to the package file
- * @param full whether to stop the load after metadata is read or continue
- * through the full archive
+ * @param full whether to also build the file list, from the .MTREE if the
+ * package has one or else by reading through the full archive
  */
 alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 		const char *pkgfile, int full)
@@ -592,11 +615,17 @@ alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 	_alpm_log(handle, ALPM_LOG_DEBUG, "starting package load for %s\n", pkgfile);
 
 	/* If full is false, only read through the archive until we find our needed
-	 * metadata. If it is true, read through the entire archive, which serves
-	 * as a verification of integrity and allows us to create the filelist. */
+	 * metadata. If it is true, the filelist is also needed; it comes from the
+	 * .MTREE when there is one, otherwise the entire archive is read. */
 	while((ret = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
 		const char *entry_name = archive_entry_pathname(entry);
 
+		/* see if we have all we need; the metadata files sort before the
+		 * payload, so stop at the first payload entry without reading it */
+		if((!full || hit_mtree) && config && entry_name[0] != '.') {
+			break;
+		}
+
 		if(strcmp(entry_name, ".PKGINFO") == 0) {
 			/* parse the info file */
 			if(parse_descfile(handle, archive, newpkg) != 0) {
@@ -617,32 +646,27 @@ alpm_pkg_t *_alpm_pkg_load_internal(alpm_handle_t *handle,
 				goto pkg_invalid;
 			}
 			config = 1;
-			continue;
 		} else if(full && strcmp(entry_name, ".MTREE") == 0) {
 			/* building the file list: cheap way
 			 * get the filelist from the mtree file rather than scanning
 			 * the whole archive  */
 			hit_mtree = build_filelist_from_mtree(handle, newpkg, archive) == 0;
-			continue;
 		} else if(handle_simple_path(newpkg, entry_name)) {
 			continue;
-		} else if(full && !hit_mtree) {
-			/* building the file list: expensive way */
-			if(add_entry_to_files_list(&newpkg->files, &files_size, entry, entry_name) < 0) {
-				goto error;
+		} else {
+			if(full && !hit_mtree) {
+				/* building the file list: expensive way */
+				if(add_entry_to_files_list(&newpkg->files, &files_size, entry, entry_name) < 0) {
+					goto error;
+				}
 			}
-		}
-
-		if(archive_read_data_skip(archive)) {
-			_alpm_log(handle, ALPM_LOG_ERROR, _("error while reading package %s: %s\n"),
-					pkgfile, archive_error_string(archive));
-			handle->pm_errno = ALPM_ERR_LIBARCHIVE;
-			goto error;
-		}
 
-		/* if we are not doing a full read, see if we have all we need */
-		if((!full || hit_mtree) && config) {
-			break;
+			if(archive_read_data_skip(archive)) {
+				_alpm_log(handle, ALPM_LOG_ERROR, _("error while reading package %s: %s\n"),
+						pkgfile, archive_error_string(archive));
+				handle->pm_errno = ALPM_ERR_LIBARCHIVE;
+				goto error;
+			}
 		}
 	}
 
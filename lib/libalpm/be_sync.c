@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 
 /* libarchive */
@@ -41,6 +42,7 @@
 #include "deps.h"
 #include "dload.h"
 #include "filelist.h"
+#include "snapshot.h"
 
 static char *get_sync_dir(alpm_handle_t *handle)
 {
@@ -69,6 +71,24 @@ static char *get_sync_dir(alpm_handle_t *handle)
 	return syncpath;
 }
 
+/* Files kept about a database live next to it, e.g. sync/core.db.snapshot */
+static char *sync_db_sidecar_path(alpm_db_t *db, const char *suffix)
+{
+	const char *dbpath = _alpm_db_path(db);
+	size_t len;
+	char *path;
+
+	if(dbpath == NULL) {
+		return NULL;
+	}
+	len = strlen(dbpath) + strlen(suffix) + 1;
+	MALLOC(path, len, RET_ERR(db->handle, ALPM_ERR_MEMORY, NULL));
+	snprintf(path, len, "%s%s", dbpath, suffix);
+	return path;
+}
+
+static void sync_db_snapshot_update(alpm_db_t *db);
+
 static int sync_db_validate(alpm_db_t *db)
 {
 	int siglevel;
@@ -141,7 +161,9 @@ valid:
  *
  * An update of the package database \a db will be attempted. Unless
  * \a force is true, the update will only be performed if the remote
- * database was modified since the last update.
+ * database was modified since the last update. HTTP servers are asked with
+ * both the time of the local copy and the entity tag they sent for it,
+ * which is kept next to the database (e.g. sync/core.db.etag).
  *
  * This operation requires a database lock, and will return an applicable error
  * if the lock could not be obtained.
@@ -176,7 +198,7 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 {
 	char *syncpath;
 	const char *dbext;
-	alpm_list_t *i;
+	alpm_list_t *i, *servers;
 	int updated = 0;
 	int ret = -1;
 	mode_t oldmask;
@@ -205,20 +227,33 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 	}
 
 	/* make sure we have a sane umask */
+	_alpm_umask_lock();
 	oldmask = umask(0022);
 
 	siglevel = alpm_db_get_siglevel(db);
 
+	/* servers that just failed are tried last; the configured order is
+	 * otherwise kept so all databases come from the same mirror */
+	servers = _alpm_servers_rank(handle, db->servers, 0);
+	if(!servers) {
+		free(syncpath);
+		umask(oldmask);
+		_alpm_umask_unlock();
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+
 	/* attempt to grab a lock */
 	if(_alpm_handle_lock(handle)) {
+		alpm_list_free(servers);
 		free(syncpath);
 		umask(oldmask);
+		_alpm_umask_unlock();
 		RET_ERR(handle, ALPM_ERR_HANDLE_LOCK, -1);
 	}
 
 	dbext = db->handle->dbext;
 
-	for(i = db->servers; i; i = i->next) {
+	for(i = servers; i; i = i->next) {
 		const char *server = i->data, *final_db_url = NULL;
 		struct dload_payload payload;
 		size_t len;
@@ -233,15 +268,20 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 		len = strlen(server) + strlen(db->treename) + strlen(dbext) + 2;
 		MALLOC(payload.fileurl, len,
 			{
+				alpm_list_free(servers);
 				free(syncpath);
 				umask(oldmask);
+				_alpm_umask_unlock();
 				RET_ERR(handle, ALPM_ERR_MEMORY, -1);
 			}
 		);
 		snprintf(payload.fileurl, len, "%s/%s%s", server, db->treename, dbext);
 		payload.handle = handle;
+		payload.server = i;
 		payload.force = force;
 		payload.unlink_on_fail = 1;
+		/* without it the request is only conditional on the time */
+		payload.etag_path = sync_db_sidecar_path(db, ".etag");
 
 		ret = _alpm_download(&payload, syncpath, NULL, &final_db_url);
 		_alpm_dload_payload_reset(&payload);
@@ -278,8 +318,10 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 
 			MALLOC(payload.fileurl, len,
 				{
+					alpm_list_free(servers);
 					free(syncpath);
 					umask(oldmask);
+					_alpm_umask_unlock();
 					RET_ERR(handle, ALPM_ERR_MEMORY, -1);
 				}
 			);
@@ -291,6 +333,7 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 			}
 
 			payload.handle = handle;
+			payload.server = i;
 			payload.force = 1;
 			payload.errors_ok = (siglevel & ALPM_SIG_DATABASE_OPTIONAL);
 
@@ -307,6 +350,7 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 			break;
 		}
 	}
+	alpm_list_free(servers);
 
 	if(updated) {
 		/* Cache needs to be rebuilt */
@@ -325,6 +369,11 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 		}
 	}
 
+	if(ret != -1 && (db->status & DB_STATUS_VALID)
+			&& (db->status & DB_STATUS_EXISTS)) {
+		sync_db_snapshot_update(db);
+	}
+
 	if(ret == -1) {
 		/* pm_errno was set by the download code */
 		_alpm_log(handle, ALPM_LOG_DEBUG, "failed to sync db: %s\n",
@@ -336,12 +385,15 @@ int SYMEXPORT alpm_db_update(int force, alpm_db_t *db)
 	_alpm_handle_unlock(handle);
 	free(syncpath);
 	umask(oldmask);
+	_alpm_umask_unlock();
 	return ret;
 }
 
 /* Forward decl so I don't reorganize the whole file right now */
 static int sync_db_read(alpm_db_t *db, struct archive *archive,
-		struct archive_entry *entry, alpm_pkg_t **likely_pkg);
+		struct archive_entry *entry, alpm_pkg_t **likely_pkg, int read_deltas);
+static int sync_db_populate_archive(alpm_db_t *db, const char *dbpath,
+		struct stat *buf, int read_deltas);
 
 static int _sync_get_validation(alpm_pkg_t *pkg)
 {
@@ -366,6 +418,49 @@ static int _sync_get_validation(alpm_pkg_t *pkg)
 	return pkg->validation;
 }
 
+/* Serializes reading file lists from snapshots, which fills in the package
+ * and allocates from the arena of its database. File lists are also asked
+ * for from the worker threads of a transaction. */
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read the file list of a package whose cache was populated from a
+ * snapshot. Packages read from the database archive have it already. */
+static alpm_filelist_t *_sync_get_files(alpm_pkg_t *pkg)
+{
+	alpm_db_t *db = pkg->origin_data.db;
+
+	pthread_mutex_lock(&files_lock);
+	if(!(pkg->infolevel & INFRQ_FILES) && db->snapshot) {
+		ssize_t idx = _alpm_snapshot_find(db->snapshot, pkg->name);
+		if(idx < 0 || _alpm_snapshot_read(db->snapshot, (size_t)idx,
+					SNAPSHOT_SECTION_FILES, pkg, db->arena) != 0) {
+			_alpm_log(db->handle, ALPM_LOG_DEBUG,
+					"could not read file list of %s from snapshot\n", pkg->name);
+		}
+		pkg->infolevel |= INFRQ_FILES;
+	}
+	pthread_mutex_unlock(&files_lock);
+	return &pkg->files;
+}
+
+/** Sync package operations struct accessor. Like the file package
+ * operations, these are the default operations with our own validation
+ * and file list lookups on top. The struct is set up when a sync database
+ * is registered, so it is only read while databases are being populated.
+ */
+static struct pkg_operations *get_sync_pkg_ops(void)
+{
+	static struct pkg_operations sync_pkg_ops;
+	static int sync_pkg_ops_initialized = 0;
+	if(!sync_pkg_ops_initialized) {
+		sync_pkg_ops = default_pkg_ops;
+		sync_pkg_ops.get_validation = _sync_get_validation;
+		sync_pkg_ops.get_files = _sync_get_files;
+		sync_pkg_ops_initialized = 1;
+	}
+	return &sync_pkg_ops;
+}
+
 static alpm_pkg_t *load_pkg_for_entry(alpm_db_t *db, const char *entryname,
 		const char **entry_filename, alpm_pkg_t *likely_pkg)
 {
@@ -397,17 +492,25 @@ static alpm_pkg_t *load_pkg_for_entry(alpm_db_t *db, const char *entryname,
 	if(pkg == NULL) {
 		pkg = _alpm_pkg_new();
 		if(pkg == NULL) {
+			free(pkgname);
+			free(pkgver);
 			RET_ERR(db->handle, ALPM_ERR_MEMORY, NULL);
 		}
 
-		pkg->name = pkgname;
-		pkg->version = pkgver;
+		pkg->in_arena = 1;
+		pkg->name = _alpm_arena_strdup(db->arena, pkgname);
+		pkg->version = _alpm_arena_strdup(db->arena, pkgver);
 		pkg->name_hash = pkgname_hash;
+		free(pkgname);
+		free(pkgver);
+		if(pkg->name == NULL || pkg->version == NULL) {
+			_alpm_pkg_free(pkg);
+			RET_ERR(db->handle, ALPM_ERR_MEMORY, NULL);
+		}
 
 		pkg->origin = ALPM_PKG_FROM_SYNCDB;
 		pkg->origin_data.db = db;
-		pkg->ops = &default_pkg_ops;
-		pkg->ops->get_validation = _sync_get_validation;
+		pkg->ops = get_sync_pkg_ops();
 		pkg->handle = db->handle;
 
 		/* add to the collection */
@@ -462,38 +565,25 @@ static size_t estimate_package_count(struct stat *st, struct archive *archive)
 	return (size_t)((st->st_size / per_package) + 1);
 }
 
-static int sync_db_populate(alpm_db_t *db)
+static int sync_db_populate_archive(alpm_db_t *db, const char *dbpath,
+		struct stat *buf, int read_deltas)
 {
-	const char *dbpath;
 	size_t est_count, count;
 	int fd;
 	int ret = 0;
 	int archive_ret;
-	struct stat buf;
 	struct archive *archive;
 	struct archive_entry *entry;
 	alpm_pkg_t *pkg = NULL;
 
-	if(db->status & DB_STATUS_INVALID) {
-		RET_ERR(db->handle, ALPM_ERR_DB_INVALID, -1);
-	}
-	if(db->status & DB_STATUS_MISSING) {
-		RET_ERR(db->handle, ALPM_ERR_DB_NOT_FOUND, -1);
-	}
-	dbpath = _alpm_db_path(db);
-	if(!dbpath) {
-		/* pm_errno set in _alpm_db_path() */
-		return -1;
-	}
-
-	fd = _alpm_open_archive(db->handle, dbpath, &buf,
+	fd = _alpm_open_archive(db->handle, dbpath, buf,
 			&archive, ALPM_ERR_DB_OPEN);
 	if(fd < 0) {
 		db->status &= ~DB_STATUS_VALID;
 		db->status |= DB_STATUS_INVALID;
 		return -1;
 	}
-	est_count = estimate_package_count(&buf, archive);
+	est_count = estimate_package_count(buf, archive);
 
 	/* currently only .files dbs contain file lists - make flexible when required*/
 	if(strcmp(db->handle->dbext, ".files") == 0) {
@@ -502,7 +592,10 @@ static int sync_db_populate(alpm_db_t *db)
 	}
 
 	db->pkgcache = _alpm_pkghash_create(est_count);
-	if(db->pkgcache == NULL) {
+	if(db->arena == NULL) {
+		db->arena = _alpm_arena_new();
+	}
+	if(db->pkgcache == NULL || db->arena == NULL) {
 		db->handle->pm_errno = ALPM_ERR_MEMORY;
 		ret = -1;
 		goto cleanup;
@@ -512,7 +605,7 @@ static int sync_db_populate(alpm_db_t *db)
 		mode_t mode = archive_entry_mode(entry);
 		if(!S_ISDIR(mode)) {
 			/* we have desc, depends or deltas - parse it */
-			if(sync_db_read(db, archive, entry, &pkg) != 0) {
+			if(sync_db_read(db, archive, entry, &pkg, read_deltas) != 0) {
 				_alpm_log(db->handle, ALPM_LOG_ERROR,
 						_("could not parse package description file '%s' from db '%s'\n"),
 						archive_entry_pathname(entry), db->treename);
@@ -546,6 +639,173 @@ cleanup:
 	return ret;
 }
 
+/* Populate the package cache from a snapshot of the database archive. Sync
+ * packages are otherwise loaded eagerly, but file lists are left in the
+ * snapshot until they are asked for, as most lookups in a files database
+ * only need the path tables. */
+static int sync_db_populate_snapshot(alpm_db_t *db, const struct stat *buf)
+{
+	alpm_snapshot_t *snapshot;
+	char *path;
+	size_t i, count;
+
+	path = sync_db_sidecar_path(db, ".snapshot");
+	if(path == NULL) {
+		return -1;
+	}
+	snapshot = _alpm_snapshot_open(db->handle, path, buf);
+	free(path);
+	if(snapshot == NULL) {
+		return -1;
+	}
+
+	count = _alpm_snapshot_count(snapshot);
+	db->pkgcache = _alpm_pkghash_create(count);
+	if(db->pkgcache == NULL) {
+		_alpm_snapshot_close(snapshot);
+		return -1;
+	}
+	if(db->arena == NULL && (db->arena = _alpm_arena_new()) == NULL) {
+		_alpm_pkghash_free(db->pkgcache);
+		db->pkgcache = NULL;
+		_alpm_snapshot_close(snapshot);
+		return -1;
+	}
+
+	for(i = 0; i < count; i++) {
+		alpm_pkg_t *pkg = _alpm_pkg_new();
+		if(pkg == NULL) {
+			goto error;
+		}
+		pkg->in_arena = 1;
+		pkg->name = _alpm_arena_strdup(db->arena, _alpm_snapshot_name(snapshot, i));
+		pkg->version = _alpm_arena_strdup(db->arena,
+				_alpm_snapshot_version(snapshot, i));
+		if(pkg->name == NULL || pkg->version == NULL) {
+			_alpm_pkg_free(pkg);
+			goto error;
+		}
+		pkg->name_hash = _alpm_hash_sdbm(pkg->name);
+
+		pkg->origin = ALPM_PKG_FROM_SYNCDB;
+		pkg->origin_data.db = db;
+		pkg->ops = get_sync_pkg_ops();
+		pkg->handle = db->handle;
+
+		/* file lists are read on first use, see _sync_get_files() */
+		if(_alpm_snapshot_read(snapshot, i, SNAPSHOT_SECTION_DESC, pkg,
+					db->arena) != 0
+				|| _alpm_pkghash_add(&db->pkgcache, pkg) == NULL) {
+			_alpm_pkg_free(pkg);
+			goto error;
+		}
+	}
+
+	/* records are sorted by name, so the list already is as well */
+	db->snapshot = snapshot;
+	_alpm_log(db->handle, ALPM_LOG_DEBUG,
+			"added %zu packages to package cache for db '%s' from snapshot\n",
+			count, db->treename);
+	return 0;
+
+error:
+	alpm_list_free_inner(db->pkgcache->list, (alpm_list_fn_free)_alpm_pkg_free);
+	_alpm_pkghash_free(db->pkgcache);
+	db->pkgcache = NULL;
+	_alpm_arena_free(db->arena);
+	db->arena = NULL;
+	_alpm_snapshot_close(snapshot);
+	return -1;
+}
+
+static int sync_db_populate(alpm_db_t *db)
+{
+	const char *dbpath;
+	struct stat buf;
+
+	if(db->status & DB_STATUS_INVALID) {
+		RET_ERR(db->handle, ALPM_ERR_DB_INVALID, -1);
+	}
+	if(db->status & DB_STATUS_MISSING) {
+		RET_ERR(db->handle, ALPM_ERR_DB_NOT_FOUND, -1);
+	}
+	dbpath = _alpm_db_path(db);
+	if(!dbpath) {
+		/* pm_errno set in _alpm_db_path() */
+		return -1;
+	}
+
+	if(stat(dbpath, &buf) == 0 && sync_db_populate_snapshot(db, &buf) == 0) {
+		return 0;
+	}
+
+	return sync_db_populate_archive(db, dbpath, &buf,
+			db->handle->deltaratio > 0.0);
+}
+
+/* Convert the database archive into a snapshot once, so that later runs can
+ * map it instead of decompressing and parsing the archive again. Deltas are
+ * always included so the snapshot does not depend on the UseDelta setting.
+ * Failing to write a snapshot is not an error; the archive is still used. */
+static void sync_db_snapshot_update(alpm_db_t *db)
+{
+	alpm_snapshot_writer_t *writer;
+	alpm_snapshot_t *snapshot;
+	alpm_list_t *lp;
+	const char *dbpath;
+	char *path;
+	struct stat buf;
+	int ret;
+
+	dbpath = _alpm_db_path(db);
+	path = sync_db_sidecar_path(db, ".snapshot");
+	if(dbpath == NULL || path == NULL || stat(dbpath, &buf) != 0) {
+		free(path);
+		return;
+	}
+
+	/* an existing snapshot is fine as long as the archive has not changed */
+	snapshot = _alpm_snapshot_open(db->handle, path, &buf);
+	if(snapshot != NULL) {
+		_alpm_snapshot_close(snapshot);
+		free(path);
+		return;
+	}
+
+	_alpm_log(db->handle, ALPM_LOG_DEBUG, "writing snapshot for db '%s'\n",
+			db->treename);
+
+	_alpm_db_free_pkgcache(db);
+	ret = sync_db_populate_archive(db, dbpath, &buf, 1);
+	if(db->pkgcache != NULL) {
+		/* let _alpm_db_free_pkgcache() clean up whatever was loaded */
+		db->status |= DB_STATUS_PKGCACHE;
+	}
+	if(ret != 0) {
+		_alpm_db_free_pkgcache(db);
+		free(path);
+		return;
+	}
+
+	writer = _alpm_snapshot_writer_new();
+	for(lp = db->pkgcache->list; writer && lp; lp = lp->next) {
+		if(_alpm_snapshot_writer_add(writer, lp->data, NULL) != 0) {
+			_alpm_snapshot_writer_free(writer);
+			writer = NULL;
+		}
+	}
+	if(writer == NULL || _alpm_snapshot_writer_commit(db->handle, writer,
+				path, &buf) != 0) {
+		_alpm_log(db->handle, ALPM_LOG_DEBUG,
+				"could not write snapshot for db '%s'\n", db->treename);
+	}
+	_alpm_snapshot_writer_free(writer);
+
+	/* the cache may hold deltas that UseDelta did not ask for */
+	_alpm_db_free_pkgcache(db);
+	free(path);
+}
+
 /* This function validates %FILENAME%. filename must be between 3 and
  * PATH_MAX characters and cannot be contain a path */
 static int _alpm_validate_filename(alpm_db_t *db, const char *pkgname,
@@ -573,37 +833,169 @@ static int _alpm_validate_filename(alpm_db_t *db, const char *pkgname,
 	return 0;
 }
 
+/* The headers of the fields in desc, depends and files entries */
+enum sync_db_field {
+	SYNC_FIELD_UNKNOWN = 0,
+	SYNC_FIELD_NAME,
+	SYNC_FIELD_VERSION,
+	SYNC_FIELD_FILENAME,
+	SYNC_FIELD_BASE,
+	SYNC_FIELD_DESC,
+	SYNC_FIELD_GROUPS,
+	SYNC_FIELD_URL,
+	SYNC_FIELD_LICENSE,
+	SYNC_FIELD_ARCH,
+	SYNC_FIELD_BUILDDATE,
+	SYNC_FIELD_PACKAGER,
+	SYNC_FIELD_CSIZE,
+	SYNC_FIELD_ISIZE,
+	SYNC_FIELD_MD5SUM,
+	SYNC_FIELD_SHA256SUM,
+	SYNC_FIELD_PGPSIG,
+	SYNC_FIELD_REPLACES,
+	SYNC_FIELD_DEPENDS,
+	SYNC_FIELD_OPTDEPENDS,
+	SYNC_FIELD_MAKEDEPENDS,
+	SYNC_FIELD_CHECKDEPENDS,
+	SYNC_FIELD_CONFLICTS,
+	SYNC_FIELD_PROVIDES,
+	SYNC_FIELD_DELTAS,
+	SYNC_FIELD_FILES
+};
+
+/* Length and first letter narrow a header down to at most two candidates,
+ * so a line is compared once or twice instead of against every header. */
+#define FIELD(header, field) \
+	if(memcmp(line, header, len) == 0) { \
+		return field; \
+	}
+
+static enum sync_db_field sync_db_field(const char *line, size_t len)
+{
+	if(len < 3 || line[0] != '%' || line[len - 1] != '%') {
+		return SYNC_FIELD_UNKNOWN;
+	}
+
+	switch(len) {
+		case 5:
+			FIELD("%URL%", SYNC_FIELD_URL);
+			break;
+		case 6:
+			switch(line[1]) {
+				case 'N': FIELD("%NAME%", SYNC_FIELD_NAME); break;
+				case 'B': FIELD("%BASE%", SYNC_FIELD_BASE); break;
+				case 'D': FIELD("%DESC%", SYNC_FIELD_DESC); break;
+				case 'A': FIELD("%ARCH%", SYNC_FIELD_ARCH); break;
+			}
+			break;
+		case 7:
+			switch(line[1]) {
+				case 'F': FIELD("%FILES%", SYNC_FIELD_FILES); break;
+				case 'C': FIELD("%CSIZE%", SYNC_FIELD_CSIZE); break;
+				case 'I': FIELD("%ISIZE%", SYNC_FIELD_ISIZE); break;
+			}
+			break;
+		case 8:
+			switch(line[1]) {
+				case 'G': FIELD("%GROUPS%", SYNC_FIELD_GROUPS); break;
+				case 'M': FIELD("%MD5SUM%", SYNC_FIELD_MD5SUM); break;
+				case 'P': FIELD("%PGPSIG%", SYNC_FIELD_PGPSIG); break;
+				case 'D': FIELD("%DELTAS%", SYNC_FIELD_DELTAS); break;
+			}
+			break;
+		case 9:
+			switch(line[1]) {
+				case 'V': FIELD("%VERSION%", SYNC_FIELD_VERSION); break;
+				case 'L': FIELD("%LICENSE%", SYNC_FIELD_LICENSE); break;
+				case 'D': FIELD("%DEPENDS%", SYNC_FIELD_DEPENDS); break;
+			}
+			break;
+		case 10:
+			switch(line[1]) {
+				case 'F': FIELD("%FILENAME%", SYNC_FIELD_FILENAME); break;
+				case 'R': FIELD("%REPLACES%", SYNC_FIELD_REPLACES); break;
+				case 'P':
+					FIELD("%PACKAGER%", SYNC_FIELD_PACKAGER);
+					FIELD("%PROVIDES%", SYNC_FIELD_PROVIDES);
+					break;
+			}
+			break;
+		case 11:
+			switch(line[1]) {
+				case 'B': FIELD("%BUILDDATE%", SYNC_FIELD_BUILDDATE); break;
+				case 'S': FIELD("%SHA256SUM%", SYNC_FIELD_SHA256SUM); break;
+				case 'C': FIELD("%CONFLICTS%", SYNC_FIELD_CONFLICTS); break;
+			}
+			break;
+		case 12:
+			FIELD("%OPTDEPENDS%", SYNC_FIELD_OPTDEPENDS);
+			break;
+		case 13:
+			FIELD("%MAKEDEPENDS%", SYNC_FIELD_MAKEDEPENDS);
+			break;
+		case 14:
+			FIELD("%CHECKDEPENDS%", SYNC_FIELD_CHECKDEPENDS);
+			break;
+	}
+	return SYNC_FIELD_UNKNOWN;
+}
+
+#undef FIELD
+
+/* whether a line is exactly the string str */
+static int line_equals(const char *line, size_t len, const char *str)
+{
+	return strncmp(str, line, len) == 0 && str[len] == '\0';
+}
+
+/* NUL-terminate a short value for the number parsers; anything too long to
+ * be a number comes back empty, which they reject */
+static const char *line_cstr(char *dest, size_t size, const char *line, size_t len)
+{
+	if(len >= size) {
+		len = 0;
+	}
+	memcpy(dest, line, len);
+	dest[len] = '\0';
+	return dest;
+}
+
+/* Lines are read where libarchive decompressed them; values are copied
+ * straight into the database's arena, the only copy they get. */
 #define READ_NEXT() do { \
-	if(_alpm_archive_fgets(archive, &buf) != ARCHIVE_OK) goto error; \
-	line = buf.line; \
-	_alpm_strip_newline(line, buf.real_line_size); \
+	if(_alpm_archive_getline(archive, &buf, &line, &len) != ARCHIVE_OK) goto error; \
 } while(0)
 
 #define READ_AND_STORE(f) do { \
 	READ_NEXT(); \
-	STRDUP(f, line, goto error); \
+	if((f = _alpm_arena_strndup(db->arena, line, len)) == NULL) goto error; \
 } while(0)
 
 #define READ_AND_STORE_ALL(f) do { \
 	char *linedup; \
-	if(_alpm_archive_fgets(archive, &buf) != ARCHIVE_OK) goto error; \
-	if(_alpm_strip_newline(buf.line, buf.real_line_size) == 0) break; \
-	STRDUP(linedup, buf.line, goto error); \
-	f = alpm_list_add(f, linedup); \
+	READ_NEXT(); \
+	if(len == 0) break; \
+	if((linedup = _alpm_arena_strndup(db->arena, line, len)) == NULL \
+			|| (f = _alpm_arena_list_add(db->arena, f, linedup)) == NULL) goto error; \
 } while(1) /* note the while(1) and not (0) */
 
 #define READ_AND_SPLITDEP(f) do { \
-	if(_alpm_archive_fgets(archive, &buf) != ARCHIVE_OK) goto error; \
-	if(_alpm_strip_newline(buf.line, buf.real_line_size) == 0) break; \
-	f = alpm_list_add(f, alpm_dep_from_string(line)); \
+	alpm_depend_t *dep; \
+	READ_NEXT(); \
+	if(len == 0) break; \
+	if((dep = _alpm_dep_from_stringn(db->arena, line, len)) == NULL \
+			|| (f = _alpm_arena_list_add(db->arena, f, dep)) == NULL) goto error; \
 } while(1) /* note the while(1) and not (0) */
 
 static int sync_db_read(alpm_db_t *db, struct archive *archive,
-		struct archive_entry *entry, alpm_pkg_t **likely_pkg)
+		struct archive_entry *entry, alpm_pkg_t **likely_pkg, int read_deltas)
 {
 	const char *entryname, *filename;
 	alpm_pkg_t *pkg;
 	struct archive_read_buffer buf;
+	const char *line;
+	size_t len;
+	char number[32];
 
 	entryname = archive_entry_pathname(entry);
 	if(entryname == NULL) {
@@ -638,121 +1030,152 @@ static int sync_db_read(alpm_db_t *db, struct archive *archive,
 
 	if(strcmp(filename, "desc") == 0 || strcmp(filename, "depends") == 0
 			|| strcmp(filename, "files") == 0
-			|| (strcmp(filename, "deltas") == 0 && db->handle->deltaratio > 0.0) ) {
+			|| (strcmp(filename, "deltas") == 0 && read_deltas) ) {
 		int ret;
-		while((ret = _alpm_archive_fgets(archive, &buf)) == ARCHIVE_OK) {
-			char *line = buf.line;
-			if(_alpm_strip_newline(line, buf.real_line_size) == 0) {
-				/* length of stripped line was zero */
+		while((ret = _alpm_archive_getline(archive, &buf, &line, &len)) == ARCHIVE_OK) {
+			if(len == 0) {
 				continue;
 			}
 
-			if(strcmp(line, "%NAME%") == 0) {
-				READ_NEXT();
-				if(strcmp(line, pkg->name) != 0) {
-					_alpm_log(db->handle, ALPM_LOG_ERROR, _("%s database is inconsistent: name "
-								"mismatch on package %s\n"), db->treename, pkg->name);
-				}
-			} else if(strcmp(line, "%VERSION%") == 0) {
-				READ_NEXT();
-				if(strcmp(line, pkg->version) != 0) {
-					_alpm_log(db->handle, ALPM_LOG_ERROR, _("%s database is inconsistent: version "
-								"mismatch on package %s\n"), db->treename, pkg->name);
-				}
-			} else if(strcmp(line, "%FILENAME%") == 0) {
-				READ_AND_STORE(pkg->filename);
-				if(_alpm_validate_filename(db, pkg->name, pkg->filename) < 0) {
-					return -1;
-				}
-			} else if(strcmp(line, "%BASE%") == 0) {
-				READ_AND_STORE(pkg->base);
-			} else if(strcmp(line, "%DESC%") == 0) {
-				READ_AND_STORE(pkg->desc);
-			} else if(strcmp(line, "%GROUPS%") == 0) {
-				READ_AND_STORE_ALL(pkg->groups);
-			} else if(strcmp(line, "%URL%") == 0) {
-				READ_AND_STORE(pkg->url);
-			} else if(strcmp(line, "%LICENSE%") == 0) {
-				READ_AND_STORE_ALL(pkg->licenses);
-			} else if(strcmp(line, "%ARCH%") == 0) {
-				READ_AND_STORE(pkg->arch);
-			} else if(strcmp(line, "%BUILDDATE%") == 0) {
-				READ_NEXT();
-				pkg->builddate = _alpm_parsedate(line);
-			} else if(strcmp(line, "%PACKAGER%") == 0) {
-				READ_AND_STORE(pkg->packager);
-			} else if(strcmp(line, "%CSIZE%") == 0) {
-				READ_NEXT();
-				pkg->size = _alpm_strtoofft(line);
-			} else if(strcmp(line, "%ISIZE%") == 0) {
-				READ_NEXT();
-				pkg->isize = _alpm_strtoofft(line);
-			} else if(strcmp(line, "%MD5SUM%") == 0) {
-				READ_AND_STORE(pkg->md5sum);
-			} else if(strcmp(line, "%SHA256SUM%") == 0) {
-				READ_AND_STORE(pkg->sha256sum);
-			} else if(strcmp(line, "%PGPSIG%") == 0) {
-				READ_AND_STORE(pkg->base64_sig);
-			} else if(strcmp(line, "%REPLACES%") == 0) {
-				READ_AND_SPLITDEP(pkg->replaces);
-			} else if(strcmp(line, "%DEPENDS%") == 0) {
-				READ_AND_SPLITDEP(pkg->depends);
-			} else if(strcmp(line, "%OPTDEPENDS%") == 0) {
-				READ_AND_SPLITDEP(pkg->optdepends);
-			} else if(strcmp(line, "%MAKEDEPENDS%") == 0) {
-				/* currently unused */
-				while(1) {
+			switch(sync_db_field(line, len)) {
+				case SYNC_FIELD_NAME:
 					READ_NEXT();
-					if(strlen(line) == 0) break;
-				}
-			} else if(strcmp(line, "%CHECKDEPENDS%") == 0) {
-				/* currently unused */
-				while(1) {
+					if(!line_equals(line, len, pkg->name)) {
+						_alpm_log(db->handle, ALPM_LOG_ERROR, _("%s database is inconsistent: name "
+									"mismatch on package %s\n"), db->treename, pkg->name);
+					}
+					break;
+				case SYNC_FIELD_VERSION:
 					READ_NEXT();
-					if(strlen(line) == 0) break;
-				}
-			} else if(strcmp(line, "%CONFLICTS%") == 0) {
-				READ_AND_SPLITDEP(pkg->conflicts);
-			} else if(strcmp(line, "%PROVIDES%") == 0) {
-				READ_AND_SPLITDEP(pkg->provides);
-			} else if(strcmp(line, "%DELTAS%") == 0) {
-				/* Different than the rest because of the _alpm_delta_parse call. */
-				while(1) {
+					if(!line_equals(line, len, pkg->version)) {
+						_alpm_log(db->handle, ALPM_LOG_ERROR, _("%s database is inconsistent: version "
+									"mismatch on package %s\n"), db->treename, pkg->name);
+					}
+					break;
+				case SYNC_FIELD_FILENAME:
+					READ_AND_STORE(pkg->filename);
+					if(_alpm_validate_filename(db, pkg->name, pkg->filename) < 0) {
+						free(buf.line);
+						return -1;
+					}
+					break;
+				case SYNC_FIELD_BASE:
+					READ_AND_STORE(pkg->base);
+					break;
+				case SYNC_FIELD_DESC:
+					READ_AND_STORE(pkg->desc);
+					break;
+				case SYNC_FIELD_GROUPS:
+					READ_AND_STORE_ALL(pkg->groups);
+					break;
+				case SYNC_FIELD_URL:
+					READ_AND_STORE(pkg->url);
+					break;
+				case SYNC_FIELD_LICENSE:
+					READ_AND_STORE_ALL(pkg->licenses);
+					break;
+				case SYNC_FIELD_ARCH:
+					READ_AND_STORE(pkg->arch);
+					break;
+				case SYNC_FIELD_BUILDDATE:
 					READ_NEXT();
-					if(strlen(line) == 0) break;
-					pkg->deltas = alpm_list_add(pkg->deltas,
-							_alpm_delta_parse(db->handle, line));
-				}
-			} else if(strcmp(line, "%FILES%") == 0) {
-				/* TODO: this could lazy load if there is future demand */
-				size_t files_count = 0, files_size = 0;
-				alpm_file_t *files = NULL;
-
-				while(1) {
-					if(_alpm_archive_fgets(archive, &buf) != ARCHIVE_OK) {
-						goto error;
+					pkg->builddate = _alpm_parsedate(
+							line_cstr(number, sizeof(number), line, len));
+					break;
+				case SYNC_FIELD_PACKAGER:
+					READ_AND_STORE(pkg->packager);
+					break;
+				case SYNC_FIELD_CSIZE:
+					READ_NEXT();
+					pkg->size = _alpm_strtoofft(
+							line_cstr(number, sizeof(number), line, len));
+					break;
+				case SYNC_FIELD_ISIZE:
+					READ_NEXT();
+					pkg->isize = _alpm_strtoofft(
+							line_cstr(number, sizeof(number), line, len));
+					break;
+				case SYNC_FIELD_MD5SUM:
+					READ_AND_STORE(pkg->md5sum);
+					break;
+				case SYNC_FIELD_SHA256SUM:
+					READ_AND_STORE(pkg->sha256sum);
+					break;
+				case SYNC_FIELD_PGPSIG:
+					READ_AND_STORE(pkg->base64_sig);
+					break;
+				case SYNC_FIELD_REPLACES:
+					READ_AND_SPLITDEP(pkg->replaces);
+					break;
+				case SYNC_FIELD_DEPENDS:
+					READ_AND_SPLITDEP(pkg->depends);
+					break;
+				case SYNC_FIELD_OPTDEPENDS:
+					READ_AND_SPLITDEP(pkg->optdepends);
+					break;
+				case SYNC_FIELD_MAKEDEPENDS:
+				case SYNC_FIELD_CHECKDEPENDS:
+					/* currently unused */
+					while(1) {
+						READ_NEXT();
+						if(len == 0) break;
 					}
-					line = buf.line;
-					if(_alpm_strip_newline(line, buf.real_line_size) == 0) {
-						break;
+					break;
+				case SYNC_FIELD_CONFLICTS:
+					READ_AND_SPLITDEP(pkg->conflicts);
+					break;
+				case SYNC_FIELD_PROVIDES:
+					READ_AND_SPLITDEP(pkg->provides);
+					break;
+				case SYNC_FIELD_DELTAS:
+					/* Different than the rest because of the _alpm_delta_parse call. */
+					while(1) {
+						char *delta;
+						READ_NEXT();
+						if(len == 0) break;
+						STRNDUP(delta, line, len, goto error);
+						pkg->deltas = alpm_list_add(pkg->deltas,
+								_alpm_delta_parse(db->handle, delta));
+						free(delta);
 					}
-
-					if(!_alpm_greedy_grow((void **)&files, &files_size,
-								(files_count ? (files_count + 1) * sizeof(alpm_file_t) : 8 * sizeof(alpm_file_t)))) {
-						goto error;
+					break;
+				case SYNC_FIELD_FILES:
+					{
+						/* TODO: this could lazy load if there is future demand */
+						size_t files_count = 0, files_size = 0;
+						alpm_file_t *files = NULL;
+
+						while(1) {
+							READ_NEXT();
+							if(len == 0) {
+								break;
+							}
+
+							if(!_alpm_greedy_grow((void **)&files, &files_size,
+										(files_count ? (files_count + 1) * sizeof(alpm_file_t) : 8 * sizeof(alpm_file_t)))) {
+								free(files);
+								goto error;
+							}
+							files[files_count].name = _alpm_arena_strndup(db->arena, line, len);
+							if(files[files_count].name == NULL) {
+								free(files);
+								goto error;
+							}
+							files_count++;
+						}
+						/* attempt to hand back any memory we don't need */
+						if(files_count > 0) {
+							files = realloc(files, sizeof(alpm_file_t) * files_count);
+						} else {
+							FREE(files);
+						}
+						pkg->files.count = files_count;
+						pkg->files.files = files;
+						_alpm_filelist_sort(&pkg->files);
 					}
-					STRDUP(files[files_count].name, line, goto error);
-					files_count++;
-				}
-				/* attempt to hand back any memory we don't need */
-				if(files_count > 0) {
-					files = realloc(files, sizeof(alpm_file_t) * files_count);
-				} else {
-					FREE(files);
-				}
-				pkg->files.count = files_count;
-				pkg->files.files = files;
-				_alpm_filelist_sort(&pkg->files);
+					break;
+				case SYNC_FIELD_UNKNOWN:
+					break;
 			}
 		}
 		if(ret != ARCHIVE_EOF) {
@@ -769,6 +1192,7 @@ static int sync_db_read(alpm_db_t *db, struct archive *archive,
 	return 0;
 
 error:
+	free(buf.line);
 	_alpm_log(db->handle, ALPM_LOG_DEBUG, "error parsing database file: %s\n", filename);
 	return -1;
 }
@@ -799,6 +1223,7 @@ alpm_db_t *_alpm_db_register_sync(alpm_handle_t *handle, const char *treename,
 	db->ops = &sync_db_ops;
 	db->handle = handle;
 	db->siglevel = level;
+	get_sync_pkg_ops();
 
 	sync_db_validate(db);
 
@@ -377,32 +377,211 @@ static int dir_belongsto_pkgs(alpm_handle_t *handle, const char *dirpath,
 	return 1;
 }
 
-static alpm_list_t *alpm_db_find_file_owners(alpm_db_t* db, const char *path)
+static alpm_pkg_t *_alpm_find_file_owner(alpm_handle_t *handle, const char *path)
+{
+	alpm_list_t *owners = alpm_db_find_file_owners(handle->db_local, path);
+	alpm_pkg_t *owner = owners ? owners->data : NULL;
+	alpm_list_free(owners);
+	return owner;
+}
+
+static int _alpm_can_overwrite_file(alpm_handle_t *handle, const char *path, const char *rootedpath)
+{
+	return _alpm_fnmatch_patterns(handle->overwrite_files, path) == 0
+		|| _alpm_fnmatch_patterns(handle->overwrite_files, rootedpath) == 0;
+}
+
+/* a file of an incoming package, see find_target_conflicts() */
+struct target_file {
+	const char *name;
+	/* length without a trailing '/', so a file and a directory of the
+	 * same name compare equal */
+	size_t len;
+	size_t pkg;
+	size_t idx;
+	int isdir;
+};
+
+/* file idx of target pkg1 is also in the later target pkg2 */
+struct target_conflict {
+	size_t pkg1;
+	size_t pkg2;
+	size_t idx;
+};
+
+static int target_file_cmp(const void *p1, const void *p2)
 {
-	alpm_list_t *i, *owners = NULL;
-	for(i = alpm_db_get_pkgcache(db); i; i = i->next) {
-		if(alpm_filelist_contains(alpm_pkg_get_files(i->data), path)) {
-			owners = alpm_list_add(owners, i->data);
+	const struct target_file *f1 = p1, *f2 = p2;
+	int cmp = memcmp(f1->name, f2->name, f1->len < f2->len ? f1->len : f2->len);
+
+	if(cmp != 0) {
+		return cmp;
+	} else if(f1->len != f2->len) {
+		return f1->len < f2->len ? -1 : 1;
+	} else if(f1->pkg != f2->pkg) {
+		return f1->pkg < f2->pkg ? -1 : 1;
+	}
+	return f1->idx < f2->idx ? -1 : f1->idx > f2->idx;
+}
+
+static int target_conflict_cmp(const void *p1, const void *p2)
+{
+	const struct target_conflict *c1 = p1, *c2 = p2;
+
+	if(c1->pkg1 != c2->pkg1) {
+		return c1->pkg1 < c2->pkg1 ? -1 : 1;
+	} else if(c1->pkg2 != c2->pkg2) {
+		return c1->pkg2 < c2->pkg2 ? -1 : 1;
+	}
+	return c1->idx < c2->idx ? -1 : c1->idx > c2->idx;
+}
+
+/* Find every path that more than one target wants by sorting the files of
+ * all targets together once, instead of intersecting the file lists of
+ * every pair of targets. Paths that are directories in both packages are
+ * no conflict. The result is sorted by first package, second package and
+ * file, the order the pairwise search found them in.
+ * @return 0 on success, -1 on error (pm_errno is set accordingly) */
+static int find_target_conflicts(alpm_handle_t *handle, alpm_pkg_t **targets,
+		size_t numtargs, struct target_conflict **conflicts, size_t *count)
+{
+	struct target_file *files = NULL;
+	struct target_conflict *found = NULL;
+	size_t numfiles = 0, found_count = 0, found_size = 0;
+	size_t t, n, start, end;
+
+	*conflicts = NULL;
+	*count = 0;
+
+	for(t = 0; t < numtargs; t++) {
+		numfiles += alpm_pkg_get_files(targets[t])->count;
+	}
+	if(numfiles == 0) {
+		return 0;
+	}
+	MALLOC(files, numfiles * sizeof(struct target_file),
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	for(n = 0, t = 0; t < numtargs; t++) {
+		alpm_filelist_t *fl = alpm_pkg_get_files(targets[t]);
+		size_t f;
+		for(f = 0; f < fl->count; f++, n++) {
+			const char *name = fl->files[f].name;
+			size_t len = strlen(name);
+			files[n].name = name;
+			files[n].isdir = (len > 0 && name[len - 1] == '/');
+			files[n].len = files[n].isdir ? len - 1 : len;
+			files[n].pkg = t;
+			files[n].idx = f;
+		}
+	}
+	qsort(files, numfiles, sizeof(struct target_file), target_file_cmp);
+
+	for(start = 0; start < numfiles; start = end) {
+		int has_file = !files[start].isdir;
+		size_t a, b;
+
+		for(end = start + 1; end < numfiles
+				&& files[end].len == files[start].len
+				&& memcmp(files[end].name, files[start].name, files[start].len) == 0;
+				end++) {
+			has_file |= !files[end].isdir;
+		}
+		/* a directory shared by many packages is the common case */
+		if(end - start < 2 || !has_file) {
+			continue;
+		}
+		for(a = start; a < end; a++) {
+			for(b = a + 1; b < end; b++) {
+				if(files[a].pkg == files[b].pkg
+						|| (files[a].isdir && files[b].isdir)) {
+					continue;
+				}
+				if(!_alpm_greedy_grow((void **)&found, &found_size,
+							(found_count + 1) * sizeof(struct target_conflict))) {
+					free(files);
+					free(found);
+					RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+				}
+				found[found_count].pkg1 = files[a].pkg;
+				found[found_count].pkg2 = files[b].pkg;
+				found[found_count].idx = files[a].idx;
+				found_count++;
+			}
 		}
 	}
-	return owners;
+	free(files);
+
+	if(found_count > 1) {
+		qsort(found, found_count, sizeof(struct target_conflict),
+				target_conflict_cmp);
+	}
+	*conflicts = found;
+	*count = found_count;
+	return 0;
 }
 
-static alpm_pkg_t *_alpm_find_file_owner(alpm_handle_t *handle, const char *path)
+/* the files of a target that CHECK 2 looks for on the filesystem: those
+ * the installed version does not have already */
+static alpm_list_t *target_new_files(alpm_handle_t *handle, alpm_pkg_t *pkg)
 {
-	alpm_list_t *i;
-	for(i = alpm_db_get_pkgcache(handle->db_local); i; i = i->next) {
-		if(alpm_filelist_contains(alpm_pkg_get_files(i->data), path)) {
-			return i->data;
+	alpm_pkg_t *dbpkg = _alpm_db_get_pkgfromcache(handle->db_local, pkg->name);
+	alpm_list_t *newfiles = NULL;
+
+	/* Do two different checks here. If the package is currently installed,
+	 * then only check files that are new in the new package. If the package
+	 * is not currently installed, then simply stat the whole filelist. */
+	if(dbpkg) {
+		/* older ver of package currently installed */
+		newfiles = _alpm_filelist_difference(alpm_pkg_get_files(pkg),
+				alpm_pkg_get_files(dbpkg));
+	} else {
+		/* no version of package currently installed */
+		alpm_filelist_t *fl = alpm_pkg_get_files(pkg);
+		size_t filenum;
+		for(filenum = 0; filenum < fl->count; filenum++) {
+			newfiles = alpm_list_add(newfiles, fl->files[filenum].name);
 		}
 	}
-	return NULL;
+	return newfiles;
 }
 
-static int _alpm_can_overwrite_file(alpm_handle_t *handle, const char *path, const char *rootedpath)
+/* Look the new files of all targets up on the filesystem in one batch.
+ * @return the results in the order of the targets and their files, NULL
+ * on error (pm_errno is set accordingly) */
+static struct llstat_result *stat_new_files(alpm_handle_t *handle,
+		alpm_list_t **newfiles, size_t numtargs)
 {
-	return _alpm_fnmatch_patterns(handle->overwrite_files, path) == 0
-		|| _alpm_fnmatch_patterns(handle->overwrite_files, rootedpath) == 0;
+	struct llstat_result *results;
+	const char **paths;
+	size_t count = 0, t, n = 0;
+	alpm_list_t *j;
+
+	for(t = 0; t < numtargs; t++) {
+		count += alpm_list_count(newfiles[t]);
+	}
+	/* one result more, so nothing is allocated with size 0 */
+	MALLOC(paths, (count + 1) * sizeof(char *),
+			RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	MALLOC(results, (count + 1) * sizeof(struct llstat_result),
+			free(paths); RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	for(t = 0; t < numtargs; t++) {
+		for(j = newfiles[t]; j; j = j->next) {
+			paths[n++] = j->data;
+		}
+	}
+	llstat_many(handle->root, paths, count, results, handle->worker_threads);
+	free(paths);
+	return results;
+}
+
+static void free_new_files(alpm_list_t **newfiles, size_t numtargs)
+{
+	size_t t;
+
+	for(t = 0; t < numtargs; t++) {
+		alpm_list_free(newfiles[t]);
+	}
+	free(newfiles);
 }
 
 /**
@@ -425,6 +604,11 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 	size_t numtargs = alpm_list_count(upgrade);
 	size_t current;
 	size_t rootlen;
+	alpm_pkg_t **targets;
+	struct target_conflict *target_conflicts, *next_conflict;
+	size_t target_conflict_count;
+	alpm_list_t **target_newfiles;
+	struct llstat_result *lsresults, *lsresult;
 
 	if(!upgrade) {
 		return NULL;
@@ -432,6 +616,36 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 
 	rootlen = strlen(handle->root);
 
+	/* CHECK 1 is done for all targets at once, its results are added
+	 * along with the other checks of each target below */
+	MALLOC(targets, numtargs * sizeof(alpm_pkg_t *),
+			RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	for(current = 0, i = upgrade; i; i = i->next, current++) {
+		targets[current] = i->data;
+	}
+	if(find_target_conflicts(handle, targets, numtargs,
+				&target_conflicts, &target_conflict_count) != 0) {
+		free(targets);
+		return NULL;
+	}
+	next_conflict = target_conflicts;
+
+	/* CHECK 2 looks at the filesystem for all targets at once as well */
+	CALLOC(target_newfiles, numtargs, sizeof(alpm_list_t *),
+			free(target_conflicts); free(targets);
+			RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+	for(current = 0; current < numtargs; current++) {
+		target_newfiles[current] = target_new_files(handle, targets[current]);
+	}
+	lsresults = stat_new_files(handle, target_newfiles, numtargs);
+	if(lsresults == NULL) {
+		free_new_files(target_newfiles, numtargs);
+		free(target_conflicts);
+		free(targets);
+		return NULL;
+	}
+	lsresult = lsresults;
+
 	/* TODO this whole function needs a huge change, which hopefully will
 	 * be possible with real transactions. Right now we only do half as much
 	 * here as we do when we actually extract files in add.c with our 12
@@ -449,45 +663,39 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 		/* CHECK 1: check every target against every target */
 		_alpm_log(handle, ALPM_LOG_DEBUG, "searching for file conflicts: %s\n",
 				p1->name);
-		for(j = i->next; j; j = j->next) {
-			alpm_list_t *common_files;
-			alpm_pkg_t *p2 = j->data;
-
-			alpm_filelist_t *p1_files = alpm_pkg_get_files(p1);
+		for(; next_conflict < target_conflicts + target_conflict_count
+				&& next_conflict->pkg1 == current; next_conflict++) {
+			alpm_pkg_t *p2 = targets[next_conflict->pkg2];
 			alpm_filelist_t *p2_files = alpm_pkg_get_files(p2);
+			const char *filename =
+				alpm_pkg_get_files(p1)->files[next_conflict->idx].name;
+			char path[PATH_MAX];
 
-			common_files = _alpm_filelist_intersection(p1_files, p2_files);
-
-			if(common_files) {
-				alpm_list_t *k;
-				char path[PATH_MAX];
-				for(k = common_files; k; k = k->next) {
-					char *filename = k->data;
-					snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
+			snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
 
-					/* can skip file-file conflicts when forced *
-					 * checking presence in p2_files detects dir-file or file-dir
-					 * conflicts as the path from p1 is returned */
-					if(_alpm_can_overwrite_file(handle, filename, path)
-							&& alpm_filelist_contains(p2_files, filename)) {
-						_alpm_log(handle, ALPM_LOG_DEBUG,
-							"%s exists in both '%s' and '%s'\n", filename,
-							p1->name, p2->name);
-						_alpm_log(handle, ALPM_LOG_DEBUG,
-							"file-file conflict being forced\n");
-						continue;
-					}
+			/* can skip file-file conflicts when forced *
+			 * checking presence in p2_files detects dir-file or file-dir
+			 * conflicts as the path from p1 is returned */
+			if(_alpm_can_overwrite_file(handle, filename, path)
+					&& alpm_filelist_contains(p2_files, filename)) {
+				_alpm_log(handle, ALPM_LOG_DEBUG,
+					"%s exists in both '%s' and '%s'\n", filename,
+					p1->name, p2->name);
+				_alpm_log(handle, ALPM_LOG_DEBUG,
+					"file-file conflict being forced\n");
+				continue;
+			}
 
-					conflicts = add_fileconflict(handle, conflicts, path, p1, p2);
-					if(handle->pm_errno == ALPM_ERR_MEMORY) {
-						alpm_list_free_inner(conflicts,
-								(alpm_list_fn_free) alpm_conflict_free);
-						alpm_list_free(conflicts);
-						alpm_list_free(common_files);
-						return NULL;
-					}
-				}
-				alpm_list_free(common_files);
+			conflicts = add_fileconflict(handle, conflicts, path, p1, p2);
+			if(handle->pm_errno == ALPM_ERR_MEMORY) {
+				alpm_list_free_inner(conflicts,
+						(alpm_list_fn_free) alpm_conflict_free);
+				alpm_list_free(conflicts);
+				free_new_files(target_newfiles, numtargs);
+				free(lsresults);
+				free(target_conflicts);
+				free(targets);
+				return NULL;
 			}
 		}
 
@@ -495,26 +703,10 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 		_alpm_log(handle, ALPM_LOG_DEBUG, "searching for filesystem conflicts: %s\n",
 				p1->name);
 		dbpkg = _alpm_db_get_pkgfromcache(handle->db_local, p1->name);
+		newfiles = target_newfiles[current];
 
-		/* Do two different checks here. If the package is currently installed,
-		 * then only check files that are new in the new package. If the package
-		 * is not currently installed, then simply stat the whole filelist. Note
-		 * that the former list needs to be freed while the latter list should NOT
-		 * be freed. */
-		if(dbpkg) {
-			/* older ver of package currently installed */
-			newfiles = _alpm_filelist_difference(alpm_pkg_get_files(p1),
-					alpm_pkg_get_files(dbpkg));
-		} else {
-			/* no version of package currently installed */
-			alpm_filelist_t *fl = alpm_pkg_get_files(p1);
-			size_t filenum;
-			for(filenum = 0; filenum < fl->count; filenum++) {
-				newfiles = alpm_list_add(newfiles, fl->files[filenum].name);
-			}
-		}
-
-		for(j = newfiles; j; j = j->next) {
+		/* lsresult follows j through the results of stat_new_files() */
+		for(j = newfiles; j; j = j->next, lsresult++) {
 			const char *filestr = j->data;
 			const char *relative_path;
 			alpm_list_t *k;
@@ -529,9 +721,10 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 			relative_path = path + rootlen;
 
 			/* stat the file - if it exists, do some checks */
-			if(llstat(path, &lsbuf) != 0) {
+			if(lsresult->err != 0) {
 				continue;
 			}
+			lsbuf = lsresult->st;
 
 			_alpm_log(handle, ALPM_LOG_DEBUG, "checking possible conflict: %s\n", path);
 
@@ -556,7 +749,7 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 					/* go ahead and skip any files inside filestr as they will
 					 * necessarily be resolved by replacing the file with a dir
 					 * NOTE: afterward, j will point to the last file inside filestr */
-					for( ; j->next; j = j->next) {
+					for( ; j->next; j = j->next, lsresult++) {
 						const char *filestr2 = j->next->data;
 						if(strncmp(filestr, filestr2, fslen) != 0) {
 							break;
@@ -578,7 +771,7 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 						 * necessarily be resolved by replacing the file with a dir
 						 * NOTE: afterward, j will point to the last file inside filestr */
 						size_t fslen = strlen(filestr);
-						for( ; j->next; j = j->next) {
+						for( ; j->next; j = j->next, lsresult++) {
 							const char *filestr2 = j->next->data;
 							if(strncmp(filestr, filestr2, fslen) != 0) {
 								break;
@@ -616,7 +809,7 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 						 * go ahead and skip any files inside filestr as they will
 						 * necessarily be resolved by replacing the file with a dir
 						 * NOTE: afterward, j will point to the last file inside filestr */
-						for( ; j->next; j = j->next) {
+						for( ; j->next; j = j->next, lsresult++) {
 							const char *filestr2 = j->next->data;
 							if(strncmp(filestr, filestr2, fslen) != 0) {
 								break;
@@ -659,14 +852,7 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 
 			/* is the file unowned and in the backup list of the new package? */
 			if(!resolved_conflict && _alpm_needbackup(relative_path, p1)) {
-				alpm_list_t *local_pkgs = _alpm_db_get_pkgcache(handle->db_local);
-				int found = 0;
-				for(k = local_pkgs; k && !found; k = k->next) {
-					if(alpm_filelist_contains(alpm_pkg_get_files(k->data), relative_path)) {
-							found = 1;
-					}
-				}
-				if(!found) {
+				if(!_alpm_find_file_owner(handle, relative_path)) {
 					_alpm_log(handle, ALPM_LOG_DEBUG,
 							"file was unowned but in new backup list\n");
 					resolved_conflict = 1;
@@ -688,15 +874,21 @@ alpm_list_t *_alpm_db_find_fileconflicts(alpm_handle_t *handle,
 					alpm_list_free_inner(conflicts,
 							(alpm_list_fn_free) alpm_conflict_free);
 					alpm_list_free(conflicts);
-					alpm_list_free(newfiles);
+					free_new_files(target_newfiles, numtargs);
+					free(lsresults);
+					free(target_conflicts);
+					free(targets);
 					return NULL;
 				}
 			}
 		}
-		alpm_list_free(newfiles);
 	}
 	PROGRESS(handle, ALPM_PROGRESS_CONFLICTS_START, "", 100,
 			numtargs, current);
+	free_new_files(target_newfiles, numtargs);
+	free(lsresults);
+	free(target_conflicts);
+	free(targets);
 
 	return conflicts;
 }
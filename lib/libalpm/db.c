@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <regex.h>
+#include <pthread.h>
 
 /* libalpm */
 #include "db.h"
@@ -36,6 +37,9 @@
 #include "alpm.h"
 #include "package.h"
 #include "group.h"
+#include "delta.h"
+
+static int load_pkgcache(alpm_db_t *db);
 
 /** \addtogroup alpm_databases Database Functions
  * @brief Functions to query and manipulate the database of libalpm
@@ -277,6 +281,254 @@ alpm_list_t SYMEXPORT *alpm_db_get_pkgcache(alpm_db_t *db)
 	return _alpm_db_get_pkgcache(db);
 }
 
+/* Whether the path tables of the snapshot the package cache was populated
+ * from still describe the database. */
+static int snapshot_usable(alpm_db_t *db)
+{
+	if(db->snapshot == NULL) {
+		return 0;
+	}
+	if(db->status & DB_STATUS_LOCAL) {
+		return _alpm_local_db_snapshot_check(db) == 0;
+	}
+	return 1;
+}
+
+/* Look a path up in the path table of the snapshot the package cache was
+ * populated from. Returns -1 if the snapshot cannot answer. */
+static int snapshot_find_file_owners(alpm_db_t *db, const char *path,
+		alpm_list_t **owners)
+{
+	size_t first, i;
+	ssize_t count = _alpm_snapshot_find_path(db->snapshot, path, &first);
+
+	if(count < 0) {
+		return -1;
+	}
+	for(i = first; i < first + (size_t)count; i++) {
+		size_t idx = _alpm_snapshot_path_record(db->snapshot, i);
+		alpm_pkg_t *pkg = _alpm_pkghash_find(db->pkgcache,
+				_alpm_snapshot_name(db->snapshot, idx));
+		if(pkg == NULL || strcmp(pkg->version,
+					_alpm_snapshot_version(db->snapshot, idx)) != 0) {
+			alpm_list_free(*owners);
+			*owners = NULL;
+			return -1;
+		}
+		*owners = alpm_list_add(*owners, pkg);
+	}
+	return 0;
+}
+
+/** Find the packages owning a file. */
+alpm_list_t SYMEXPORT *alpm_db_find_file_owners(alpm_db_t *db, const char *path)
+{
+	alpm_list_t *i, *owners = NULL;
+
+	ASSERT(db != NULL, return NULL);
+	db->handle->pm_errno = ALPM_ERR_OK;
+	ASSERT(path != NULL, RET_ERR(db->handle, ALPM_ERR_WRONG_ARGS, NULL));
+
+	i = _alpm_db_get_pkgcache(db);
+	if(snapshot_usable(db) && snapshot_find_file_owners(db, path, &owners) == 0) {
+		return owners;
+	}
+
+	for(; i; i = i->next) {
+		if(alpm_filelist_contains(alpm_pkg_get_files(i->data), path)) {
+			owners = alpm_list_add(owners, i->data);
+		}
+	}
+	return owners;
+}
+
+/* Look a file name up in the basename table of the snapshot the package
+ * cache was populated from. Returns -1 if the snapshot cannot answer. */
+static int snapshot_filename_search(alpm_db_t *db, const char *filename,
+		alpm_list_t **pkgs)
+{
+	size_t first, i;
+	ssize_t count = _alpm_snapshot_find_basename(db->snapshot, filename, &first);
+	alpm_pkg_t *last = NULL;
+
+	if(count < 0) {
+		return -1;
+	}
+	for(i = first; i < first + (size_t)count; i++) {
+		size_t idx = _alpm_snapshot_basename_record(db->snapshot, i);
+		alpm_pkg_t *pkg = _alpm_pkghash_find(db->pkgcache,
+				_alpm_snapshot_name(db->snapshot, idx));
+		if(pkg == NULL || strcmp(pkg->version,
+					_alpm_snapshot_version(db->snapshot, idx)) != 0) {
+			alpm_list_free(*pkgs);
+			*pkgs = NULL;
+			return -1;
+		}
+		/* a package shows up once per matching file, all in a row */
+		if(pkg != last) {
+			*pkgs = alpm_list_add(*pkgs, pkg);
+			last = pkg;
+		}
+	}
+	return 0;
+}
+
+/** Find the packages with a file of a given name. */
+alpm_list_t SYMEXPORT *alpm_db_filename_search(alpm_db_t *db, const char *filename)
+{
+	alpm_list_t *i, *pkgs = NULL;
+
+	ASSERT(db != NULL, return NULL);
+	db->handle->pm_errno = ALPM_ERR_OK;
+	ASSERT(filename != NULL, RET_ERR(db->handle, ALPM_ERR_WRONG_ARGS, NULL));
+
+	i = _alpm_db_get_pkgcache(db);
+	if(snapshot_usable(db) && snapshot_filename_search(db, filename, &pkgs) == 0) {
+		return pkgs;
+	}
+
+	for(; i; i = i->next) {
+		alpm_filelist_t *files = alpm_pkg_get_files(i->data);
+		size_t f;
+		for(f = 0; f < files->count; f++) {
+			const char *c = strrchr(files->files[f].name, '/');
+			if(c && *(c + 1) && strcmp(c + 1, filename) == 0) {
+				pkgs = alpm_list_add(pkgs, i->data);
+				break;
+			}
+		}
+	}
+	return pkgs;
+}
+
+struct populate_job {
+	alpm_db_t *db;
+	/* private copy of the handle, so each database gets its own error code
+	 * and holds back its output instead of calling into the front end */
+	alpm_handle_t handle;
+	/* output of the job, passed on by the calling thread once all are done */
+	alpm_list_t *deferred;
+	int ret;
+};
+
+struct populate_queue {
+	pthread_mutex_t lock;
+	struct populate_job *jobs;
+	size_t count;
+	size_t next;
+};
+
+static void *populate_worker(void *arg)
+{
+	struct populate_queue *queue = arg;
+
+	while(1) {
+		struct populate_job *job;
+
+		pthread_mutex_lock(&queue->lock);
+		if(queue->next == queue->count) {
+			pthread_mutex_unlock(&queue->lock);
+			return NULL;
+		}
+		job = queue->jobs + queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+
+		job->ret = load_pkgcache(job->db);
+	}
+}
+
+/** Load the package caches of all sync databases concurrently. */
+int SYMEXPORT alpm_dbs_populate_parallel(alpm_handle_t *handle,
+		unsigned int nthreads)
+{
+	struct populate_queue queue;
+	pthread_t *threads;
+	size_t i, count, started = 0;
+	alpm_list_t *lp;
+	int ret = 0;
+
+	CHECK_HANDLE(handle, return -1);
+
+	count = alpm_list_count(handle->dbs_sync);
+	if(count == 0) {
+		return 0;
+	}
+	memset(&queue, 0, sizeof(queue));
+	CALLOC(queue.jobs, count, sizeof(struct populate_job),
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	CALLOC(threads, count, sizeof(pthread_t),
+			free(queue.jobs); RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+
+	/* deltas are parsed with a pattern shared by all workers */
+	if(handle->deltaratio > 0.0) {
+		_alpm_delta_compile_regex(handle);
+	}
+
+	for(lp = handle->dbs_sync; lp; lp = lp->next) {
+		alpm_db_t *db = lp->data;
+		struct populate_job *job;
+		/* anything not loadable is left for _alpm_db_get_pkgcache() to report */
+		if(!(db->status & DB_STATUS_VALID) || (db->status & DB_STATUS_MISSING)
+				|| (db->status & DB_STATUS_PKGCACHE)) {
+			continue;
+		}
+		job = queue.jobs + queue.count++;
+		job->db = db;
+		job->handle = *handle;
+		job->handle.deferred = &job->deferred;
+		db->handle = &job->handle;
+	}
+
+	if(nthreads == 0 || nthreads > queue.count) {
+		nthreads = queue.count;
+	}
+
+	pthread_mutex_init(&queue.lock, NULL);
+	/* the calling thread works through the queue as well */
+	for(i = 1; i < nthreads; i++) {
+		if(pthread_create(&threads[started], NULL, populate_worker, &queue) != 0) {
+			break;
+		}
+		started++;
+	}
+	populate_worker(&queue);
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&queue.lock);
+
+	for(i = 0; i < queue.count; i++) {
+		struct populate_job *job = queue.jobs + i;
+		alpm_db_t *db = job->db;
+
+		db->handle = handle;
+		_alpm_deferred_flush(handle, job->deferred);
+		job->deferred = NULL;
+		if(db->pkgcache) {
+			for(lp = db->pkgcache->list; lp; lp = lp->next) {
+				((alpm_pkg_t *)lp->data)->handle = handle;
+			}
+		}
+		if(job->ret != 0) {
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"failed to load package cache for repository '%s': %s\n",
+					db->treename, alpm_strerror(job->handle.pm_errno));
+			if(ret == 0) {
+				handle->pm_errno = job->handle.pm_errno;
+				ret = -1;
+			}
+		}
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG,
+			"loaded %zu package caches using %zu threads\n",
+			queue.count, started + 1);
+
+	free(threads);
+	free(queue.jobs);
+	return ret;
+}
+
 /** Get a group entry from a package database. */
 alpm_group_t SYMEXPORT *alpm_db_get_group(alpm_db_t *db, const char *name)
 {
@@ -515,6 +767,30 @@ static void free_groupcache(alpm_db_t *db)
 	db->status &= ~DB_STATUS_GRPCACHE;
 }
 
+static void free_provcache(alpm_db_t *db)
+{
+	if(db == NULL || !(db->status & DB_STATUS_PROVCACHE)) {
+		return;
+	}
+
+	_alpm_nameindex_free(db->provcache);
+	db->provcache = NULL;
+	db->status &= ~DB_STATUS_PROVCACHE;
+}
+
+static void free_depcache(alpm_db_t *db)
+{
+	if(db == NULL || !(db->status & DB_STATUS_DEPCACHE)) {
+		return;
+	}
+
+	_alpm_nameindex_free(db->depcache);
+	_alpm_nameindex_free(db->optdepcache);
+	db->depcache = NULL;
+	db->optdepcache = NULL;
+	db->status &= ~DB_STATUS_DEPCACHE;
+}
+
 void _alpm_db_free_pkgcache(alpm_db_t *db)
 {
 	if(db == NULL || !(db->status & DB_STATUS_PKGCACHE)) {
@@ -529,9 +805,15 @@ void _alpm_db_free_pkgcache(alpm_db_t *db)
 				(alpm_list_fn_free)_alpm_pkg_free);
 		_alpm_pkghash_free(db->pkgcache);
 	}
+	_alpm_snapshot_close(db->snapshot);
+	db->snapshot = NULL;
+	_alpm_arena_free(db->arena);
+	db->arena = NULL;
 	db->status &= ~DB_STATUS_PKGCACHE;
 
 	free_groupcache(db);
+	free_provcache(db);
+	free_depcache(db);
 }
 
 alpm_pkghash_t *_alpm_db_get_pkgcache_hash(alpm_db_t *db)
@@ -595,6 +877,8 @@ int _alpm_db_add_pkgincache(alpm_db_t *db, alpm_pkg_t *pkg)
 	}
 
 	free_groupcache(db);
+	free_provcache(db);
+	free_depcache(db);
 
 	return 0;
 }
@@ -621,6 +905,8 @@ int _alpm_db_remove_pkgfromcache(alpm_db_t *db, alpm_pkg_t *pkg)
 	_alpm_pkg_free(data);
 
 	free_groupcache(db);
+	free_provcache(db);
+	free_depcache(db);
 
 	return 0;
 }
@@ -726,3 +1012,148 @@ alpm_group_t *_alpm_db_get_groupfromcache(alpm_db_t *db, const char *target)
 
 	return NULL;
 }
+
+/* Builds the provision index of db in db->provcache.
+ * Returns 0 on success, -1 on error.
+ */
+static int load_provcache(alpm_db_t *db)
+{
+	alpm_pkghash_t *pkgcache = _alpm_db_get_pkgcache_hash(db);
+	alpm_list_t *lp;
+
+	if(pkgcache == NULL) {
+		return -1;
+	}
+
+	_alpm_log(db->handle, ALPM_LOG_DEBUG, "loading provision cache for repository '%s'\n",
+			db->treename);
+
+	db->provcache = _alpm_nameindex_new(pkgcache->entries);
+	if(db->provcache == NULL) {
+		return -1;
+	}
+
+	for(lp = pkgcache->list; lp; lp = lp->next) {
+		alpm_pkg_t *pkg = lp->data;
+		alpm_list_t *i;
+
+		for(i = alpm_pkg_get_provides(pkg); i; i = i->next) {
+			alpm_depend_t *provision = i->data;
+			if(_alpm_nameindex_add(db->provcache, provision->name,
+						provision->name_hash, pkg) != 0) {
+				_alpm_nameindex_free(db->provcache);
+				db->provcache = NULL;
+				return -1;
+			}
+		}
+	}
+
+	db->status |= DB_STATUS_PROVCACHE;
+	return 0;
+}
+
+/** Find the packages of db providing a name.
+ * The list belongs to the db and is only valid until its package cache
+ * changes.
+ */
+alpm_list_t *_alpm_db_get_providers(alpm_db_t *db, const char *name,
+		unsigned long name_hash)
+{
+	if(db == NULL || name == NULL) {
+		return NULL;
+	}
+
+	if(!(db->status & DB_STATUS_VALID)) {
+		RET_ERR(db->handle, ALPM_ERR_DB_INVALID, NULL);
+	}
+
+	if(!(db->status & DB_STATUS_PROVCACHE)) {
+		if(load_provcache(db)) {
+			return NULL;
+		}
+	}
+
+	return _alpm_nameindex_find(db->provcache, name, name_hash);
+}
+
+static int index_dependencies(alpm_nameindex_t *index, alpm_pkg_t *pkg,
+		alpm_list_t *deps)
+{
+	for(; deps; deps = deps->next) {
+		alpm_depend_t *dep = deps->data;
+		if(_alpm_nameindex_add(index, dep->name, dep->name_hash, pkg) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Builds the reverse dependency indexes of db if needed.
+ */
+int _alpm_db_load_depcache(alpm_db_t *db)
+{
+	alpm_pkghash_t *pkgcache;
+	alpm_list_t *lp;
+
+	if(db->status & DB_STATUS_DEPCACHE) {
+		return 0;
+	}
+
+	pkgcache = _alpm_db_get_pkgcache_hash(db);
+	if(pkgcache == NULL) {
+		return -1;
+	}
+
+	_alpm_log(db->handle, ALPM_LOG_DEBUG, "loading dependency cache for repository '%s'\n",
+			db->treename);
+
+	db->depcache = _alpm_nameindex_new(pkgcache->entries);
+	db->optdepcache = _alpm_nameindex_new(pkgcache->entries / 4);
+	if(db->depcache == NULL || db->optdepcache == NULL) {
+		goto error;
+	}
+
+	for(lp = pkgcache->list; lp; lp = lp->next) {
+		alpm_pkg_t *pkg = lp->data;
+		if(index_dependencies(db->depcache, pkg,
+					alpm_pkg_get_depends(pkg)) != 0
+				|| index_dependencies(db->optdepcache, pkg,
+					alpm_pkg_get_optdepends(pkg)) != 0) {
+			goto error;
+		}
+	}
+
+	db->status |= DB_STATUS_DEPCACHE;
+	return 0;
+
+error:
+	_alpm_nameindex_free(db->depcache);
+	_alpm_nameindex_free(db->optdepcache);
+	db->depcache = NULL;
+	db->optdepcache = NULL;
+	return -1;
+}
+
+/** Find the packages of db with a (optional) dependency on a name.
+ * Whether the dependency is satisfied by a particular version is left to
+ * the caller. The list belongs to the db and is only valid until its package
+ * cache changes.
+ */
+alpm_list_t *_alpm_db_get_dependents(alpm_db_t *db, const char *name,
+		unsigned long name_hash, int optional)
+{
+	if(db == NULL || name == NULL) {
+		return NULL;
+	}
+
+	if(!(db->status & DB_STATUS_VALID)) {
+		RET_ERR(db->handle, ALPM_ERR_DB_INVALID, NULL);
+	}
+
+	if(_alpm_db_load_depcache(db)) {
+		return NULL;
+	}
+
+	return _alpm_nameindex_find(optional ? db->optdepcache : db->depcache,
+			name, name_hash);
+}
@@ -29,6 +29,9 @@
 #include "alpm.h"
 #include "pkghash.h"
 #include "signing.h"
+#include "snapshot.h"
+#include "arena.h"
+#include "nameindex.h"
 
 /* Database entries */
 typedef enum _alpm_dbinfrq_t {
@@ -52,7 +55,13 @@ enum _alpm_dbstatus_t {
 
 	DB_STATUS_LOCAL = (1 << 10),
 	DB_STATUS_PKGCACHE = (1 << 11),
-	DB_STATUS_GRPCACHE = (1 << 12)
+	DB_STATUS_GRPCACHE = (1 << 12),
+	/* the on-disk snapshot no longer matches the database */
+	DB_STATUS_SNAPSHOT_DIRTY = (1 << 13),
+	DB_STATUS_PROVCACHE = (1 << 14),
+	DB_STATUS_DEPCACHE = (1 << 15),
+	/* every record of the mapped snapshot matches its entry */
+	DB_STATUS_SNAPSHOT_CHECKED = (1 << 16)
 };
 
 struct db_operations {
@@ -69,6 +78,15 @@ struct __alpm_db_t {
 	char *_path;
 	alpm_pkghash_t *pkgcache;
 	alpm_list_t *grpcache;
+	/* provision name -> providing packages, built on demand */
+	alpm_nameindex_t *provcache;
+	/* dependency name -> depending packages, built on demand */
+	alpm_nameindex_t *depcache;
+	alpm_nameindex_t *optdepcache;
+	/* mapped snapshot the pkgcache was populated from, if any */
+	alpm_snapshot_t *snapshot;
+	/* backing memory of the metadata of cached sync packages */
+	alpm_arena_t *arena;
 	alpm_list_t *servers;
 	struct db_operations *ops;
 
@@ -98,6 +116,8 @@ int _alpm_local_db_prepare(alpm_db_t *db, alpm_pkg_t *info);
 int _alpm_local_db_write(alpm_db_t *db, alpm_pkg_t *info, int inforeq);
 int _alpm_local_db_remove(alpm_db_t *db, alpm_pkg_t *info);
 char *_alpm_local_db_pkgpath(alpm_db_t *db, alpm_pkg_t *info, const char *filename);
+int _alpm_local_db_snapshot_check(alpm_db_t *db);
+int _alpm_local_db_snapshot_update(alpm_db_t *db);
 
 /* cache bullshit */
 /* packages */
@@ -110,5 +130,10 @@ alpm_pkg_t *_alpm_db_get_pkgfromcache(alpm_db_t *db, const char *target);
 /* groups */
 alpm_list_t *_alpm_db_get_groupcache(alpm_db_t *db);
 alpm_group_t *_alpm_db_get_groupfromcache(alpm_db_t *db, const char *target);
+alpm_list_t *_alpm_db_get_providers(alpm_db_t *db, const char *name,
+		unsigned long name_hash);
+int _alpm_db_load_depcache(alpm_db_t *db);
+alpm_list_t *_alpm_db_get_dependents(alpm_db_t *db, const char *name,
+		unsigned long name_hash, int optional);
 
 #endif /* ALPM_DB_H */
@@ -271,6 +271,24 @@ alpm_list_t SYMEXPORT *alpm_pkg_unused_deltas(alpm_pkg_t *pkg)
 
 #define NUM_MATCHES 6
 
+/** Compile the pattern used by _alpm_delta_parse() if needed.
+ * This happens lazily on the first parse, but must be done up front before
+ * deltas are parsed from several threads at once.
+ * @param handle the context handle
+ */
+void _alpm_delta_compile_regex(alpm_handle_t *handle)
+{
+	/* this is so we only have to compile the pattern once */
+	if(!handle->delta_regex_compiled) {
+		/* $deltafile $deltamd5 $deltasize $oldfile $newfile*/
+		regcomp(&handle->delta_regex,
+				"^([^[:space:]]+) ([[:xdigit:]]{32}) ([[:digit:]]+)"
+				" ([^[:space:]]+) ([^[:space:]]+)$",
+				REG_EXTENDED | REG_NEWLINE);
+		handle->delta_regex_compiled = 1;
+	}
+}
+
 /** Parses the string representation of a alpm_delta_t object.
  * This function assumes that the string is in the correct format.
  * This format is as follows:
@@ -286,15 +304,7 @@ alpm_delta_t *_alpm_delta_parse(alpm_handle_t *handle, const char *line)
 	regmatch_t pmatch[NUM_MATCHES];
 	char filesize[32];
 
-	/* this is so we only have to compile the pattern once */
-	if(!handle->delta_regex_compiled) {
-		/* $deltafile $deltamd5 $deltasize $oldfile $newfile*/
-		regcomp(&handle->delta_regex,
-				"^([^[:space:]]+) ([[:xdigit:]]{32}) ([[:digit:]]+)"
-				" ([^[:space:]]+) ([^[:space:]]+)$",
-				REG_EXTENDED | REG_NEWLINE);
-		handle->delta_regex_compiled = 1;
-	}
+	_alpm_delta_compile_regex(handle);
 
 	if(regexec(&handle->delta_regex, line, NUM_MATCHES, pmatch, 0) != 0) {
 		/* delta line is invalid, return NULL */
@@ -24,6 +24,7 @@
 
 #include "alpm.h"
 
+void _alpm_delta_compile_regex(alpm_handle_t *handle);
 alpm_delta_t *_alpm_delta_parse(alpm_handle_t *handle, const char *line);
 void _alpm_delta_free(alpm_delta_t *delta);
 alpm_delta_t *_alpm_delta_dup(const alpm_delta_t *delta);
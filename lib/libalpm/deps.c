@@ -34,6 +34,7 @@
 #include "db.h"
 #include "handle.h"
 #include "trans.h"
+#include "nameindex.h"
 
 void SYMEXPORT alpm_dep_free(alpm_depend_t *dep)
 {
@@ -96,6 +97,49 @@ static alpm_pkg_t *find_dep_satisfier(alpm_list_t *pkgs, alpm_depend_t *dep)
 	return NULL;
 }
 
+/* Index a list of packages by their names and provisions so satisfiers can
+ * be looked up with find_indexed_satisfier(). Returns NULL if memory ran
+ * out, in which case callers fall back to scanning the list. */
+static alpm_nameindex_t *index_satisfiers(alpm_list_t *pkgs)
+{
+	alpm_nameindex_t *index = _alpm_nameindex_new(alpm_list_count(pkgs));
+	alpm_list_t *i, *j;
+
+	if(index == NULL) {
+		return NULL;
+	}
+	for(i = pkgs; i; i = i->next) {
+		alpm_pkg_t *pkg = i->data;
+		if(_alpm_nameindex_add(index, pkg->name, pkg->name_hash, pkg) != 0) {
+			goto error;
+		}
+		for(j = alpm_pkg_get_provides(pkg); j; j = j->next) {
+			alpm_depend_t *provision = j->data;
+			if(_alpm_nameindex_add(index, provision->name,
+						provision->name_hash, pkg) != 0) {
+				goto error;
+			}
+		}
+	}
+	return index;
+
+error:
+	_alpm_nameindex_free(index);
+	return NULL;
+}
+
+/* Same result as find_dep_satisfier(pkgs, dep) when index was built from
+ * pkgs, only looking at the packages which can satisfy dep by name. */
+static alpm_pkg_t *find_indexed_satisfier(alpm_nameindex_t *index,
+		alpm_list_t *pkgs, alpm_depend_t *dep)
+{
+	if(index == NULL) {
+		return find_dep_satisfier(pkgs, dep);
+	}
+	return find_dep_satisfier(
+			_alpm_nameindex_find(index, dep->name, dep->name_hash), dep);
+}
+
 /* Convert a list of alpm_pkg_t * to a graph structure,
  * with a edge for each dependency.
  * Returns a list of vertices (one vertex = one package)
@@ -278,6 +322,108 @@ alpm_list_t *_alpm_sortbydeps(alpm_handle_t *handle,
 	return newtargs;
 }
 
+struct prefix_vertex {
+	alpm_pkg_t *pkg;
+	/* position in the target list, or (size_t)-1 for installed packages */
+	size_t target;
+	/* last target whose dependencies reached this package */
+	size_t seen;
+};
+
+/* For each package in targets, already ordered by _alpm_sortbydeps(), find
+ * how many of the targets ahead of it have to be installed before it can
+ * be: everything up to the last earlier target it depends on, directly or
+ * through installed packages which are not targets. A target depending on
+ * a later one, as happens in dependency cycles, waits for every target
+ * ahead of it. targets must not be empty.
+ * Returns an array with one count per target, or NULL on error.
+ */
+size_t *_alpm_sortbydeps_prefix(alpm_handle_t *handle, alpm_list_t *targets)
+{
+	alpm_list_t *localpkgs, *i, *j;
+	struct prefix_vertex *vertices = NULL, **stack = NULL;
+	alpm_nameindex_t *index = NULL;
+	size_t *required = NULL;
+	size_t count, total, n, k;
+
+	count = alpm_list_count(targets);
+	localpkgs = alpm_list_diff(
+			alpm_db_get_pkgcache(handle->db_local), targets, _alpm_pkg_cmp);
+	total = count + alpm_list_count(localpkgs);
+
+	CALLOC(required, count, sizeof(size_t), goto error);
+	CALLOC(vertices, total, sizeof(struct prefix_vertex), goto error);
+	CALLOC(stack, total, sizeof(struct prefix_vertex *), goto error);
+	index = _alpm_nameindex_new(total);
+	if(index == NULL) {
+		goto error;
+	}
+
+	for(n = 0, i = targets; i; i = i->next, n++) {
+		vertices[n].pkg = i->data;
+		vertices[n].target = n;
+	}
+	for(i = localpkgs; i; i = i->next, n++) {
+		vertices[n].pkg = i->data;
+		vertices[n].target = (size_t)-1;
+	}
+	for(n = 0; n < total; n++) {
+		alpm_pkg_t *pkg = vertices[n].pkg;
+		if(_alpm_nameindex_add(index, pkg->name, pkg->name_hash, vertices + n) != 0) {
+			goto error;
+		}
+		for(i = alpm_pkg_get_provides(pkg); i; i = i->next) {
+			alpm_depend_t *provision = i->data;
+			if(_alpm_nameindex_add(index, provision->name,
+						provision->name_hash, vertices + n) != 0) {
+				goto error;
+			}
+		}
+	}
+
+	for(k = 0; k < count; k++) {
+		size_t depth = 0;
+
+		vertices[k].seen = k + 1;
+		stack[depth++] = vertices + k;
+		while(depth > 0) {
+			struct prefix_vertex *vertex = stack[--depth];
+			for(i = alpm_pkg_get_depends(vertex->pkg); i; i = i->next) {
+				alpm_depend_t *dep = i->data;
+				for(j = _alpm_nameindex_find(index, dep->name, dep->name_hash);
+						j; j = j->next) {
+					struct prefix_vertex *satisfier = j->data;
+					if(satisfier->seen == k + 1 || !_alpm_depcmp(satisfier->pkg, dep)) {
+						continue;
+					}
+					satisfier->seen = k + 1;
+					if(satisfier->target == (size_t)-1) {
+						stack[depth++] = satisfier;
+					} else if(satisfier->target >= k) {
+						required[k] = k;
+					} else if(satisfier->target + 1 > required[k]) {
+						required[k] = satisfier->target + 1;
+					}
+				}
+			}
+		}
+	}
+
+	_alpm_nameindex_free(index);
+	free(stack);
+	free(vertices);
+	alpm_list_free(localpkgs);
+	return required;
+
+error:
+	_alpm_nameindex_free(index);
+	free(stack);
+	free(vertices);
+	free(required);
+	alpm_list_free(localpkgs);
+	return NULL;
+}
+
 static int no_dep_version(alpm_handle_t *handle)
 {
 	if(!handle->trans) {
@@ -319,6 +465,7 @@ alpm_list_t SYMEXPORT *alpm_checkdeps(alpm_handle_t *handle,
 	alpm_list_t *i, *j;
 	alpm_list_t *dblist = NULL, *modified = NULL;
 	alpm_list_t *baddeps = NULL;
+	alpm_nameindex_t *dbindex;
 	int nodepversion;
 
 	CHECK_HANDLE(handle, return NULL);
@@ -332,6 +479,7 @@ alpm_list_t SYMEXPORT *alpm_checkdeps(alpm_handle_t *handle,
 		}
 	}
 
+	dbindex = index_satisfiers(dblist);
 	nodepversion = no_dep_version(handle);
 
 	/* look for unsatisfied dependencies of the upgrade list */
@@ -350,7 +498,7 @@ alpm_list_t SYMEXPORT *alpm_checkdeps(alpm_handle_t *handle,
 			/* 2. we check database for untouched satisfying packages */
 			/* 3. we check the dependency ignore list */
 			if(!find_dep_satisfier(upgrade, depend) &&
-					!find_dep_satisfier(dblist, depend) &&
+					!find_indexed_satisfier(dbindex, dblist, depend) &&
 					!_alpm_depcmp_provides(depend, handle->assumeinstalled)) {
 				/* Unsatisfied dependency in the upgrade list */
 				alpm_depmissing_t *miss;
@@ -383,7 +531,7 @@ alpm_list_t SYMEXPORT *alpm_checkdeps(alpm_handle_t *handle,
 				/* 3. we check the dependency ignore list */
 				if(causingpkg &&
 						!find_dep_satisfier(upgrade, depend) &&
-						!find_dep_satisfier(dblist, depend) &&
+						!find_indexed_satisfier(dbindex, dblist, depend) &&
 						!_alpm_depcmp_provides(depend, handle->assumeinstalled)) {
 					alpm_depmissing_t *miss;
 					char *missdepstring = alpm_dep_compute_string(depend);
@@ -398,6 +546,7 @@ alpm_list_t SYMEXPORT *alpm_checkdeps(alpm_handle_t *handle,
 		}
 	}
 
+	_alpm_nameindex_free(dbindex);
 	alpm_list_free(modified);
 	alpm_list_free(dblist);
 
@@ -470,33 +619,57 @@ int _alpm_depcmp(alpm_pkg_t *pkg, alpm_depend_t *dep)
 		|| _alpm_depcmp_provides(dep, alpm_pkg_get_provides(pkg));
 }
 
-alpm_depend_t SYMEXPORT *alpm_dep_from_string(const char *depstring)
+/* Parse the first len bytes of a dependency string, which need not be
+ * NUL-terminated; if arena is not NULL, the dependency and its strings are
+ * allocated from it and must not be freed individually. */
+alpm_depend_t *_alpm_dep_from_stringn(alpm_arena_t *arena,
+		const char *depstring, size_t len)
 {
 	alpm_depend_t *depend;
-	const char *ptr, *version, *desc;
+	const char *ptr, *version, *desc, *end;
 	size_t deplen;
 
 	if(depstring == NULL) {
 		return NULL;
 	}
+	end = depstring + len;
 
-	CALLOC(depend, 1, sizeof(alpm_depend_t), return NULL);
+	if(arena) {
+		depend = _alpm_arena_calloc(arena, sizeof(alpm_depend_t));
+		if(depend == NULL) {
+			return NULL;
+		}
+	} else {
+		CALLOC(depend, 1, sizeof(alpm_depend_t), return NULL);
+	}
 
 	/* Note the extra space in ": " to avoid matching the epoch */
-	if((desc = strstr(depstring, ": ")) != NULL) {
-		STRDUP(depend->desc, desc + 2, goto error);
+	for(desc = depstring; (desc = memchr(desc, ':', end - desc)) != NULL; desc++) {
+		if(desc + 1 < end && desc[1] == ' ') {
+			break;
+		}
+	}
+	if(desc != NULL) {
+		if(arena) {
+			depend->desc = _alpm_arena_strndup(arena, desc + 2, end - desc - 2);
+			if(depend->desc == NULL) {
+				return NULL;
+			}
+		} else {
+			STRNDUP(depend->desc, desc + 2, end - desc - 2, goto error);
+		}
 		deplen = desc - depstring;
 	} else {
-		/* no description- point desc at NULL at end of string for later use */
+		/* no description- point desc at the end of string for later use */
 		depend->desc = NULL;
-		deplen = strlen(depstring);
-		desc = depstring + deplen;
+		deplen = len;
+		desc = end;
 	}
 
 	/* Find a version comparator if one exists. If it does, set the type and
 	 * increment the ptr accordingly so we can copy the right strings. */
 	if((ptr = memchr(depstring, '<', deplen))) {
-		if(ptr[1] == '=') {
+		if(ptr + 1 < end && ptr[1] == '=') {
 			depend->mod = ALPM_DEP_MOD_LE;
 			version = ptr + 2;
 		} else {
@@ -504,7 +677,7 @@ alpm_depend_t SYMEXPORT *alpm_dep_from_string(const char *depstring)
 			version = ptr + 1;
 		}
 	} else if((ptr = memchr(depstring, '>', deplen))) {
-		if(ptr[1] == '=') {
+		if(ptr + 1 < end && ptr[1] == '=') {
 			depend->mod = ALPM_DEP_MOD_GE;
 			version = ptr + 2;
 		} else {
@@ -524,11 +697,24 @@ alpm_depend_t SYMEXPORT *alpm_dep_from_string(const char *depstring)
 	}
 
 	/* copy the right parts to the right places */
-	STRNDUP(depend->name, depstring, ptr - depstring, goto error);
-	depend->name_hash = _alpm_hash_sdbm(depend->name);
-	if(version) {
-		STRNDUP(depend->version, version, desc - version, goto error);
+	if(arena) {
+		depend->name = _alpm_arena_strndup(arena, depstring, ptr - depstring);
+		if(depend->name == NULL) {
+			return NULL;
+		}
+		if(version) {
+			depend->version = _alpm_arena_strndup(arena, version, desc - version);
+			if(depend->version == NULL) {
+				return NULL;
+			}
+		}
+	} else {
+		STRNDUP(depend->name, depstring, ptr - depstring, goto error);
+		if(version) {
+			STRNDUP(depend->version, version, desc - version, goto error);
+		}
 	}
+	depend->name_hash = _alpm_hash_sdbm(depend->name);
 
 	return depend;
 
@@ -537,6 +723,21 @@ error:
 	return NULL;
 }
 
+/* Parse a dependency string, see _alpm_dep_from_stringn() */
+alpm_depend_t *_alpm_dep_from_string(alpm_arena_t *arena,
+		const char *depstring)
+{
+	if(depstring == NULL) {
+		return NULL;
+	}
+	return _alpm_dep_from_stringn(arena, depstring, strlen(depstring));
+}
+
+alpm_depend_t SYMEXPORT *alpm_dep_from_string(const char *depstring)
+{
+	return _alpm_dep_from_string(NULL, depstring);
+}
+
 alpm_depend_t *_alpm_dep_dup(const alpm_depend_t *dep)
 {
 	alpm_depend_t *newdep;
@@ -580,6 +781,60 @@ static void _alpm_select_depends(alpm_list_t **from, alpm_list_t **to,
 	}
 }
 
+/* Check whether a package kept in db has a dependency on name which pkg
+ * satisfies. Packages in targs and rem are not kept. */
+static int _alpm_is_needed(alpm_db_t *db, alpm_list_t *targs, alpm_list_t *rem,
+		alpm_pkg_t *pkg, const char *name, unsigned long name_hash)
+{
+	alpm_list_t *i;
+
+	for(i = _alpm_db_get_dependents(db, name, name_hash, 0); i; i = i->next) {
+		alpm_pkg_t *deppkg = i->data;
+		if(!alpm_list_find_ptr(rem, deppkg)
+				&& !alpm_pkg_find(targs, deppkg->name)
+				&& _alpm_pkg_depends_on(deppkg, pkg)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Move packages still needed by kept packages out of a removal list.
+ * @param db package database to do dependency tracing in
+ * @param targs list of packages removed anyway
+ * @param rem list of packages to check, updated in place
+ */
+static void _alpm_keep_needed(alpm_db_t *db, alpm_list_t *targs,
+		alpm_list_t **rem)
+{
+	int changed;
+
+	/* keeping a package can make its own dependencies needed again */
+	do {
+		alpm_list_t *i, *next;
+		changed = 0;
+		for(i = *rem; i; i = next) {
+			alpm_pkg_t *pkg = i->data;
+			alpm_list_t *j;
+			int needed;
+
+			next = i->next;
+			/* only dependencies on pkg's name or provisions can be satisfied by it */
+			needed = _alpm_is_needed(db, targs, *rem, pkg, pkg->name, pkg->name_hash);
+			for(j = alpm_pkg_get_provides(pkg); j && !needed; j = j->next) {
+				alpm_depend_t *provision = j->data;
+				needed = _alpm_is_needed(db, targs, *rem, pkg,
+						provision->name, provision->name_hash);
+			}
+			if(needed) {
+				*rem = alpm_list_remove_item(*rem, i);
+				free(i);
+				changed = 1;
+			}
+		}
+	} while(changed);
+}
+
 /**
  * @brief Adds unneeded dependencies to an existing list of packages.
  * By unneeded, we mean dependencies that are only required by packages in the
@@ -612,11 +867,14 @@ int _alpm_recursedeps(alpm_db_t *db, alpm_list_t **targs, int include_explicit)
 		_alpm_select_depends(&keep, &rem, i->data, include_explicit);
 	}
 
+	alpm_list_free(keep);
+
 	/* recursively select any still needed packages to keep */
-	for(i = keep; i && rem; i = i->next) {
-		_alpm_select_depends(&rem, &keep, i->data, 1);
+	if(rem && _alpm_db_load_depcache(db) != 0) {
+		alpm_list_free(rem);
+		return -1;
 	}
-	alpm_list_free(keep);
+	_alpm_keep_needed(db, *targs, &rem);
 
 	/* copy selected packages into the target list */
 	for(i = rem; i; i = i->next) {
@@ -696,7 +954,7 @@ static alpm_pkg_t *resolvedep(alpm_handle_t *handle, alpm_depend_t *dep,
 		if(!(db->usage & (ALPM_DB_USAGE_INSTALL|ALPM_DB_USAGE_UPGRADE))) {
 			continue;
 		}
-		for(j = _alpm_db_get_pkgcache(db); j; j = j->next) {
+		for(j = _alpm_db_get_providers(db, dep->name, dep->name_hash); j; j = j->next) {
 			alpm_pkg_t *pkg = j->data;
 			if((pkg->name_hash != dep->name_hash || strcmp(pkg->name, dep->name) != 0)
 					&& _alpm_depcmp(pkg, dep) && !alpm_pkg_find(excluding, pkg->name)) {
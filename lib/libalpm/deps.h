@@ -26,10 +26,16 @@
 #include "sync.h"
 #include "package.h"
 #include "alpm.h"
+#include "arena.h"
 
+alpm_depend_t *_alpm_dep_from_stringn(alpm_arena_t *arena,
+		const char *depstring, size_t len);
+alpm_depend_t *_alpm_dep_from_string(alpm_arena_t *arena,
+		const char *depstring);
 alpm_depend_t *_alpm_dep_dup(const alpm_depend_t *dep);
 alpm_list_t *_alpm_sortbydeps(alpm_handle_t *handle,
 		alpm_list_t *targets, alpm_list_t *ignore, int reverse);
+size_t *_alpm_sortbydeps_prefix(alpm_handle_t *handle, alpm_list_t *targets);
 int _alpm_recursedeps(alpm_db_t *db, alpm_list_t **targs, int include_explicit);
 int _alpm_resolvedeps(alpm_handle_t *handle, alpm_list_t *localpkgs, alpm_pkg_t *pkg,
 		alpm_list_t *preferred, alpm_list_t **packages, alpm_list_t *remove,
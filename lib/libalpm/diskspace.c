@@ -187,56 +187,218 @@ static alpm_list_t *mount_point_list(alpm_handle_t *handle)
 	return mount_points;
 }
 
-static alpm_mountpoint_t *match_mount_point(const alpm_list_t *mount_points,
-		const char *real_path)
+/* mount points are kept in a tree of path components so a lookup costs one
+ * step per component of the path instead of a comparison per mount point */
+struct mount_point_node {
+	char *name;
+	size_t name_len;
+	alpm_mountpoint_t *mp;
+	alpm_list_t *children;
+};
+
+/* position of a partial walk through the mount point tree */
+struct mount_point_match {
+	/* deepest node matched so far, NULL once the path has left the tree */
+	const struct mount_point_node *node;
+	/* mount point the path walked so far belongs to */
+	alpm_mountpoint_t *mp;
+};
+
+static void mount_point_tree_free(struct mount_point_node *node)
+{
+	alpm_list_t *i;
+
+	if(node == NULL) {
+		return;
+	}
+	for(i = node->children; i; i = i->next) {
+		mount_point_tree_free(i->data);
+	}
+	alpm_list_free(node->children);
+	FREE(node->name);
+	free(node);
+}
+
+static struct mount_point_node *mount_point_child(const struct mount_point_node *node,
+		const char *name, size_t name_len)
 {
-	const alpm_list_t *mp;
-
-	for(mp = mount_points; mp != NULL; mp = mp->next) {
-		alpm_mountpoint_t *data = mp->data;
-
-		/* first, check if the prefix matches */
-		if(strncmp(data->mount_dir, real_path, data->mount_dir_len) == 0) {
-			/* now, the hard work- a file like '/etc/myconfig' shouldn't map to a
-			 * mountpoint '/e', but only '/etc'. If the mountpoint ends in a trailing
-			 * slash, we know we didn't have a mismatch, otherwise we have to do some
-			 * more sanity checks. */
-			if(data->mount_dir[data->mount_dir_len - 1] == '/') {
-				return data;
-			} else if(strlen(real_path) >= data->mount_dir_len) {
-				const char next = real_path[data->mount_dir_len];
-				if(next == '/' || next == '\0') {
-					return data;
-				}
+	const alpm_list_t *i;
+
+	for(i = node->children; i; i = i->next) {
+		struct mount_point_node *child = i->data;
+		if(child->name_len == name_len && memcmp(child->name, name, name_len) == 0) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+static struct mount_point_node *mount_point_tree_new(alpm_handle_t *handle,
+		const alpm_list_t *mount_points)
+{
+	const alpm_list_t *i;
+	struct mount_point_node *tree;
+
+	CALLOC(tree, 1, sizeof(struct mount_point_node),
+			RET_ERR(handle, ALPM_ERR_MEMORY, NULL));
+
+	for(i = mount_points; i; i = i->next) {
+		alpm_mountpoint_t *data = i->data;
+		struct mount_point_node *node = tree;
+		const char *p = data->mount_dir;
+
+		/* anything else could never prefix an absolute path */
+		if(p[0] != '/') {
+			continue;
+		}
+
+		while(*p) {
+			struct mount_point_node *child;
+			size_t len;
+
+			if(*p == '/') {
+				p++;
+				continue;
 			}
+			len = strcspn(p, "/");
+			child = mount_point_child(node, p, len);
+			if(child == NULL) {
+				CALLOC(child, 1, sizeof(struct mount_point_node), goto error);
+				STRNDUP(child->name, p, len, free(child); goto error);
+				child->name_len = len;
+				node->children = alpm_list_add(node->children, child);
+			}
+			node = child;
+			p += len;
+		}
+
+		/* the same directory may be mounted more than once; like the sorted
+		 * list walk did, the first one listed wins */
+		if(node->mp == NULL) {
+			node->mp = data;
 		}
 	}
 
-	/* should not get here... */
-	return NULL;
+	return tree;
+
+error:
+	mount_point_tree_free(tree);
+	RET_ERR(handle, ALPM_ERR_MEMORY, NULL);
+}
+
+/* continue a walk through the mount point tree over the components of the
+ * first len bytes of path */
+static void mount_point_walk(struct mount_point_match *match,
+		const char *path, size_t len)
+{
+	const char *end = path + len;
+
+	while(match->node && path < end) {
+		const char *slash;
+		size_t n;
+
+		if(*path == '/') {
+			path++;
+			continue;
+		}
+		slash = memchr(path, '/', end - path);
+		n = slash ? (size_t)(slash - path) : (size_t)(end - path);
+		match->node = mount_point_child(match->node, path, n);
+		if(match->node && match->node->mp) {
+			match->mp = match->node->mp;
+		}
+		path += n;
+	}
+}
+
+static alpm_mountpoint_t *match_mount_point(const struct mount_point_node *tree,
+		const char *real_path)
+{
+	struct mount_point_match match;
+
+	if(real_path[0] != '/') {
+		return NULL;
+	}
+	match.node = tree;
+	match.mp = tree->mp;
+	mount_point_walk(&match, real_path, strlen(real_path));
+	return match.mp;
+}
+
+/* Package file lists are sorted, so consecutive files usually share a
+ * directory; the walk up to the last directory looked up is kept around and
+ * reused until the directory changes. */
+struct mount_point_cache {
+	struct mount_point_match root;
+	struct mount_point_match dir;
+	const char *dirname;
+	size_t dirname_len;
+};
+
+static void mount_point_cache_init(struct mount_point_cache *cache,
+		const struct mount_point_match *rootmatch)
+{
+	cache->root = *rootmatch;
+	cache->dirname = NULL;
+	cache->dirname_len = 0;
+}
+
+/* resolve the mount point of a file given relative to the root */
+static alpm_mountpoint_t *match_file_mount_point(struct mount_point_cache *cache,
+		const char *filename)
+{
+	struct mount_point_match match;
+	const char *slash = strrchr(filename, '/');
+	size_t dirlen = slash ? (size_t)(slash - filename) + 1 : 0;
+
+	if(cache->dirname == NULL || dirlen != cache->dirname_len
+			|| memcmp(filename, cache->dirname, dirlen) != 0) {
+		cache->dir = cache->root;
+		mount_point_walk(&cache->dir, filename, dirlen);
+		cache->dirname = filename;
+		cache->dirname_len = dirlen;
+	}
+
+	/* the last component can still be a mount point of its own as long as
+	 * the directory did not leave the tree */
+	match = cache->dir;
+	mount_point_walk(&match, filename + dirlen, strlen(filename + dirlen));
+	return match.mp;
 }
 
 static int calculate_removed_size(alpm_handle_t *handle,
-		const alpm_list_t *mount_points, alpm_pkg_t *pkg)
+		const struct mount_point_match *rootmatch, alpm_pkg_t *pkg)
 {
 	size_t i;
 	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	const char **paths;
+	struct llstat_result *results;
+	struct mount_point_cache cache;
 
 	if(!filelist->count) {
 		return 0;
 	}
 
+	MALLOC(paths, filelist->count * sizeof(char *),
+			RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	MALLOC(results, filelist->count * sizeof(struct llstat_result),
+			free(paths); RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	for(i = 0; i < filelist->count; i++) {
+		paths[i] = filelist->files[i].name;
+	}
+	llstat_many(handle->root, paths, filelist->count, results,
+			handle->worker_threads);
+	free(paths);
+
+	mount_point_cache_init(&cache, rootmatch);
 	for(i = 0; i < filelist->count; i++) {
 		const alpm_file_t *file = filelist->files + i;
 		alpm_mountpoint_t *mp;
-		struct stat st;
-		char path[PATH_MAX];
+		struct stat *st = &results[i].st;
 		blkcnt_t remove_size;
 		const char *filename = file->name;
 
-		snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
-
-		if(llstat(path, &st) == -1) {
+		if(results[i].err != 0) {
 			if(alpm_option_match_noextract(handle, filename)) {
 				_alpm_log(handle, ALPM_LOG_WARNING,
 						_("could not get file information for %s\n"), filename);
@@ -246,11 +408,11 @@ static int calculate_removed_size(alpm_handle_t *handle,
 
 		/* skip directories and symlinks to be consistent with libarchive that
 		 * reports them to be zero size */
-		if(S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)) {
+		if(S_ISDIR(st->st_mode) || S_ISLNK(st->st_mode)) {
 			continue;
 		}
 
-		mp = match_mount_point(mount_points, path);
+		mp = match_file_mount_point(&cache, filename);
 		if(mp == NULL) {
 			_alpm_log(handle, ALPM_LOG_WARNING,
 					_("could not determine mount point for file %s\n"), filename);
@@ -270,28 +432,33 @@ static int calculate_removed_size(alpm_handle_t *handle,
 		}
 
 		/* the addition of (divisor - 1) performs ceil() with integer division */
-		remove_size = (st.st_size + mp->fsp.f_bsize - 1) / mp->fsp.f_bsize;
+		remove_size = (st->st_size + mp->fsp.f_bsize - 1) / mp->fsp.f_bsize;
 		mp->blocks_needed -= remove_size;
 		mp->used |= USED_REMOVE;
 	}
+	free(results);
 
 	return 0;
 }
 
+/* staged_mp is where the files of a staged package were extracted to; those
+ * files take up their space already and are only moved into place */
 static int calculate_installed_size(alpm_handle_t *handle,
-		const alpm_list_t *mount_points, alpm_pkg_t *pkg)
+		const struct mount_point_match *rootmatch, alpm_pkg_t *pkg,
+		alpm_mountpoint_t *staged_mp)
 {
 	size_t i;
 	alpm_filelist_t *filelist = alpm_pkg_get_files(pkg);
+	struct mount_point_cache cache;
 
 	if(!filelist->count) {
 		return 0;
 	}
 
+	mount_point_cache_init(&cache, rootmatch);
 	for(i = 0; i < filelist->count; i++) {
 		const alpm_file_t *file = filelist->files + i;
 		alpm_mountpoint_t *mp;
-		char path[PATH_MAX];
 		blkcnt_t install_size;
 		const char *filename = file->name;
 
@@ -307,9 +474,7 @@ static int calculate_installed_size(alpm_handle_t *handle,
 			filename = handle->dbpath;
 		}
 
-		snprintf(path, PATH_MAX, "%s%s", handle->root, filename);
-
-		mp = match_mount_point(mount_points, path);
+		mp = match_file_mount_point(&cache, filename);
 		if(mp == NULL) {
 			_alpm_log(handle, ALPM_LOG_WARNING,
 					_("could not determine mount point for file %s\n"), filename);
@@ -321,6 +486,10 @@ static int calculate_installed_size(alpm_handle_t *handle,
 			continue;
 		}
 
+		if(mp == staged_mp) {
+			continue;
+		}
+
 		/* lazy load filesystem info */
 		if(mp->fsinfo_loaded == MOUNT_FSINFO_UNLOADED) {
 			if(mount_point_load_fsinfo(handle, mp) < 0) {
@@ -358,11 +527,39 @@ static int check_mountpoint(alpm_handle_t *handle, alpm_mountpoint_t *mp)
 	return 0;
 }
 
+/* the mount point of a directory, with its filesystem info loaded */
+static alpm_mountpoint_t *match_dir_mount_point(alpm_handle_t *handle,
+		const struct mount_point_node *tree, const char *dir)
+{
+	alpm_mountpoint_t *mp;
+	char resolved_dir[PATH_MAX];
+
+	if(realpath(dir, resolved_dir) != NULL) {
+		dir = resolved_dir;
+	}
+	mp = match_mount_point(tree, dir);
+	if(mp == NULL) {
+		_alpm_log(handle, ALPM_LOG_ERROR,
+				_("could not determine mount point for file %s\n"), dir);
+		return NULL;
+	}
+	if(mp->fsinfo_loaded == MOUNT_FSINFO_UNLOADED) {
+		if(mount_point_load_fsinfo(handle, mp)) {
+			return NULL;
+		}
+	}
+	return mp;
+}
+
+/* Check that num_files downloads of the given sizes fit into cachedir, and
+ * if stagedir is set, that stage_size bytes of staged files fit there as
+ * well. */
 int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
-		size_t num_files, off_t *file_sizes)
+		size_t num_files, off_t *file_sizes, const char *stagedir, off_t stage_size)
 {
 	alpm_list_t *mount_points;
-	alpm_mountpoint_t *cachedir_mp;
+	struct mount_point_node *tree;
+	alpm_mountpoint_t *cachedir_mp, *stagedir_mp = NULL;
 	char resolved_cachedir[PATH_MAX];
 	size_t j;
 	int error = 0;
@@ -380,7 +577,13 @@ int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
 		return -1;
 	}
 
-	cachedir_mp = match_mount_point(mount_points, cachedir);
+	tree = mount_point_tree_new(handle, mount_points);
+	if(tree == NULL) {
+		mount_point_list_free(mount_points);
+		return -1;
+	}
+
+	cachedir_mp = match_mount_point(tree, cachedir);
 	if(cachedir_mp == NULL) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine cachedir mount point %s\n"),
 				cachedir);
@@ -404,11 +607,26 @@ int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
 			cachedir_mp->fsp.f_bsize;
 	}
 
+	if(stagedir) {
+		stagedir_mp = match_dir_mount_point(handle, tree, stagedir);
+		if(stagedir_mp == NULL) {
+			error = 1;
+			goto finish;
+		}
+		stagedir_mp->max_blocks_needed += (stage_size + stagedir_mp->fsp.f_bsize - 1) /
+			stagedir_mp->fsp.f_bsize;
+	}
+
 	if(check_mountpoint(handle, cachedir_mp)) {
 		error = 1;
 	}
+	if(stagedir_mp && stagedir_mp != cachedir_mp
+			&& check_mountpoint(handle, stagedir_mp)) {
+		error = 1;
+	}
 
 finish:
+	mount_point_tree_free(tree);
 	mount_point_list_free(mount_points);
 
 	if(error) {
@@ -421,7 +639,10 @@ finish:
 int _alpm_check_diskspace(alpm_handle_t *handle)
 {
 	alpm_list_t *mount_points, *i;
-	alpm_mountpoint_t *root_mp;
+	struct mount_point_node *tree;
+	struct mount_point_match rootmatch;
+	alpm_mountpoint_t *stage_mp;
+	char resolved_dbpath[PATH_MAX];
 	size_t replaces = 0, current = 0, numtargs;
 	int error = 0;
 	alpm_list_t *targ;
@@ -433,13 +654,22 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine filesystem mount points\n"));
 		return -1;
 	}
-	root_mp = match_mount_point(mount_points, handle->root);
-	if(root_mp == NULL) {
+	tree = mount_point_tree_new(handle, mount_points);
+	if(tree == NULL) {
+		mount_point_list_free(mount_points);
+		return -1;
+	}
+	rootmatch.node = tree;
+	rootmatch.mp = tree->mp;
+	mount_point_walk(&rootmatch, handle->root, strlen(handle->root));
+	if(handle->root[0] != '/' || rootmatch.mp == NULL) {
 		_alpm_log(handle, ALPM_LOG_ERROR, _("could not determine root mount point %s\n"),
 				handle->root);
 		error = 1;
 		goto finish;
 	}
+	stage_mp = match_mount_point(tree, realpath(handle->dbpath, resolved_dbpath)
+			? resolved_dbpath : handle->dbpath);
 
 	replaces = alpm_list_count(trans->remove);
 	if(replaces) {
@@ -451,7 +681,7 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 					numtargs, current);
 
 			local_pkg = targ->data;
-			calculate_removed_size(handle, mount_points, local_pkg);
+			calculate_removed_size(handle, &rootmatch, local_pkg);
 		}
 	}
 
@@ -465,9 +695,10 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 		/* is this package already installed? */
 		local_pkg = _alpm_db_get_pkgfromcache(handle->db_local, pkg->name);
 		if(local_pkg) {
-			calculate_removed_size(handle, mount_points, local_pkg);
+			calculate_removed_size(handle, &rootmatch, local_pkg);
 		}
-		calculate_installed_size(handle, mount_points, pkg);
+		calculate_installed_size(handle, &rootmatch, pkg,
+				pkg->stage ? stage_mp : NULL);
 
 		for(i = mount_points; i; i = i->next) {
 			alpm_mountpoint_t *data = i->data;
@@ -492,6 +723,7 @@ int _alpm_check_diskspace(alpm_handle_t *handle)
 	}
 
 finish:
+	mount_point_tree_free(tree);
 	mount_point_list_free(mount_points);
 
 	if(error) {
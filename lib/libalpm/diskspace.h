@@ -58,6 +58,6 @@ typedef struct __alpm_mountpoint_t {
 
 int _alpm_check_diskspace(alpm_handle_t *handle);
 int _alpm_check_downloadspace(alpm_handle_t *handle, const char *cachedir,
-		size_t num_files, off_t *file_sizes);
+		size_t num_files, off_t *file_sizes, const char *stagedir, off_t stage_size);
 
 #endif /* ALPM_DISKSPACE_H */
@@ -20,9 +20,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h> /* setsockopt, SO_KEEPALIVE */
 #include <sys/time.h>
 #include <sys/types.h>
@@ -48,6 +50,45 @@
 #include "util.h"
 #include "handle.h"
 
+/* servers tried once each before the fastest one is preferred */
+#define SERVER_PROBES 3
+/* transfers a server that failed is tried last for, per failure in a row,
+ * and the most it can be held back */
+#define SERVER_PENALTY 4
+#define SERVER_PENALTY_MAX 32
+
+/* how transfers from a server went over the life of a handle */
+struct server_stats {
+	char *url;
+	/* totals over the successful transfers that moved data */
+	double bytes;
+	double seconds;
+	/* failed transfers since the last successful one */
+	unsigned int failures;
+	/* rankings left before a failed server is tried in turn again */
+	unsigned int penalty;
+};
+
+static void server_stats_free(struct server_stats *stats)
+{
+	free(stats->url);
+	free(stats);
+}
+
+static struct server_stats *find_server_stats(alpm_handle_t *handle,
+		const char *url)
+{
+	alpm_list_t *i;
+
+	for(i = handle->server_stats; i; i = i->next) {
+		struct server_stats *stats = i->data;
+		if(strcmp(stats->url, url) == 0) {
+			return stats;
+		}
+	}
+	return NULL;
+}
+
 #ifdef HAVE_LIBCURL
 static const char *get_filename(const char *url)
 {
@@ -79,15 +120,10 @@ static CURL *get_libcurl_handle(alpm_handle_t *handle)
 	return handle->curl;
 }
 
-enum {
-	ABORT_SIGINT = 1,
-	ABORT_OVER_MAXFILESIZE
-};
-
 static int dload_interrupted;
 static void inthandler(int UNUSED signum)
 {
-	dload_interrupted = ABORT_SIGINT;
+	dload_interrupted = 1;
 }
 
 static int dload_progress_cb(void *file, curl_off_t dltotal, curl_off_t dlnow,
@@ -110,7 +146,7 @@ static int dload_progress_cb(void *file, curl_off_t dltotal, curl_off_t dlnow,
 
 	/* is our filesize still under any set limit? */
 	if(payload->max_size && current_size > payload->max_size) {
-		dload_interrupted = ABORT_OVER_MAXFILESIZE;
+		payload->size_exceeded = 1;
 		return 1;
 	}
 
@@ -125,6 +161,14 @@ static int dload_progress_cb(void *file, curl_off_t dltotal, curl_off_t dlnow,
 		return 0;
 	}
 
+	if(payload->progress_held) {
+		/* keep the latest numbers to replay once it is our turn */
+		payload->held_dlnow = dlnow;
+		payload->held_dltotal = dltotal;
+		payload->prevprogress = current_size;
+		return 0;
+	}
+
 	/* initialize the progress bar here to avoid displaying it when
 	 * a repo is up to date and nothing gets downloaded.
 	 * payload->handle->dlcb will receive the remote_name
@@ -204,8 +248,12 @@ static int utimes_long(const char *path, long seconds)
 /* prefix to avoid possible future clash with getumask(3) */
 static mode_t _getumask(void)
 {
-	mode_t mask = umask(0);
+	mode_t mask;
+
+	_alpm_umask_lock();
+	mask = umask(0);
 	umask(mask);
+	_alpm_umask_unlock();
 	return mask;
 }
 
@@ -215,6 +263,7 @@ static size_t dload_parseheader_cb(void *ptr, size_t size, size_t nmemb, void *u
 	const char *fptr, *endptr = NULL;
 	const char * const cd_header = "Content-Disposition:";
 	const char * const fn_key = "filename=";
+	const char * const etag_header = "ETag:";
 	struct dload_payload *payload = (struct dload_payload *)user;
 	long respcode;
 
@@ -236,9 +285,25 @@ static size_t dload_parseheader_cb(void *ptr, size_t size, size_t nmemb, void *u
 			STRNDUP(payload->content_disp_name, fptr, endptr - fptr + 1,
 					RET_ERR(payload->handle, ALPM_ERR_MEMORY, realsize));
 		}
+	} else if(payload->etag_path
+			&& _alpm_raw_ncmp(etag_header, ptr, strlen(etag_header)) == 0) {
+		/* the tag is kept as sent, quotes and weakness prefix included */
+		fptr = (const char *)ptr + strlen(etag_header);
+		endptr = (const char *)ptr + realsize;
+		while(fptr < endptr && (*fptr == ' ' || *fptr == '\t')) {
+			fptr++;
+		}
+		while(endptr > fptr && isspace((unsigned char)endptr[-1])) {
+			endptr--;
+		}
+		FREE(payload->etag);
+		if(endptr > fptr) {
+			STRNDUP(payload->etag, fptr, endptr - fptr,
+					RET_ERR(payload->handle, ALPM_ERR_MEMORY, realsize));
+		}
 	}
 
-	curl_easy_getinfo(payload->handle->curl, CURLINFO_RESPONSE_CODE, &respcode);
+	curl_easy_getinfo(payload->curl, CURLINFO_RESPONSE_CODE, &respcode);
 	if(payload->respcode != respcode) {
 		payload->respcode = respcode;
 	}
@@ -246,37 +311,107 @@ static size_t dload_parseheader_cb(void *ptr, size_t size, size_t nmemb, void *u
 	return realsize;
 }
 
-static void curl_set_handle_opts(struct dload_payload *payload,
-		CURL *curl, char *error_buffer)
+static size_t dload_write_cb(char *ptr, size_t size, size_t nmemb, void *user)
+{
+	struct dload_payload *payload = (struct dload_payload *)user;
+	size_t written = fwrite(ptr, 1, size * nmemb, payload->localf);
+
+	_alpm_digest_update(payload->digest, ptr, written);
+	return written;
+}
+
+/* options shared by whole-file and segmented transfers */
+static void curl_set_common_opts(alpm_handle_t *handle, CURL *curl,
+		const char *url, char *error_buffer)
 {
-	alpm_handle_t *handle = payload->handle;
 	const char *useragent = getenv("HTTP_USER_AGENT");
-	struct stat st;
 
 	/* the curl_easy handle is initialized with the alpm handle, so we only need
 	 * to reset the handle's parameters for each time it's used. */
 	curl_easy_reset(curl);
-	curl_easy_setopt(curl, CURLOPT_URL, payload->fileurl);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_buffer);
 	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
-	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
-	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, dload_progress_cb);
-	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)payload);
 	if(!handle->disable_dl_timeout) {
 		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
 		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
 	}
-	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dload_parseheader_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)payload);
 	curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 	curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
 	curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 60L);
 	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_ANY);
 
-	_alpm_log(handle, ALPM_LOG_DEBUG, "url: %s\n", payload->fileurl);
+	if(useragent != NULL) {
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
+	}
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "url: %s\n", url);
+}
+
+/* read the entity tag stored for a file, NULL if there is none */
+static char *etag_read(const char *path)
+{
+	char line[PATH_MAX];
+	char *etag = NULL;
+	size_t len;
+	FILE *fp = fopen(path, "r");
+
+	if(fp == NULL) {
+		return NULL;
+	}
+	if(fgets(line, sizeof(line), fp) != NULL) {
+		len = _alpm_strip_newline(line, 0);
+		if(len > 0) {
+			etag = strdup(line);
+		}
+	}
+	fclose(fp);
+	return etag;
+}
+
+/* remember the entity tag the server sent with a file, or forget the one
+ * stored for the previous version if it sent none */
+static void etag_write(alpm_handle_t *handle, const char *path, const char *etag)
+{
+	FILE *fp;
+	int err;
+
+	if(etag == NULL) {
+		unlink(path);
+		return;
+	}
+	fp = fopen(path, "w");
+	if(fp == NULL) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not open %s: %s\n",
+				path, strerror(errno));
+		/* the stored tag belongs to the previous version */
+		unlink(path);
+		return;
+	}
+	err = fprintf(fp, "%s\n", etag) < 0;
+	err = fclose(fp) != 0 || err;
+	if(err) {
+		/* a partial tag would never match, there is no use sending it */
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write %s\n", path);
+		unlink(path);
+	}
+}
+
+static void curl_set_handle_opts(struct dload_payload *payload,
+		CURL *curl, char *error_buffer)
+{
+	alpm_handle_t *handle = payload->handle;
+	struct stat st;
+
+	curl_set_common_opts(handle, curl, payload->fileurl, error_buffer);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, dload_progress_cb);
+	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)payload);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dload_parseheader_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)payload);
 
 	if(payload->max_size) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "maxsize: %jd\n",
@@ -285,10 +420,6 @@ static void curl_set_handle_opts(struct dload_payload *payload,
 				(curl_off_t)payload->max_size);
 	}
 
-	if(useragent != NULL) {
-		curl_easy_setopt(curl, CURLOPT_USERAGENT, useragent);
-	}
-
 	if(!payload->allow_resume && !payload->force && payload->destfile_name &&
 			stat(payload->destfile_name, &st) == 0) {
 		/* start from scratch, but only download if our local is out of date. */
@@ -296,6 +427,27 @@ static void curl_set_handle_opts(struct dload_payload *payload,
 		curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)st.st_mtime);
 		_alpm_log(handle, ALPM_LOG_DEBUG,
 				"using time condition: %ld\n", (long)st.st_mtime);
+
+		/* servers that honor the tag answer If-None-Match over the time */
+		if(payload->etag_path) {
+			char *etag = etag_read(payload->etag_path);
+			if(etag) {
+				size_t len = strlen(etag) + 16;
+				char *header = malloc(len);
+				if(header) {
+					struct curl_slist *headers;
+					snprintf(header, len, "If-None-Match: %s", etag);
+					headers = curl_slist_append(payload->headers, header);
+					if(headers) {
+						payload->headers = headers;
+						curl_easy_setopt(curl, CURLOPT_HTTPHEADER, payload->headers);
+						_alpm_log(handle, ALPM_LOG_DEBUG, "using entity tag: %s\n", etag);
+					}
+					free(header);
+				}
+				free(etag);
+			}
+		}
 	} else if(stat(payload->tempfile_name, &st) == 0 && payload->allow_resume) {
 		/* a previous partial download exists, resume from end of file. */
 		payload->tempfile_openmode = "ab";
@@ -359,29 +511,25 @@ static FILE *create_tempfile(struct dload_payload *payload, const char *localpat
 /* RFC1123 states applications should support this length */
 #define HOSTNAME_SIZE 256
 
-static int curl_download_internal(struct dload_payload *payload,
-		const char *localpath, char **final_file, const char **final_url)
+/* set up payload->curl for a transfer and open the file it writes to */
+static int curl_prepare_download(struct dload_payload *payload,
+		const char *localpath)
 {
-	int ret = -1;
-	FILE *localf = NULL;
-	char *effective_url;
-	char hostname[HOSTNAME_SIZE];
-	char error_buffer[CURL_ERROR_SIZE] = {0};
-	struct stat st;
-	long timecond, remote_time = -1;
-	double remote_size, bytes_dl;
-	struct sigaction orig_sig_pipe, orig_sig_int;
-	/* shortcut to our handle within the payload */
 	alpm_handle_t *handle = payload->handle;
-	CURL *curl = get_libcurl_handle(handle);
-	handle->pm_errno = ALPM_ERR_OK;
+	char hostname[HOSTNAME_SIZE];
 
 	/* make sure these are NULL */
 	FREE(payload->tempfile_name);
 	FREE(payload->destfile_name);
 	FREE(payload->content_disp_name);
+	FREE(payload->etag);
+	curl_slist_free_all(payload->headers);
+	payload->headers = NULL;
 
 	payload->tempfile_openmode = "wb";
+	payload->localf = NULL;
+	payload->size_exceeded = 0;
+	payload->error_buffer[0] = '\0';
 	if(!payload->remote_name) {
 		STRDUP(payload->remote_name, get_filename(payload->fileurl),
 				RET_ERR(handle, ALPM_ERR_MEMORY, -1));
@@ -396,29 +544,29 @@ static int curl_download_internal(struct dload_payload *payload,
 		payload->destfile_name = get_fullpath(localpath, payload->remote_name, "");
 		payload->tempfile_name = get_fullpath(localpath, payload->remote_name, ".part");
 		if(!payload->destfile_name || !payload->tempfile_name) {
-			goto cleanup;
+			return -1;
 		}
 	} else {
 		/* URL doesn't contain a filename, so make a tempfile. We can't support
 		 * resuming this kind of download; partial transfers will be destroyed */
 		payload->unlink_on_fail = 1;
 
-		localf = create_tempfile(payload, localpath);
-		if(localf == NULL) {
-			goto cleanup;
+		payload->localf = create_tempfile(payload, localpath);
+		if(payload->localf == NULL) {
+			return -1;
 		}
 	}
 
-	curl_set_handle_opts(payload, curl, error_buffer);
+	curl_set_handle_opts(payload, payload->curl, payload->error_buffer);
 
-	if(localf == NULL) {
-		localf = fopen(payload->tempfile_name, payload->tempfile_openmode);
-		if(localf == NULL) {
+	if(payload->localf == NULL) {
+		payload->localf = fopen(payload->tempfile_name, payload->tempfile_openmode);
+		if(payload->localf == NULL) {
 			handle->pm_errno = ALPM_ERR_RETRIEVE;
 			_alpm_log(handle, ALPM_LOG_ERROR,
 					_("could not open file %s: %s\n"),
 					payload->tempfile_name, strerror(errno));
-			goto cleanup;
+			return -1;
 		}
 	}
 
@@ -426,16 +574,85 @@ static int curl_download_internal(struct dload_payload *payload,
 			"opened tempfile for download: %s (%s)\n", payload->tempfile_name,
 			payload->tempfile_openmode);
 
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, localf);
+	FREE(payload->digest);
+	FREE(payload->md5sum);
+	FREE(payload->sha256sum);
+	if(payload->want_digests) {
+		payload->digest = _alpm_digest_new();
+		/* a resumed download only brings the rest of the file */
+		if(payload->digest && payload->initial_size > 0 &&
+				_alpm_digest_update_file(payload->digest, payload->tempfile_name) != 0) {
+			FREE(payload->digest);
+		}
+	}
 
-	/* Ignore any SIGPIPE signals. With libcurl, these shouldn't be happening,
-	 * but better safe than sorry. Store the old signal handler first. */
-	mask_signal(SIGPIPE, SIG_IGN, &orig_sig_pipe);
-	dload_interrupted = 0;
-	mask_signal(SIGINT, &inthandler, &orig_sig_int);
+	if(payload->digest) {
+		curl_easy_setopt(payload->curl, CURLOPT_WRITEFUNCTION, dload_write_cb);
+		curl_easy_setopt(payload->curl, CURLOPT_WRITEDATA, (void *)payload);
+	} else {
+		curl_easy_setopt(payload->curl, CURLOPT_WRITEDATA, payload->localf);
+	}
+
+	return 0;
+}
+
+static void record_server_stats(alpm_handle_t *handle, const char *url,
+		CURL *curl, int success)
+{
+	struct server_stats *stats;
+
+	/* says nothing about the server */
+	if(dload_interrupted) {
+		return;
+	}
+
+	stats = find_server_stats(handle, url);
+	if(stats == NULL) {
+		CALLOC(stats, 1, sizeof(struct server_stats), return);
+		STRDUP(stats->url, url, free(stats); return);
+		if(alpm_list_append(&handle->server_stats, stats) == NULL) {
+			server_stats_free(stats);
+			return;
+		}
+	}
+
+	if(success) {
+		double bytes_dl = 0, total_time = 0;
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &bytes_dl);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+		stats->failures = 0;
+		stats->penalty = 0;
+		if(bytes_dl > 0) {
+			stats->bytes += bytes_dl;
+			stats->seconds += total_time;
+		}
+	} else {
+		/* a mirror missing one file may still serve the others, so the
+		 * penalty runs out and grows only while the failures continue */
+		stats->failures++;
+		if(stats->failures > SERVER_PENALTY_MAX / SERVER_PENALTY) {
+			stats->penalty = SERVER_PENALTY_MAX;
+		} else {
+			stats->penalty = SERVER_PENALTY * stats->failures;
+		}
+	}
+}
+
+/* check the result of the transfer in payload->curlerr and move the file
+ * into place */
+static int curl_finish_download(struct dload_payload *payload,
+		const char *localpath, char **final_file, const char **final_url)
+{
+	int ret = -1;
+	char *effective_url;
+	char hostname[HOSTNAME_SIZE];
+	struct stat st;
+	long timecond, remote_time = -1;
+	double remote_size, bytes_dl;
+	/* shortcut to our handle within the payload */
+	alpm_handle_t *handle = payload->handle;
+	CURL *curl = payload->curl;
 
-	/* perform transfer */
-	payload->curlerr = curl_easy_perform(curl);
 	_alpm_log(handle, ALPM_LOG_DEBUG, "curl returned error %d from transfer\n",
 			payload->curlerr);
 
@@ -445,6 +662,9 @@ static int curl_download_internal(struct dload_payload *payload,
 	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, (char *)NULL);
 
+	/* the url was checked before the transfer started */
+	curl_gethost(payload->fileurl, hostname, sizeof(hostname));
+
 	/* was it a success? */
 	switch(payload->curlerr) {
 		case CURLE_OK:
@@ -454,18 +674,18 @@ static int curl_download_internal(struct dload_payload *payload,
 				payload->unlink_on_fail = 1;
 				if(!payload->errors_ok) {
 					/* non-translated message is same as libcurl */
-					snprintf(error_buffer, sizeof(error_buffer),
+					snprintf(payload->error_buffer, sizeof(payload->error_buffer),
 							"The requested URL returned error: %ld", payload->respcode);
 					_alpm_log(handle, ALPM_LOG_ERROR,
 							_("failed retrieving file '%s' from %s : %s\n"),
-							payload->remote_name, hostname, error_buffer);
+							payload->remote_name, hostname, payload->error_buffer);
 				}
 				goto cleanup;
 			}
 			break;
 		case CURLE_ABORTED_BY_CALLBACK:
 			/* handle the interrupt accordingly */
-			if(dload_interrupted == ABORT_OVER_MAXFILESIZE) {
+			if(payload->size_exceeded) {
 				payload->curlerr = CURLE_FILESIZE_EXCEEDED;
 				payload->unlink_on_fail = 1;
 				handle->pm_errno = ALPM_ERR_LIBCURL;
@@ -479,22 +699,22 @@ static int curl_download_internal(struct dload_payload *payload,
 			handle->pm_errno = ALPM_ERR_SERVER_BAD_URL;
 			_alpm_log(handle, ALPM_LOG_ERROR,
 					_("failed retrieving file '%s' from %s : %s\n"),
-					payload->remote_name, hostname, error_buffer);
+					payload->remote_name, hostname, payload->error_buffer);
 			goto cleanup;
 		default:
 			/* delete zero length downloads */
-			if(fstat(fileno(localf), &st) == 0 && st.st_size == 0) {
+			if(fstat(fileno(payload->localf), &st) == 0 && st.st_size == 0) {
 				payload->unlink_on_fail = 1;
 			}
 			if(!payload->errors_ok) {
 				handle->pm_errno = ALPM_ERR_LIBCURL;
 				_alpm_log(handle, ALPM_LOG_ERROR,
 						_("failed retrieving file '%s' from %s : %s\n"),
-						payload->remote_name, hostname, error_buffer);
+						payload->remote_name, hostname, payload->error_buffer);
 			} else {
 				_alpm_log(handle, ALPM_LOG_DEBUG,
 						"failed retrieving file '%s' from %s : %s\n",
-						payload->remote_name, hostname, error_buffer);
+						payload->remote_name, hostname, payload->error_buffer);
 			}
 			goto cleanup;
 	}
@@ -510,9 +730,10 @@ static int curl_download_internal(struct dload_payload *payload,
 		*final_url = effective_url;
 	}
 
-	/* time condition was met and we didn't download anything. we need to
-	 * clean up the 0 byte .part file that's left behind. */
-	if(timecond == 1 && DOUBLE_EQ(bytes_dl, 0)) {
+	/* time condition was met, or the entity tag still matches, and we didn't
+	 * download anything. we need to clean up the 0 byte .part file that's left
+	 * behind. */
+	if((timecond == 1 || payload->respcode == 304) && DOUBLE_EQ(bytes_dl, 0)) {
 		_alpm_log(handle, ALPM_LOG_DEBUG, "file met time condition\n");
 		ret = 1;
 		unlink(payload->tempfile_name);
@@ -556,11 +777,26 @@ static int curl_download_internal(struct dload_payload *payload,
 	ret = 0;
 
 cleanup:
-	if(localf != NULL) {
-		fclose(localf);
+	if(payload->localf != NULL) {
+		if(fclose(payload->localf) != 0 && ret == 0) {
+			handle->pm_errno = ALPM_ERR_RETRIEVE;
+			_alpm_log(handle, ALPM_LOG_ERROR, _("could not write to file %s: %s\n"),
+					payload->tempfile_name, strerror(errno));
+			ret = -1;
+		}
+		payload->localf = NULL;
 		utimes_long(payload->tempfile_name, remote_time);
 	}
 
+	if(payload->digest) {
+		if(ret == 0) {
+			_alpm_digest_finish(payload->digest, &payload->md5sum, &payload->sha256sum);
+		} else {
+			free(payload->digest);
+		}
+		payload->digest = NULL;
+	}
+
 	if(ret == 0) {
 		const char *realname = payload->tempfile_name;
 		if(payload->destfile_name) {
@@ -571,6 +807,9 @@ cleanup:
 				ret = -1;
 			}
 		}
+		if(ret != -1 && payload->etag_path) {
+			etag_write(handle, payload->etag_path, payload->etag);
+		}
 		if(ret != -1 && final_file) {
 			STRDUP(*final_file, strrchr(realname, '/') + 1,
 					RET_ERR(handle, ALPM_ERR_MEMORY, -1));
@@ -582,16 +821,840 @@ cleanup:
 		unlink(payload->tempfile_name);
 	}
 
+	/* a missing optional file is not the server's fault */
+	if(payload->server && (ret != -1 || !payload->errors_ok)) {
+		record_server_stats(handle, payload->server->data, curl, ret != -1);
+	}
+
+	return ret;
+}
+
+static int curl_download_internal(struct dload_payload *payload,
+		const char *localpath, char **final_file, const char **final_url)
+{
+	int ret;
+	struct sigaction orig_sig_pipe, orig_sig_int;
+	/* shortcut to our handle within the payload */
+	alpm_handle_t *handle = payload->handle;
+
+	handle->pm_errno = ALPM_ERR_OK;
+	payload->curl = get_libcurl_handle(handle);
+
+	if(curl_prepare_download(payload, localpath) != 0) {
+		if(payload->localf != NULL) {
+			fclose(payload->localf);
+			payload->localf = NULL;
+		}
+		return -1;
+	}
+
+	/* Ignore any SIGPIPE signals. With libcurl, these shouldn't be happening,
+	 * but better safe than sorry. Store the old signal handler first. */
+	mask_signal(SIGPIPE, SIG_IGN, &orig_sig_pipe);
+	dload_interrupted = 0;
+	mask_signal(SIGINT, &inthandler, &orig_sig_int);
+
+	/* perform transfer */
+	payload->curlerr = curl_easy_perform(payload->curl);
+	ret = curl_finish_download(payload, localpath, final_file, final_url);
+
 	/* restore the old signal handlers */
 	unmask_signal(SIGINT, &orig_sig_int);
 	unmask_signal(SIGPIPE, &orig_sig_pipe);
 	/* if we were interrupted, trip the old handler */
-	if(dload_interrupted == ABORT_SIGINT) {
+	if(dload_interrupted) {
 		raise(SIGINT);
 	}
 
 	return ret;
 }
+
+/* start the payload's transfer from its current server, moving on to the
+ * following servers if a transfer cannot be set up */
+static int multi_start_transfer(CURLM *curlm, struct dload_payload *payload,
+		const char *localpath)
+{
+	alpm_handle_t *handle = payload->handle;
+
+	for(; payload->server; payload->server = payload->server->next) {
+		const char *server_url = payload->server->data;
+		size_t len;
+
+		if(payload->curl == NULL) {
+			payload->curl = curl_easy_init();
+			if(payload->curl == NULL) {
+				RET_ERR(handle, ALPM_ERR_LIBCURL, -1);
+			}
+		}
+
+		/* print server + filename into a buffer */
+		len = strlen(server_url) + strlen(payload->remote_name) + 2;
+		MALLOC(payload->fileurl, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+		snprintf(payload->fileurl, len, "%s/%s", server_url, payload->remote_name);
+
+		if(curl_prepare_download(payload, localpath) == 0) {
+			curl_easy_setopt(payload->curl, CURLOPT_PRIVATE, (void *)payload);
+#ifdef CURLPIPE_MULTIPLEX
+			/* wait for a connection that can be shared over starting a new one */
+			curl_easy_setopt(payload->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+			if(curl_multi_add_handle(curlm, payload->curl) == CURLM_OK) {
+				return 0;
+			}
+		}
+		if(payload->localf != NULL) {
+			fclose(payload->localf);
+			payload->localf = NULL;
+		}
+		_alpm_dload_payload_reset_for_retry(payload);
+	}
+
+	return -1;
+}
+
+static void multi_release_transfer(struct dload_payload *payload, int success)
+{
+	alpm_event_pkgdownload_t event = {
+		.type = success ? ALPM_EVENT_PKGDOWNLOAD_DONE : ALPM_EVENT_PKGDOWNLOAD_FAILED,
+		.file = payload->remote_name
+	};
+
+	if(payload->curl != NULL) {
+		curl_easy_cleanup(payload->curl);
+		payload->curl = NULL;
+	}
+	payload->finished = 1;
+	EVENT(payload->handle, &event);
+}
+
+/* Front ends draw one progress bar at a time, so only the oldest unfinished
+ * transfer reports through dlcb. The others keep their latest numbers and
+ * replay them here once everything queued before them is done. */
+static alpm_list_t *multi_advance_progress(alpm_handle_t *handle,
+		alpm_list_t *head)
+{
+	for(; head; head = head->next) {
+		struct dload_payload *payload = head->data;
+
+		if(payload->progress_held) {
+			payload->progress_held = 0;
+			if(handle->dlcb && payload->held_dltotal > 0) {
+				handle->dlcb(payload->remote_name, 0, -1);
+				handle->dlcb(payload->remote_name, payload->held_dlnow,
+						payload->held_dltotal);
+				payload->cb_initialized = 1;
+			}
+		}
+		if(!payload->finished) {
+			break;
+		}
+	}
+	return head;
+}
+
+/* smallest byte range worth a connection of its own */
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+
+/* one byte range of a file downloaded in segments */
+struct dload_segment {
+	struct dload_payload *payload;
+	CURL *curl;
+	const alpm_list_t *server;
+	char *url;
+	off_t start;
+	/* next byte to write */
+	off_t offset;
+	/* one past the last byte of the range */
+	off_t end;
+	/* the handle is on the multi handle */
+	int active;
+	/* the server did not answer with the requested range of the file */
+	int bad_range;
+	char error_buffer[CURL_ERROR_SIZE];
+};
+
+/* A file fetched in byte ranges at the same time. Each range is an easy
+ * handle on the multi handle of _alpm_download_multi(), next to the
+ * transfers of other files, and the file is assembled in its .part file. */
+struct dload_segmented {
+	struct dload_segment *segments;
+	size_t count;
+	/* the HTTP servers of the payload, best first */
+	alpm_list_t *servers;
+	int fd;
+	/* bytes to fetch, not counting what a resumed .part file held */
+	off_t size;
+	off_t prevprogress;
+	long remote_time;
+	/* payload->digest covers the file up to here. The segment this offset
+	 * falls in hashes its data as it arrives; the data of later segments is
+	 * read back once every segment before them is complete. */
+	off_t hashed;
+};
+
+static size_t segment_header_cb(void *ptr, size_t size, size_t nmemb, void *user)
+{
+	size_t realsize = size * nmemb;
+	const char * const cr_header = "Content-Range:";
+	struct dload_segment *segment = (struct dload_segment *)user;
+
+	if(_alpm_raw_ncmp(cr_header, ptr, strlen(cr_header)) == 0) {
+		/* "bytes first-last/total": the file has to be as large as the
+		 * payload allows, or the ranges do not add up to it */
+		const char *total = memchr(ptr, '/', realsize);
+		if(total == NULL || strtoll(total + 1, NULL, 10) != segment->payload->max_size) {
+			segment->bad_range = 1;
+			return 0;
+		}
+	}
+	return realsize;
+}
+
+static size_t segment_write_cb(char *ptr, size_t size, size_t nmemb, void *user)
+{
+	struct dload_segment *segment = (struct dload_segment *)user;
+	struct dload_payload *payload = segment->payload;
+	struct dload_segmented *segmented = payload->segmented;
+	size_t len = size * nmemb, written = 0;
+	off_t at = segment->offset;
+	long respcode = 0;
+
+	/* SIGINT sent, abort by alerting curl */
+	if(dload_interrupted) {
+		return 0;
+	}
+	/* a server ignoring the range sends the whole file */
+	curl_easy_getinfo(segment->curl, CURLINFO_RESPONSE_CODE, &respcode);
+	if(respcode != 206 || (off_t)len > segment->end - segment->offset) {
+		segment->bad_range = 1;
+		return 0;
+	}
+	while(written < len) {
+		ssize_t ret = pwrite(segmented->fd, ptr + written, len - written,
+				segment->offset);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		written += ret;
+		segment->offset += ret;
+	}
+	if(payload->digest && at == segmented->hashed) {
+		_alpm_digest_update(payload->digest, ptr, written);
+		segmented->hashed += written;
+	}
+	return written;
+}
+
+/* hash the data the segments have written past the hashed part of the file,
+ * up to the first segment that is not complete yet */
+static void segmented_hash_catch_up(struct dload_payload *payload)
+{
+	struct dload_segmented *segmented = payload->segmented;
+	char buf[ALPM_BUFFER_SIZE];
+	size_t n;
+
+	for(n = 0; n < segmented->count && payload->digest; n++) {
+		struct dload_segment *segment = segmented->segments + n;
+
+		while(segmented->hashed < segment->offset) {
+			off_t left = segment->offset - segmented->hashed;
+			ssize_t got = pread(segmented->fd, buf,
+					left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf),
+					segmented->hashed);
+			if(got < 0 && errno == EINTR) {
+				continue;
+			}
+			if(got <= 0) {
+				/* the digests are computed from the finished file instead */
+				FREE(payload->digest);
+				return;
+			}
+			_alpm_digest_update(payload->digest, buf, (size_t)got);
+			segmented->hashed += got;
+		}
+		if(segment->offset < segment->end) {
+			break;
+		}
+	}
+}
+
+/* fetch what is left of the segment's range from its current server */
+static int segment_start(CURLM *curlm, struct dload_segment *segment)
+{
+	struct dload_payload *payload = segment->payload;
+	alpm_handle_t *handle = payload->handle;
+	const char *server_url = segment->server->data;
+	char range[64];
+	size_t len;
+
+	FREE(segment->url);
+	len = strlen(server_url) + strlen(payload->remote_name) + 2;
+	MALLOC(segment->url, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	snprintf(segment->url, len, "%s/%s", server_url, payload->remote_name);
+
+	if(segment->curl == NULL) {
+		segment->curl = curl_easy_init();
+		if(segment->curl == NULL) {
+			RET_ERR(handle, ALPM_ERR_LIBCURL, -1);
+		}
+	}
+	curl_set_common_opts(handle, segment->curl, segment->url,
+			segment->error_buffer);
+	snprintf(range, sizeof(range), "%jd-%jd",
+			(intmax_t)segment->offset, (intmax_t)segment->end - 1);
+	curl_easy_setopt(segment->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(segment->curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(segment->curl, CURLOPT_HEADERFUNCTION, segment_header_cb);
+	curl_easy_setopt(segment->curl, CURLOPT_HEADERDATA, (void *)segment);
+	curl_easy_setopt(segment->curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+	curl_easy_setopt(segment->curl, CURLOPT_WRITEDATA, (void *)segment);
+	/* the payload, as for a whole-file transfer; segment_done() finds the
+	 * segment from the easy handle */
+	curl_easy_setopt(segment->curl, CURLOPT_PRIVATE, (void *)payload);
+#ifdef CURLPIPE_MULTIPLEX
+	curl_easy_setopt(segment->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+	segment->error_buffer[0] = '\0';
+	segment->bad_range = 0;
+
+	if(curl_multi_add_handle(curlm, segment->curl) != CURLM_OK) {
+		RET_ERR(handle, ALPM_ERR_LIBCURL, -1);
+	}
+	segment->active = 1;
+	return 0;
+}
+
+/* a failed segment moves on to its next server */
+static int segment_failed(CURLM *curlm, struct dload_segment *segment,
+		CURLcode result)
+{
+	struct dload_payload *payload = segment->payload;
+	alpm_handle_t *handle = payload->handle;
+	char hostname[HOSTNAME_SIZE];
+
+	if(dload_interrupted) {
+		return -1;
+	}
+	record_server_stats(handle, segment->server->data, segment->curl, 0);
+
+	if(segment->bad_range) {
+		snprintf(segment->error_buffer, sizeof(segment->error_buffer),
+				"The server did not return the requested range");
+	} else if(result == CURLE_OK) {
+		snprintf(segment->error_buffer, sizeof(segment->error_buffer),
+				"The range ended early");
+	}
+	curl_gethost(segment->url, hostname, sizeof(hostname));
+	_alpm_log(handle, ALPM_LOG_ERROR,
+			_("failed retrieving file '%s' from %s : %s\n"),
+			payload->remote_name, hostname, segment->error_buffer);
+
+	if(segment->server->next == NULL) {
+		handle->pm_errno = ALPM_ERR_LIBCURL;
+		return -1;
+	}
+	segment->server = segment->server->next;
+	return segment_start(curlm, segment);
+}
+
+static int segmentable(struct dload_payload *payload)
+{
+	alpm_handle_t *handle = payload->handle;
+
+	return handle->segmented_download_size > 0
+		&& handle->parallel_downloads > 1
+		&& handle->fetchcb == NULL
+		&& payload->max_size >= handle->segmented_download_size
+		&& payload->max_size >= 2 * SEGMENT_MIN_SIZE
+		&& payload->remote_name != NULL
+		&& !payload->trust_remote_name;
+}
+
+/* Stop the segments of a file and free them. A .part file that is not
+ * complete keeps everything before the first gap, so it can be resumed
+ * like any other download.
+ * @return the number of transfers removed from curlm */
+static unsigned int segmented_free(CURLM *curlm, struct dload_payload *payload)
+{
+	struct dload_segmented *segmented = payload->segmented;
+	unsigned int removed = 0;
+	size_t n;
+
+	if(segmented == NULL) {
+		return 0;
+	}
+	if(segmented->fd >= 0) {
+		off_t prefix = payload->initial_size;
+		for(n = 0; n < segmented->count; n++) {
+			prefix = segmented->segments[n].offset;
+			if(segmented->segments[n].offset < segmented->segments[n].end) {
+				break;
+			}
+		}
+		if(payload->unlink_on_fail || prefix == 0) {
+			unlink(payload->tempfile_name);
+		} else if(ftruncate(segmented->fd, prefix) != 0) {
+			unlink(payload->tempfile_name);
+		}
+		close(segmented->fd);
+	}
+	for(n = 0; n < segmented->count; n++) {
+		struct dload_segment *segment = segmented->segments + n;
+		if(segment->curl) {
+			if(segment->active) {
+				curl_multi_remove_handle(curlm, segment->curl);
+				removed++;
+			}
+			curl_easy_cleanup(segment->curl);
+		}
+		free(segment->url);
+	}
+	free(segmented->segments);
+	alpm_list_free(segmented->servers);
+	free(segmented);
+	payload->segmented = NULL;
+	return removed;
+}
+
+/* Start downloading a file in byte ranges from the payload's HTTP servers,
+ * one range for each of the given number of connections, as far as the
+ * size of the file makes that worthwhile.
+ * @return the number of transfers added to curlm, 0 if the file is to be
+ * downloaded whole */
+static unsigned int segmented_start(CURLM *curlm, struct dload_payload *payload,
+		const char *localpath, unsigned int connections)
+{
+	alpm_handle_t *handle = payload->handle;
+	alpm_list_t *i, *ranked, *servers = NULL;
+	struct dload_segmented *segmented;
+	size_t n, count;
+	struct stat st;
+
+	ranked = _alpm_servers_rank(handle, payload->servers, 1);
+	for(i = ranked; i; i = i->next) {
+		const char *server_url = i->data;
+		if(strncmp(server_url, "http://", 7) == 0
+				|| strncmp(server_url, "https://", 8) == 0) {
+			servers = alpm_list_add(servers, i->data);
+		}
+	}
+	alpm_list_free(ranked);
+	if(servers == NULL) {
+		return 0;
+	}
+
+	CALLOC(segmented, 1, sizeof(struct dload_segmented),
+			alpm_list_free(servers); RET_ERR(handle, ALPM_ERR_MEMORY, 0));
+	segmented->servers = servers;
+	segmented->fd = -1;
+	segmented->prevprogress = -1;
+	segmented->remote_time = -1;
+	payload->segmented = segmented;
+
+	/* the same names as a whole-file download, so either resumes the other */
+	FREE(payload->tempfile_name);
+	FREE(payload->destfile_name);
+	payload->destfile_name = get_fullpath(localpath, payload->remote_name, "");
+	payload->tempfile_name = get_fullpath(localpath, payload->remote_name, ".part");
+	if(!payload->destfile_name || !payload->tempfile_name) {
+		handle->pm_errno = ALPM_ERR_MEMORY;
+		goto error;
+	}
+
+	/* read as well, for hashing the segments that complete out of order */
+	segmented->fd = open(payload->tempfile_name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if(segmented->fd < 0) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not open file %s: %s\n"),
+				payload->tempfile_name, strerror(errno));
+		goto error;
+	}
+	payload->initial_size = 0;
+	if(payload->allow_resume && fstat(segmented->fd, &st) == 0
+			&& st.st_size < payload->max_size) {
+		payload->initial_size = st.st_size;
+	} else if(ftruncate(segmented->fd, 0) != 0) {
+		goto error;
+	}
+
+	segmented->size = payload->max_size - payload->initial_size;
+	count = connections;
+	if((off_t)count > segmented->size / SEGMENT_MIN_SIZE) {
+		count = segmented->size / SEGMENT_MIN_SIZE;
+	}
+	if(count < 2) {
+		/* not worth splitting what is left */
+		goto error;
+	}
+
+	FREE(payload->digest);
+	FREE(payload->md5sum);
+	FREE(payload->sha256sum);
+	if(payload->want_digests) {
+		payload->digest = _alpm_digest_new();
+		/* a resumed download only brings the rest of the file */
+		if(payload->digest && payload->initial_size > 0 &&
+				_alpm_digest_update_file(payload->digest, payload->tempfile_name) != 0) {
+			FREE(payload->digest);
+		}
+	}
+	segmented->hashed = payload->initial_size;
+
+	CALLOC(segmented->segments, count, sizeof(struct dload_segment),
+			handle->pm_errno = ALPM_ERR_MEMORY; goto error);
+	segmented->count = count;
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "downloading %s in %zu segments from %jd\n",
+			payload->remote_name, count, (intmax_t)payload->initial_size);
+	for(n = 0; n < count; n++) {
+		struct dload_segment *segment = segmented->segments + n;
+		segment->payload = payload;
+		segment->server = servers;
+		segment->start = payload->initial_size
+			+ segmented->size / (off_t)count * (off_t)n;
+		segment->offset = segment->start;
+		segment->end = payload->initial_size
+			+ segmented->size / (off_t)count * (off_t)(n + 1);
+		if(n + 1 == count) {
+			segment->end = payload->max_size;
+		}
+	}
+	for(n = 0; n < count; n++) {
+		if(segment_start(curlm, segmented->segments + n) != 0) {
+			goto error;
+		}
+	}
+	return count;
+
+error:
+	segmented_free(curlm, payload);
+	FREE(payload->digest);
+	return 0;
+}
+
+/* put a file whose segments are all complete in place */
+static int segmented_finish(struct dload_payload *payload)
+{
+	alpm_handle_t *handle = payload->handle;
+	struct dload_segmented *segmented = payload->segmented;
+	int err;
+
+	segmented_hash_catch_up(payload);
+	err = close(segmented->fd);
+	segmented->fd = -1;
+	if(err != 0) {
+		handle->pm_errno = ALPM_ERR_RETRIEVE;
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not write to file %s: %s\n"),
+				payload->tempfile_name, strerror(errno));
+		return -1;
+	}
+	/* the time of the file on the server, as for a whole-file download */
+	utimes_long(payload->tempfile_name, segmented->remote_time);
+	if(rename(payload->tempfile_name, payload->destfile_name) != 0) {
+		_alpm_log(handle, ALPM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+				payload->tempfile_name, payload->destfile_name, strerror(errno));
+		return -1;
+	}
+	if(payload->digest) {
+		if(segmented->hashed == payload->max_size) {
+			_alpm_digest_finish(payload->digest, &payload->md5sum, &payload->sha256sum);
+		} else {
+			free(payload->digest);
+		}
+		payload->digest = NULL;
+	}
+	return 0;
+}
+
+/* Handle a segment whose transfer has ended and was removed from curlm.
+ * A failed segment is retried on its next server, which adds a transfer
+ * to *active.
+ * @return 1 once the file is in place, -1 if the segments gave up and the
+ * rest of the file has to be downloaded whole, 0 otherwise */
+static int segment_done(CURLM *curlm, struct dload_payload *payload,
+		CURL *curl, CURLcode result, unsigned int *active)
+{
+	struct dload_segmented *segmented = payload->segmented;
+	struct dload_segment *segment = NULL;
+	size_t n;
+	int ret;
+
+	for(n = 0; n < segmented->count; n++) {
+		if(segmented->segments[n].curl == curl) {
+			segment = segmented->segments + n;
+			break;
+		}
+	}
+	segment->active = 0;
+
+	if(result != CURLE_OK || segment->offset != segment->end) {
+		if(segment_failed(curlm, segment, result) == 0) {
+			(*active)++;
+			return 0;
+		}
+		*active -= segmented_free(curlm, payload);
+		FREE(payload->digest);
+		return -1;
+	}
+
+	if(segmented->remote_time == -1) {
+		curl_easy_getinfo(segment->curl, CURLINFO_FILETIME, &segmented->remote_time);
+	}
+	record_server_stats(payload->handle, segment->server->data, segment->curl, 1);
+	segmented_hash_catch_up(payload);
+	/* a segment may have all its data before curl reports it as done */
+	for(n = 0; n < segmented->count; n++) {
+		if(segmented->segments[n].active
+				|| segmented->segments[n].offset < segmented->segments[n].end) {
+			return 0;
+		}
+	}
+
+	ret = segmented_finish(payload);
+	*active -= segmented_free(curlm, payload);
+	if(ret != 0) {
+		FREE(payload->digest);
+		return -1;
+	}
+	return 1;
+}
+
+/* pass on the progress of a file downloaded in segments, as
+ * dload_progress_cb() does for a whole-file transfer */
+static void segmented_progress(struct dload_payload *payload)
+{
+	alpm_handle_t *handle = payload->handle;
+	struct dload_segmented *segmented = payload->segmented;
+	off_t progress = 0;
+	size_t n;
+
+	for(n = 0; n < segmented->count; n++) {
+		progress += segmented->segments[n].offset - segmented->segments[n].start;
+	}
+	if(handle->dlcb == NULL || progress == segmented->prevprogress) {
+		return;
+	}
+	segmented->prevprogress = progress;
+
+	/* initial_size is not part of the download size, as elsewhere */
+	if(payload->progress_held) {
+		payload->held_dlnow = progress;
+		payload->held_dltotal = segmented->size;
+		return;
+	}
+	if(!payload->cb_initialized) {
+		handle->dlcb(payload->remote_name, 0, -1);
+		payload->cb_initialized = 1;
+	}
+	handle->dlcb(payload->remote_name, progress, segmented->size);
+}
+
+/** Download several files from their mirror lists at the same time.
+ * Up to handle->parallel_downloads transfers run at once on a single curl
+ * multi handle, which keeps connections to each host open for the transfers
+ * that follow. A file that fails is retried on its next server. A very
+ * large file is split into byte ranges, each of them one of those transfers;
+ * if the ranges fail, the rest of the file is downloaded whole.
+ * @param handle the context handle
+ * @param payloads list of payloads with remote_name and servers set
+ * @param localpath the directory to save the files in
+ * @param done called for each file once it is in place, may be NULL
+ * @param data passed on to done
+ * @return the number of files that could not be downloaded, -1 on error
+ */
+int _alpm_download_multi(alpm_handle_t *handle, alpm_list_t *payloads,
+		const char *localpath, _alpm_dload_done_fn done, void *data)
+{
+	CURLM *curlm;
+	alpm_list_t *i, *next = payloads, *head = payloads;
+	unsigned int active = 0;
+	int failed = 0;
+	struct sigaction orig_sig_pipe, orig_sig_int;
+
+	handle->pm_errno = ALPM_ERR_OK;
+	/* makes sure curl_global_init() was called */
+	get_libcurl_handle(handle);
+	curlm = curl_multi_init();
+	if(curlm == NULL) {
+		RET_ERR(handle, ALPM_ERR_LIBCURL, -1);
+	}
+#ifdef CURLPIPE_MULTIPLEX
+	curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+	curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+			(long)handle->parallel_downloads);
+
+	mask_signal(SIGPIPE, SIG_IGN, &orig_sig_pipe);
+	dload_interrupted = 0;
+	mask_signal(SIGINT, &inthandler, &orig_sig_int);
+
+	while(active > 0 || (next && !dload_interrupted)) {
+		CURLMcode mc;
+		CURLMsg *msg;
+		int running, msgs_left;
+
+		while(next && active < handle->parallel_downloads && !dload_interrupted) {
+			struct dload_payload *payload = next->data;
+			alpm_event_pkgdownload_t event = {
+				.type = ALPM_EVENT_PKGDOWNLOAD_START,
+				.file = payload->remote_name
+			};
+			unsigned int segments = 0;
+
+			/* a very large file waits for two connections at least, and
+			 * then takes every connection that is free */
+			if(segmentable(payload) && active > 0
+					&& handle->parallel_downloads - active < 2) {
+				break;
+			}
+			next = next->next;
+			EVENT(handle, &event);
+			/* ranked when the transfer starts, so it benefits from the
+			 * transfers that finished before it */
+			payload->server_order = _alpm_servers_rank(handle, payload->servers, 1);
+			payload->server = payload->server_order;
+			payload->progress_held = (payload != head->data);
+			if(segmentable(payload)) {
+				segments = segmented_start(curlm, payload, localpath,
+						handle->parallel_downloads - active);
+			}
+			if(segments == 0 && multi_start_transfer(curlm, payload, localpath) == 0) {
+				segments = 1;
+			}
+			if(segments == 0) {
+				failed++;
+				multi_release_transfer(payload, 0);
+				continue;
+			}
+			if(active > 0) {
+				_alpm_log(handle, ALPM_LOG_DEBUG, "%s started alongside %u other transfers\n",
+						payload->remote_name, active);
+			}
+			active += segments;
+		}
+
+		mc = curl_multi_perform(curlm, &running);
+		if(mc != CURLM_OK) {
+			_alpm_log(handle, ALPM_LOG_ERROR, _("failed to download files: %s\n"),
+					curl_multi_strerror(mc));
+			handle->pm_errno = ALPM_ERR_LIBCURL;
+			break;
+		}
+
+		while((msg = curl_multi_info_read(curlm, &msgs_left)) != NULL) {
+			struct dload_payload *payload;
+			CURL *curl = msg->easy_handle;
+			char *priv;
+
+			if(msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, &priv);
+			payload = (struct dload_payload *)priv;
+			payload->curlerr = msg->data.result;
+			/* msg is no longer valid once the handle is removed */
+			curl_multi_remove_handle(curlm, curl);
+			active--;
+
+			if(payload->segmented) {
+				int ret = segment_done(curlm, payload, curl, payload->curlerr, &active);
+				if(ret == 0) {
+					continue;
+				} else if(ret == 1) {
+					multi_release_transfer(payload, 1);
+					if(done) {
+						done(payload, data);
+					}
+					continue;
+				}
+				/* a whole-file transfer resumes whatever the segments got */
+				if(!dload_interrupted
+						&& multi_start_transfer(curlm, payload, localpath) == 0) {
+					active++;
+					continue;
+				}
+				failed++;
+				multi_release_transfer(payload, 0);
+				continue;
+			}
+
+			if(curl_finish_download(payload, localpath, NULL, NULL) != -1) {
+				multi_release_transfer(payload, 1);
+				if(done) {
+					done(payload, data);
+				}
+				continue;
+			}
+			if(!dload_interrupted && payload->server->next) {
+				_alpm_dload_payload_reset_for_retry(payload);
+				payload->held_dlnow = payload->held_dltotal = 0;
+				payload->server = payload->server->next;
+				if(multi_start_transfer(curlm, payload, localpath) == 0) {
+					active++;
+					continue;
+				}
+			}
+			failed++;
+			multi_release_transfer(payload, 0);
+		}
+
+		for(i = head; i != next; i = i->next) {
+			struct dload_payload *payload = i->data;
+			if(payload->segmented) {
+				segmented_progress(payload);
+			}
+		}
+		head = multi_advance_progress(handle, head);
+
+		if(active > 0) {
+			curl_multi_wait(curlm, NULL, 0, 1000, NULL);
+		}
+	}
+
+	/* tear down whatever is left after an error */
+	for(i = payloads; i; i = i->next) {
+		struct dload_payload *payload = i->data;
+		if(payload->segmented) {
+			segmented_free(curlm, payload);
+			FREE(payload->digest);
+			failed++;
+			multi_release_transfer(payload, 0);
+			continue;
+		}
+		if(payload->curl == NULL) {
+			continue;
+		}
+		curl_multi_remove_handle(curlm, payload->curl);
+		if(payload->localf != NULL) {
+			fclose(payload->localf);
+			payload->localf = NULL;
+		}
+		if(payload->unlink_on_fail && payload->tempfile_name) {
+			unlink(payload->tempfile_name);
+		}
+		failed++;
+		multi_release_transfer(payload, 0);
+	}
+	/* files never started after an interrupt */
+	for(; next; next = next->next) {
+		struct dload_payload *payload = next->data;
+		if(!payload->finished) {
+			failed++;
+		}
+	}
+	multi_advance_progress(handle, head);
+	curl_multi_cleanup(curlm);
+
+	unmask_signal(SIGINT, &orig_sig_int);
+	unmask_signal(SIGPIPE, &orig_sig_pipe);
+	if(dload_interrupted) {
+		raise(SIGINT);
+	}
+
+	return failed;
+}
 #endif
 
 /** Download a file given by a URL to a local directory.
@@ -624,6 +1687,106 @@ int _alpm_download(struct dload_payload *payload, const char *localpath,
 	}
 }
 
+#ifndef HAVE_LIBCURL
+int _alpm_download_multi(alpm_handle_t *handle, alpm_list_t UNUSED *payloads,
+		const char UNUSED *localpath, _alpm_dload_done_fn UNUSED done,
+		void UNUSED *data)
+{
+	RET_ERR(handle, ALPM_ERR_EXTERNAL_DOWNLOAD, -1);
+}
+#endif
+
+struct ranked_server {
+	const char *url;
+	struct server_stats *stats;
+	size_t pos;
+	int class;
+	double rate;
+};
+
+static int ranked_server_cmp(const void *p1, const void *p2)
+{
+	const struct ranked_server *s1 = p1;
+	const struct ranked_server *s2 = p2;
+
+	if(s1->class != s2->class) {
+		return s1->class - s2->class;
+	}
+	if(s1->rate != s2->rate) {
+		return s1->rate > s2->rate ? -1 : 1;
+	}
+	if(s1->stats && s2->stats && s1->stats->failures != s2->stats->failures) {
+		return s1->stats->failures < s2->stats->failures ? -1 : 1;
+	}
+	return s1->pos < s2->pos ? -1 : 1;
+}
+
+/** Order a server list by how the servers have done so far.
+ * Servers that failed their last transfer are tried last until their
+ * penalty, counted in calls to this function, runs out. With by_speed,
+ * the first SERVER_PROBES working servers are each tried once, and servers
+ * whose throughput is known then go fastest first. Otherwise the
+ * configured order is kept.
+ * @param handle the context handle
+ * @param servers list of server urls in configured order
+ * @param by_speed whether to prefer fast servers over the configured order
+ * @return a new list sharing the urls of servers, NULL if servers is empty
+ * or memory ran out
+ */
+alpm_list_t *_alpm_servers_rank(alpm_handle_t *handle, alpm_list_t *servers,
+		int by_speed)
+{
+	struct ranked_server *ranked;
+	alpm_list_t *i, *order = NULL;
+	size_t n, count = alpm_list_count(servers), healthy = 0;
+
+	if(count == 0) {
+		return NULL;
+	}
+	MALLOC(ranked, count * sizeof(struct ranked_server), return NULL);
+
+	for(i = servers, n = 0; i; i = i->next, n++) {
+		struct ranked_server *server = ranked + n;
+		struct server_stats *stats = find_server_stats(handle, i->data);
+
+		server->url = i->data;
+		server->stats = stats;
+		server->pos = n;
+		server->rate = 0;
+		if(stats && stats->penalty > 0) {
+			stats->penalty--;
+			server->class = 3;
+		} else if(!by_speed) {
+			server->class = 0;
+		} else if(stats && stats->bytes > 0) {
+			server->class = 1;
+			server->rate = stats->bytes / (stats->seconds > 0.001 ? stats->seconds : 0.001);
+		} else {
+			server->class = healthy < SERVER_PROBES ? 0 : 2;
+		}
+		if(server->class != 3) {
+			healthy++;
+		}
+	}
+	qsort(ranked, count, sizeof(struct ranked_server), ranked_server_cmp);
+
+	for(n = 0; n < count; n++) {
+		if(alpm_list_append(&order, (void *)ranked[n].url) == NULL) {
+			alpm_list_free(order);
+			order = NULL;
+			break;
+		}
+	}
+	free(ranked);
+	return order;
+}
+
+void _alpm_server_stats_free(alpm_list_t *stats)
+{
+	alpm_list_free_inner(stats, (alpm_list_fn_free)server_stats_free);
+	alpm_list_free(stats);
+}
+
 static char *filecache_find_url(alpm_handle_t *handle, const char *url)
 {
 	const char *filebase = strrchr(url, '/');
@@ -729,6 +1892,15 @@ void _alpm_dload_payload_reset(struct dload_payload *payload)
 	FREE(payload->destfile_name);
 	FREE(payload->content_disp_name);
 	FREE(payload->fileurl);
+	FREE(payload->etag_path);
+	FREE(payload->etag);
+	FREE(payload->md5sum);
+	FREE(payload->sha256sum);
+	alpm_list_free(payload->server_order);
+#ifdef HAVE_LIBCURL
+	FREE(payload->digest);
+	curl_slist_free_all(payload->headers);
+#endif
 	memset(payload, '\0', sizeof(*payload));
 }
 
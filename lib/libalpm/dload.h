@@ -31,7 +31,15 @@ struct dload_payload {
 	char *destfile_name;
 	char *content_disp_name;
 	char *fileurl;
+	/* file keeping the entity tag of destfile_name, for conditional requests */
+	char *etag_path;
+	/* entity tag the server sent with the file */
+	char *etag;
 	alpm_list_t *servers;
+	/* servers in the order they are tried, see _alpm_servers_rank() */
+	alpm_list_t *server_order;
+	/* server being tried, statistics are kept for it */
+	const alpm_list_t *server;
 	long respcode;
 	off_t initial_size;
 	off_t max_size;
@@ -42,15 +50,42 @@ struct dload_payload {
 	int unlink_on_fail;
 	int trust_remote_name;
 	int cb_initialized;
+	/* hash the file while it is written, see md5sum and sha256sum */
+	int want_digests;
+	/* digests of the downloaded file, if want_digests */
+	char *md5sum;
+	char *sha256sum;
 #ifdef HAVE_LIBCURL
+	struct _alpm_digest_t *digest;
 	CURLcode curlerr;       /* last error produced by curl */
+	CURL *curl;             /* easy handle of the ongoing transfer */
+	/* byte ranges being downloaded at the same time, instead of curl */
+	struct dload_segmented *segmented;
+	FILE *localf;           /* file the ongoing transfer writes to */
+	struct curl_slist *headers; /* extra request headers */
+	int size_exceeded;
+	int finished;
+	/* set while another transfer owns the front end's progress display */
+	int progress_held;
+	off_t held_dlnow;
+	off_t held_dltotal;
+	char error_buffer[CURL_ERROR_SIZE];
 #endif
 };
 
+/* called for each file _alpm_download_multi() has put in place */
+typedef void (*_alpm_dload_done_fn)(struct dload_payload *payload, void *data);
+
+alpm_list_t *_alpm_servers_rank(alpm_handle_t *handle, alpm_list_t *servers,
+		int by_speed);
+void _alpm_server_stats_free(alpm_list_t *stats);
+
 void _alpm_dload_payload_reset(struct dload_payload *payload);
 void _alpm_dload_payload_reset_for_retry(struct dload_payload *payload);
 
 int _alpm_download(struct dload_payload *payload, const char *localpath,
 		char **final_file, const char **final_url);
+int _alpm_download_multi(alpm_handle_t *handle, alpm_list_t *payloads,
+		const char *localpath, _alpm_dload_done_fn done, void *data);
 
 #endif /* ALPM_DLOAD_H */
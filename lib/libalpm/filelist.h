@@ -24,9 +24,7 @@
 alpm_list_t *_alpm_filelist_difference(alpm_filelist_t *filesA,
 		alpm_filelist_t *filesB);
 
-alpm_list_t *_alpm_filelist_intersection(alpm_filelist_t *filesA,
-		alpm_filelist_t *filesB);
-
+int _alpm_filelist_contains_below(alpm_filelist_t *filelist, const char *dir);
 void _alpm_filelist_sort(alpm_filelist_t *filelist);
 
 #endif /* ALPM_FILELIST_H */
@@ -38,6 +38,7 @@
 #include "trans.h"
 #include "alpm.h"
 #include "deps.h"
+#include "dload.h"
 
 alpm_handle_t *_alpm_handle_new(void)
 {
@@ -46,6 +47,7 @@ alpm_handle_t *_alpm_handle_new(void)
 	CALLOC(handle, 1, sizeof(alpm_handle_t), return NULL);
 	handle->deltaratio = 0.0;
 	handle->lockfd = -1;
+	handle->parallel_downloads = 1;
 
 	return handle;
 }
@@ -79,6 +81,7 @@ void _alpm_handle_free(alpm_handle_t *handle)
 
 	/* free memory */
 	_alpm_trans_free(handle->trans);
+	_alpm_server_stats_free(handle->server_stats);
 	FREE(handle->root);
 	FREE(handle->dbpath);
 	FREE(handle->dbext);
@@ -315,6 +318,24 @@ int SYMEXPORT alpm_option_get_checkspace(alpm_handle_t *handle)
 	return handle->checkspace;
 }
 
+unsigned int SYMEXPORT alpm_option_get_parallel_downloads(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return 0);
+	return handle->parallel_downloads;
+}
+
+off_t SYMEXPORT alpm_option_get_segmented_download_size(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return -1);
+	return handle->segmented_download_size;
+}
+
+unsigned int SYMEXPORT alpm_option_get_worker_threads(alpm_handle_t *handle)
+{
+	CHECK_HANDLE(handle, return 0);
+	return handle->worker_threads;
+}
+
 const char SYMEXPORT *alpm_option_get_dbext(alpm_handle_t *handle)
 {
 	CHECK_HANDLE(handle, return NULL);
@@ -784,6 +805,32 @@ int SYMEXPORT alpm_option_set_checkspace(alpm_handle_t *handle, int checkspace)
 	return 0;
 }
 
+int SYMEXPORT alpm_option_set_parallel_downloads(alpm_handle_t *handle,
+		unsigned int num_streams)
+{
+	CHECK_HANDLE(handle, return -1);
+	ASSERT(num_streams >= 1, RET_ERR(handle, ALPM_ERR_WRONG_ARGS, -1));
+	handle->parallel_downloads = num_streams;
+	return 0;
+}
+
+int SYMEXPORT alpm_option_set_segmented_download_size(alpm_handle_t *handle,
+		off_t size)
+{
+	CHECK_HANDLE(handle, return -1);
+	ASSERT(size >= 0, RET_ERR(handle, ALPM_ERR_WRONG_ARGS, -1));
+	handle->segmented_download_size = size;
+	return 0;
+}
+
+int SYMEXPORT alpm_option_set_worker_threads(alpm_handle_t *handle,
+		unsigned int num_threads)
+{
+	CHECK_HANDLE(handle, return -1);
+	handle->worker_threads = num_threads;
+	return 0;
+}
+
 int SYMEXPORT alpm_option_set_dbext(alpm_handle_t *handle, const char *dbext)
 {
 	CHECK_HANDLE(handle, return -1);
@@ -54,6 +54,7 @@ struct __alpm_handle_t {
 	/* internal usage */
 	alpm_db_t *db_local;    /* local db pointer */
 	alpm_list_t *dbs_sync;  /* List of (alpm_db_t *) */
+	alpm_list_t *server_stats; /* how each server has done, see dload.c */
 	FILE *logstream;        /* log file stream pointer */
 	alpm_trans_t *trans;
 
@@ -98,6 +99,9 @@ struct __alpm_handle_t {
 	double deltaratio;       /* Download deltas if possible; a ratio value */
 	int usesyslog;           /* Use syslog instead of logfile? */ /* TODO move to frontend */
 	int checkspace;          /* Check disk space before installing */
+	unsigned int parallel_downloads; /* Number of files downloaded at once */
+	off_t segmented_download_size; /* Files this large are fetched in segments, 0 for never */
+	unsigned int worker_threads; /* Threads validating, loading and extracting packages, 0 for one per CPU */
 	char *dbext;             /* Sync DB extension */
 	int siglevel;            /* Default signature verification level */
 	int localfilesiglevel;   /* Signature verification level for local file
@@ -108,6 +112,10 @@ struct __alpm_handle_t {
 	/* error code */
 	alpm_errno_t pm_errno;
 
+	/* when set, log messages and .pacnew events are appended to this list
+	 * instead of being passed on; see _alpm_deferred_flush() */
+	alpm_list_t **deferred;
+
 	/* lock file descriptor */
 	int lockfd;
 
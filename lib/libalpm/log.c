@@ -19,9 +19,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 
 /* libalpm */
 #include "log.h"
@@ -45,6 +48,66 @@ static int _alpm_log_leader(FILE *f, const char *prefix)
 			tm->tm_hour, tm->tm_min, prefix);
 }
 
+/* a message or event held back by a thread whose output is deferred */
+struct deferred_output {
+	alpm_loglevel_t level;
+	/* only set for messages passed to alpm_logaction() */
+	char *prefix;
+	char *message;
+	/* for .pacnew events, message holds the file name */
+	int pacnew;
+	alpm_event_pacnew_created_t event;
+};
+
+static char *format_message(const char *fmt, va_list args)
+{
+	char *message;
+	va_list args_len;
+	int len;
+
+	va_copy(args_len, args);
+	len = vsnprintf(NULL, 0, fmt, args_len);
+	va_end(args_len);
+	if(len < 0) {
+		return NULL;
+	}
+	MALLOC(message, (size_t)len + 1, return NULL);
+	vsnprintf(message, (size_t)len + 1, fmt, args);
+	return message;
+}
+
+static void defer_output(alpm_handle_t *handle, struct deferred_output *output)
+{
+	alpm_list_t *deferred = alpm_list_add(*handle->deferred, output);
+
+	if(deferred == NULL) {
+		free(output->prefix);
+		free(output->message);
+		free(output);
+		return;
+	}
+	*handle->deferred = deferred;
+}
+
+static void defer_message(alpm_handle_t *handle, alpm_loglevel_t level,
+		const char *prefix, const char *fmt, va_list args)
+{
+	struct deferred_output *output;
+
+	CALLOC(output, 1, sizeof(struct deferred_output), return);
+	output->level = level;
+	if(prefix) {
+		STRDUP(output->prefix, prefix, free(output); return);
+	}
+	output->message = format_message(fmt, args);
+	if(output->message == NULL) {
+		free(output->prefix);
+		free(output);
+		return;
+	}
+	defer_output(handle, output);
+}
+
 /** A printf-like function for logging.
  * @param handle the context handle
  * @param prefix caller-specific prefix for the log
@@ -63,6 +126,13 @@ int SYMEXPORT alpm_logaction(alpm_handle_t *handle, const char *prefix,
 		prefix = "UNKNOWN";
 	}
 
+	if(handle->deferred) {
+		va_start(args, fmt);
+		defer_message(handle, ALPM_LOG_WARNING, prefix, fmt, args);
+		va_end(args);
+		return 0;
+	}
+
 	/* check if the logstream is open already, opening it if needed */
 	if(handle->logstream == NULL && handle->logfile != NULL) {
 		int fd;
@@ -118,6 +188,55 @@ void _alpm_log(alpm_handle_t *handle, alpm_loglevel_t flag, const char *fmt, ...
 	}
 
 	va_start(args, fmt);
-	handle->logcb(flag, fmt, args);
+	if(handle->deferred) {
+		defer_message(handle, flag, NULL, fmt, args);
+	} else {
+		handle->logcb(flag, fmt, args);
+	}
 	va_end(args);
 }
+
+/* Send a .pacnew event, or hold it back with the other output of the
+ * handle if that is deferred. */
+void _alpm_pacnew_created(alpm_handle_t *handle,
+		alpm_event_pacnew_created_t *event)
+{
+	struct deferred_output *output;
+
+	if(handle->deferred == NULL) {
+		EVENT(handle, event);
+		return;
+	}
+	if(handle->eventcb == NULL) {
+		return;
+	}
+	CALLOC(output, 1, sizeof(struct deferred_output), return);
+	STRDUP(output->message, event->file, free(output); return);
+	output->pacnew = 1;
+	output->event = *event;
+	output->event.file = NULL;
+	defer_output(handle, output);
+}
+
+/* Pass on output deferred by another thread, in the order it was produced,
+ * and free the list. Must be called on a handle whose output goes out. */
+void _alpm_deferred_flush(alpm_handle_t *handle, alpm_list_t *deferred)
+{
+	alpm_list_t *i;
+
+	for(i = deferred; i; i = i->next) {
+		struct deferred_output *output = i->data;
+		if(output->pacnew) {
+			output->event.file = output->message;
+			EVENT(handle, &output->event);
+		} else if(output->prefix) {
+			alpm_logaction(handle, output->prefix, "%s", output->message);
+		} else {
+			_alpm_log(handle, output->level, "%s", output->message);
+		}
+		free(output->prefix);
+		free(output->message);
+		free(output);
+	}
+	alpm_list_free(deferred);
+}
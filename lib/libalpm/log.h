@@ -27,4 +27,8 @@
 void _alpm_log(alpm_handle_t *handle, alpm_loglevel_t flag,
 		const char *fmt, ...) __attribute__((format(printf,3,4)));
 
+void _alpm_pacnew_created(alpm_handle_t *handle,
+		alpm_event_pacnew_created_t *event);
+void _alpm_deferred_flush(alpm_handle_t *handle, alpm_list_t *deferred);
+
 #endif /* ALPM_LOG_H */
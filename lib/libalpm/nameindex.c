@@ -0,0 +1,158 @@
+/*
+ *  nameindex.c
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libalpm */
+#include "nameindex.h"
+#include "arena.h"
+#include "util.h"
+
+struct nameindex_entry {
+	struct nameindex_entry *next;
+	const char *name;
+	unsigned long name_hash;
+	alpm_list_t *items;
+};
+
+struct _alpm_nameindex_t {
+	/* entries and their item lists */
+	alpm_arena_t *arena;
+	struct nameindex_entry **buckets;
+	size_t size;
+	size_t entries;
+};
+
+/** Create an index expected to hold about "size" names. */
+alpm_nameindex_t *_alpm_nameindex_new(size_t size)
+{
+	alpm_nameindex_t *index;
+
+	CALLOC(index, 1, sizeof(alpm_nameindex_t), return NULL);
+	index->size = 16;
+	while(index->size < size) {
+		index->size *= 2;
+	}
+	index->arena = _alpm_arena_new();
+	CALLOC(index->buckets, index->size, sizeof(struct nameindex_entry *),
+			_alpm_nameindex_free(index); return NULL);
+	if(index->arena == NULL) {
+		_alpm_nameindex_free(index);
+		return NULL;
+	}
+	return index;
+}
+
+void _alpm_nameindex_free(alpm_nameindex_t *index)
+{
+	if(index == NULL) {
+		return;
+	}
+	_alpm_arena_free(index->arena);
+	free(index->buckets);
+	free(index);
+}
+
+static struct nameindex_entry *find_entry(const alpm_nameindex_t *index,
+		const char *name, unsigned long name_hash)
+{
+	struct nameindex_entry *entry;
+
+	for(entry = index->buckets[name_hash & (index->size - 1)]; entry;
+			entry = entry->next) {
+		if(entry->name_hash == name_hash && strcmp(entry->name, name) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* double the bucket count once there are more names than buckets */
+static int grow(alpm_nameindex_t *index)
+{
+	struct nameindex_entry **buckets;
+	size_t i, size = index->size * 2;
+
+	CALLOC(buckets, size, sizeof(struct nameindex_entry *), return -1);
+	for(i = 0; i < index->size; i++) {
+		struct nameindex_entry *entry, *next;
+		for(entry = index->buckets[i]; entry; entry = next) {
+			size_t pos = entry->name_hash & (size - 1);
+			next = entry->next;
+			entry->next = buckets[pos];
+			buckets[pos] = entry;
+		}
+	}
+	free(index->buckets);
+	index->buckets = buckets;
+	index->size = size;
+	return 0;
+}
+
+/** Add an item under a name.
+ * @return 0 on success, -1 if memory ran out
+ */
+int _alpm_nameindex_add(alpm_nameindex_t *index, const char *name,
+		unsigned long name_hash, void *data)
+{
+	struct nameindex_entry *entry = find_entry(index, name, name_hash);
+	alpm_list_t *items;
+
+	if(entry == NULL) {
+		size_t pos;
+		if(index->entries >= index->size && grow(index) != 0) {
+			return -1;
+		}
+		entry = _alpm_arena_calloc(index->arena, sizeof(struct nameindex_entry));
+		if(entry == NULL) {
+			return -1;
+		}
+		entry->name = name;
+		entry->name_hash = name_hash;
+		pos = name_hash & (index->size - 1);
+		entry->next = index->buckets[pos];
+		index->buckets[pos] = entry;
+		index->entries++;
+	} else if(entry->items->prev->data == data) {
+		return 0;
+	}
+
+	items = _alpm_arena_list_add(index->arena, entry->items, data);
+	if(items == NULL) {
+		return -1;
+	}
+	entry->items = items;
+	return 0;
+}
+
+/** Look up the items added under a name.
+ * @return the items in the order they were added, NULL if there are none
+ */
+alpm_list_t *_alpm_nameindex_find(const alpm_nameindex_t *index,
+		const char *name, unsigned long name_hash)
+{
+	struct nameindex_entry *entry;
+
+	if(index == NULL || name == NULL) {
+		return NULL;
+	}
+	entry = find_entry(index, name, name_hash);
+	return entry ? entry->items : NULL;
+}
@@ -0,0 +1,44 @@
+/*
+ *  nameindex.h
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALPM_NAMEINDEX_H
+#define ALPM_NAMEINDEX_H
+
+#include <stddef.h>
+
+#include "alpm_list.h"
+
+/**
+ * @brief A hash table mapping names to lists of items.
+ *
+ * Names are not copied and must outlive the index. Items are kept in the
+ * order they were added, and adding the same item under a name twice in a
+ * row has no effect. The lists returned by _alpm_nameindex_find() belong to
+ * the index and must not be modified or freed.
+ */
+typedef struct _alpm_nameindex_t alpm_nameindex_t;
+
+alpm_nameindex_t *_alpm_nameindex_new(size_t size);
+void _alpm_nameindex_free(alpm_nameindex_t *index);
+
+int _alpm_nameindex_add(alpm_nameindex_t *index, const char *name,
+		unsigned long name_hash, void *data);
+alpm_list_t *_alpm_nameindex_find(const alpm_nameindex_t *index,
+		const char *name, unsigned long name_hash);
+
+#endif /* ALPM_NAMEINDEX_H */
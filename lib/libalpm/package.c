@@ -27,6 +27,7 @@
 
 /* libalpm */
 #include "package.h"
+#include "add.h"
 #include "alpm_list.h"
 #include "log.h"
 #include "util.h"
@@ -462,16 +463,18 @@ int SYMEXPORT alpm_pkg_has_scriptlet(alpm_pkg_t *pkg)
 	return pkg->ops->has_scriptlet(pkg);
 }
 
-static void find_requiredby(alpm_pkg_t *pkg, alpm_db_t *db, alpm_list_t **reqs,
-		int optional)
+static void add_requiredby(alpm_pkg_t *pkg, alpm_list_t *dependents,
+		alpm_list_t **reqs, int optional)
 {
-	const alpm_list_t *i;
-	pkg->handle->pm_errno = ALPM_ERR_OK;
-
-	for(i = _alpm_db_get_pkgcache(db); i; i = i->next) {
-		alpm_pkg_t *cachepkg = i->data;
+	for(; dependents; dependents = dependents->next) {
+		alpm_pkg_t *cachepkg = dependents->data;
+		const char *cachepkgname = cachepkg->name;
 		alpm_list_t *j;
 
+		if(alpm_list_find_str(*reqs, cachepkgname) != NULL) {
+			continue;
+		}
+
 		if(optional == 0) {
 			j = alpm_pkg_get_depends(cachepkg);
 		} else {
@@ -480,15 +483,29 @@ static void find_requiredby(alpm_pkg_t *pkg, alpm_db_t *db, alpm_list_t **reqs,
 
 		for(; j; j = j->next) {
 			if(_alpm_depcmp(pkg, j->data)) {
-				const char *cachepkgname = cachepkg->name;
-				if(alpm_list_find_str(*reqs, cachepkgname) == NULL) {
-					*reqs = alpm_list_add(*reqs, strdup(cachepkgname));
-				}
+				*reqs = alpm_list_add(*reqs, strdup(cachepkgname));
+				break;
 			}
 		}
 	}
 }
 
+static void find_requiredby(alpm_pkg_t *pkg, alpm_db_t *db, alpm_list_t **reqs,
+		int optional)
+{
+	const alpm_list_t *i;
+	pkg->handle->pm_errno = ALPM_ERR_OK;
+
+	/* pkg can only satisfy dependencies on its name or one of its provisions */
+	add_requiredby(pkg, _alpm_db_get_dependents(db, pkg->name, pkg->name_hash,
+				optional), reqs, optional);
+	for(i = alpm_pkg_get_provides(pkg); i; i = i->next) {
+		alpm_depend_t *provision = i->data;
+		add_requiredby(pkg, _alpm_db_get_dependents(db, provision->name,
+					provision->name_hash, optional), reqs, optional);
+	}
+}
+
 static alpm_list_t *compute_requiredby(alpm_pkg_t *pkg, int optional)
 {
 	const alpm_list_t *i;
@@ -512,10 +529,9 @@ static alpm_list_t *compute_requiredby(alpm_pkg_t *pkg, int optional)
 				db = i->data;
 				find_requiredby(pkg, db, &reqs, optional);
 			}
-			reqs = alpm_list_msort(reqs, alpm_list_count(reqs), _alpm_str_cmp);
 		}
 	}
-	return reqs;
+	return alpm_list_msort(reqs, alpm_list_count(reqs), _alpm_str_cmp);
 }
 
 /** Compute the packages requiring a given package. */
@@ -668,6 +684,15 @@ void _alpm_pkg_free(alpm_pkg_t *pkg)
 		return;
 	}
 
+	if(pkg->in_arena) {
+		/* only the file list array, backup entries, deltas and transaction
+		 * data are allocated separately */
+		free(pkg->files.files);
+		alpm_list_free_inner(pkg->backup, (alpm_list_fn_free)_alpm_backup_free);
+		alpm_list_free(pkg->backup);
+		goto free_common;
+	}
+
 	FREE(pkg->filename);
 	FREE(pkg->base);
 	FREE(pkg->name);
@@ -696,11 +721,17 @@ void _alpm_pkg_free(alpm_pkg_t *pkg)
 	free_deplist(pkg->optdepends);
 	free_deplist(pkg->conflicts);
 	free_deplist(pkg->provides);
+
+free_common:
 	alpm_list_free_inner(pkg->deltas, (alpm_list_fn_free)_alpm_delta_free);
 	alpm_list_free(pkg->deltas);
 	alpm_list_free(pkg->delta_path);
 	alpm_list_free(pkg->removes);
 	_alpm_pkg_free(pkg->oldpkg);
+	free(pkg->dl_md5sum);
+	free(pkg->dl_sha256sum);
+	/* the package was never installed from it */
+	_alpm_stage_free(pkg->stage);
 
 	if(pkg->origin == ALPM_PKG_FROM_FILE) {
 		FREE(pkg->origin_data.file);
@@ -728,6 +759,8 @@ void _alpm_pkg_free_trans(alpm_pkg_t *pkg)
 	pkg->removes = NULL;
 	_alpm_pkg_free(pkg->oldpkg);
 	pkg->oldpkg = NULL;
+	FREE(pkg->dl_md5sum);
+	FREE(pkg->dl_sha256sum);
 }
 
 /* Is spkg an upgrade for localpkg? */
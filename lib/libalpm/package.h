@@ -122,6 +122,13 @@ struct __alpm_pkg_t {
 	alpm_list_t *delta_path;
 	alpm_list_t *removes; /* in transaction targets only */
 	alpm_pkg_t *oldpkg; /* in transaction targets only */
+	/* digests of the file computed while downloading it, in transaction
+	 * targets only */
+	char *dl_md5sum;
+	char *dl_sha256sum;
+	/* files extracted ahead of installing the package, in transaction
+	 * targets only */
+	struct pkg_stage *stage;
 
 	struct pkg_operations *ops;
 
@@ -142,6 +149,9 @@ struct __alpm_pkg_t {
 	int infolevel;
 	/* Bitfield from alpm_pkgvalidation_t */
 	int validation;
+	/* metadata strings, dependencies and their list nodes are owned by the
+	 * arena of the database the package came from */
+	int in_arena;
 };
 
 alpm_file_t *_alpm_file_copy(alpm_file_t *dest, const alpm_file_t *src);
@@ -208,6 +208,15 @@ gpg_error:
 	RET_ERR(handle, ALPM_ERR_GPGME, -1);
 }
 
+/** Set up GPGME ahead of signature checks made from several threads.
+ * @param handle the context handle
+ * @return 0 on success, -1 on error (pm_errno is set accordingly)
+ */
+int _alpm_gpgme_init(alpm_handle_t *handle)
+{
+	return init_gpgme(handle);
+}
+
 /**
  * Determine if we have a key is known in our local keyring.
  * @param handle the context handle
@@ -709,6 +718,11 @@ error:
 }
 
 #else /* HAVE_LIBGPGME */
+int _alpm_gpgme_init(alpm_handle_t UNUSED *handle)
+{
+	return 0;
+}
+
 int _alpm_key_in_keychain(alpm_handle_t UNUSED *handle, const char UNUSED *fpr)
 {
 	return -1;
@@ -22,6 +22,7 @@
 #include "alpm.h"
 
 char *_alpm_sigpath(alpm_handle_t *handle, const char *path);
+int _alpm_gpgme_init(alpm_handle_t *handle);
 int _alpm_gpgme_checksig(alpm_handle_t *handle, const char *path,
 		const char *base64_sig, alpm_siglist_t *result);
 
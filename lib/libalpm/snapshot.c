@@ -0,0 +1,1062 @@
+/*
+ *  snapshot.c
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* libalpm */
+#include "snapshot.h"
+#include "alpm_list.h"
+#include "backup.h"
+#include "delta.h"
+#include "deps.h"
+#include "handle.h"
+#include "log.h"
+#include "package.h"
+#include "util.h"
+
+/* On-disk layout:
+ *
+ *   header | record table (sorted by name) | path table (sorted by path) |
+ *   basename table (sorted by basename) | data
+ *
+ * All offsets are absolute file offsets. Integers are stored in host byte
+ * order; a snapshot written on a host of different endianness is simply
+ * rejected and rebuilt. Each section is a sequence of fields, every field
+ * being a field header followed by 'len' bytes of data and a NUL byte,
+ * padded to a multiple of four bytes. */
+
+#define SNAPSHOT_MAGIC "ALPMSNAP"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_BYTEORDER 0x01020304u
+
+#define SNAPSHOT_FLAG_SCRIPTLET (1 << 0)
+
+enum snapshot_field {
+	FIELD_FILENAME = 1,
+	FIELD_BASE,
+	FIELD_DESC,
+	FIELD_URL,
+	FIELD_ARCH,
+	FIELD_PACKAGER,
+	FIELD_MD5SUM,
+	FIELD_SHA256SUM,
+	FIELD_PGPSIG,
+	FIELD_BUILDDATE,
+	FIELD_INSTALLDATE,
+	FIELD_CSIZE,
+	FIELD_ISIZE,
+	FIELD_REASON,
+	FIELD_VALIDATION,
+	FIELD_GROUP,
+	FIELD_LICENSE,
+	FIELD_REPLACES,
+	FIELD_DEPENDS,
+	FIELD_OPTDEPENDS,
+	FIELD_CONFLICTS,
+	FIELD_PROVIDES,
+	FIELD_DELTA,
+	FIELD_FILE,
+	FIELD_BACKUP
+};
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t count;
+	uint64_t paths;
+	uint64_t basenames;
+	/* identity of the source the snapshot was built from */
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime;
+	int64_t src_mtime_nsec;
+};
+
+struct snapshot_record {
+	uint64_t name;
+	uint64_t version;
+	uint64_t section[2];
+	uint64_t section_len[2];
+	uint32_t flags;
+	uint32_t reserved;
+	/* files the record was read from, see _alpm_snapshot_stamps_match() */
+	alpm_snapshot_stamp_t stamps[SNAPSHOT_STAMPS];
+};
+
+/* one entry per file of every package, mapping a path (or, in the basename
+ * table, the part after its last slash) to its owner */
+struct snapshot_path {
+	uint64_t path;
+	uint64_t record;
+};
+
+struct snapshot_field_header {
+	uint32_t type;
+	uint32_t len;
+};
+
+struct _alpm_snapshot_t {
+	const char *map;
+	size_t size;
+	size_t count;
+	const struct snapshot_record *records;
+	size_t paths;
+	const struct snapshot_path *path_table;
+	size_t basenames;
+	const struct snapshot_path *basename_table;
+};
+
+struct _alpm_snapshot_writer_t {
+	char *data;
+	size_t data_len;
+	size_t data_size;
+	struct snapshot_record *records;
+	size_t count;
+	size_t records_size;
+	struct snapshot_path *paths;
+	size_t path_count;
+	size_t paths_size;
+	struct snapshot_path *basenames;
+	size_t basename_count;
+	size_t basenames_size;
+	/* name of the last record added, kept to enforce the sort order */
+	char *last_name;
+};
+
+static void stamp_source(struct snapshot_header *hdr, const struct stat *st)
+{
+	hdr->src_dev = (uint64_t)st->st_dev;
+	hdr->src_ino = (uint64_t)st->st_ino;
+	hdr->src_size = (uint64_t)st->st_size;
+	hdr->src_mtime = (int64_t)st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	hdr->src_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+static int string_valid(const char *map, size_t size, uint64_t offset)
+{
+	return offset < size && memchr(map + offset, '\0', size - offset) != NULL;
+}
+
+static int validate_snapshot(const char *map, size_t size,
+		const struct stat *source, size_t *count, size_t *paths,
+		size_t *basenames)
+{
+	struct snapshot_header hdr, expect;
+	const struct snapshot_record *records;
+	size_t i;
+
+	if(size < sizeof(hdr)) {
+		return -1;
+	}
+	memcpy(&hdr, map, sizeof(hdr));
+	if(memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.version != SNAPSHOT_VERSION
+			|| hdr.byteorder != SNAPSHOT_BYTEORDER
+			|| hdr.size != size) {
+		return -1;
+	}
+
+	memset(&expect, 0, sizeof(expect));
+	stamp_source(&expect, source);
+	if(hdr.src_dev != expect.src_dev || hdr.src_ino != expect.src_ino
+			|| hdr.src_size != expect.src_size
+			|| hdr.src_mtime != expect.src_mtime
+			|| hdr.src_mtime_nsec != expect.src_mtime_nsec) {
+		return 1;
+	}
+
+	if(hdr.count > (size - sizeof(hdr)) / sizeof(struct snapshot_record)
+			|| hdr.paths > (size - sizeof(hdr) - hdr.count * sizeof(struct snapshot_record))
+				/ sizeof(struct snapshot_path)
+			|| hdr.basenames > (size - sizeof(hdr) - hdr.count * sizeof(struct snapshot_record)
+				- hdr.paths * sizeof(struct snapshot_path)) / sizeof(struct snapshot_path)) {
+		return -1;
+	}
+	records = (const struct snapshot_record *)(map + sizeof(hdr));
+	for(i = 0; i < hdr.count; i++) {
+		const struct snapshot_record *rec = records + i;
+		int s;
+		if(!string_valid(map, size, rec->name)
+				|| !string_valid(map, size, rec->version)) {
+			return -1;
+		}
+		for(s = 0; s < 2; s++) {
+			if(rec->section[s] > size || rec->section_len[s] > size - rec->section[s]) {
+				return -1;
+			}
+		}
+	}
+
+	/* path table entries are checked as they are looked at */
+	*count = hdr.count;
+	*paths = hdr.paths;
+	*basenames = hdr.basenames;
+	return 0;
+}
+
+/** Map a snapshot from disk.
+ * @param handle the context handle
+ * @param path location of the snapshot file
+ * @param source stat information of the data the snapshot was built from
+ * @return the snapshot, or NULL if it is missing, damaged or out of date
+ */
+alpm_snapshot_t *_alpm_snapshot_open(alpm_handle_t *handle, const char *path,
+		const struct stat *source)
+{
+	alpm_snapshot_t *snapshot;
+	struct stat st;
+	void *map;
+	size_t count, paths, basenames;
+	int fd, ret;
+
+	OPEN(fd, path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "no snapshot at %s\n", path);
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not map snapshot %s: %s\n",
+				path, strerror(errno));
+		return NULL;
+	}
+
+	ret = validate_snapshot(map, (size_t)st.st_size, source, &count, &paths,
+			&basenames);
+	if(ret != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "ignoring %s snapshot %s\n",
+				ret > 0 ? "stale" : "invalid", path);
+		munmap(map, (size_t)st.st_size);
+		return NULL;
+	}
+
+	CALLOC(snapshot, 1, sizeof(alpm_snapshot_t),
+			munmap(map, (size_t)st.st_size); return NULL);
+	snapshot->map = map;
+	snapshot->size = (size_t)st.st_size;
+	snapshot->count = count;
+	snapshot->records = (const struct snapshot_record *)
+		(snapshot->map + sizeof(struct snapshot_header));
+	snapshot->paths = paths;
+	snapshot->path_table = (const struct snapshot_path *)
+		(snapshot->records + count);
+	snapshot->basenames = basenames;
+	snapshot->basename_table = snapshot->path_table + paths;
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "mapped snapshot %s with %zu packages\n",
+			path, count);
+	return snapshot;
+}
+
+void _alpm_snapshot_close(alpm_snapshot_t *snapshot)
+{
+	if(snapshot == NULL) {
+		return;
+	}
+	munmap((void *)snapshot->map, snapshot->size);
+	free(snapshot);
+}
+
+size_t _alpm_snapshot_count(const alpm_snapshot_t *snapshot)
+{
+	return snapshot->count;
+}
+
+const char *_alpm_snapshot_name(const alpm_snapshot_t *snapshot, size_t idx)
+{
+	return snapshot->map + snapshot->records[idx].name;
+}
+
+const char *_alpm_snapshot_version(const alpm_snapshot_t *snapshot, size_t idx)
+{
+	return snapshot->map + snapshot->records[idx].version;
+}
+
+int _alpm_snapshot_has_scriptlet(const alpm_snapshot_t *snapshot, size_t idx)
+{
+	return (snapshot->records[idx].flags & SNAPSHOT_FLAG_SCRIPTLET) != 0;
+}
+
+/** Compare the stamps of a record with those of the files it was read from.
+ * @param snapshot the snapshot
+ * @param idx record index of the package
+ * @param stamps SNAPSHOT_STAMPS stamps, in the order given when writing
+ * @return 1 if all of them match, 0 otherwise
+ */
+int _alpm_snapshot_stamps_match(const alpm_snapshot_t *snapshot, size_t idx,
+		const alpm_snapshot_stamp_t *stamps)
+{
+	return memcmp(snapshot->records[idx].stamps, stamps,
+			sizeof(snapshot->records[idx].stamps)) == 0;
+}
+
+/** Look up the record of a package by name.
+ * @return the record index, or -1 if there is no such package
+ */
+ssize_t _alpm_snapshot_find(const alpm_snapshot_t *snapshot, const char *name)
+{
+	size_t lo = 0, hi = snapshot->count;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, _alpm_snapshot_name(snapshot, mid));
+		if(cmp == 0) {
+			return (ssize_t)mid;
+		} else if(cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+/* find the range of entries of a path or basename table matching key */
+static ssize_t find_in_table(const alpm_snapshot_t *snapshot,
+		const struct snapshot_path *table, size_t entries, const char *key,
+		size_t *first)
+{
+	size_t lo = 0, hi = entries, end;
+
+	/* find the first entry not sorting before key */
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(!string_valid(snapshot->map, snapshot->size, table[mid].path)) {
+			return -1;
+		}
+		if(strcmp(snapshot->map + table[mid].path, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for(end = lo; end < entries; end++) {
+		if(!string_valid(snapshot->map, snapshot->size, table[end].path)
+				|| table[end].record >= snapshot->count) {
+			return -1;
+		}
+		if(strcmp(snapshot->map + table[end].path, key) != 0) {
+			break;
+		}
+	}
+
+	*first = lo;
+	return (ssize_t)(end - lo);
+}
+
+/** Look up the packages owning a path.
+ * @param snapshot the snapshot
+ * @param path the path, relative to the root, with a trailing slash for
+ * directories
+ * @param first set to the path table index of the first owner
+ * @return the number of owners, or -1 if the path table is damaged
+ */
+ssize_t _alpm_snapshot_find_path(const alpm_snapshot_t *snapshot,
+		const char *path, size_t *first)
+{
+	return find_in_table(snapshot, snapshot->path_table, snapshot->paths,
+			path, first);
+}
+
+/** Get the record index of the owner at a path table index. */
+size_t _alpm_snapshot_path_record(const alpm_snapshot_t *snapshot, size_t idx)
+{
+	return (size_t)snapshot->path_table[idx].record;
+}
+
+/** Look up the packages with a file of a given name in any directory.
+ * A package is listed once for each such file, in package order.
+ * @param snapshot the snapshot
+ * @param basename the file name, without any directory
+ * @param first set to the basename table index of the first match
+ * @return the number of matches, or -1 if the basename table is damaged
+ */
+ssize_t _alpm_snapshot_find_basename(const alpm_snapshot_t *snapshot,
+		const char *basename, size_t *first)
+{
+	return find_in_table(snapshot, snapshot->basename_table,
+			snapshot->basenames, basename, first);
+}
+
+/** Get the record index of the package at a basename table index. */
+size_t _alpm_snapshot_basename_record(const alpm_snapshot_t *snapshot,
+		size_t idx)
+{
+	return (size_t)snapshot->basename_table[idx].record;
+}
+
+static int64_t read_int(const char *data, uint32_t len)
+{
+	int64_t val = 0;
+	if(len == sizeof(val)) {
+		memcpy(&val, data, sizeof(val));
+	}
+	return val;
+}
+
+#define STORE_STRING(f) do { \
+	if(arena) { \
+		if((f = _alpm_arena_strdup(arena, data)) == NULL) goto error; \
+	} else { \
+		FREE(f); \
+		STRDUP(f, data, goto error); \
+	} \
+} while(0)
+
+#define STORE_LIST(f) do { \
+	char *dup; \
+	if(arena) { \
+		if((dup = _alpm_arena_strdup(arena, data)) == NULL \
+				|| (f = _alpm_arena_list_add(arena, f, dup)) == NULL) goto error; \
+	} else { \
+		STRDUP(dup, data, goto error); \
+		f = alpm_list_add(f, dup); \
+	} \
+} while(0)
+
+#define STORE_DEP(f) do { \
+	alpm_depend_t *dep = _alpm_dep_from_string(arena, data); \
+	if(dep == NULL) goto error; \
+	if(arena) { \
+		if((f = _alpm_arena_list_add(arena, f, dep)) == NULL) goto error; \
+	} else { \
+		f = alpm_list_add(f, dep); \
+	} \
+} while(0)
+
+/** Fill in one section of a package from its snapshot record.
+ * @param snapshot the snapshot
+ * @param idx record index of the package
+ * @param section the section to load
+ * @param pkg the package to fill in
+ * @param arena if not NULL, metadata is allocated from this arena
+ * @return 0 on success, -1 if the record is damaged or memory ran out
+ */
+int _alpm_snapshot_read(const alpm_snapshot_t *snapshot, size_t idx,
+		alpm_snapshot_section_t section, alpm_pkg_t *pkg, alpm_arena_t *arena)
+{
+	const struct snapshot_record *rec = snapshot->records + idx;
+	const char *pos = snapshot->map + rec->section[section];
+	const char *end = pos + rec->section_len[section];
+	size_t files_count = 0, files_size = 0;
+	alpm_file_t *files = NULL;
+
+	while(pos < end) {
+		struct snapshot_field_header fh;
+		const char *data;
+
+		if((size_t)(end - pos) < sizeof(fh)) {
+			goto error;
+		}
+		memcpy(&fh, pos, sizeof(fh));
+		data = pos + sizeof(fh);
+		if(fh.len >= (size_t)(end - data) || data[fh.len] != '\0') {
+			goto error;
+		}
+		pos = data + ((fh.len + 1 + 3) & ~(size_t)3);
+
+		switch(fh.type) {
+			case FIELD_FILENAME:
+				STORE_STRING(pkg->filename);
+				break;
+			case FIELD_BASE:
+				STORE_STRING(pkg->base);
+				break;
+			case FIELD_DESC:
+				STORE_STRING(pkg->desc);
+				break;
+			case FIELD_URL:
+				STORE_STRING(pkg->url);
+				break;
+			case FIELD_ARCH:
+				STORE_STRING(pkg->arch);
+				break;
+			case FIELD_PACKAGER:
+				STORE_STRING(pkg->packager);
+				break;
+			case FIELD_MD5SUM:
+				STORE_STRING(pkg->md5sum);
+				break;
+			case FIELD_SHA256SUM:
+				STORE_STRING(pkg->sha256sum);
+				break;
+			case FIELD_PGPSIG:
+				STORE_STRING(pkg->base64_sig);
+				break;
+			case FIELD_BUILDDATE:
+				pkg->builddate = (alpm_time_t)read_int(data, fh.len);
+				break;
+			case FIELD_INSTALLDATE:
+				pkg->installdate = (alpm_time_t)read_int(data, fh.len);
+				break;
+			case FIELD_CSIZE:
+				pkg->size = (off_t)read_int(data, fh.len);
+				break;
+			case FIELD_ISIZE:
+				pkg->isize = (off_t)read_int(data, fh.len);
+				break;
+			case FIELD_REASON:
+				pkg->reason = (alpm_pkgreason_t)read_int(data, fh.len);
+				break;
+			case FIELD_VALIDATION:
+				pkg->validation = (int)read_int(data, fh.len);
+				break;
+			case FIELD_GROUP:
+				STORE_LIST(pkg->groups);
+				break;
+			case FIELD_LICENSE:
+				STORE_LIST(pkg->licenses);
+				break;
+			case FIELD_REPLACES:
+				STORE_DEP(pkg->replaces);
+				break;
+			case FIELD_DEPENDS:
+				STORE_DEP(pkg->depends);
+				break;
+			case FIELD_OPTDEPENDS:
+				STORE_DEP(pkg->optdepends);
+				break;
+			case FIELD_CONFLICTS:
+				STORE_DEP(pkg->conflicts);
+				break;
+			case FIELD_PROVIDES:
+				STORE_DEP(pkg->provides);
+				break;
+			case FIELD_DELTA:
+				if(pkg->handle->deltaratio > 0.0) {
+					pkg->deltas = alpm_list_add(pkg->deltas,
+							_alpm_delta_parse(pkg->handle, data));
+				}
+				break;
+			case FIELD_FILE:
+				if(!_alpm_greedy_grow((void **)&files, &files_size,
+							(files_count ? (files_count + 1) * sizeof(alpm_file_t) : 8 * sizeof(alpm_file_t)))) {
+					goto error;
+				}
+				memset(files + files_count, 0, sizeof(alpm_file_t));
+				if(arena) {
+					files[files_count].name = _alpm_arena_strndup(arena, data, fh.len);
+					if(files[files_count].name == NULL) {
+						goto error;
+					}
+				} else {
+					MALLOC(files[files_count].name, fh.len + 1, goto error);
+					memcpy(files[files_count].name, data, fh.len + 1);
+				}
+				files_count++;
+				break;
+			case FIELD_BACKUP:
+				{
+					alpm_backup_t *backup;
+					CALLOC(backup, 1, sizeof(alpm_backup_t), goto error);
+					if(_alpm_split_backup(data, &backup)) {
+						FREE(backup);
+						goto error;
+					}
+					pkg->backup = alpm_list_add(pkg->backup, backup);
+				}
+				break;
+			default:
+				/* unknown fields are skipped */
+				break;
+		}
+	}
+
+	if(section == SNAPSHOT_SECTION_FILES) {
+		if(files_count > 0) {
+			alpm_file_t *newfiles = realloc(files, sizeof(alpm_file_t) * files_count);
+			if(newfiles != NULL) {
+				files = newfiles;
+			}
+		} else {
+			FREE(files);
+		}
+		/* file lists are stored in sorted order */
+		pkg->files.count = files_count;
+		pkg->files.files = files;
+	}
+
+	return 0;
+
+error:
+	while(!arena && files_count > 0) {
+		FREE(files[--files_count].name);
+	}
+	FREE(files);
+	_alpm_log(pkg->handle, ALPM_LOG_DEBUG,
+			"damaged snapshot record for package %s\n", pkg->name);
+	return -1;
+}
+
+#undef STORE_STRING
+#undef STORE_LIST
+#undef STORE_DEP
+
+/** Fill in a record stamp from the stat information of a file. */
+void _alpm_snapshot_stamp(alpm_snapshot_stamp_t *stamp, const struct stat *st)
+{
+	memset(stamp, 0, sizeof(alpm_snapshot_stamp_t));
+	stamp->ino = (int64_t)st->st_ino;
+	stamp->size = (int64_t)st->st_size;
+	stamp->mtime = (int64_t)st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	stamp->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+alpm_snapshot_writer_t *_alpm_snapshot_writer_new(void)
+{
+	alpm_snapshot_writer_t *writer;
+	CALLOC(writer, 1, sizeof(alpm_snapshot_writer_t), return NULL);
+	return writer;
+}
+
+void _alpm_snapshot_writer_free(alpm_snapshot_writer_t *writer)
+{
+	if(writer == NULL) {
+		return;
+	}
+	free(writer->data);
+	free(writer->records);
+	free(writer->paths);
+	free(writer->basenames);
+	free(writer->last_name);
+	free(writer);
+}
+
+/* grow a writer buffer to hold at least required bytes; unlike
+ * _alpm_greedy_grow this also copes with a single append larger than
+ * the current size */
+static void *writer_grow(void **data, size_t *current, size_t required)
+{
+	size_t newsize;
+
+	if(*current >= required) {
+		return data;
+	}
+	newsize = *current * 2;
+	if(newsize < required) {
+		newsize = required;
+	}
+	return _alpm_realloc(data, current, newsize);
+}
+
+/* append raw bytes to the data area; returns the offset they were put at */
+static int put_bytes(alpm_snapshot_writer_t *w, const void *bytes, size_t len,
+		uint64_t *offset)
+{
+	size_t padded = (len + 3) & ~(size_t)3;
+
+	if(!writer_grow((void **)&w->data, &w->data_size, w->data_len + padded)) {
+		return -1;
+	}
+	if(offset) {
+		*offset = w->data_len;
+	}
+	memcpy(w->data + w->data_len, bytes, len);
+	memset(w->data + w->data_len + len, 0, padded - len);
+	w->data_len += padded;
+	return 0;
+}
+
+static int put_field(alpm_snapshot_writer_t *w, enum snapshot_field type,
+		const void *value, size_t len)
+{
+	struct snapshot_field_header fh;
+	size_t padded = (len + 1 + 3) & ~(size_t)3;
+
+	if(len >= UINT32_MAX) {
+		return -1;
+	}
+	fh.type = type;
+	fh.len = (uint32_t)len;
+	if(!writer_grow((void **)&w->data, &w->data_size,
+				w->data_len + sizeof(fh) + padded)) {
+		return -1;
+	}
+	memcpy(w->data + w->data_len, &fh, sizeof(fh));
+	w->data_len += sizeof(fh);
+	memcpy(w->data + w->data_len, value, len);
+	memset(w->data + w->data_len + len, 0, padded - len);
+	w->data_len += padded;
+	return 0;
+}
+
+static int put_string(alpm_snapshot_writer_t *w, enum snapshot_field type,
+		const char *str)
+{
+	if(str == NULL) {
+		return 0;
+	}
+	return put_field(w, type, str, strlen(str));
+}
+
+static int put_int(alpm_snapshot_writer_t *w, enum snapshot_field type,
+		int64_t val)
+{
+	if(val == 0) {
+		return 0;
+	}
+	return put_field(w, type, &val, sizeof(val));
+}
+
+static int put_strlist(alpm_snapshot_writer_t *w, enum snapshot_field type,
+		alpm_list_t *list)
+{
+	for(; list; list = list->next) {
+		if(put_string(w, type, list->data) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int put_deplist(alpm_snapshot_writer_t *w, enum snapshot_field type,
+		alpm_list_t *list)
+{
+	for(; list; list = list->next) {
+		char *depstring = alpm_dep_compute_string(list->data);
+		int ret;
+		if(depstring == NULL) {
+			return -1;
+		}
+		ret = put_string(w, type, depstring);
+		free(depstring);
+		if(ret != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int put_deltas(alpm_snapshot_writer_t *w, alpm_list_t *deltas)
+{
+	for(; deltas; deltas = deltas->next) {
+		const alpm_delta_t *d = deltas->data;
+		char *line;
+		int ret;
+		/* same layout as a %DELTAS% line of a sync database */
+		if(asprintf(&line, "%s %s %jd %s %s", d->delta, d->delta_md5,
+					(intmax_t)d->delta_size, d->from, d->to) < 0) {
+			return -1;
+		}
+		ret = put_string(w, FIELD_DELTA, line);
+		free(line);
+		if(ret != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int put_desc(alpm_snapshot_writer_t *w, alpm_pkg_t *pkg)
+{
+	if(put_string(w, FIELD_FILENAME, pkg->filename)
+			|| put_string(w, FIELD_BASE, pkg->base)
+			|| put_string(w, FIELD_DESC, pkg->desc)
+			|| put_string(w, FIELD_URL, pkg->url)
+			|| put_string(w, FIELD_ARCH, pkg->arch)
+			|| put_string(w, FIELD_PACKAGER, pkg->packager)
+			|| put_string(w, FIELD_MD5SUM, pkg->md5sum)
+			|| put_string(w, FIELD_SHA256SUM, pkg->sha256sum)
+			|| put_string(w, FIELD_PGPSIG, pkg->base64_sig)
+			|| put_int(w, FIELD_BUILDDATE, pkg->builddate)
+			|| put_int(w, FIELD_INSTALLDATE, pkg->installdate)
+			|| put_int(w, FIELD_CSIZE, pkg->size)
+			|| put_int(w, FIELD_ISIZE, pkg->isize)
+			|| put_int(w, FIELD_REASON, pkg->reason)
+			|| put_int(w, FIELD_VALIDATION, pkg->validation)
+			|| put_strlist(w, FIELD_GROUP, pkg->groups)
+			|| put_strlist(w, FIELD_LICENSE, pkg->licenses)
+			|| put_deplist(w, FIELD_REPLACES, pkg->replaces)
+			|| put_deplist(w, FIELD_DEPENDS, pkg->depends)
+			|| put_deplist(w, FIELD_OPTDEPENDS, pkg->optdepends)
+			|| put_deplist(w, FIELD_CONFLICTS, pkg->conflicts)
+			|| put_deplist(w, FIELD_PROVIDES, pkg->provides)
+			|| put_deltas(w, pkg->deltas)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int put_files(alpm_snapshot_writer_t *w, alpm_pkg_t *pkg)
+{
+	alpm_list_t *lp;
+	size_t i;
+
+	for(i = 0; i < pkg->files.count; i++) {
+		const char *name = pkg->files.files[i].name;
+		const char *basename = strrchr(name, '/');
+		/* the name follows the field header */
+		uint64_t offset = w->data_len + sizeof(struct snapshot_field_header);
+
+		if(!writer_grow((void **)&w->paths, &w->paths_size,
+					(w->path_count + 1) * sizeof(struct snapshot_path))
+				|| !writer_grow((void **)&w->basenames, &w->basenames_size,
+					(w->basename_count + 1) * sizeof(struct snapshot_path))) {
+			return -1;
+		}
+		if(put_string(w, FIELD_FILE, name) != 0) {
+			return -1;
+		}
+
+		w->paths[w->path_count].path = offset;
+		w->paths[w->path_count].record = w->count;
+		w->path_count++;
+		/* directories and files at the top level have no basename entry */
+		if(basename && basename[1] != '\0') {
+			w->basenames[w->basename_count].path = offset + (uint64_t)(basename + 1 - name);
+			w->basenames[w->basename_count].record = w->count;
+			w->basename_count++;
+		}
+	}
+	for(lp = pkg->backup; lp; lp = lp->next) {
+		const alpm_backup_t *backup = lp->data;
+		char *line;
+		int ret;
+		if(asprintf(&line, "%s\t%s", backup->name, backup->hash) < 0) {
+			return -1;
+		}
+		ret = put_string(w, FIELD_BACKUP, line);
+		free(line);
+		if(ret != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Append a package to a snapshot being built.
+ * Packages must be added in ascending name order and must be fully loaded;
+ * fields are taken directly from the package struct.
+ * @param writer the snapshot being built
+ * @param pkg the package
+ * @param stamps SNAPSHOT_STAMPS stamps of the files pkg was read from, or
+ * NULL if it does not come from separate files
+ * @return 0 on success, -1 on error
+ */
+int _alpm_snapshot_writer_add(alpm_snapshot_writer_t *writer, alpm_pkg_t *pkg,
+		const alpm_snapshot_stamp_t *stamps)
+{
+	struct snapshot_record *rec;
+	size_t start;
+
+	if(writer->last_name && strcmp(writer->last_name, pkg->name) >= 0) {
+		return -1;
+	}
+	FREE(writer->last_name);
+	STRDUP(writer->last_name, pkg->name, return -1);
+
+	if(!writer_grow((void **)&writer->records, &writer->records_size,
+				(writer->count + 1) * sizeof(struct snapshot_record))) {
+		return -1;
+	}
+	rec = writer->records + writer->count;
+	memset(rec, 0, sizeof(struct snapshot_record));
+
+	if(put_bytes(writer, pkg->name, strlen(pkg->name) + 1, &rec->name) != 0
+			|| put_bytes(writer, pkg->version, strlen(pkg->version) + 1,
+				&rec->version) != 0) {
+		return -1;
+	}
+
+	start = writer->data_len;
+	if(put_desc(writer, pkg) != 0) {
+		return -1;
+	}
+	rec->section[SNAPSHOT_SECTION_DESC] = start;
+	rec->section_len[SNAPSHOT_SECTION_DESC] = writer->data_len - start;
+
+	start = writer->data_len;
+	if(put_files(writer, pkg) != 0) {
+		return -1;
+	}
+	rec->section[SNAPSHOT_SECTION_FILES] = start;
+	rec->section_len[SNAPSHOT_SECTION_FILES] = writer->data_len - start;
+
+	if(pkg->scriptlet) {
+		rec->flags |= SNAPSHOT_FLAG_SCRIPTLET;
+	}
+	if(stamps) {
+		memcpy(rec->stamps, stamps, sizeof(rec->stamps));
+	}
+
+	writer->count++;
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while(len > 0) {
+		ssize_t n = write(fd, p, len);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+struct path_sort {
+	const char *path;
+	uint64_t record;
+};
+
+static int path_cmp(const void *p1, const void *p2)
+{
+	const struct path_sort *a = p1, *b = p2;
+	int cmp = strcmp(a->path, b->path);
+	if(cmp != 0) {
+		return cmp;
+	}
+	return (a->record > b->record) - (a->record < b->record);
+}
+
+/* sort a path or basename table, leaving the packages matching a name in
+ * package order */
+static int sort_table(alpm_snapshot_writer_t *writer,
+		struct snapshot_path *table, size_t entries, uint64_t base)
+{
+	struct path_sort *sorted;
+	size_t i;
+
+	if(entries == 0) {
+		return 0;
+	}
+	MALLOC(sorted, entries * sizeof(struct path_sort), return -1);
+	for(i = 0; i < entries; i++) {
+		sorted[i].path = writer->data + table[i].path;
+		sorted[i].record = table[i].record;
+	}
+	qsort(sorted, entries, sizeof(struct path_sort), path_cmp);
+	for(i = 0; i < entries; i++) {
+		table[i].path = (uint64_t)(sorted[i].path - writer->data) + base;
+		table[i].record = sorted[i].record;
+	}
+	free(sorted);
+	return 0;
+}
+
+/** Write a snapshot to disk, atomically replacing any existing one.
+ * @param handle the context handle
+ * @param writer the snapshot contents
+ * @param path location of the snapshot file
+ * @param source stat information of the data the snapshot was built from
+ * @return 0 on success, -1 on error
+ */
+int _alpm_snapshot_writer_commit(alpm_handle_t *handle,
+		alpm_snapshot_writer_t *writer, const char *path,
+		const struct stat *source)
+{
+	struct snapshot_header hdr;
+	uint64_t base;
+	size_t i, len;
+	char *tmppath;
+	int fd;
+
+	base = sizeof(hdr) + writer->count * sizeof(struct snapshot_record)
+		+ (writer->path_count + writer->basename_count) * sizeof(struct snapshot_path);
+	if(sort_table(writer, writer->paths, writer->path_count, base) != 0
+			|| sort_table(writer, writer->basenames, writer->basename_count,
+				base) != 0) {
+		RET_ERR(handle, ALPM_ERR_MEMORY, -1);
+	}
+	for(i = 0; i < writer->count; i++) {
+		struct snapshot_record *rec = writer->records + i;
+		rec->name += base;
+		rec->version += base;
+		rec->section[0] += base;
+		rec->section[1] += base;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.byteorder = SNAPSHOT_BYTEORDER;
+	hdr.size = base + writer->data_len;
+	hdr.count = writer->count;
+	hdr.paths = writer->path_count;
+	hdr.basenames = writer->basename_count;
+	stamp_source(&hdr, source);
+
+	len = strlen(path) + 8;
+	MALLOC(tmppath, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	snprintf(tmppath, len, "%s.XXXXXX", path);
+	fd = mkstemp(tmppath);
+	if(fd < 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not create snapshot %s: %s\n",
+				tmppath, strerror(errno));
+		free(tmppath);
+		return -1;
+	}
+
+	if(fchmod(fd, 0644) != 0
+			|| write_all(fd, &hdr, sizeof(hdr)) != 0
+			|| write_all(fd, writer->records,
+				writer->count * sizeof(struct snapshot_record)) != 0
+			|| write_all(fd, writer->paths,
+				writer->path_count * sizeof(struct snapshot_path)) != 0
+			|| write_all(fd, writer->basenames,
+				writer->basename_count * sizeof(struct snapshot_path)) != 0
+			|| write_all(fd, writer->data, writer->data_len) != 0
+			|| fsync(fd) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not write snapshot %s: %s\n",
+				tmppath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(tmppath);
+		return -1;
+	}
+	close(fd);
+
+	if(rename(tmppath, path) != 0) {
+		_alpm_log(handle, ALPM_LOG_DEBUG, "could not rename snapshot %s: %s\n",
+				tmppath, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		return -1;
+	}
+	free(tmppath);
+
+	_alpm_log(handle, ALPM_LOG_DEBUG, "wrote snapshot %s with %zu packages\n",
+			path, writer->count);
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ *  snapshot.h
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ALPM_SNAPSHOT_H
+#define ALPM_SNAPSHOT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "alpm.h"
+#include "arena.h"
+
+/**
+ * @brief A pre-parsed, memory-mapped image of a package database.
+ *
+ * A snapshot holds one record per package, sorted by package name. Each
+ * record carries the package name and version plus two sections of tagged
+ * fields: one with the information normally found in a 'desc' (and
+ * 'depends') entry and one with the file list and backup entries. Tables
+ * of every file path and of every file basename, each sorted by name, point
+ * back at the owning records. A snapshot is stamped with the identity of
+ * the source it was built from (a directory or a database archive) and is
+ * rejected if that source has changed since. Records may in addition carry
+ * stamps of the files they were read from, which a caller can compare
+ * against the files on disk to notice entries edited in place.
+ */
+typedef struct _alpm_snapshot_t alpm_snapshot_t;
+typedef struct _alpm_snapshot_writer_t alpm_snapshot_writer_t;
+
+typedef enum _alpm_snapshot_section_t {
+	SNAPSHOT_SECTION_DESC = 0,
+	SNAPSHOT_SECTION_FILES = 1
+} alpm_snapshot_section_t;
+
+/* number of stamps kept per record */
+#define SNAPSHOT_STAMPS 3
+
+/** Identity of one of the files a record was built from; all zero if the
+ * file did not exist. */
+typedef struct _alpm_snapshot_stamp_t {
+	int64_t ino;
+	int64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+} alpm_snapshot_stamp_t;
+
+alpm_snapshot_t *_alpm_snapshot_open(alpm_handle_t *handle, const char *path,
+		const struct stat *source);
+void _alpm_snapshot_close(alpm_snapshot_t *snapshot);
+
+size_t _alpm_snapshot_count(const alpm_snapshot_t *snapshot);
+const char *_alpm_snapshot_name(const alpm_snapshot_t *snapshot, size_t idx);
+const char *_alpm_snapshot_version(const alpm_snapshot_t *snapshot, size_t idx);
+int _alpm_snapshot_has_scriptlet(const alpm_snapshot_t *snapshot, size_t idx);
+int _alpm_snapshot_stamps_match(const alpm_snapshot_t *snapshot, size_t idx,
+		const alpm_snapshot_stamp_t *stamps);
+ssize_t _alpm_snapshot_find(const alpm_snapshot_t *snapshot, const char *name);
+ssize_t _alpm_snapshot_find_path(const alpm_snapshot_t *snapshot,
+		const char *path, size_t *first);
+size_t _alpm_snapshot_path_record(const alpm_snapshot_t *snapshot, size_t idx);
+ssize_t _alpm_snapshot_find_basename(const alpm_snapshot_t *snapshot,
+		const char *basename, size_t *first);
+size_t _alpm_snapshot_basename_record(const alpm_snapshot_t *snapshot,
+		size_t idx);
+int _alpm_snapshot_read(const alpm_snapshot_t *snapshot, size_t idx,
+		alpm_snapshot_section_t section, alpm_pkg_t *pkg, alpm_arena_t *arena);
+
+void _alpm_snapshot_stamp(alpm_snapshot_stamp_t *stamp, const struct stat *st);
+
+alpm_snapshot_writer_t *_alpm_snapshot_writer_new(void);
+int _alpm_snapshot_writer_add(alpm_snapshot_writer_t *writer, alpm_pkg_t *pkg,
+		const alpm_snapshot_stamp_t *stamps);
+int _alpm_snapshot_writer_commit(alpm_handle_t *handle,
+		alpm_snapshot_writer_t *writer, const char *path,
+		const struct stat *source);
+void _alpm_snapshot_writer_free(alpm_snapshot_writer_t *writer);
+
+#endif /* ALPM_SNAPSHOT_H */
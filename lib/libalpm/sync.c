@@ -28,6 +28,7 @@
 #include <stdint.h> /* intmax_t */
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
 
 /* libalpm */
 #include "sync.h"
@@ -924,6 +925,7 @@ static int find_dl_candidates(alpm_db_t *repo, alpm_list_t **files, alpm_list_t
 				ASSERT(spkg->filename != NULL, RET_ERR(handle, ALPM_ERR_PKG_INVALID_NAME, -1));
 				payload = build_payload(handle, spkg->filename, spkg->size, repo->servers);
 				ASSERT(payload, return -1);
+				payload->want_digests = 1;
 				*files = alpm_list_add(*files, payload);
 			}
 		}
@@ -932,6 +934,405 @@ static int find_dl_candidates(alpm_db_t *repo, alpm_list_t **files, alpm_list_t
 	return 0;
 }
 
+struct validity {
+	alpm_pkg_t *pkg;
+	char *path;
+	alpm_siglist_t *siglist;
+	int siglevel;
+	int validation;
+	alpm_errno_t error;
+};
+
+static void validity_cleanup(struct validity *v)
+{
+	alpm_siglist_cleanup(v->siglist);
+	free(v->siglist);
+	free(v->path);
+}
+
+/* v->pkg and v->siglevel must be set, only handle is written to */
+static int validate_target(alpm_handle_t *handle, struct validity *v)
+{
+	v->path = _alpm_filecache_find(handle, v->pkg->filename);
+	if(_alpm_pkg_validate_internal(handle, v->path, v->pkg,
+				v->siglevel, &v->siglist, &v->validation) == -1) {
+		v->error = handle->pm_errno;
+		return -1;
+	}
+	return 0;
+}
+
+/* A target validated and loaded by the worker threads */
+struct pipeline_job {
+	alpm_list_t *target;
+	struct validity v;
+	alpm_pkg_t *pkgfile;
+	/* output of the worker, passed on by the main thread once done */
+	alpm_list_t *deferred;
+	int queued;
+	int valid;
+	int done;
+};
+
+struct pipeline;
+
+struct pipeline_worker {
+	struct pipeline *pipeline;
+	/* private copy of the handle, so each worker gets its own error code
+	 * and holds back its output instead of calling into the front end */
+	alpm_handle_t handle;
+	pthread_t thread;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	/* signalled when a job is queued or the queue is closed */
+	pthread_cond_t work;
+	/* signalled when a job got through validation or is done */
+	pthread_cond_t progress;
+	struct pipeline_job *jobs;
+	struct pipeline_job **queue;
+	struct pipeline_worker *workers;
+	/* used for jobs processed without worker threads */
+	alpm_handle_t handle;
+	size_t count;
+	size_t queued;
+	size_t taken;
+	size_t validated;
+	size_t done;
+	/* progress is weighted by package size, as without a pipeline; the
+	 * targets loaded from files count as done from the start */
+	size_t targets;
+	uint64_t total_bytes;
+	uint64_t validated_bytes;
+	uint64_t done_bytes;
+	size_t nworkers;
+	/* files still being downloaded */
+	size_t downloads;
+	int validate;
+	int load;
+	/* extract the files of each loaded package ahead of installing it */
+	int stage;
+	int closed;
+};
+
+static void pipeline_process(alpm_handle_t *handle, struct pipeline *pipeline,
+		struct pipeline_job *job)
+{
+	if(pipeline->validate) {
+		job->valid = validate_target(handle, &job->v) == 0;
+	}
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->validated++;
+	pipeline->validated_bytes += job->v.pkg->size;
+	pthread_cond_broadcast(&pipeline->progress);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if(pipeline->load && job->valid) {
+		char *filepath = job->v.path;
+		if(filepath == NULL) {
+			filepath = _alpm_filecache_find(handle, job->v.pkg->filename);
+		}
+		job->pkgfile = _alpm_pkg_load_internal(handle, filepath, 1);
+		if(!job->pkgfile) {
+			_alpm_log(handle, ALPM_LOG_DEBUG, "failed to load pkgfile internal\n");
+			job->v.error = handle->pm_errno;
+		} else if(pipeline->stage) {
+			/* if staging fails, the package file itself is installed */
+			_alpm_stage_pkg(handle, job->pkgfile);
+		}
+		if(filepath != job->v.path) {
+			free(filepath);
+		}
+	}
+	pthread_mutex_lock(&pipeline->lock);
+	job->done = 1;
+	pipeline->done++;
+	pipeline->done_bytes += job->v.pkg->size;
+	pthread_cond_broadcast(&pipeline->progress);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void *pipeline_worker(void *arg)
+{
+	struct pipeline_worker *worker = arg;
+	struct pipeline *pipeline = worker->pipeline;
+
+	while(1) {
+		struct pipeline_job *job;
+
+		pthread_mutex_lock(&pipeline->lock);
+		while(pipeline->taken == pipeline->queued && !pipeline->closed) {
+			pthread_cond_wait(&pipeline->work, &pipeline->lock);
+		}
+		if(pipeline->taken == pipeline->queued) {
+			pthread_mutex_unlock(&pipeline->lock);
+			return NULL;
+		}
+		job = pipeline->queue[pipeline->taken++];
+		pthread_mutex_unlock(&pipeline->lock);
+
+		worker->handle.deferred = &job->deferred;
+		pipeline_process(&worker->handle, pipeline, job);
+	}
+}
+
+static void pipeline_queue(struct pipeline *pipeline, struct pipeline_job *job)
+{
+	job->queued = 1;
+	if(pipeline->nworkers == 0) {
+		pipeline_process(&pipeline->handle, pipeline, job);
+		return;
+	}
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->queue[pipeline->queued++] = job;
+	pthread_cond_signal(&pipeline->work);
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* queue the target whose package file is named filename */
+static void pipeline_submit(struct pipeline *pipeline, const char *filename)
+{
+	size_t i;
+
+	for(i = 0; i < pipeline->count; i++) {
+		struct pipeline_job *job = pipeline->jobs + i;
+		if(!job->queued && strcmp(job->v.pkg->filename, filename) == 0) {
+			pipeline_queue(pipeline, job);
+			return;
+		}
+	}
+}
+
+static void pipeline_submit_all(struct pipeline *pipeline)
+{
+	size_t i;
+
+	for(i = 0; i < pipeline->count; i++) {
+		if(!pipeline->jobs[i].queued) {
+			pipeline_queue(pipeline, pipeline->jobs + i);
+		}
+	}
+}
+
+/* Pass on what the workers logged for the jobs they are done with. The
+ * front end is only ever called from the main thread, so it does not have
+ * to cope with the progress callback and the log callback running at once. */
+static void pipeline_flush(alpm_handle_t *handle, struct pipeline *pipeline)
+{
+	size_t i;
+
+	for(i = 0; i < pipeline->count; i++) {
+		struct pipeline_job *job = pipeline->jobs + i;
+		alpm_list_t *deferred = NULL;
+
+		pthread_mutex_lock(&pipeline->lock);
+		if(job->done) {
+			deferred = job->deferred;
+			job->deferred = NULL;
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+		_alpm_deferred_flush(handle, deferred);
+	}
+}
+
+/* hand the digests computed while downloading to the target they belong to,
+ * then queue it for validation if validation is pipelined. Called on the
+ * main thread between transfers, which is also where the workers' output
+ * is passed on while downloads are running. */
+static void download_done(struct dload_payload *payload, void *data)
+{
+	struct pipeline *pipeline = data;
+
+	if(payload->sha256sum) {
+		alpm_list_t *i;
+		for(i = payload->handle->trans->add; i; i = i->next) {
+			alpm_pkg_t *spkg = i->data;
+			if(spkg->origin == ALPM_PKG_FROM_FILE
+					|| strcmp(spkg->filename, payload->remote_name) != 0) {
+				continue;
+			}
+			free(spkg->dl_md5sum);
+			free(spkg->dl_sha256sum);
+			spkg->dl_md5sum = payload->md5sum;
+			spkg->dl_sha256sum = payload->sha256sum;
+			payload->md5sum = NULL;
+			payload->sha256sum = NULL;
+			break;
+		}
+	}
+	if(pipeline) {
+		pipeline->downloads--;
+		_alpm_log(payload->handle, ALPM_LOG_DEBUG, "%s passed on with %zu downloads left\n",
+				payload->remote_name, pipeline->downloads);
+		pipeline_flush(payload->handle, pipeline);
+		pipeline_submit(pipeline, payload->remote_name);
+	}
+}
+
+static size_t pipeline_worker_count(alpm_handle_t *handle, size_t jobs)
+{
+	long count = handle->worker_threads;
+
+	if(count == 0) {
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+		if(count < 1) {
+			count = 1;
+		}
+	}
+	return (size_t)count < jobs ? (size_t)count : jobs;
+}
+
+/* set up a job for each target not loaded from a file and start the
+ * workers; validate and load select what the jobs do */
+static int pipeline_start(alpm_handle_t *handle, struct pipeline *pipeline,
+		int validate, int load)
+{
+	alpm_list_t *i;
+	size_t n, nworkers;
+	int signatures = 0;
+
+	memset(pipeline, 0, sizeof(*pipeline));
+	for(i = handle->trans->add; i; i = i->next) {
+		alpm_pkg_t *spkg = i->data;
+		if(spkg->origin != ALPM_PKG_FROM_FILE) {
+			pipeline->count++;
+			pipeline->total_bytes += spkg->size;
+		}
+		pipeline->targets++;
+	}
+	if(pipeline->count > 0) {
+		CALLOC(pipeline->jobs, pipeline->count, sizeof(struct pipeline_job),
+				RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+		CALLOC(pipeline->queue, pipeline->count, sizeof(struct pipeline_job *),
+				FREE(pipeline->jobs); RET_ERR(handle, ALPM_ERR_MEMORY, -1));
+	}
+
+	pipeline->count = 0;
+	for(i = handle->trans->add; i; i = i->next) {
+		alpm_pkg_t *spkg = i->data;
+		struct pipeline_job *job;
+		if(spkg->origin == ALPM_PKG_FROM_FILE) {
+			continue;
+		}
+		job = pipeline->jobs + pipeline->count++;
+		job->target = i;
+		job->v.pkg = spkg;
+		job->v.siglevel = alpm_db_get_siglevel(alpm_pkg_get_db(spkg));
+		job->valid = !validate;
+		if(job->v.siglevel & ALPM_SIG_PACKAGE) {
+			signatures = 1;
+		}
+	}
+
+	nworkers = pipeline_worker_count(handle, pipeline->count);
+	if(validate && signatures && nworkers > 1 && _alpm_gpgme_init(handle) != 0) {
+		/* GPGME sets itself up on first use, which must not happen twice at once */
+		nworkers = 1;
+	}
+
+	pipeline->handle = *handle;
+	pipeline->validate = validate;
+	pipeline->load = load;
+	pipeline->stage = load && (handle->trans->flags & ALPM_TRANS_FLAG_STREAM);
+	if(pipeline->stage && _alpm_stage_setup(handle) != 0) {
+		/* the packages are installed from their files instead */
+		pipeline->stage = 0;
+	}
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->work, NULL);
+	pthread_cond_init(&pipeline->progress, NULL);
+
+	/* without workers, jobs are processed as they are queued */
+	if(nworkers > 0) {
+		CALLOC(pipeline->workers, nworkers, sizeof(struct pipeline_worker),
+				nworkers = 0);
+	}
+	for(n = 0; n < nworkers; n++) {
+		struct pipeline_worker *worker = pipeline->workers + n;
+		worker->pipeline = pipeline;
+		worker->handle = *handle;
+		if(pthread_create(&worker->thread, NULL, pipeline_worker, worker) != 0) {
+			break;
+		}
+		pipeline->nworkers++;
+	}
+	_alpm_log(handle, ALPM_LOG_DEBUG, "using %zu threads for %zu packages\n",
+			pipeline->nworkers, pipeline->count);
+	return 0;
+}
+
+/* Wait for every job to get through validation, or to be done entirely if
+ * loaded is set, and report progress on the way. Every job must be queued. */
+static void pipeline_wait(alpm_handle_t *handle, struct pipeline *pipeline,
+		alpm_progress_t progress, int loaded)
+{
+	size_t current = (size_t)-1, files = pipeline->targets - pipeline->count;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while(1) {
+		size_t now = loaded ? pipeline->done : pipeline->validated;
+		if(now != current) {
+			uint64_t bytes = loaded ? pipeline->done_bytes : pipeline->validated_bytes;
+			int percent = 100;
+			if(now < pipeline->count && pipeline->total_bytes) {
+				percent = (int)(((double)bytes / pipeline->total_bytes) * 100);
+			}
+			current = now;
+			pthread_mutex_unlock(&pipeline->lock);
+			pipeline_flush(handle, pipeline);
+			PROGRESS(handle, progress, "", percent, pipeline->targets, files + current);
+			pthread_mutex_lock(&pipeline->lock);
+			/* jobs finishing while the lock was released have signalled
+			 * already, so look again before waiting */
+			continue;
+		}
+		if(current == pipeline->count) {
+			break;
+		}
+		pthread_cond_wait(&pipeline->progress, &pipeline->lock);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* let the workers go through what is queued, stop them and pass on what
+ * they logged */
+static void pipeline_finish(alpm_handle_t *handle, struct pipeline *pipeline)
+{
+	size_t n;
+
+	if(pipeline->nworkers == 0) {
+		return;
+	}
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->closed = 1;
+	pthread_cond_broadcast(&pipeline->work);
+	pthread_mutex_unlock(&pipeline->lock);
+	for(n = 0; n < pipeline->nworkers; n++) {
+		pthread_join(pipeline->workers[n].thread, NULL);
+	}
+	pipeline->nworkers = 0;
+	pipeline_flush(handle, pipeline);
+}
+
+static void pipeline_free(alpm_handle_t *handle, struct pipeline *pipeline)
+{
+	size_t i;
+
+	pipeline_finish(handle, pipeline);
+	pthread_cond_destroy(&pipeline->progress);
+	pthread_cond_destroy(&pipeline->work);
+	pthread_mutex_destroy(&pipeline->lock);
+	for(i = 0; i < pipeline->count; i++) {
+		struct pipeline_job *job = pipeline->jobs + i;
+		validity_cleanup(&job->v);
+		_alpm_pkg_free(job->pkgfile);
+	}
+	free(pipeline->jobs);
+	free(pipeline->queue);
+	free(pipeline->workers);
+}
+
 static int download_single_file(alpm_handle_t *handle, struct dload_payload *payload,
 		const char *cachedir)
 {
@@ -945,10 +1346,13 @@ static int download_single_file(alpm_handle_t *handle, struct dload_payload *pay
 	payload->allow_resume = 1;
 
 	EVENT(handle, &event);
-	for(server = payload->servers; server; server = server->next) {
+	payload->server_order = _alpm_servers_rank(handle, payload->servers, 1);
+	for(server = payload->server_order; server; server = server->next) {
 		const char *server_url = server->data;
 		size_t len;
 
+		payload->server = server;
+
 		/* print server + filename into a buffer */
 		len = strlen(server_url) + strlen(payload->remote_name) + 2;
 		MALLOC(payload->fileurl, len, RET_ERR(handle, ALPM_ERR_MEMORY, -1));
@@ -967,7 +1371,8 @@ static int download_single_file(alpm_handle_t *handle, struct dload_payload *pay
 	return -1;
 }
 
-static int download_files(alpm_handle_t *handle, alpm_list_t **deltas)
+static int download_files(alpm_handle_t *handle, alpm_list_t **deltas,
+		struct pipeline *pipeline)
 {
 	const char *cachedir;
 	alpm_list_t *i, *files = NULL;
@@ -994,41 +1399,71 @@ static int download_files(alpm_handle_t *handle, alpm_list_t **deltas)
 		errors += find_dl_candidates(i->data, &files, deltas);
 	}
 
-	if(files) {
-		/* check for necessary disk space for download */
-		if(handle->checkspace) {
-			off_t *file_sizes;
-			size_t idx, num_files;
-			int ret;
+	/* check for necessary disk space for download, and for the files staged
+	 * from every package whether it is downloaded or not */
+	if(handle->checkspace && (files || (pipeline && pipeline->stage))) {
+		off_t *file_sizes = NULL, stage_size = 0;
+		size_t idx, num_files = alpm_list_count(files);
+		int ret;
 
-			_alpm_log(handle, ALPM_LOG_DEBUG, "checking available disk space for download\n");
+		_alpm_log(handle, ALPM_LOG_DEBUG, "checking available disk space for download\n");
 
-			num_files = alpm_list_count(files);
+		if(num_files) {
 			CALLOC(file_sizes, num_files, sizeof(off_t), goto finish);
-
-			for(i = files, idx = 0; i; i = i->next, idx++) {
-				const struct dload_payload *payload = i->data;
-				file_sizes[idx] = payload->max_size;
+		}
+		for(i = files, idx = 0; i; i = i->next, idx++) {
+			const struct dload_payload *payload = i->data;
+			file_sizes[idx] = payload->max_size;
+		}
+		if(pipeline && pipeline->stage) {
+			for(idx = 0; idx < pipeline->count; idx++) {
+				stage_size += pipeline->jobs[idx].v.pkg->isize;
 			}
+		}
 
-			ret = _alpm_check_downloadspace(handle, cachedir, num_files, file_sizes);
-			free(file_sizes);
+		ret = _alpm_check_downloadspace(handle, cachedir, num_files, file_sizes,
+				stage_size ? handle->dbpath : NULL, stage_size);
+		free(file_sizes);
 
-			if(ret != 0) {
-				errors++;
-				goto finish;
-			}
+		if(ret != 0) {
+			errors++;
+			goto finish;
 		}
+	}
 
+	if(files) {
+		if(pipeline) {
+			pipeline->downloads = alpm_list_count(files);
+		}
 		event.type = ALPM_EVENT_RETRIEVE_START;
 		EVENT(handle, &event);
 		event.type = ALPM_EVENT_RETRIEVE_DONE;
-		for(i = files; i; i = i->next) {
-			if(download_single_file(handle, i->data, cachedir) == -1) {
-				errors++;
+		if(handle->parallel_downloads > 1 && handle->fetchcb == NULL) {
+			int failed;
+
+			for(i = files; i; i = i->next) {
+				struct dload_payload *payload = i->data;
+				payload->handle = handle;
+				payload->allow_resume = 1;
+			}
+			failed = _alpm_download_multi(handle, files, cachedir,
+					download_done, pipeline);
+			if(failed != 0) {
+				errors += failed > 0 ? failed : 1;
 				event.type = ALPM_EVENT_RETRIEVE_FAILED;
 				_alpm_log(handle, ALPM_LOG_WARNING, _("failed to retrieve some files\n"));
 			}
+		} else {
+			for(i = files; i; i = i->next) {
+				struct dload_payload *payload = i->data;
+				if(download_single_file(handle, payload, cachedir) == -1) {
+					errors++;
+					event.type = ALPM_EVENT_RETRIEVE_FAILED;
+					_alpm_log(handle, ALPM_LOG_WARNING, _("failed to retrieve some files\n"));
+				} else {
+					download_done(payload, pipeline);
+				}
+			}
 		}
 		EVENT(handle, &event);
 	}
@@ -1130,195 +1565,271 @@ static int check_keyring(alpm_handle_t *handle)
 }
 #endif /* HAVE_LIBGPGME */
 
-static int check_validity(alpm_handle_t *handle,
-		size_t total, uint64_t total_bytes)
+/* log why packages failed validation, offering to delete broken files */
+static void report_invalid(alpm_handle_t *handle, alpm_list_t *errors)
 {
-	struct validity {
-		alpm_pkg_t *pkg;
-		char *path;
-		alpm_siglist_t *siglist;
-		int siglevel;
-		int validation;
-		alpm_errno_t error;
-	};
-	size_t current = 0;
-	uint64_t current_bytes = 0;
-	alpm_list_t *i, *errors = NULL;
-	alpm_event_t event;
-
-	/* Check integrity of packages */
-	event.type = ALPM_EVENT_INTEGRITY_START;
-	EVENT(handle, &event);
-
-	for(i = handle->trans->add; i; i = i->next, current++) {
-		struct validity v = { i->data, NULL, NULL, 0, 0, 0 };
-		int percent = (int)(((double)current_bytes / total_bytes) * 100);
+	alpm_list_t *i;
 
-		PROGRESS(handle, ALPM_PROGRESS_INTEGRITY_START, "", percent,
-				total, current);
-		if(v.pkg->origin == ALPM_PKG_FROM_FILE) {
-			continue; /* pkg_load() has been already called, this package is valid */
+	for(i = errors; i; i = i->next) {
+		struct validity *v = i->data;
+		switch(v->error) {
+			case ALPM_ERR_PKG_MISSING_SIG:
+				_alpm_log(handle, ALPM_LOG_ERROR,
+						_("%s: missing required signature\n"), v->pkg->name);
+				break;
+			case ALPM_ERR_PKG_INVALID_SIG:
+				_alpm_process_siglist(handle, v->pkg->name, v->siglist,
+						v->siglevel & ALPM_SIG_PACKAGE_OPTIONAL,
+						v->siglevel & ALPM_SIG_PACKAGE_MARGINAL_OK,
+						v->siglevel & ALPM_SIG_PACKAGE_UNKNOWN_OK);
+				/* fallthrough */
+			case ALPM_ERR_PKG_INVALID_CHECKSUM:
+				prompt_to_delete(handle, v->path, v->error);
+				break;
+			case ALPM_ERR_PKG_NOT_FOUND:
+			case ALPM_ERR_BADPERMS:
+			case ALPM_ERR_PKG_OPEN:
+				_alpm_log(handle, ALPM_LOG_ERROR, _("failed to read file %s: %s\n"), v->path, alpm_strerror(v->error));
+				break;
+			default:
+				/* ignore */
+				break;
 		}
+	}
+}
 
-		current_bytes += v.pkg->size;
-		v.path = _alpm_filecache_find(handle, v.pkg->filename);
-		v.siglevel = alpm_db_get_siglevel(alpm_pkg_get_db(v.pkg));
+/* record the outcome of validation, reporting the packages that failed */
+static int pipeline_check_validity(alpm_handle_t *handle,
+		struct pipeline *pipeline)
+{
+	alpm_list_t *errors = NULL;
+	size_t i;
 
-		if(_alpm_pkg_validate_internal(handle, v.path, v.pkg,
-					v.siglevel, &v.siglist, &v.validation) == -1) {
-			struct validity *invalid;
-			v.error = handle->pm_errno;
-			MALLOC(invalid, sizeof(struct validity), return -1);
-			memcpy(invalid, &v, sizeof(struct validity));
-			errors = alpm_list_add(errors, invalid);
+	for(i = 0; i < pipeline->count; i++) {
+		struct pipeline_job *job = pipeline->jobs + i;
+		if(job->valid) {
+			job->v.pkg->validation = job->v.validation;
 		} else {
-			alpm_siglist_cleanup(v.siglist);
-			free(v.siglist);
-			free(v.path);
-			v.pkg->validation = v.validation;
+			errors = alpm_list_add(errors, &job->v);
 		}
 	}
+	if(errors == NULL) {
+		return 0;
+	}
+
+	/* no worker may log while the user is asked about broken files */
+	pipeline_finish(handle, pipeline);
+	report_invalid(handle, errors);
+	alpm_list_free(errors);
+	if(handle->pm_errno == ALPM_ERR_OK) {
+		RET_ERR(handle, ALPM_ERR_PKG_INVALID, -1);
+	}
+	return -1;
+}
+
+static int check_validity(alpm_handle_t *handle)
+{
+	struct pipeline pipeline;
+	alpm_event_t event;
+	int ret;
+
+	if(pipeline_start(handle, &pipeline, 1, 0) != 0) {
+		return -1;
+	}
 
-	PROGRESS(handle, ALPM_PROGRESS_INTEGRITY_START, "", 100,
-			total, current);
+	/* Check integrity of packages */
+	event.type = ALPM_EVENT_INTEGRITY_START;
+	EVENT(handle, &event);
+	pipeline_submit_all(&pipeline);
+	pipeline_wait(handle, &pipeline, ALPM_PROGRESS_INTEGRITY_START, 0);
 	event.type = ALPM_EVENT_INTEGRITY_DONE;
 	EVENT(handle, &event);
 
-	if(errors) {
-		for(i = errors; i; i = i->next) {
-			struct validity *v = i->data;
-			switch(v->error) {
-				case ALPM_ERR_PKG_MISSING_SIG:
-					_alpm_log(handle, ALPM_LOG_ERROR,
-							_("%s: missing required signature\n"), v->pkg->name);
-					break;
-				case ALPM_ERR_PKG_INVALID_SIG:
-					_alpm_process_siglist(handle, v->pkg->name, v->siglist,
-							v->siglevel & ALPM_SIG_PACKAGE_OPTIONAL,
-							v->siglevel & ALPM_SIG_PACKAGE_MARGINAL_OK,
-							v->siglevel & ALPM_SIG_PACKAGE_UNKNOWN_OK);
-					/* fallthrough */
-				case ALPM_ERR_PKG_INVALID_CHECKSUM:
-					prompt_to_delete(handle, v->path, v->error);
-					break;
-				case ALPM_ERR_PKG_NOT_FOUND:
-				case ALPM_ERR_BADPERMS:
-				case ALPM_ERR_PKG_OPEN:
-					_alpm_log(handle, ALPM_LOG_ERROR, _("failed to read file %s: %s\n"), v->path, alpm_strerror(v->error));
-					break;
-				default:
-					/* ignore */
-					break;
-			}
-			alpm_siglist_cleanup(v->siglist);
-			free(v->siglist);
-			free(v->path);
-			free(v);
-		}
-		alpm_list_free(errors);
+	ret = pipeline_check_validity(handle, &pipeline);
+	pipeline_free(handle, &pipeline);
+	return ret;
+}
+
+/* swap the sync target in trans->add for the package loaded from its file */
+static int replace_target(alpm_handle_t *handle, alpm_list_t *target,
+		alpm_pkg_t *pkgfile, alpm_list_t **data)
+{
+	alpm_pkg_t *spkg = target->data;
+	int error = 0;
 
-		if(handle->pm_errno == ALPM_ERR_OK) {
-			RET_ERR(handle, ALPM_ERR_PKG_INVALID, -1);
+	/* from here on the target is a package file, for which
+	 * alpm_pkg_get_db() returns NULL; everything that needs its sync
+	 * database has looked it up by now */
+	_alpm_log(handle, ALPM_LOG_DEBUG,
+			"replacing pkgcache entry with package file for target %s\n",
+			spkg->name);
+	if(!pkgfile) {
+		error = 1;
+	} else {
+		if(strcmp(spkg->name, pkgfile->name) != 0) {
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"internal package name mismatch, expected: '%s', actual: '%s'\n",
+					spkg->name, pkgfile->name);
+			error = 1;
 		}
+		if(strcmp(spkg->version, pkgfile->version) != 0) {
+			_alpm_log(handle, ALPM_LOG_DEBUG,
+					"internal package version mismatch, expected: '%s', actual: '%s'\n",
+					spkg->version, pkgfile->version);
+			error = 1;
+		}
+	}
+	if(error != 0) {
+		*data = alpm_list_add(*data, strdup(spkg->filename));
 		return -1;
 	}
-
+	/* copy over the install reason */
+	pkgfile->reason = spkg->reason;
+	/* copy over validation method */
+	pkgfile->validation = spkg->validation;
+	/* transfer oldpkg */
+	pkgfile->oldpkg = spkg->oldpkg;
+	spkg->oldpkg = NULL;
+	target->data = pkgfile;
+	/* spkg has been removed from the target list, so we can free the
+	 * sync-specific fields */
+	_alpm_pkg_free_trans(spkg);
 	return 0;
 }
 
-static int load_packages(alpm_handle_t *handle, alpm_list_t **data,
-		size_t total, size_t total_bytes)
+/* put the loaded packages in place of their sync targets, in order */
+static int pipeline_replace_targets(alpm_handle_t *handle,
+		struct pipeline *pipeline, alpm_list_t **data)
 {
-	size_t current = 0, current_bytes = 0;
-	int errors = 0;
-	alpm_list_t *i;
+	size_t i;
+	int ret = 0;
+
+	for(i = 0; i < pipeline->count; i++) {
+		struct pipeline_job *job = pipeline->jobs + i;
+		if(job->pkgfile) {
+			job->pkgfile->handle = handle;
+		} else {
+			handle->pm_errno = job->v.error;
+		}
+		if(replace_target(handle, job->target, job->pkgfile, data) != 0) {
+			ret = -1;
+			continue;
+		}
+		/* now owned by the transaction */
+		job->pkgfile = NULL;
+	}
+
+	if(ret != 0 && handle->pm_errno == ALPM_ERR_OK) {
+		RET_ERR(handle, ALPM_ERR_PKG_INVALID, -1);
+	}
+	return ret;
+}
+
+static int load_packages(alpm_handle_t *handle, alpm_list_t **data)
+{
+	struct pipeline pipeline;
 	alpm_event_t event;
+	int ret;
+
+	if(pipeline_start(handle, &pipeline, 0, 1) != 0) {
+		return -1;
+	}
 
 	/* load packages from disk now that they are known-valid */
 	event.type = ALPM_EVENT_LOAD_START;
 	EVENT(handle, &event);
+	pipeline_submit_all(&pipeline);
+	pipeline_wait(handle, &pipeline, ALPM_PROGRESS_LOAD_START, 1);
+	pipeline_finish(handle, &pipeline);
+	ret = pipeline_replace_targets(handle, &pipeline, data);
+	event.type = ALPM_EVENT_LOAD_DONE;
+	EVENT(handle, &event);
 
-	for(i = handle->trans->add; i; i = i->next, current++) {
-		int error = 0;
-		alpm_pkg_t *spkg = i->data;
-		char *filepath;
-		int percent = (int)(((double)current_bytes / total_bytes) * 100);
-
-		PROGRESS(handle, ALPM_PROGRESS_LOAD_START, "", percent,
-				total, current);
-		if(spkg->origin == ALPM_PKG_FROM_FILE) {
-			continue; /* pkg_load() has been already called, this package is valid */
-		}
+	pipeline_free(handle, &pipeline);
+	return ret;
+}
 
-		current_bytes += spkg->size;
-		filepath = _alpm_filecache_find(handle, spkg->filename);
+/* Validate and load each package as soon as its download completes. The
+ * front end still sees the integrity and load stages, in the usual order,
+ * once the downloads are done. */
+static int sync_load_pipelined(alpm_handle_t *handle, alpm_list_t **data)
+{
+	struct pipeline pipeline;
+	alpm_list_t *deltas = NULL;
+	alpm_event_t event;
+	size_t i;
+	int ret;
 
-		/* load the package file and replace pkgcache entry with it in the target list */
-		/* TODO: alpm_pkg_get_db() will not work on this target anymore */
-		_alpm_log(handle, ALPM_LOG_DEBUG,
-				"replacing pkgcache entry with package file for target %s\n",
-				spkg->name);
-		alpm_pkg_t *pkgfile =_alpm_pkg_load_internal(handle, filepath, 1);
-		if(!pkgfile) {
-			_alpm_log(handle, ALPM_LOG_DEBUG, "failed to load pkgfile internal\n");
-			error = 1;
-		} else {
-			if(strcmp(spkg->name, pkgfile->name) != 0) {
-				_alpm_log(handle, ALPM_LOG_DEBUG,
-						"internal package name mismatch, expected: '%s', actual: '%s'\n",
-						spkg->name, pkgfile->name);
-				error = 1;
-			}
-			if(strcmp(spkg->version, pkgfile->version) != 0) {
-				_alpm_log(handle, ALPM_LOG_DEBUG,
-						"internal package version mismatch, expected: '%s', actual: '%s'\n",
-						spkg->version, pkgfile->version);
-				error = 1;
-			}
-		}
-		if(error != 0) {
-			errors++;
-			*data = alpm_list_add(*data, strdup(spkg->filename));
-			free(filepath);
-			continue;
+	/* may add a fallback cache dir, which the workers must not see change */
+	_alpm_filecache_setup(handle);
+	if(pipeline_start(handle, &pipeline, 1,
+				!(handle->trans->flags & ALPM_TRANS_FLAG_DOWNLOADONLY)) != 0) {
+		return -1;
+	}
+	for(i = 0; i < pipeline.count; i++) {
+		if(pipeline.jobs[i].v.pkg->download_size == 0) {
+			pipeline_queue(&pipeline, pipeline.jobs + i);
 		}
-		free(filepath);
-		/* copy over the install reason */
-		pkgfile->reason = spkg->reason;
-		/* copy over validation method */
-		pkgfile->validation = spkg->validation;
-		/* transfer oldpkg */
-		pkgfile->oldpkg = spkg->oldpkg;
-		spkg->oldpkg = NULL;
-		i->data = pkgfile;
-		/* spkg has been removed from the target list, so we can free the
-		 * sync-specific fields */
-		_alpm_pkg_free_trans(spkg);
-	}
-
-	PROGRESS(handle, ALPM_PROGRESS_LOAD_START, "", 100,
-			total, current);
-	event.type = ALPM_EVENT_LOAD_DONE;
+	}
+	ret = download_files(handle, &deltas, &pipeline);
+	alpm_list_free(deltas);
+	if(ret) {
+		pipeline_free(handle, &pipeline);
+		return -1;
+	}
+	/* anything whose download turned out not to be needed */
+	pipeline_submit_all(&pipeline);
+
+	event.type = ALPM_EVENT_INTEGRITY_START;
+	EVENT(handle, &event);
+	pipeline_wait(handle, &pipeline, ALPM_PROGRESS_INTEGRITY_START, 0);
+	event.type = ALPM_EVENT_INTEGRITY_DONE;
 	EVENT(handle, &event);
 
-	if(errors) {
-		if(handle->pm_errno == ALPM_ERR_OK) {
-			RET_ERR(handle, ALPM_ERR_PKG_INVALID, -1);
-		}
+	if(pipeline_check_validity(handle, &pipeline) != 0) {
+		pipeline_free(handle, &pipeline);
 		return -1;
 	}
 
-	return 0;
+	if(pipeline.load) {
+		event.type = ALPM_EVENT_LOAD_START;
+		EVENT(handle, &event);
+		pipeline_wait(handle, &pipeline, ALPM_PROGRESS_LOAD_START, 1);
+		pipeline_finish(handle, &pipeline);
+		ret = pipeline_replace_targets(handle, &pipeline, data);
+		event.type = ALPM_EVENT_LOAD_DONE;
+		EVENT(handle, &event);
+	}
+	pipeline_free(handle, &pipeline);
+	return ret;
 }
 
 int _alpm_sync_load(alpm_handle_t *handle, alpm_list_t **data)
 {
 	alpm_list_t *i, *deltas = NULL;
-	size_t total = 0;
-	uint64_t total_bytes = 0;
 	alpm_trans_t *trans = handle->trans;
+	int use_deltas = 0;
+
+	for(i = trans->add; i; i = i->next) {
+		alpm_pkg_t *spkg = i->data;
+		if(spkg->origin != ALPM_PKG_FROM_FILE && spkg->delta_path) {
+			use_deltas = 1;
+		}
+	}
+
+	/* packages built from deltas only exist once every download is done */
+	if(!use_deltas && (trans->flags
+				& (ALPM_TRANS_FLAG_PIPELINE | ALPM_TRANS_FLAG_STREAM))) {
+#ifdef HAVE_LIBGPGME
+		/* make sure all required signatures are in keyring */
+		if(check_keyring(handle)) {
+			return -1;
+		}
+#endif
+		return sync_load_pipelined(handle, data);
+	}
 
-	if(download_files(handle, &deltas)) {
+	if(download_files(handle, &deltas, NULL)) {
 		alpm_list_free(deltas);
 		return -1;
 	}
@@ -1341,19 +1852,7 @@ int _alpm_sync_load(alpm_handle_t *handle, alpm_list_t **data)
 	}
 #endif
 
-	/* get the total size of all packages so we can adjust the progress bar more
-	 * realistically if there are small and huge packages involved */
-	for(i = trans->add; i; i = i->next) {
-		alpm_pkg_t *spkg = i->data;
-		if(spkg->origin != ALPM_PKG_FROM_FILE) {
-			total_bytes += spkg->size;
-		}
-		total++;
-	}
-	/* this can only happen maliciously */
-	total_bytes = total_bytes ? total_bytes : 1;
-
-	if(check_validity(handle, total, total_bytes) != 0) {
+	if(check_validity(handle) != 0) {
 		return -1;
 	}
 
@@ -1361,7 +1860,7 @@ int _alpm_sync_load(alpm_handle_t *handle, alpm_list_t **data)
 		return 0;
 	}
 
-	if(load_packages(handle, data, total, total_bytes)) {
+	if(load_packages(handle, data)) {
 		return -1;
 	}
 
@@ -272,6 +272,8 @@ int SYMEXPORT alpm_trans_release(alpm_handle_t *handle)
 
 	/* unlock db */
 	if(!nolock_flag) {
+		/* refresh the local database snapshot while we still hold the lock */
+		_alpm_local_db_snapshot_update(handle->db_local);
 		_alpm_handle_unlock(handle);
 	}
 
@@ -57,6 +57,34 @@
 #include "handle.h"
 #include "trans.h"
 
+/* The umask and working directory are shared by all threads. Code that
+ * changes either of them temporarily, or that reads the umask (as
+ * archive_write_disk_new() does by clearing it), holds this lock. It is
+ * recursive, as such code may call other code doing the same. */
+static pthread_mutex_t umask_lock;
+static pthread_once_t umask_lock_once = PTHREAD_ONCE_INIT;
+
+static void umask_lock_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&umask_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void _alpm_umask_lock(void)
+{
+	pthread_once(&umask_lock_once, umask_lock_init);
+	pthread_mutex_lock(&umask_lock);
+}
+
+void _alpm_umask_unlock(void)
+{
+	pthread_mutex_unlock(&umask_lock);
+}
+
 #ifndef HAVE_STRSEP
 /** Extracts tokens from a string.
  * Replaces strset which is not portable (missing on Solaris).
@@ -110,6 +138,7 @@ int _alpm_makepath_mode(const char *path, mode_t mode)
 
 	STRDUP(str, path, return 1);
 
+	_alpm_umask_lock();
 	oldmask = umask(0000);
 
 	for(ptr = str; *ptr; ptr++) {
@@ -138,6 +167,7 @@ int _alpm_makepath_mode(const char *path, mode_t mode)
 
 done:
 	umask(oldmask);
+	_alpm_umask_unlock();
 	free(str);
 	return ret;
 }
@@ -326,6 +356,7 @@ int _alpm_unpack(alpm_handle_t *handle, const char *path, const char *prefix,
 		return 1;
 	}
 
+	_alpm_umask_lock();
 	oldmask = umask(0022);
 
 	/* save the cwd so we can restore it later */
@@ -404,6 +435,7 @@ cleanup:
 		}
 		close(cwdfd);
 	}
+	_alpm_umask_unlock();
 
 	return ret;
 }
@@ -580,25 +612,13 @@ int _alpm_run_chroot(alpm_handle_t *handle, const char *cmd, char *const argv[],
 {
 	pid_t pid;
 	int child2parent_pipefd[2], parent2child_pipefd[2];
-	int cwdfd;
 	int retval = 0;
 
 #define HEAD 1
 #define TAIL 0
 
-	/* save the cwd so we can restore it later */
-	OPEN(cwdfd, ".", O_RDONLY | O_CLOEXEC);
-	if(cwdfd < 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not get current working directory\n"));
-	}
-
-	/* just in case our cwd was removed in the upgrade operation */
-	if(chdir(handle->root) != 0) {
-		_alpm_log(handle, ALPM_LOG_ERROR, _("could not change directory to %s (%s)\n"),
-				handle->root, strerror(errno));
-		goto cleanup;
-	}
-
+	/* the working directory is only changed in the child, as other threads
+	 * may be extracting files meanwhile */
 	_alpm_log(handle, ALPM_LOG_DEBUG, "executing \"%s\" under chroot \"%s\"\n",
 			cmd, handle->root);
 
@@ -637,11 +657,13 @@ int _alpm_run_chroot(alpm_handle_t *handle, const char *cmd, char *const argv[],
 		close(parent2child_pipefd[HEAD]);
 		close(child2parent_pipefd[TAIL]);
 		close(child2parent_pipefd[HEAD]);
-		if(cwdfd >= 0) {
-			close(cwdfd);
-		}
 
 		/* use fprintf instead of _alpm_log to send output through the parent */
+		if(chdir(handle->root) != 0) {
+			fprintf(stderr, _("could not change directory to %s (%s)\n"),
+					handle->root, strerror(errno));
+			exit(1);
+		}
 		if(chroot(handle->root) != 0) {
 			fprintf(stderr, _("could not change the root directory (%s)\n"), strerror(errno));
 			exit(1);
@@ -760,14 +782,6 @@ int _alpm_run_chroot(alpm_handle_t *handle, const char *cmd, char *const argv[],
 	}
 
 cleanup:
-	if(cwdfd >= 0) {
-		if(fchdir(cwdfd) != 0) {
-			_alpm_log(handle, ALPM_LOG_ERROR,
-					_("could not restore working directory (%s)\n"), strerror(errno));
-		}
-		close(cwdfd);
-	}
-
 	return retval;
 }
 
@@ -1023,6 +1037,107 @@ static char *hex_representation(unsigned char *bytes, size_t size)
 	return str;
 }
 
+struct _alpm_digest_t {
+#if HAVE_LIBSSL
+	MD5_CTX md5;
+	SHA256_CTX sha256;
+#else /* HAVE_LIBNETTLE */
+	struct md5_ctx md5;
+	struct sha256_ctx sha256;
+#endif
+};
+
+/** Start computing the MD5 and SHA-256 digests of a stream of data.
+ * @return the digest context, NULL on error
+ */
+alpm_digest_t *_alpm_digest_new(void)
+{
+	alpm_digest_t *digest;
+
+	MALLOC(digest, sizeof(alpm_digest_t), return NULL);
+#if HAVE_LIBSSL
+	MD5_Init(&digest->md5);
+	SHA256_Init(&digest->sha256);
+#else /* HAVE_LIBNETTLE */
+	md5_init(&digest->md5);
+	sha256_init(&digest->sha256);
+#endif
+	return digest;
+}
+
+void _alpm_digest_update(alpm_digest_t *digest, const void *buf, size_t len)
+{
+#if HAVE_LIBSSL
+	MD5_Update(&digest->md5, buf, len);
+	SHA256_Update(&digest->sha256, buf, len);
+#else /* HAVE_LIBNETTLE */
+	md5_update(&digest->md5, len, buf);
+	sha256_update(&digest->sha256, len, buf);
+#endif
+}
+
+/** Feed the contents of a file to a digest.
+ * @param digest the digest context
+ * @param path file to read
+ * @return 0 on success, 1 on file open error, 2 on file read error
+ */
+int _alpm_digest_update_file(alpm_digest_t *digest, const char *path)
+{
+	unsigned char *buf;
+	ssize_t n;
+	int fd;
+
+	MALLOC(buf, (size_t)ALPM_BUFFER_SIZE, return 1);
+
+	OPEN(fd, path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		free(buf);
+		return 1;
+	}
+
+	while((n = read(fd, buf, ALPM_BUFFER_SIZE)) > 0 || errno == EINTR) {
+		if(n < 0) {
+			continue;
+		}
+		_alpm_digest_update(digest, buf, n);
+	}
+
+	close(fd);
+	free(buf);
+
+	return n < 0 ? 2 : 0;
+}
+
+/** Finish a digest and free it; a digest no longer needed can be passed to
+ * free() instead.
+ * @param digest the digest context
+ * @param md5sum where to store the hexadecimal MD5 digest
+ * @param sha256sum where to store the hexadecimal SHA-256 digest
+ * @return 0 on success, -1 on error
+ */
+int _alpm_digest_finish(alpm_digest_t *digest, char **md5sum, char **sha256sum)
+{
+	unsigned char md5[16], sha256[32];
+
+#if HAVE_LIBSSL
+	MD5_Final(md5, &digest->md5);
+	SHA256_Final(sha256, &digest->sha256);
+#else /* HAVE_LIBNETTLE */
+	md5_digest(&digest->md5, MD5_DIGEST_SIZE, md5);
+	sha256_digest(&digest->sha256, SHA256_DIGEST_SIZE, sha256);
+#endif
+	free(digest);
+
+	*md5sum = hex_representation(md5, 16);
+	*sha256sum = hex_representation(sha256, 32);
+	if(*md5sum == NULL || *sha256sum == NULL) {
+		FREE(*md5sum);
+		FREE(*sha256sum);
+		return -1;
+	}
+	return 0;
+}
+
 /** Get the md5 sum of file.
  * @param filename name of the file
  * @return the checksum on success, NULL on error
@@ -1092,14 +1207,44 @@ int _alpm_test_checksum(const char *filepath, const char *expected,
 	return ret;
 }
 
-/* Note: does NOT handle sparse files on purpose for speed. */
-/** TODO.
+/* make room for needed bytes in the line buffer, keeping what is in it */
+static int archive_line_reserve(struct archive_read_buffer *b, size_t needed)
+{
+	char *new_line;
+
+	if(needed > b->max_line_size) {
+		b->ret = -ERANGE;
+		return -1;
+	}
+	if(needed <= b->line_size) {
+		return 0;
+	}
+	CALLOC(new_line, needed, sizeof(char), b->ret = -ENOMEM; return -1);
+	if(b->line) {
+		memcpy(new_line, b->line, b->line_size);
+	}
+	b->line_offset = new_line + (b->line_offset - b->line);
+	b->line_size = needed;
+	free(b->line);
+	b->line = new_line;
+	return 0;
+}
+
+/** Read the next line of the current archive entry without copying it.
+ * A line that lies within one data block is returned where it is in the
+ * block; only lines running across blocks are put together in b->line.
+ * Either way the line is not NUL-terminated, has no newline, and stays
+ * valid until the next call.
  * Does not handle sparse files on purpose for speed.
- * @param a
- * @param b
- * @return
+ * @param a the archive, positioned on the entry
+ * @param b the read state, zeroed with max_line_size set before the first call
+ * @param line set to the start of the line
+ * @param len set to the length of the line
+ * @return ARCHIVE_OK, ARCHIVE_EOF at the end of the entry, or an error; b is
+ * reset for the next entry on anything but ARCHIVE_OK
  */
-int _alpm_archive_fgets(struct archive *a, struct archive_read_buffer *b)
+int _alpm_archive_getline(struct archive *a, struct archive_read_buffer *b,
+		const char **line, size_t *len)
 {
 	/* ensure we start populating our line buffer at the beginning */
 	b->line_offset = b->line;
@@ -1136,52 +1281,33 @@ int _alpm_archive_fgets(struct archive *a, struct archive_read_buffer *b)
 			eol = memchr(b->block_offset, '\0', block_remaining);
 		}
 
-		/* allocate our buffer, or ensure our existing one is big enough */
-		if(!b->line) {
-			/* set the initial buffer to the read block_size */
-			CALLOC(b->line, b->block_size + 1, sizeof(char), b->ret = -ENOMEM; goto cleanup);
-			b->line_size = b->block_size + 1;
-			b->line_offset = b->line;
-		} else {
-			/* note: we know eol > b->block_offset and b->line_offset > b->line,
-			 * so we know the result is unsigned and can fit in size_t */
-			size_t new = eol ? (size_t)(eol - b->block_offset) : block_remaining;
-			size_t needed = (size_t)((b->line_offset - b->line) + new + 1);
-			if(needed > b->max_line_size) {
+		if(eol && b->line_offset == b->line) {
+			/* the whole line is in the block, hand it out from there */
+			*line = b->block_offset;
+			*len = (size_t)(eol - b->block_offset);
+			b->block_offset = eol + 1;
+			if(*len + 1 > b->max_line_size) {
 				b->ret = -ERANGE;
 				goto cleanup;
 			}
-			if(needed > b->line_size) {
-				/* need to realloc + copy data to fit total length */
-				char *new_line;
-				CALLOC(new_line, needed, sizeof(char), b->ret = -ENOMEM; goto cleanup);
-				memcpy(new_line, b->line, b->line_size);
-				b->line_size = needed;
-				b->line_offset = new_line + (b->line_offset - b->line);
-				free(b->line);
-				b->line = new_line;
-			}
-		}
-
-		if(eol) {
-			size_t len = (size_t)(eol - b->block_offset);
-			memcpy(b->line_offset, b->block_offset, len);
-			b->line_offset[len] = '\0';
-			b->block_offset = eol + 1;
-			b->real_line_size = b->line_offset + len - b->line;
-			/* this is the main return point; from here you can read b->line */
 			return ARCHIVE_OK;
 		} else {
-			/* we've looked through the whole block but no newline, copy it */
-			size_t len = (size_t)(b->block + b->block_size - b->block_offset);
-			memcpy(b->line_offset, b->block_offset, len);
-			b->line_offset += len;
-			b->block_offset = b->block + b->block_size;
-			/* there was no new data, return what is left; saved ARCHIVE_EOF will be
+			/* note: we know eol > b->block_offset and b->line_offset >= b->line,
+			 * so we know the result is unsigned and can fit in size_t */
+			size_t new = eol ? (size_t)(eol - b->block_offset) : block_remaining;
+			if(archive_line_reserve(b,
+						(size_t)(b->line_offset - b->line) + new + 1) != 0) {
+				goto cleanup;
+			}
+			memcpy(b->line_offset, b->block_offset, new);
+			b->line_offset += new;
+			b->block_offset = eol ? eol + 1 : b->block + b->block_size;
+			/* with no new data, return what is left; saved ARCHIVE_EOF will be
 			 * returned on next call */
-			if(len == 0) {
+			if(eol || new == 0) {
 				b->line_offset[0] = '\0';
-				b->real_line_size = b->line_offset - b->line;
+				*line = b->line;
+				*len = (size_t)(b->line_offset - b->line);
 				return ARCHIVE_OK;
 			}
 		}
@@ -1196,6 +1322,37 @@ cleanup:
 	}
 }
 
+/** Read the next line of the current archive entry into b->line.
+ * Like _alpm_archive_getline(), but the line is always copied and
+ * NUL-terminated, so it may be modified; its length is b->real_line_size.
+ * @param a the archive, positioned on the entry
+ * @param b the read state, zeroed with max_line_size set before the first call
+ * @return ARCHIVE_OK, ARCHIVE_EOF at the end of the entry, or an error
+ */
+int _alpm_archive_fgets(struct archive *a, struct archive_read_buffer *b)
+{
+	const char *line;
+	size_t len;
+	int ret = _alpm_archive_getline(a, b, &line, &len);
+
+	if(ret != ARCHIVE_OK) {
+		return ret;
+	}
+	if(line != b->line) {
+		b->line_offset = b->line;
+		if(archive_line_reserve(b, len + 1) != 0) {
+			ret = b->ret;
+			FREE(b->line);
+			memset(b, 0, sizeof(struct archive_read_buffer));
+			return ret;
+		}
+		memcpy(b->line, line, len);
+		b->line[len] = '\0';
+	}
+	b->real_line_size = len;
+	return ARCHIVE_OK;
+}
+
 /** Parse a full package specifier.
  * @param target package specifier to parse, such as: "pacman-4.0.1-2",
  * "pacman-4.01-2/", or "pacman-4.0.1-2/desc"
@@ -38,6 +38,7 @@
 #include <math.h> /* fabs */
 #include <float.h> /* DBL_EPSILON */
 #include <fcntl.h> /* open, close */
+#include <pthread.h> /* pthread_mutex_t */
 
 #include <archive.h> /* struct archive */
 
@@ -93,7 +94,8 @@ void _alpm_alloc_fail(size_t size);
 #define OPEN(fd, path, flags) do { fd = open(path, flags | O_BINARY); } while(fd == -1 && errno == EINTR)
 
 /**
- * Used as a buffer/state holder for _alpm_archive_fgets().
+ * Used as a buffer/state holder for _alpm_archive_getline() and
+ * _alpm_archive_fgets().
  */
 struct archive_read_buffer {
 	char *line;
@@ -109,6 +111,9 @@ struct archive_read_buffer {
 	int ret;
 };
 
+void _alpm_umask_lock(void);
+void _alpm_umask_unlock(void);
+
 int _alpm_makepath(const char *path);
 int _alpm_makepath_mode(const char *path, mode_t mode);
 int _alpm_copyfile(const char *src, const char *dest);
@@ -131,9 +136,17 @@ int _alpm_ldconfig(alpm_handle_t *handle);
 int _alpm_str_cmp(const void *s1, const void *s2);
 char *_alpm_filecache_find(alpm_handle_t *handle, const char *filename);
 const char *_alpm_filecache_setup(alpm_handle_t *handle);
+/* MD5 and SHA-256 digests computed together over a stream of data */
+typedef struct _alpm_digest_t alpm_digest_t;
+alpm_digest_t *_alpm_digest_new(void);
+void _alpm_digest_update(alpm_digest_t *digest, const void *buf, size_t len);
+int _alpm_digest_update_file(alpm_digest_t *digest, const char *path);
+int _alpm_digest_finish(alpm_digest_t *digest, char **md5sum, char **sha256sum);
 /* Unlike many uses of alpm_pkgvalidation_t, _alpm_test_checksum expects
  * an enum value rather than a bitfield. */
 int _alpm_test_checksum(const char *filepath, const char *expected, alpm_pkgvalidation_t type);
+int _alpm_archive_getline(struct archive *a, struct archive_read_buffer *b,
+		const char **line, size_t *len);
 int _alpm_archive_fgets(struct archive *a, struct archive_read_buffer *b);
 int _alpm_splitname(const char *target, char **name, char **version,
 		unsigned long *name_hash);
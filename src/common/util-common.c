@@ -19,8 +19,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "util-common.h"
 
@@ -104,6 +108,153 @@ int llstat(char *path, struct stat *buf)
 	return ret;
 }
 
+/* paths a thread of llstat_many() takes at a time; consecutive paths
+ * mostly share a directory */
+#define LLSTAT_CHUNK 256
+
+struct llstat_batch {
+	const char *root;
+	const char * const *paths;
+	struct llstat_result *results;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+/* the directory last opened by a thread of llstat_many() */
+struct llstat_dir {
+	char path[PATH_MAX];
+	int fd;
+};
+
+static void llstat_one(const char *root, const char *file,
+		struct llstat_result *result, struct llstat_dir *dir)
+{
+	char path[PATH_MAX];
+	char *slash;
+	int len = snprintf(path, PATH_MAX, "%s%s", root, file);
+
+	result->err = 0;
+	if(len < 0 || len >= PATH_MAX) {
+		result->err = ENAMETOOLONG;
+		return;
+	}
+	/* the same as llstat(), a trailing slash does not follow a symlink */
+	while(len > 1 && path[len - 1] == '/') {
+		path[--len] = '\0';
+	}
+
+	slash = strrchr(path, '/');
+	if(slash == NULL || slash == path) {
+		if(lstat(path, &result->st) != 0) {
+			result->err = errno;
+		}
+		return;
+	}
+
+	/* look the file up in its directory, which is only resolved once for
+	 * all the files in it */
+	*slash = '\0';
+	if(strcmp(path, dir->path) != 0) {
+		if(dir->fd >= 0) {
+			close(dir->fd);
+		}
+		strcpy(dir->path, path);
+		dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if(dir->fd >= 0) {
+		if(fstatat(dir->fd, slash + 1, &result->st, AT_SYMLINK_NOFOLLOW) != 0) {
+			result->err = errno;
+		}
+	} else {
+		/* a directory we may search but not read */
+		*slash = '/';
+		if(lstat(path, &result->st) != 0) {
+			result->err = errno;
+		}
+	}
+}
+
+static void *llstat_worker(void *data)
+{
+	struct llstat_batch *batch = data;
+	struct llstat_dir dir;
+
+	dir.path[0] = '\0';
+	dir.fd = -1;
+	while(1) {
+		size_t i, start, end;
+
+		pthread_mutex_lock(&batch->lock);
+		start = batch->next;
+		end = start + LLSTAT_CHUNK < batch->count ? start + LLSTAT_CHUNK : batch->count;
+		batch->next = end;
+		pthread_mutex_unlock(&batch->lock);
+
+		if(start == end) {
+			break;
+		}
+		for(i = start; i < end; i++) {
+			llstat_one(batch->root, batch->paths[i], batch->results + i, &dir);
+		}
+	}
+	if(dir.fd >= 0) {
+		close(dir.fd);
+	}
+	return NULL;
+}
+
+/** llstat() many paths at once.
+ * Each path is looked up relative to an open descriptor of its directory,
+ * and larger batches are spread over several threads, so filesystems where
+ * every lookup is a round trip are not waited on one path at a time.
+ * @param root prefix of all paths, e.g. the root directory
+ * @param paths paths to look up below root
+ * @param count number of paths
+ * @param results filled with the stat buffer and 0, or the errno of the
+ * failed lookup, for each path
+ * @param nthreads number of threads to use, 0 for one per processor
+ */
+void llstat_many(const char *root, const char * const *paths, size_t count,
+		struct llstat_result *results, unsigned int nthreads)
+{
+	struct llstat_batch batch;
+	pthread_t *threads = NULL;
+	size_t started = 0, i;
+
+	if(nthreads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	if(nthreads > (count + LLSTAT_CHUNK - 1) / LLSTAT_CHUNK) {
+		nthreads = (count + LLSTAT_CHUNK - 1) / LLSTAT_CHUNK;
+	}
+
+	batch.root = root;
+	batch.paths = paths;
+	batch.results = results;
+	batch.count = count;
+	batch.next = 0;
+	pthread_mutex_init(&batch.lock, NULL);
+
+	/* the calling thread works along, which is all a small batch gets */
+	if(nthreads > 1) {
+		threads = calloc(nthreads - 1, sizeof(pthread_t));
+	}
+	for(i = 0; threads && i < nthreads - 1; i++) {
+		if(pthread_create(&threads[started], NULL, llstat_worker, &batch) != 0) {
+			break;
+		}
+		started++;
+	}
+	llstat_worker(&batch);
+	for(i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&batch.lock);
+}
+
 /** Wrapper around fgets() which properly handles EINTR
  * @param s string to read into
  * @param size maximum length to read
@@ -28,6 +28,16 @@ char *mdirname(const char *path);
 
 int llstat(char *path, struct stat *buf);
 
+/* the outcome of one of the lookups of llstat_many() */
+struct llstat_result {
+	struct stat st;
+	/* 0 on success, otherwise the errno of the failed lookup */
+	int err;
+};
+
+void llstat_many(const char *root, const char * const *paths, size_t count,
+		struct llstat_result *results, unsigned int nthreads);
+
 char *safe_fgets(char *s, int size, FILE *stream);
 
 size_t strtrim(char *str);
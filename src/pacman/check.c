@@ -26,23 +26,30 @@
 #include "conf.h"
 #include "util.h"
 
+/* report a file whose lookup failed with err, unless it is NoExtract */
+static int check_file_missing(const char *pkgname, const char *filepath,
+		size_t rootlen, int err)
+{
+	if(alpm_option_match_noextract(config->handle, filepath + rootlen) == 0) {
+		/* NoExtract */
+		return -1;
+	} else {
+		if(config->quiet) {
+			printf("%s %s\n", pkgname, filepath);
+		} else {
+			pm_printf(ALPM_LOG_WARNING, "%s: %s (%s)\n",
+					pkgname, filepath, strerror(err));
+		}
+		return 1;
+	}
+}
+
 static int check_file_exists(const char *pkgname, char *filepath, size_t rootlen,
 		struct stat *st)
 {
 	/* use lstat to prevent errors from symlinks */
 	if(llstat(filepath, st) != 0) {
-		if(alpm_option_match_noextract(config->handle, filepath + rootlen) == 0) {
-			/* NoExtract */
-			return -1;
-		} else {
-			if(config->quiet) {
-				printf("%s %s\n", pkgname, filepath);
-			} else {
-				pm_printf(ALPM_LOG_WARNING, "%s: %s (%s)\n",
-						pkgname, filepath, strerror(errno));
-			}
-			return 1;
-		}
+		return check_file_missing(pkgname, filepath, rootlen, errno);
 	}
 
 	return 0;
@@ -198,6 +205,8 @@ int check_pkg_fast(alpm_pkg_t *pkg)
 	size_t rootlen;
 	char filepath[PATH_MAX];
 	alpm_filelist_t *filelist;
+	const char **paths;
+	struct llstat_result *results;
 	size_t i;
 
 	root = alpm_option_get_root(config->handle);
@@ -211,10 +220,26 @@ int check_pkg_fast(alpm_pkg_t *pkg)
 
 	pkgname = alpm_pkg_get_name(pkg);
 	filelist = alpm_pkg_get_files(pkg);
+
+	/* look all files up at once, which matters on network filesystems */
+	paths = malloc((filelist->count + 1) * sizeof(char *));
+	results = malloc((filelist->count + 1) * sizeof(struct llstat_result));
+	if(paths == NULL || results == NULL) {
+		free(paths);
+		free(results);
+		pm_printf(ALPM_LOG_ERROR, _("memory exhausted\n"));
+		return 1;
+	}
+	for(i = 0; i < filelist->count; i++) {
+		paths[i] = filelist->files[i].name;
+	}
+	llstat_many(root, paths, filelist->count, results, config->worker_threads);
+	free(paths);
+
 	for(i = 0; i < filelist->count; i++) {
 		const alpm_file_t *file = filelist->files + i;
-		struct stat st;
-		int exists;
+		struct stat *st = &results[i].st;
+		int exists = 0;
 		const char *path = file->name;
 		size_t plen = strlen(path);
 
@@ -224,10 +249,12 @@ int check_pkg_fast(alpm_pkg_t *pkg)
 		}
 		strcpy(filepath + rootlen, path);
 
-		exists = check_file_exists(pkgname, filepath, rootlen, &st);
+		if(results[i].err != 0) {
+			exists = check_file_missing(pkgname, filepath, rootlen, results[i].err);
+		}
 		if(exists == 0) {
 			int expect_dir = path[plen - 1] == '/' ? 1 : 0;
-			int is_dir = S_ISDIR(st.st_mode) ? 1 : 0;
+			int is_dir = S_ISDIR(st->st_mode) ? 1 : 0;
 			if(expect_dir != is_dir) {
 				pm_printf(ALPM_LOG_WARNING, _("%s: %s (File type mismatch)\n"),
 						pkgname, filepath);
@@ -237,6 +264,7 @@ int check_pkg_fast(alpm_pkg_t *pkg)
 			++errors;
 		}
 	}
+	free(results);
 
 	if(!config->quiet) {
 		printf(_n("%s: %jd total file, ", "%s: %jd total files, ",
@@ -104,6 +104,7 @@ config_t *config_new(void)
 	newconfig->logmask = ALPM_LOG_ERROR | ALPM_LOG_WARNING;
 	newconfig->configfile = strdup(CONFFILE);
 	newconfig->deltaratio = 0.0;
+	newconfig->parallel_downloads = 1;
 	if(alpm_capabilities() & ALPM_CAPABILITY_SIGNATURES) {
 		newconfig->siglevel = ALPM_SIG_PACKAGE | ALPM_SIG_PACKAGE_OPTIONAL |
 			ALPM_SIG_DATABASE | ALPM_SIG_DATABASE_OPTIONAL;
@@ -471,6 +472,34 @@ static void setrepeatingoption(char *ptr, const char *option,
 	}
 }
 
+/** Parse the value of a numeric option.
+ * @param key the name of the option, for the error message
+ * @param value the value to parse
+ * @param min the smallest value allowed
+ * @param max the largest value allowed
+ * @param file the config file, for the error message
+ * @param linenum the line of the option, for the error message
+ * @param out where to store the value
+ * @return 0 on success, 1 if the value is not a number in range
+ */
+static int parse_number_option(const char *key, const char *value,
+		long min, long max, const char *file, int linenum, unsigned int *out)
+{
+	long number;
+	char *endptr;
+
+	errno = 0;
+	number = strtol(value, &endptr, 10);
+	if(*endptr != '\0' || errno != 0 || number < min || number > max) {
+		pm_printf(ALPM_LOG_ERROR,
+				_("config file %s, line %d: invalid value for '%s' : '%s'\n"),
+				file, linenum, key, value);
+		return 1;
+	}
+	*out = (unsigned int)number;
+	return 0;
+}
+
 static int _parse_options(const char *key, char *value,
 		const char *file, int linenum)
 {
@@ -545,6 +574,24 @@ static int _parse_options(const char *key, char *value,
 			}
 			config->deltaratio = ratio;
 			pm_printf(ALPM_LOG_DEBUG, "config: usedelta = %f\n", ratio);
+		} else if(strcmp(key, "ParallelDownloads") == 0) {
+			if(parse_number_option(key, value, 1, INT_MAX, file, linenum,
+						&config->parallel_downloads)) {
+				return 1;
+			}
+			pm_printf(ALPM_LOG_DEBUG, "config: paralleldownloads = %u\n", config->parallel_downloads);
+		} else if(strcmp(key, "SegmentedDownloadSize") == 0) {
+			if(parse_number_option(key, value, 0, INT_MAX, file, linenum,
+						&config->segmented_download_size)) {
+				return 1;
+			}
+			pm_printf(ALPM_LOG_DEBUG, "config: segmenteddownloadsize = %u\n", config->segmented_download_size);
+		} else if(strcmp(key, "WorkerThreads") == 0) {
+			if(parse_number_option(key, value, 0, INT_MAX, file, linenum,
+						&config->worker_threads)) {
+				return 1;
+			}
+			pm_printf(ALPM_LOG_DEBUG, "config: workerthreads = %u\n", config->worker_threads);
 		} else if(strcmp(key, "DBPath") == 0) {
 			/* don't overwrite a path specified on the command line */
 			if(!config->dbpath) {
@@ -767,6 +814,10 @@ static int setup_libalpm(void)
 	alpm_option_set_checkspace(handle, config->checkspace);
 	alpm_option_set_usesyslog(handle, config->usesyslog);
 	alpm_option_set_deltaratio(handle, config->deltaratio);
+	alpm_option_set_parallel_downloads(handle, config->parallel_downloads);
+	alpm_option_set_segmented_download_size(handle,
+			(off_t)config->segmented_download_size * 1024 * 1024);
+	alpm_option_set_worker_threads(handle, config->worker_threads);
 
 	alpm_option_set_ignorepkgs(handle, config->ignorepkg);
 	alpm_option_set_ignoregroups(handle, config->ignoregrp);
@@ -56,6 +56,10 @@ typedef struct __config_t {
 	unsigned short usesyslog;
 	unsigned short color;
 	unsigned short disable_dl_timeout;
+	unsigned int parallel_downloads;
+	/* in MiB */
+	unsigned int segmented_download_size;
+	unsigned int worker_threads;
 	double deltaratio;
 	char *arch;
 	char *print_format;
@@ -207,6 +211,9 @@ enum {
 	OP_UNNEEDED,
 	OP_VERBOSE,
 	OP_DOWNLOADONLY,
+	OP_STREAM,
+	OP_PIPELINE,
+	OP_CONCURRENT,
 	OP_REFRESH,
 	OP_ASSUMEINSTALLED,
 	OP_DISABLEDLTIMEOUT
@@ -67,28 +67,26 @@ static int files_fileowner(alpm_list_t *syncs, alpm_list_t *targets) {
 		for(s = syncs; s; s = alpm_list_next(s)) {
 			alpm_list_t *p;
 			alpm_db_t *repo = s->data;
-			alpm_list_t *packages = alpm_db_get_pkgcache(repo);
+			alpm_list_t *owners = alpm_db_find_file_owners(repo, filename);
 
-			for(p = packages; p; p = alpm_list_next(p)) {
+			for(p = owners; p; p = alpm_list_next(p)) {
 				alpm_pkg_t *pkg = p->data;
-				alpm_filelist_t *files = alpm_pkg_get_files(pkg);
-
-				if(alpm_filelist_contains(files, filename)) {
-					if(config->op_f_machinereadable) {
-						print_line_machinereadable(repo, pkg, filename);
-					} else if(!config->quiet) {
-						const colstr_t *colstr = &config->colstr;
-						printf(_("%s is owned by %s%s/%s%s %s%s%s\n"), filename,
-								colstr->repo, alpm_db_get_name(repo), colstr->title,
-								alpm_pkg_get_name(pkg), colstr->version,
-								alpm_pkg_get_version(pkg), colstr->nocolor);
-					} else {
-						printf("%s/%s\n", alpm_db_get_name(repo), alpm_pkg_get_name(pkg));
-					}
 
-					found = 1;
+				if(config->op_f_machinereadable) {
+					print_line_machinereadable(repo, pkg, filename);
+				} else if(!config->quiet) {
+					const colstr_t *colstr = &config->colstr;
+					printf(_("%s is owned by %s%s/%s%s %s%s%s\n"), filename,
+							colstr->repo, alpm_db_get_name(repo), colstr->title,
+							alpm_pkg_get_name(pkg), colstr->version,
+							alpm_pkg_get_version(pkg), colstr->nocolor);
+				} else {
+					printf("%s/%s\n", alpm_db_get_name(repo), alpm_pkg_get_name(pkg));
 				}
+
+				found = 1;
 			}
+			alpm_list_free(owners);
 		}
 
 		if(!found) {
@@ -121,9 +119,17 @@ static int files_search(alpm_list_t *syncs, alpm_list_t *targets, int regex) {
 		for(s = syncs; s; s = alpm_list_next(s)) {
 			alpm_list_t *p;
 			alpm_db_t *repo = s->data;
-			alpm_list_t *packages = alpm_db_get_pkgcache(repo);
+			alpm_list_t *packages;
 			int m;
 
+			/* plain names are looked up in the database's file name index,
+			 * only regular expressions need to go through every package */
+			if(regex) {
+				packages = alpm_db_get_pkgcache(repo);
+			} else {
+				packages = alpm_db_filename_search(repo, targ);
+			}
+
 			for(p = packages; p; p = alpm_list_next(p)) {
 				size_t f = 0;
 				char* c;
@@ -174,6 +180,9 @@ static int files_search(alpm_list_t *syncs, alpm_list_t *targets, int regex) {
 					alpm_list_free(match);
 				}
 			}
+			if(!regex) {
+				alpm_list_free(packages);
+			}
 		}
 
 		if(regex) {
@@ -306,6 +315,10 @@ int pacman_files(alpm_list_t *targets)
 		return 1;
 	}
 
+	/* every database is read; load them side by side. Failures are
+	 * reported again when a database is accessed. */
+	alpm_dbs_populate_parallel(config->handle, 0);
+
 	/* determine the owner of a file */
 	if(config->op_q_owns) {
 		return files_fileowner(files_dbs, targets);
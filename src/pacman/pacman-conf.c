@@ -133,6 +133,14 @@ static void show_float(const char *directive, float val)
 	printf("%f%c", val, sep);
 }
 
+static void show_uint(const char *directive, unsigned int val)
+{
+	if(verbose) {
+		printf("%s = ", directive);
+	}
+	printf("%u%c", val, sep);
+}
+
 static void show_bool(const char *directive, short unsigned int val)
 {
 	if(val) {
@@ -270,6 +278,9 @@ static void dump_config(void)
 	show_bool("ILoveCandy", config->chomp);
 
 	show_float("UseDelta", config->deltaratio);
+	show_uint("ParallelDownloads", config->parallel_downloads);
+	show_uint("SegmentedDownloadSize", config->segmented_download_size);
+	show_uint("WorkerThreads", config->worker_threads);
 
 	show_cleanmethod("CleanMethod", config->cleanmethod);
 
@@ -382,6 +393,12 @@ static int list_directives(void)
 
 		} else if(strcasecmp(i->data, "UseDelta") == 0) {
 			show_float("UseDelta", config->deltaratio);
+		} else if(strcasecmp(i->data, "ParallelDownloads") == 0) {
+			show_uint("ParallelDownloads", config->parallel_downloads);
+		} else if(strcasecmp(i->data, "SegmentedDownloadSize") == 0) {
+			show_uint("SegmentedDownloadSize", config->segmented_download_size);
+		} else if(strcasecmp(i->data, "WorkerThreads") == 0) {
+			show_uint("WorkerThreads", config->worker_threads);
 
 		} else if(strcasecmp(i->data, "CleanMethod") == 0) {
 			show_cleanmethod("CleanMethod", config->cleanmethod);
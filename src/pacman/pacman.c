@@ -165,6 +165,8 @@ static void usage(int op, const char * const myname)
 			addlist(_("  -y, --refresh        download fresh package databases from the server\n"
 			          "                       (-yy to force a refresh even if up to date)\n"));
 			addlist(_("      --needed         do not reinstall up to date packages\n"));
+			addlist(_("      --pipeline       verify packages while others are downloading\n"));
+			addlist(_("      --stream         extract packages while others are downloading\n"));
 		} else if(op == PM_OP_DATABASE) {
 			printf("%s:  %s {-D --database} <%s> <%s>\n", str_usg, myname, str_opt, str_pkg);
 			printf("%s:\n", str_opt);
@@ -196,6 +198,7 @@ static void usage(int op, const char * const myname)
 				addlist(_("      --ignore <pkg>   ignore a package upgrade (can be used more than once)\n"));
 				addlist(_("      --ignoregroup <grp>\n"
 				          "                       ignore a group upgrade (can be used more than once)\n"));
+				addlist(_("      --concurrent     install packages that do not depend on each other at once\n"));
 				/* pass through */
 			case PM_OP_REMOVE:
 				addlist(_("  -d, --nodeps         skip dependency version checks (-dd to skip all checks)\n"));
@@ -734,6 +737,9 @@ static int parsearg_upgrade(int opt)
 		case OP_IGNOREGROUP:
 			parsearg_util_addlist(&(config->ignoregrp));
 			break;
+		case OP_CONCURRENT:
+			config->flags |= ALPM_TRANS_FLAG_CONCURRENT;
+			break;
 		default: return 1;
 	}
 	return 0;
@@ -838,6 +844,12 @@ static int parsearg_sync(int opt)
 			config->flags |= ALPM_TRANS_FLAG_DOWNLOADONLY;
 			config->flags |= ALPM_TRANS_FLAG_NOCONFLICTS;
 			break;
+		case OP_STREAM:
+			config->flags |= ALPM_TRANS_FLAG_STREAM;
+			break;
+		case OP_PIPELINE:
+			config->flags |= ALPM_TRANS_FLAG_PIPELINE;
+			break;
 		case OP_REFRESH:
 		case 'y':
 			(config->op_s_sync)++;
@@ -933,6 +945,9 @@ static int parseargs(int argc, char *argv[])
 		{"unneeded",   no_argument,       0, OP_UNNEEDED},
 		{"verbose",    no_argument,       0, OP_VERBOSE},
 		{"downloadonly", no_argument,     0, OP_DOWNLOADONLY},
+		{"stream",     no_argument,       0, OP_STREAM},
+		{"pipeline",   no_argument,       0, OP_PIPELINE},
+		{"concurrent", no_argument,       0, OP_CONCURRENT},
 		{"refresh",    no_argument,       0, OP_REFRESH},
 		{"noconfirm",  no_argument,       0, OP_NOCONFIRM},
 		{"confirm",    no_argument,       0, OP_CONFIRM},
@@ -102,10 +102,18 @@ static int sync_cleandb(const char *dbpath)
 			dbname = strndup(dname, len - 3);
 		} else if(len > 7 && strcmp(dname + len - 7, ".db.sig") == 0) {
 			dbname = strndup(dname, len - 7);
+		} else if(len > 12 && strcmp(dname + len - 12, ".db.snapshot") == 0) {
+			dbname = strndup(dname, len - 12);
+		} else if(len > 8 && strcmp(dname + len - 8, ".db.etag") == 0) {
+			dbname = strndup(dname, len - 8);
 		} else if(len > 6 && strcmp(dname + len - 6, ".files") == 0) {
 			dbname = strndup(dname, len - 6);
 		} else if(len > 6 && strcmp(dname + len - 6, ".files.sig") == 0) {
 			dbname = strndup(dname, len - 10);
+		} else if(len > 15 && strcmp(dname + len - 15, ".files.snapshot") == 0) {
+			dbname = strndup(dname, len - 15);
+		} else if(len > 11 && strcmp(dname + len - 11, ".files.etag") == 0) {
+			dbname = strndup(dname, len - 11);
 		} else {
 			ret += unlink_verbose(path, 0);
 			continue;
@@ -922,6 +930,12 @@ int pacman_sync(alpm_list_t *targets)
 		return 1;
 	}
 
+	if(config->op_s_search || (config->op_q_list && targets == NULL)) {
+		/* every database is read; load them side by side. Failures are
+		 * reported again when a database is accessed. */
+		alpm_dbs_populate_parallel(config->handle, 0);
+	}
+
 	/* search for a package */
 	if(config->op_s_search) {
 		return sync_search(sync_dbs, targets);
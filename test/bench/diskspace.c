@@ -0,0 +1,146 @@
+/*
+ *  diskspace.c : Benchmark the disk space check of a transaction
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* libalpm */
+#include "alpm_list.h"
+#include "diskspace.h"
+#include "handle.h"
+#include "package.h"
+#include "trans.h"
+#include "util.h"
+
+#include "bench.h"
+
+#define ROUNDS 20
+
+/* the file list being collected by nftw() */
+static alpm_filelist_t walked;
+static size_t walked_size;
+
+static int walk_cb(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	alpm_file_t *file;
+	int isdir = (type == FTW_D);
+
+	(void)ftw;
+	if(path[1] == '\0') {
+		return 0;
+	}
+	if(walked.count == walked_size) {
+		walked_size = walked_size ? walked_size * 2 : 1024;
+		file = realloc(walked.files, walked_size * sizeof(alpm_file_t));
+		if(file == NULL) {
+			return -1;
+		}
+		walked.files = file;
+	}
+	file = walked.files + walked.count;
+	memset(file, 0, sizeof(alpm_file_t));
+	/* file lists hold paths relative to the root, directories with a
+	 * trailing slash */
+	if(asprintf(&file->name, "%s%s", path + 1, isdir ? "/" : "") < 0) {
+		return -1;
+	}
+	/* sizes are left at zero so the check passes on any host; only the
+	 * mount point look-ups are measured */
+	file->mode = st->st_mode;
+	walked.count++;
+	return 0;
+}
+
+static int file_cmp(const void *f1, const void *f2)
+{
+	return strcmp(((const alpm_file_t *)f1)->name, ((const alpm_file_t *)f2)->name);
+}
+
+int main(int argc, char *argv[])
+{
+	char dbpath[] = "/tmp/alpm-bench-XXXXXX";
+	const char *dir = "/usr";
+	alpm_handle_t *handle;
+	alpm_pkg_t *pkg;
+	double start, elapsed;
+	int i, ret = 1;
+
+	if(argc > 1) {
+		dir = argv[1];
+	}
+	if(dir[0] != '/') {
+		fprintf(stderr, "usage: %s [absolute directory]\n", argv[0]);
+		return 2;
+	}
+
+	if(nftw(dir, walk_cb, 64, FTW_PHYS) != 0) {
+		fprintf(stderr, "could not walk %s\n", dir);
+		return 1;
+	}
+	qsort(walked.files, walked.count, sizeof(alpm_file_t), file_cmp);
+
+	if(mkdtemp(dbpath) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	handle = alpm_initialize("/", dbpath, NULL);
+	if(handle == NULL) {
+		fprintf(stderr, "could not initialize libalpm\n");
+		rmdir(dbpath);
+		return 1;
+	}
+	handle->trans = calloc(1, sizeof(alpm_trans_t));
+	pkg = _alpm_pkg_new();
+	if(handle->trans == NULL || pkg == NULL) {
+		_alpm_pkg_free(pkg);
+		goto cleanup;
+	}
+	pkg->name = strdup("walked");
+	pkg->version = strdup("1.0-1");
+	pkg->name_hash = _alpm_hash_sdbm(pkg->name);
+	pkg->handle = handle;
+	pkg->ops = &default_pkg_ops;
+	pkg->origin = ALPM_PKG_FROM_FILE;
+	pkg->files = walked;
+	handle->trans->add = alpm_list_add(NULL, pkg);
+
+	start = bench_now();
+	for(i = 0; i < ROUNDS; i++) {
+		if(_alpm_check_diskspace(handle) != 0) {
+			fprintf(stderr, "disk space check failed: %s\n",
+					alpm_strerror(alpm_errno(handle)));
+			goto cleanup;
+		}
+	}
+	elapsed = bench_now() - start;
+
+	printf("%zu paths under %s: %.2f ms per check\n",
+			walked.count, dir, elapsed * 1e3 / ROUNDS);
+	ret = 0;
+
+cleanup:
+	alpm_release(handle);
+	rmdir(dbpath);
+	return ret;
+}
@@ -0,0 +1,183 @@
+/*
+ *  fileconflicts.c : Benchmark the file conflict check of a transaction
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* libalpm */
+#include "alpm_list.h"
+#include "conflict.h"
+#include "handle.h"
+#include "package.h"
+#include "trans.h"
+#include "util.h"
+
+#include "bench.h"
+
+/* every package ships this many files in its own directory, next to a few
+ * directories all of them share */
+#define DATAFILES 120
+
+static int add_file(alpm_filelist_t *files, size_t *size, mode_t mode,
+		const char *fmt, const char *name, size_t idx)
+{
+	alpm_file_t *file;
+
+	if(files->count == *size) {
+		*size = *size ? *size * 2 : 64;
+		file = realloc(files->files, *size * sizeof(alpm_file_t));
+		if(file == NULL) {
+			return -1;
+		}
+		files->files = file;
+	}
+	file = files->files + files->count;
+	memset(file, 0, sizeof(alpm_file_t));
+	if(asprintf(&file->name, fmt, name, idx) < 0) {
+		return -1;
+	}
+	file->mode = mode;
+	files->count++;
+	return 0;
+}
+
+static int file_cmp(const void *f1, const void *f2)
+{
+	return strcmp(((const alpm_file_t *)f1)->name, ((const alpm_file_t *)f2)->name);
+}
+
+/* Package i ships usr/bin/pkgNNNNN, usr/share/pkgNNNNN/ and its data files.
+ * One in fifty packages also ships the binary of the next package, and as
+ * many ship a file where the next package has its data directory. */
+static alpm_pkg_t *make_pkg(alpm_handle_t *handle, size_t i)
+{
+	static const char *dirs[] = {
+		"usr/", "usr/bin/", "usr/lib/", "usr/share/", "usr/share/doc/"
+	};
+	const mode_t dir = S_IFDIR | 0755, reg = S_IFREG | 0644;
+	alpm_filelist_t *files;
+	alpm_pkg_t *pkg;
+	char name[32], next[32];
+	size_t j, size = 0;
+	int err = 0;
+
+	pkg = _alpm_pkg_new();
+	if(pkg == NULL) {
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "pkg%05zu", i);
+	snprintf(next, sizeof(next), "pkg%05zu", i + 1);
+	pkg->name = strdup(name);
+	pkg->version = strdup("1.0-1");
+	if(pkg->name == NULL || pkg->version == NULL) {
+		_alpm_pkg_free(pkg);
+		return NULL;
+	}
+	pkg->name_hash = _alpm_hash_sdbm(pkg->name);
+	pkg->handle = handle;
+	pkg->ops = &default_pkg_ops;
+	pkg->origin = ALPM_PKG_FROM_FILE;
+
+	files = &pkg->files;
+	for(j = 0; j < sizeof(dirs) / sizeof(dirs[0]); j++) {
+		err |= add_file(files, &size, dir, dirs[j], "", 0);
+	}
+	err |= add_file(files, &size, reg, "usr/bin/%s", name, 0);
+	err |= add_file(files, &size, reg, "usr/lib/lib%s.so", name, 0);
+	err |= add_file(files, &size, dir, "usr/share/%s/", name, 0);
+	err |= add_file(files, &size, dir, "usr/share/doc/%s/", name, 0);
+	err |= add_file(files, &size, reg, "usr/share/doc/%s/README", name, 0);
+	for(j = 0; j < DATAFILES; j++) {
+		err |= add_file(files, &size, reg, "usr/share/%s/data%03zu", name, j);
+	}
+	if(i % 50 == 0) {
+		err |= add_file(files, &size, reg, "usr/bin/%s", next, 0);
+	} else if(i % 50 == 25) {
+		err |= add_file(files, &size, reg, "usr/share/%s", next, 0);
+	}
+	if(err) {
+		_alpm_pkg_free(pkg);
+		return NULL;
+	}
+	qsort(files->files, files->count, sizeof(alpm_file_t), file_cmp);
+	return pkg;
+}
+
+int main(int argc, char *argv[])
+{
+	char root[] = "/tmp/alpm-bench-XXXXXX";
+	alpm_handle_t *handle;
+	alpm_list_t *conflicts;
+	size_t i, count = 2000, paths = 0;
+	double start, elapsed;
+	int ret = 1;
+
+	if(argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+	if(count == 0) {
+		fprintf(stderr, "usage: %s [packages]\n", argv[0]);
+		return 2;
+	}
+
+	/* an empty root, so the filesystem check finds nothing */
+	if(mkdtemp(root) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	handle = alpm_initialize(root, root, NULL);
+	if(handle == NULL) {
+		fprintf(stderr, "could not initialize libalpm\n");
+		rmdir(root);
+		return 1;
+	}
+	handle->trans = calloc(1, sizeof(alpm_trans_t));
+	if(handle->trans == NULL) {
+		goto cleanup;
+	}
+	for(i = 0; i < count; i++) {
+		alpm_pkg_t *pkg = make_pkg(handle, i);
+		if(pkg == NULL) {
+			goto cleanup;
+		}
+		paths += pkg->files.count;
+		handle->trans->add = alpm_list_add(handle->trans->add, pkg);
+	}
+
+	start = bench_now();
+	conflicts = _alpm_db_find_fileconflicts(handle, handle->trans->add, NULL);
+	elapsed = bench_now() - start;
+
+	printf("%zu packages, %zu paths: %zu conflicts in %.3f s\n",
+			count, paths, alpm_list_count(conflicts), elapsed);
+	alpm_list_free_inner(conflicts, (alpm_list_fn_free)alpm_fileconflict_free);
+	alpm_list_free(conflicts);
+	ret = 0;
+
+cleanup:
+	if(ret != 0) {
+		fprintf(stderr, "benchmark failed\n");
+	}
+	alpm_release(handle);
+	rmdir(root);
+	return ret;
+}
@@ -0,0 +1,132 @@
+/*
+ *  pkghash.c : Benchmark package hash insertion and look-up
+ *
+ *  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* libalpm */
+#include "package.h"
+#include "pkghash.h"
+#include "util.h"
+
+#include "bench.h"
+
+#define QUERIES 65536
+
+static const char *prefixes[] = {
+	"lib", "python-", "python2-", "perl-", "ruby-", "haskell-", "xorg-",
+	"ttf-", "lib32-", "kde-", "gnome-", "texlive-", "r-", "nodejs-"
+};
+
+/* names built from common prefixes, so that many share a long head */
+static char *make_name(size_t i)
+{
+	char *name;
+	const size_t nprefixes = sizeof(prefixes) / sizeof(prefixes[0]);
+
+	if(asprintf(&name, "%s%zx-%zu", prefixes[i % nprefixes],
+				(i * 2654435761u) & 0xffff, i) < 0) {
+		return NULL;
+	}
+	return name;
+}
+
+static int run(size_t n, unsigned long lookups)
+{
+	alpm_pkg_t **pkgs;
+	alpm_pkghash_t *hash;
+	char *queries[QUERIES] = { NULL };
+	double start, insert, lookup;
+	unsigned long i, found = 0;
+	int ret = 1;
+
+	pkgs = calloc(n, sizeof(alpm_pkg_t *));
+	if(pkgs == NULL) {
+		return 1;
+	}
+	for(i = 0; i < n; i++) {
+		pkgs[i] = _alpm_pkg_new();
+		if(pkgs[i] == NULL || (pkgs[i]->name = make_name(i)) == NULL) {
+			goto cleanup;
+		}
+		pkgs[i]->name_hash = _alpm_hash_sdbm(pkgs[i]->name);
+	}
+	/* half of the queries hit, the other half miss */
+	for(i = 0; i < QUERIES; i++) {
+		queries[i] = make_name(i % 2 ? (i * 7919) % n : n + i);
+		if(queries[i] == NULL) {
+			goto cleanup;
+		}
+	}
+
+	/* created at half the final size, so inserting includes growing */
+	start = bench_now();
+	hash = _alpm_pkghash_create(n / 2);
+	for(i = 0; hash && i < n; i++) {
+		hash = _alpm_pkghash_add(&hash, pkgs[i]);
+	}
+	insert = bench_now() - start;
+	if(hash == NULL) {
+		goto cleanup;
+	}
+
+	start = bench_now();
+	for(i = 0; i < lookups; i++) {
+		found += _alpm_pkghash_find(hash, queries[i % QUERIES]) != NULL;
+	}
+	lookup = bench_now() - start;
+
+	printf("%8zu packages: insert %8.2f ms, lookup %6.1f ns (%lu of %lu found)\n",
+			n, insert * 1e3, lookup * 1e9 / lookups, found, lookups);
+	_alpm_pkghash_free(hash);
+	ret = 0;
+
+cleanup:
+	for(i = 0; i < QUERIES; i++) {
+		free(queries[i]);
+	}
+	for(i = 0; i < n; i++) {
+		_alpm_pkg_free(pkgs[i]);
+	}
+	free(pkgs);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 12000, 100000, 600000 };
+	unsigned long lookups = 20000000;
+	size_t i;
+
+	if(argc > 1) {
+		lookups = strtoul(argv[1], NULL, 10);
+	}
+	if(lookups == 0) {
+		fprintf(stderr, "usage: %s [lookups]\n", argv[0]);
+		return 2;
+	}
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if(run(sizes[i], lookups) != 0) {
+			fprintf(stderr, "benchmark failed\n");
+			return 1;
+		}
+	}
+	return 0;
+}
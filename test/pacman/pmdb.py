@@ -54,6 +54,8 @@ def __init__(self, treename, root):
         self.root = root
         self.pkgs = []
         self.option = {}
+        # server urls listed before the one serving this repository
+        self.mirrors = []
         if self.treename == "local":
             self.dbdir = os.path.join(root, util.PM_DBPATH, treename)
             self.dbfile = None
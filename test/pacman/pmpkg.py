@@ -15,6 +15,7 @@
 #  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 from io import BytesIO
+import gzip
 import os
 import tarfile
 
@@ -53,6 +54,8 @@ def __init__(self, name, version = "1.0-1"):
         # files
         self.files = []
         self.backup = []
+        self.mtree = False    # ship a .MTREE describing the payload
+        self.filedata = {}    # contents of files, instead of their name
         # install
         self.install = {
             "pre_install": "",
@@ -138,6 +141,12 @@ def makepkg(self, path):
         if any(self.install.values()):
             archive_files.append((".INSTALL", self.installfile()))
 
+        archive_files = [(name, data.encode('utf8')) for name, data in archive_files]
+
+        # .MTREE, which makepkg puts ahead of the other metadata
+        if self.mtree:
+            archive_files.insert(0, (".MTREE", gzip.compress(self.mtreefile().encode('utf8'))))
+
         self.path = os.path.join(path, self.filename())
         util.mkdir(os.path.dirname(self.path))
 
@@ -146,7 +155,7 @@ def makepkg(self, path):
         for name, data in archive_files:
             info = tarfile.TarInfo(name)
             info.size = len(data)
-            tar.addfile(info, BytesIO(data.encode('utf8')))
+            tar.addfile(info, BytesIO(data))
 
         # Generate package file system
         for name in self.files:
@@ -165,12 +174,33 @@ def makepkg(self, path):
                 tar.addfile(info)
             else:
                 # TODO wow what a hack, adding a newline to match mkfile?
-                filedata = name + "\n"
+                filedata = self.filedata.get(name, name + "\n")
+                if isinstance(filedata, str):
+                    filedata = filedata.encode('utf8')
                 info.size = len(filedata)
-                tar.addfile(info, BytesIO(filedata.encode('utf8')))
+                tar.addfile(info, BytesIO(filedata))
 
         tar.close()
 
+    def mtreefile(self):
+        """Generate an mtree describing the package file system."""
+        data = ["#mtree"]
+        for name in self.files:
+            fileinfo = util.getfileinfo(name)
+            line = "./%s" % fileinfo["filename"].rstrip("/")
+            if fileinfo["isdir"]:
+                line += " type=dir mode=%o" % (fileinfo["perms"] if fileinfo["hasperms"] else 0o755)
+            elif fileinfo["islink"]:
+                line += " type=link link=%s" % fileinfo["link"]
+            else:
+                if fileinfo["hasperms"]:
+                    line += " mode=%o" % fileinfo["perms"]
+                filedata = self.filedata.get(name, name + "\n")
+                line += " type=file size=%d" % len(filedata)
+            data.append(line)
+        data.append("")
+        return "\n".join(data)
+
     def install_package(self, root):
         """Install the package in the given root."""
         for f in self.files:
@@ -139,6 +139,11 @@ def check(self, test):
                     mode = os.lstat(filename)[stat.ST_MODE]
                     if int(value, 8) != stat.S_IMODE(mode):
                         success = 0
+            elif case == "MTIME":
+                if not os.path.isfile(filename):
+                    success = 0
+                elif int(os.stat(filename).st_mtime) != int(value):
+                    success = 0
             elif case == "TYPE":
                 if value == "dir":
                     if not os.path.isdir(filename):
@@ -0,0 +1,114 @@
+#  Copyright (c) 2018 Pacman Development Team <pacman-dev@archlinux.org>
+#
+#  This program is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+import hashlib
+import http.server
+import os
+import re
+import threading
+
+
+class pmhandler(http.server.BaseHTTPRequestHandler):
+    """Serve the files below the server's directory, with byte ranges and
+    entity tags
+    """
+
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        path = os.path.join(self.server.directory, self.path.lstrip("/"))
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return
+        with open(path, "rb") as f:
+            data = f.read()
+        start, end = 0, len(data)
+
+        etag = None
+        if self.server.etags:
+            etag = '"%s"' % hashlib.md5(data).hexdigest()
+            tags = [t.strip() for t in
+                    self.headers.get("If-None-Match", "").split(",")]
+            if etag in tags:
+                self.send_response(304)
+                self.send_header("ETag", etag)
+                self.end_headers()
+                return
+
+        match = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        if match and self.server.ranges:
+            start = int(match.group(1))
+            if match.group(2):
+                end = min(int(match.group(2)) + 1, len(data))
+            if start >= end:
+                self.send_error(416)
+                return
+            self.send_response(206)
+            self.send_header("Content-Range",
+                    "bytes %d-%d/%d" % (start, end - 1, len(data)))
+        else:
+            self.send_response(200)
+        self.send_header("Content-Length", str(end - start))
+        self.send_header("Last-Modified", self.date_time_string(
+                self.server.mtime if self.server.mtime is not None
+                else os.stat(path).st_mtime))
+        if etag:
+            self.send_header("ETag", etag)
+        self.end_headers()
+        self.wfile.write(data[start:end])
+
+    def log_message(self, format, *args):
+        pass
+
+
+class pmserver(http.server.ThreadingHTTPServer):
+    """HTTP server for the sync repositories of a test
+
+    ranges -- whether Range requests are honoured
+    mtime -- time sent as Last-Modified for every file, None for the
+             time of the file itself
+    etags -- whether files are sent with an entity tag, and If-None-Match
+             requests for a matching tag answered with 304
+    """
+
+    daemon_threads = True
+
+    def __init__(self, directory, ranges=True, mtime=None, etags=False):
+        http.server.ThreadingHTTPServer.__init__(self, ("127.0.0.1", 0),
+                pmhandler)
+        self.directory = directory
+        self.ranges = ranges
+        self.mtime = mtime
+        self.etags = etags
+        self.thread = None
+
+    def handle_error(self, request, client_address):
+        # pacman drops connections that send something it did not ask for
+        pass
+
+    def url(self):
+        return "http://127.0.0.1:%d" % self.server_address[1]
+
+    def start(self):
+        self.thread = threading.Thread(target=self.serve_forever)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def stop(self):
+        if self.thread:
+            self.shutdown()
+            self.thread.join()
+        self.server_close()
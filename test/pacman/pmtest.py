@@ -25,6 +25,7 @@
 import pmrule
 import pmdb
 import pmfile
+import pmserver
 import tap
 import util
 from util import vprint
@@ -86,6 +87,7 @@ def load(self):
             "fail": 0
         }
         self.args = ""
+        self.setup = []
         self.retcode = 0
         self.db = {
             "local": pmdb.pmdb("local", self.root)
@@ -93,6 +95,7 @@ def load(self):
         self.localpkgs = []
         self.createlocalpkgs = False
         self.filesystem = []
+        self.servers = []
 
         self.description = ""
         self.option = {}
@@ -213,6 +216,15 @@ def add_script(self, name, content):
         path = os.path.join("bin/", name)
         self.filesystem.append(pmfile.pmfile(path, content, mode=0o755))
 
+    def add_http_server(self, treename, **kwargs):
+        """Serve a sync repository over HTTP, ahead of its file:// server.
+        See pmserver.pmserver for the options."""
+        server = pmserver.pmserver(os.path.join(self.root, util.SYNCREPO),
+                **kwargs)
+        self.servers.append(server)
+        self.db[treename].mirrors.append("%s/%s" % (server.url(), treename))
+        return server
+
     def snapshots_needed(self):
         files = set()
         for r in self.rules:
@@ -270,6 +282,7 @@ def run(self, pacman):
             cmd.append("--confirm")
         if pacman["debug"]:
             cmd.append("--debug=%s" % pacman["debug"])
+        setup_cmd = list(cmd)
         cmd.extend(shlex.split(self.args))
 
         if not (pacman["gdb"] or pacman["nolog"]):
@@ -280,10 +293,23 @@ def run(self, pacman):
 
         # Change to the tmp dir before running pacman, so that local package
         # archives are made available more easily.
+        for server in self.servers:
+            server.start()
+        for step in self.setup:
+            if callable(step):
+                step(self)
+            else:
+                vprint("\tsetup: pacman %s" % step)
+                subprocess.call(setup_cmd + shlex.split(step),
+                        stdout=output, stderr=output,
+                        cwd=os.path.join(self.root, util.TMPDIR),
+                        env={'LC_ALL': 'C'})
         time_start = time.time()
         self.retcode = subprocess.call(cmd, stdout=output, stderr=output,
                 cwd=os.path.join(self.root, util.TMPDIR), env={'LC_ALL': 'C'})
         time_end = time.time()
+        for server in self.servers:
+            server.stop()
         vprint("\ttime elapsed: %.2fs" % (time_end - time_start))
 
         if output:
@@ -0,0 +1,28 @@
+self.description = "Install a package with many small files on several threads"
+
+self.option['WorkerThreads'] = ['4']
+
+p = pmpkg("dummy")
+p.files = ["usr/share/dummy/%s/file%03d" % (d, n)
+           for d in "abc" for n in range(250)]
+p.files += ["usr/bin/dummy|755",
+            "usr/share/dummy/b/large",
+            "usr/share/dummy/b/link -> file130",
+            "usr/share/dummy/c/private|600"]
+# written out on the calling thread, between files queued for the pool
+p.filedata["usr/share/dummy/b/large"] = "large\n" * 65536
+self.addpkg(p)
+
+self.args = "--debug -U %s" % p.filename()
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_EXIST=dummy")
+self.addrule("PACMAN_OUTPUT=using 4 threads to extract files")
+self.addrule("FILE_CONTENTS=usr/share/dummy/a/file000|usr/share/dummy/a/file000\n")
+self.addrule("FILE_CONTENTS=usr/share/dummy/b/file130|usr/share/dummy/b/file130\n")
+self.addrule("FILE_CONTENTS=usr/share/dummy/c/file249|usr/share/dummy/c/file249\n")
+self.addrule("FILE_EXIST=usr/share/dummy/b/large")
+self.addrule("FILE_MODE=usr/bin/dummy|755")
+self.addrule("FILE_MODE=usr/share/dummy/c/private|600")
+self.addrule("LINK_EXIST=usr/share/dummy/b/link")
+self.addrule("FILE_CONTENTS=usr/share/dummy/b/link|usr/share/dummy/b/file130\n")
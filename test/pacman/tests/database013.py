@@ -0,0 +1,12 @@
+self.description = "-D --asdeps writes a fresh local database snapshot"
+
+lp = pmpkg("pkg")
+lp.reason = 0
+self.addpkg2db("local", lp)
+
+self.args = "-D pkg --asdeps"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_EXIST=pkg")
+self.addrule("PKG_REASON=pkg|1")
+self.addrule("FILE_EXIST=var/lib/pacman/local.snapshot")
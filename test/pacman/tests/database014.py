@@ -0,0 +1,23 @@
+self.description = "A desc edited in place is not read from the local database snapshot"
+
+import os
+
+lp = pmpkg("pkg")
+lp.desc = "old"
+self.addpkg2db("local", lp)
+
+def edit_desc(test):
+	path = os.path.join(test.root, "var/lib/pacman/local/pkg-1.0-1/desc")
+	with open(path) as f:
+		desc = f.read()
+	with open(path, "w") as f:
+		f.write(desc.replace("\nold\n", "\nedited in place\n"))
+
+# the first run writes the snapshot
+self.setup = ["-D pkg --asdeps", edit_desc]
+self.args = "--debug -Qi pkg"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=^debug: mapped snapshot")
+self.addrule("PACMAN_OUTPUT=snapshot entry for pkg-1.0-1 is out of date")
+self.addrule("PACMAN_OUTPUT=^Description +: edited in place")
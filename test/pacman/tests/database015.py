@@ -0,0 +1,23 @@
+self.description = "A file list edited in place is not read from the local database snapshot"
+
+import os
+
+lp = pmpkg("pkg")
+lp.files = ["bin/old"]
+self.addpkg2db("local", lp)
+
+self.filesystem = ["bin/new"]
+
+def edit_files(test):
+	path = os.path.join(test.root, "var/lib/pacman/local/pkg-1.0-1/files")
+	with open(path) as f:
+		files = f.read()
+	with open(path, "w") as f:
+		f.write(files.replace("bin/old\n", "bin/new\n"))
+
+# the first run writes the snapshot
+self.setup = ["-D pkg --asdeps", edit_files]
+self.args = "-Qo %s" % os.path.join(self.root, "bin/new")
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=is owned by pkg 1.0-1")
@@ -0,0 +1,24 @@
+self.description = "Fileconflicts with the filesystem spread over a large package"
+
+self.option['WorkerThreads'] = ['4']
+
+# enough files for the lookups to be split between threads, and a
+# conflict at either end and in the middle
+self.filesystem = ["usr/share/pkg1/a/file000",
+                   "usr/share/pkg1/b/file130",
+                   "usr/share/pkg1/c/file249"]
+
+p = pmpkg("pkg1")
+p.files = ["usr/share/pkg1/%s/file%03d" % (d, n)
+           for d in "abc" for n in range(250)]
+self.addpkg(p)
+
+self.args = "-U %s" % p.filename()
+
+self.addrule("PACMAN_RETCODE=1")
+self.addrule("!PKG_EXIST=pkg1")
+self.addrule("PACMAN_OUTPUT=pkg1: .*/usr/share/pkg1/a/file000 exists in filesystem")
+self.addrule("PACMAN_OUTPUT=pkg1: .*/usr/share/pkg1/b/file130 exists in filesystem")
+self.addrule("PACMAN_OUTPUT=pkg1: .*/usr/share/pkg1/c/file249 exists in filesystem")
+self.addrule("!PACMAN_OUTPUT=pkg1: .*/usr/share/pkg1/b/file131 exists in filesystem")
+self.addrule("!FILE_EXIST=usr/share/pkg1/a/file001")
@@ -0,0 +1,22 @@
+self.description = "Query unrequired dependencies satisfied through provisions"
+
+app = pmpkg("app")
+app.depends = ["libfoo.so=1"]
+self.addpkg2db("local", app)
+
+libfoo = pmpkg("libfoo")
+libfoo.provides = ["libfoo.so=1"]
+libfoo.reason = 1
+self.addpkg2db("local", libfoo)
+
+libfoo2 = pmpkg("libfoo2")
+libfoo2.provides = ["libfoo.so=2"]
+libfoo2.reason = 1
+self.addpkg2db("local", libfoo2)
+
+self.args = "-Qdtq"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=^libfoo2$")
+self.addrule("!PACMAN_OUTPUT=^libfoo$")
+self.addrule("!PACMAN_OUTPUT=^app$")
@@ -0,0 +1,13 @@
+self.description = "Query info on a package file with an mtree and a scriptlet"
+
+p = pmpkg("dummy")
+p.files = ["bin/dummy"]
+p.install['post_install'] = "echo foobar"
+p.mtree = True
+self.addpkg(p)
+
+self.args = "-Qip %s" % p.filename()
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=^Name.*dummy")
+self.addrule("PACMAN_OUTPUT=^Install Script.*Yes")
@@ -0,0 +1,23 @@
+self.description = "Query--check missing files spread over a large package"
+
+import os
+
+self.option['WorkerThreads'] = ['4']
+
+pkg = pmpkg("dummy")
+pkg.files = ["usr/share/dummy/%s/file%03d" % (d, n)
+             for d in "abc" for n in range(250)]
+self.addpkg2db("local", pkg)
+
+def remove_files(test):
+	for f in ["a/file000", "b/file130", "c/file249"]:
+		os.unlink(os.path.join(test.root, "usr/share/dummy", f))
+
+self.setup = [remove_files]
+self.args = "-Qk"
+
+self.addrule("PACMAN_RETCODE=1")
+self.addrule("PACMAN_OUTPUT=dummy: 756 total files, 3 missing files")
+self.addrule("PACMAN_OUTPUT=warning: dummy: .*/usr/share/dummy/a/file000 \(No such file or directory\)")
+self.addrule("PACMAN_OUTPUT=warning: dummy: .*/usr/share/dummy/b/file130 \(No such file or directory\)")
+self.addrule("PACMAN_OUTPUT=warning: dummy: .*/usr/share/dummy/c/file249 \(No such file or directory\)")
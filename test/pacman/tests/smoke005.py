@@ -0,0 +1,13 @@
+self.description = "Search several sync DBs loaded in parallel"
+
+for r in range(1, 5):
+	for i in range(100):
+		sp = pmpkg("pkg%d-%03d" % (r, i))
+		sp.desc = "test description for package %d" % i
+		self.addpkg2db("sync%d" % r, sp)
+
+self.args = "-Ss pkg"
+
+self.addrule("PACMAN_RETCODE=0")
+for r in range(1, 5):
+	self.addrule("PACMAN_OUTPUT=^sync%d/pkg%d-099" % (r, r))
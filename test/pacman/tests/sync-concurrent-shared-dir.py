@@ -0,0 +1,29 @@
+self.description = "Upgrade packages sharing a directory one of them gives up concurrently"
+
+self.option['WorkerThreads'] = ['2']
+
+lp1 = pmpkg("pkg1", "1.0-1")
+lp1.files = ["usr/share/shared/pkg1"]
+self.addpkg2db("local", lp1)
+
+lp2 = pmpkg("pkg2", "1.0-1")
+lp2.files = ["usr/share/shared/pkg2"]
+self.addpkg2db("local", lp2)
+
+p1 = pmpkg("pkg1", "2.0-1")
+p1.files = ["usr/share/shared/pkg1-new"]
+self.addpkg2db("sync", p1)
+
+# removing the old pkg2 must not take the directory from under pkg1
+p2 = pmpkg("pkg2", "2.0-1")
+p2.files = ["usr/bin/pkg2"]
+self.addpkg2db("sync", p2)
+
+self.args = "--debug -S --concurrent %s %s" % (p1.name, p2.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_VERSION=pkg1|2.0-1")
+self.addrule("PKG_VERSION=pkg2|2.0-1")
+self.addrule("PACMAN_OUTPUT=pkg2 waits for pkg1, which uses directory")
+self.addrule("FILE_EXIST=usr/share/shared/pkg1-new")
+self.addrule("!FILE_EXIST=usr/share/shared/pkg2")
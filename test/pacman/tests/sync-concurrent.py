@@ -0,0 +1,36 @@
+self.description = "Install packages which do not depend on each other at once"
+
+self.option['WorkerThreads'] = ['2']
+
+lp = pmpkg("pkg1", "1.0-1")
+lp.files = ["usr/bin/pkg1",
+            "usr/share/pkg1/old"]
+self.addpkg2db("local", lp)
+
+p1 = pmpkg("pkg1", "2.0-1")
+p1.files = ["usr/bin/pkg1",
+            "usr/share/pkg1/"]
+self.addpkg2db("sync", p1)
+
+p2 = pmpkg("pkg2")
+p2.files = ["usr/bin/pkg2",
+            "usr/share/pkg1/pkg2"]
+self.addpkg2db("sync", p2)
+
+p3 = pmpkg("pkg3")
+p3.depends = ["pkg1>=2.0"]
+p3.files = ["usr/bin/pkg3"]
+self.addpkg2db("sync", p3)
+
+self.args = "-S --concurrent %s %s %s" % (p1.name, p2.name, p3.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_VERSION=pkg1|2.0-1")
+self.addrule("!FILE_EXIST=usr/share/pkg1/old")
+for p in (p1, p2, p3):
+	self.addrule("PKG_EXIST=%s" % p.name)
+	for f in p.files:
+		if f.endswith("/"):
+			self.addrule("DIR_EXIST=%s" % f)
+		else:
+			self.addrule("FILE_EXIST=%s" % f)
@@ -0,0 +1,25 @@
+self.description = "Check disk space of an upgrade that removes a large package"
+
+import os
+
+self.option['CheckSpace'] = ['']
+self.option['WorkerThreads'] = ['4']
+
+lp = pmpkg("dummy")
+lp.files = ["usr/share/dummy/%s/file%03d" % (d, n)
+            for d in "abc" for n in range(250)]
+self.addpkg2db("local", lp)
+
+sp = pmpkg("dummy", "2.0-1")
+self.addpkg2db("sync", sp)
+
+def remove_file(test):
+	os.unlink(os.path.join(test.root, "usr/share/dummy/b/file130"))
+
+self.setup = [remove_file]
+self.args = "-Su"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_VERSION=dummy|2.0-1")
+self.addrule("PACMAN_OUTPUT=could not get file information for usr/share/dummy/b/file130")
+self.addrule("!PACMAN_OUTPUT=could not get file information for usr/share/dummy/./file(?!130)")
@@ -0,0 +1,37 @@
+self.description = "Validate packages with the digests computed while downloading them"
+
+import os
+
+# this setting forces us to download packages
+self.cachepkgs = False
+
+p1 = pmpkg("pkg1")
+p1.files = ["usr/bin/pkg1"]
+self.addpkg2db("sync", p1)
+
+# random data does not compress, so half of the package is worth resuming
+p2 = pmpkg("pkg2")
+p2.files = ["usr/share/pkg2/data"]
+p2.filedata = {"usr/share/pkg2/data": os.urandom(256 * 1024)}
+self.addpkg2db("sync", p2)
+
+self.add_http_server("sync")
+
+def interrupt_download(test):
+	# the first half of pkg2, as an interrupted download leaves it behind
+	pkg = [p for p in test.db["sync"].pkgs if p.name == "pkg2"][0]
+	with open(pkg.path, "rb") as f:
+		data = f.read()
+	path = os.path.join(test.root, "var/cache/pacman/pkg", pkg.filename() + ".part")
+	with open(path, "wb") as f:
+		f.write(data[:len(data) // 2])
+
+self.setup = [interrupt_download]
+self.args = "--debug -S %s %s" % (p1.name, p2.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=using checksum computed during download")
+self.addrule("!PACMAN_OUTPUT=checksums? .*invalid")
+self.addrule("PKG_EXIST=pkg1")
+self.addrule("PKG_EXIST=pkg2")
+self.addrule("FILE_EXIST=usr/share/pkg2/data")
@@ -0,0 +1,22 @@
+self.description = "Download several packages in parallel"
+
+# this setting forces us to download packages
+self.cachepkgs = False
+self.option['ParallelDownloads'] = ['3']
+
+numpkgs = 10
+pkgnames = []
+for i in range(numpkgs):
+	name = "pkg_%s" % i
+	pkgnames.append(name)
+	p = pmpkg(name)
+	p.files = ["usr/bin/foo-%s" % i]
+	self.addpkg2db("sync", p)
+
+self.args = "--debug -S %s" % ' '.join(pkgnames)
+
+self.addrule("PACMAN_RETCODE=0")
+for name in pkgnames:
+	self.addrule("PKG_EXIST=%s" % name)
+# the third transfer starts while the first two are still running
+self.addrule("PACMAN_OUTPUT=started alongside 2 other transfers")
@@ -0,0 +1,30 @@
+self.description = "Verify and load packages while others are downloading"
+
+# this setting forces us to download packages
+self.cachepkgs = False
+self.option['ParallelDownloads'] = ['2']
+self.option['WorkerThreads'] = ['2']
+
+p1 = pmpkg("pkg1")
+p1.files = ["usr/bin/pkg1"]
+p1.depends = ["pkg2"]
+self.addpkg2db("sync", p1)
+
+p2 = pmpkg("pkg2")
+p2.files = ["usr/lib/libpkg2.so.1"]
+self.addpkg2db("sync", p2)
+
+p3 = pmpkg("pkg3")
+p3.files = ["usr/bin/pkg3"]
+self.addpkg2db("sync", p3)
+
+self.args = "--debug -S --pipeline %s %s" % (p1.name, p3.name)
+
+self.addrule("PACMAN_RETCODE=0")
+for p in (p1, p2, p3):
+	self.addrule("PKG_EXIST=%s" % p.name)
+	for f in p.files:
+		self.addrule("FILE_EXIST=%s" % f)
+self.addrule("PKG_REASON=pkg2|1")
+# the first package goes on to validation while the others download
+self.addrule("PACMAN_OUTPUT=passed on with 2 downloads left")
@@ -0,0 +1,25 @@
+self.description = "Download a database again when its entity tag changed"
+
+import os
+
+sp = pmpkg("pkg1")
+self.addpkg2db("sync", sp)
+
+self.add_http_server("sync", etags=True)
+
+def change_etag(test):
+	# the tag of an older version of the database
+	path = os.path.join(test.root, "var/lib/pacman/sync/sync.db.etag")
+	with open(path, "w") as f:
+		f.write("\"stale\"\n")
+	path = os.path.join(test.root, "var/lib/pacman/sync/sync.db")
+	os.utime(path, (355, 355))
+
+self.setup = ["-Syy", change_etag]
+self.args = "--debug -Sy"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=using entity tag: \"stale\"")
+self.addrule("!PACMAN_OUTPUT=sync is up to date")
+self.addrule("!FILE_MTIME=var/lib/pacman/sync/sync.db|355")
+self.addrule("!FILE_CONTENTS=var/lib/pacman/sync/sync.db.etag|\"stale\"\n")
@@ -0,0 +1,22 @@
+self.description = "Do not download a database again while its entity tag matches"
+
+import os
+
+sp = pmpkg("pkg1")
+self.addpkg2db("sync", sp)
+
+self.add_http_server("sync", etags=True)
+
+def backdate_db(test):
+	# asked by time alone, the server would send the database again
+	path = os.path.join(test.root, "var/lib/pacman/sync/sync.db")
+	os.utime(path, (355, 355))
+
+self.setup = ["-Syy", backdate_db]
+self.args = "--debug -Sy"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=using entity tag: \"[0-9a-f]+\"")
+self.addrule("PACMAN_OUTPUT=sync is up to date")
+self.addrule("FILE_EXIST=var/lib/pacman/sync/sync.db.etag")
+self.addrule("FILE_MTIME=var/lib/pacman/sync/sync.db|355")
@@ -0,0 +1,22 @@
+self.description = "Search several repositories loaded side by side"
+
+sp1 = pmpkg("foo")
+sp1.desc = "found in sync1"
+self.addpkg2db("sync1", sp1)
+
+sp2 = pmpkg("foobar")
+sp2.desc = "found in sync2"
+self.addpkg2db("sync2", sp2)
+
+sp3 = pmpkg("bar")
+self.addpkg2db("sync3", sp3)
+
+self.args = "--debug -Ss foo"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=^sync1/foo 1.0-1")
+self.addrule("PACMAN_OUTPUT=^sync2/foobar 1.0-1")
+self.addrule("!PACMAN_OUTPUT=^sync3/bar")
+# the workers' messages are passed on by the main thread
+self.addrule("PACMAN_OUTPUT=^debug: loading package cache for repository 'sync2'")
+self.addrule("PACMAN_OUTPUT=^debug: loaded 3 package caches using 3 threads")
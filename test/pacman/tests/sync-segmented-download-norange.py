@@ -0,0 +1,23 @@
+self.description = "Download a large package whole when the server ignores ranges"
+
+import os
+
+# this setting forces us to download packages
+self.cachepkgs = False
+self.option['ParallelDownloads'] = ['3']
+self.option['SegmentedDownloadSize'] = ['1']
+
+p1 = pmpkg("big")
+p1.files = ["usr/share/big/data"]
+p1.filedata = {"usr/share/big/data": os.urandom(3 * 1024 * 1024 + 1000)}
+self.addpkg2db("sync", p1)
+
+self.add_http_server("sync", ranges=False)
+
+self.args = "--debug -S %s" % p1.name
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_EXIST=big")
+self.addrule("PACMAN_OUTPUT=downloading %s in 3 segments" % p1.filename())
+self.addrule("PACMAN_OUTPUT=did not return the requested range")
+self.addrule("FILE_EXIST=usr/share/big/data")
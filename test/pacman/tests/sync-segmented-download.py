@@ -0,0 +1,30 @@
+self.description = "Download a large package in segments over HTTP"
+
+import os
+
+# this setting forces us to download packages
+self.cachepkgs = False
+self.option['ParallelDownloads'] = ['3']
+self.option['SegmentedDownloadSize'] = ['1']
+
+# random data does not compress, so the package stays above 3 MiB
+p1 = pmpkg("big")
+p1.files = ["usr/share/big/data"]
+p1.filedata = {"usr/share/big/data": os.urandom(3 * 1024 * 1024 + 1000)}
+self.addpkg2db("sync", p1)
+
+p2 = pmpkg("small")
+p2.files = ["usr/bin/small"]
+self.addpkg2db("sync", p2)
+
+self.add_http_server("sync", mtime=355)
+
+self.args = "--debug -S %s %s" % (p1.name, p2.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_EXIST=big")
+self.addrule("PKG_EXIST=small")
+self.addrule("PACMAN_OUTPUT=downloading %s in 3 segments" % p1.filename())
+self.addrule("PACMAN_OUTPUT=%s started alongside 2 other transfers" % p2.filename())
+self.addrule("FILE_EXIST=usr/share/big/data")
+self.addrule("FILE_MTIME=var/cache/pacman/pkg/%s|355" % p1.filename())
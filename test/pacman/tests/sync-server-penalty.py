@@ -0,0 +1,29 @@
+self.description = "Try a mirror again after it failed to serve one package"
+
+# this setting forces us to download packages
+self.cachepkgs = False
+
+# the mirror serves every package but the first
+numpkgs = 6
+pkgnames = []
+for i in range(1, numpkgs + 1):
+	p = pmpkg("pkg%d" % i)
+	p.files = ["usr/bin/pkg%d" % i]
+	self.addpkg2db("sync", p)
+	pkgnames.append(p.name)
+	if i > 1:
+		self.filesystem.append("var/pub/mirror/%s -> ../sync/%s"
+				% (p.filename(), p.filename()))
+self.db["sync"].mirrors = ["file://%s/var/pub/mirror" % self.root]
+
+self.args = "--debug -S %s" % ' '.join(pkgnames)
+
+self.addrule("PACMAN_RETCODE=0")
+for name in pkgnames:
+	self.addrule("PKG_EXIST=%s" % name)
+self.addrule("PACMAN_OUTPUT=url: .*/mirror/pkg1-")
+# tried last while the penalty for its failure runs out...
+for i in range(2, 6):
+	self.addrule("!PACMAN_OUTPUT=url: .*/mirror/pkg%d-" % i)
+# ...then in turn again
+self.addrule("PACMAN_OUTPUT=url: .*/mirror/pkg6-")
@@ -0,0 +1,39 @@
+self.description = "Install cached packages extracted ahead of installing them"
+
+# left behind by an interrupted transaction
+self.filesystem = ["var/lib/pacman/stage/pkg1-XXXXXX/0"]
+
+lp = pmpkg("pkg1")
+lp.files = ["etc/pkg1.conf*"]
+lp.backup = ["etc/pkg1.conf"]
+self.addpkg2db("local", lp)
+
+p1 = pmpkg("pkg1", "1.0-2")
+p1.files = ["etc/pkg1.conf",
+            "usr/bin/pkg1"]
+p1.backup = ["etc/pkg1.conf"]
+p1.install['post_upgrade'] = "echo foobar"
+self.addpkg2db("sync", p1)
+
+p2 = pmpkg("pkg2")
+p2.files = ["usr/bin/pkg2",
+            "usr/share/pkg2/",
+            "usr/share/pkg2/empty"]
+self.addpkg2db("sync", p2)
+
+self.args = "--debug -S --stream %s %s" % (p1.name, p2.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=removing stale stage")
+self.addrule("PACMAN_OUTPUT=staged .*pkg1-1.0-2")
+self.addrule("PACMAN_OUTPUT=staged .*pkg2-1.0-1")
+self.addrule("PKG_VERSION=pkg1|1.0-2")
+self.addrule("!FILE_EXIST=etc/pkg1.conf.pacnew")
+self.addrule("!FILE_MODIFIED=etc/pkg1.conf")
+self.addrule("FILE_EXIST=usr/bin/pkg1")
+self.addrule("FILE_EXIST=var/lib/pacman/local/pkg1-1.0-2/install")
+self.addrule("PKG_EXIST=pkg2")
+self.addrule("FILE_EXIST=usr/bin/pkg2")
+self.addrule("DIR_EXIST=usr/share/pkg2/")
+self.addrule("FILE_EXIST=usr/share/pkg2/empty")
+self.addrule("!DIR_EXIST=var/lib/pacman/stage/pkg1-XXXXXX/")
@@ -0,0 +1,16 @@
+self.description = "Do not move staged files through a symlinked directory"
+
+self.cachepkgs = False
+self.filesystem = ["target/", "usr/lib -> ../target"]
+
+p = pmpkg("pkg1")
+p.files = ["usr/lib/libpkg1.so"]
+# leave out the parent directories, which would conflict with the symlink
+p.finalized = True
+self.addpkg2db("sync", p)
+
+self.args = "--debug -S --stream %s" % p.name
+
+self.addrule("PACMAN_OUTPUT=staged .*pkg1-1.0-1")
+self.addrule("!FILE_EXIST=target/libpkg1.so")
+self.addrule("FILE_EXIST=usr/lib/libpkg1.so")
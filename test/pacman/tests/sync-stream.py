@@ -0,0 +1,29 @@
+self.description = "Install packages extracted while downloading"
+
+# this setting forces us to download packages
+self.cachepkgs = False
+self.option['ParallelDownloads'] = ['2']
+
+p1 = pmpkg("pkg1")
+p1.files = ["usr/bin/pkg1",
+            "usr/share/pkg1/"]
+self.addpkg2db("sync", p1)
+
+p2 = pmpkg("pkg2")
+p2.files = ["usr/bin/pkg2",
+            "usr/lib/libpkg2.so.1"]
+self.addpkg2db("sync", p2)
+
+self.args = "--debug -S --stream %s %s" % (p1.name, p2.name)
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=staged .*pkg1-1.0-1")
+self.addrule("PACMAN_OUTPUT=staged .*pkg2-1.0-1")
+for p in (p1, p2):
+	self.addrule("PKG_EXIST=%s" % p.name)
+	for f in p.files:
+		if f.endswith("/"):
+			self.addrule("DIR_EXIST=%s" % f)
+		else:
+			self.addrule("FILE_EXIST=%s" % f)
+self.addrule("DIR_EXIST=var/lib/pacman/stage/")
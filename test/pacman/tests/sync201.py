@@ -0,0 +1,15 @@
+self.description = "Synchronizing a database writes its snapshot"
+
+self.option['XferCommand'] = ['/usr/bin/curl %u > %o']
+
+sp1 = pmpkg("spkg1", "1.0-1")
+sp1.depends = ["spkg2"]
+sp2 = pmpkg("spkg2", "2.0-1")
+
+for sp in sp1, sp2:
+	self.addpkg2db("sync", sp)
+
+self.args = "-Sy"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("FILE_EXIST=var/lib/pacman/sync/sync.db.snapshot")
@@ -0,0 +1,21 @@
+self.description = "Install from a database read back from its snapshot"
+
+self.option['XferCommand'] = ['/usr/bin/curl %u > %o']
+
+sp1 = pmpkg("spkg1", "1.0-1")
+sp1.depends = ["virtual"]
+sp2 = pmpkg("spkg2", "2.0-1")
+sp2.provides = ["virtual"]
+sp2.files = ["usr/bin/spkg2"]
+
+for sp in sp1, sp2:
+	self.addpkg2db("sync", sp)
+
+self.args = "--debug -Sy spkg1"
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PACMAN_OUTPUT=packages to package cache for db 'sync' from snapshot")
+self.addrule("PKG_VERSION=spkg1|1.0-1")
+self.addrule("PKG_VERSION=spkg2|2.0-1")
+self.addrule("PKG_REASON=spkg2|1")
+self.addrule("FILE_EXIST=usr/bin/spkg2")
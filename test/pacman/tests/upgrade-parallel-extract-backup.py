@@ -0,0 +1,40 @@
+self.description = "Upgrade a package with backup files among many small files"
+
+self.option['WorkerThreads'] = ['4']
+self.option['NoUpgrade'] = ["usr/share/dummy/c/frozen"]
+
+files = ["usr/share/dummy/%s/file%03d" % (d, n)
+         for d in "abc" for n in range(250)]
+
+lp = pmpkg("dummy")
+lp.files = files + ["usr/share/dummy/a/edited.conf*",
+                    "usr/share/dummy/b/stock.conf",
+                    "usr/share/dummy/c/frozen"]
+lp.backup = ["usr/share/dummy/a/edited.conf",
+             "usr/share/dummy/b/stock.conf"]
+self.addpkg2db("local", lp)
+
+p = pmpkg("dummy", "1.0-2")
+p.files = files + ["usr/share/dummy/a/edited.conf",
+                   "usr/share/dummy/b/stock.conf",
+                   "usr/share/dummy/c/frozen"]
+p.backup = ["usr/share/dummy/a/edited.conf",
+            "usr/share/dummy/b/stock.conf"]
+for f in p.files:
+	p.filedata[f] = "new\n"
+self.addpkg(p)
+
+self.args = "--debug -U %s" % p.filename()
+
+self.addrule("PACMAN_RETCODE=0")
+self.addrule("PKG_VERSION=dummy|1.0-2")
+self.addrule("PACMAN_OUTPUT=using 4 threads to extract files")
+self.addrule("FILE_CONTENTS=usr/share/dummy/a/file000|new\n")
+self.addrule("FILE_CONTENTS=usr/share/dummy/b/file130|new\n")
+self.addrule("FILE_CONTENTS=usr/share/dummy/c/file249|new\n")
+self.addrule("FILE_PACNEW=usr/share/dummy/a/edited.conf")
+self.addrule("FILE_CONTENTS=usr/share/dummy/a/edited.conf.pacnew|new\n")
+self.addrule("!FILE_PACNEW=usr/share/dummy/b/stock.conf")
+self.addrule("FILE_CONTENTS=usr/share/dummy/b/stock.conf|new\n")
+self.addrule("FILE_PACNEW=usr/share/dummy/c/frozen")
+self.addrule("FILE_CONTENTS=usr/share/dummy/c/frozen|usr/share/dummy/c/frozen\n")
@@ -114,7 +114,7 @@ def mkcfgfile(filename, root, option, db):
     # Options
     data = ["[options]"]
     for key, value in option.items():
-        data.extend(["%s = %s" % (key, j) for j in value])
+        data.extend(["%s = %s" % (key, j) if j else key for j in value])
 
     # Repositories
     # sort by repo name so tests can predict repo order, rather than be
@@ -123,10 +123,11 @@ def mkcfgfile(filename, root, option, db):
         if key != "local":
             value = db[key]
             data.append("[%s]\n" \
-                    "SigLevel = %s\n" \
-                    "Server = file://%s" \
-                     % (value.treename, value.getverify(), \
-                        os.path.join(root, SYNCREPO, value.treename)))
+                    "SigLevel = %s" \
+                     % (value.treename, value.getverify()))
+            data.extend(["Server = %s" % j for j in value.mirrors])
+            data.append("Server = file://%s" \
+                    % os.path.join(root, SYNCREPO, value.treename))
             for optkey, optval in value.option.items():
                 data.extend(["%s = %s" % (optkey, j) for j in optval])
 